@@ -0,0 +1,211 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "CandidateEdgePartitions.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+using std::min;
+using std::max;
+
+
+CandidateEdgePartitions::CandidateEdgePartitions(const string &prefix,
+                                                 const size_t nv,
+                                                 const size_t np,
+                                                 const size_t be) :
+  file_prefix(prefix), n_vertices(nv),
+  n_partitions(max(min(np, nv), static_cast<size_t>(1))),
+  range((nv + n_partitions - 1)/n_partitions),
+  buffer_edges(max(be, static_cast<size_t>(1))), spilled_edges(0),
+  buffers(n_partitions) {
+
+  if (n_vertices > UINT32_MAX)
+    throw SMITHLABException("too many vertices for candidate edges: " +
+                            toa(n_vertices));
+  // start from empty files, which also checks they can be written
+  for (size_t p = 0; p < n_partitions; ++p) {
+    std::ofstream out(partition_file(p).c_str(), std::ios::binary);
+    if (!out)
+      throw SMITHLABException("cannot write to file: " + partition_file(p));
+  }
+}
+
+
+CandidateEdgePartitions::~CandidateEdgePartitions() {
+  for (size_t p = 0; p < n_partitions; ++p)
+    std::remove(partition_file(p).c_str());
+}
+
+
+string
+CandidateEdgePartitions::partition_file(const size_t p) const {
+  return file_prefix + ".part" + toa(p);
+}
+
+
+size_t
+CandidateEdgePartitions::partition_end(const size_t p) const {
+  return min((p + 1)*range, n_vertices);
+}
+
+
+void
+CandidateEdgePartitions::add(const CandidateEdge &e) {
+  if (e.src >= n_vertices || e.dst >= n_vertices)
+    throw SMITHLABException("candidate edge vertex out of range");
+  const size_t p = e.src/range;
+  buffers[p].push_back(e);
+  if (buffers[p].size() >= buffer_edges)
+    spill(p);
+}
+
+
+void
+CandidateEdgePartitions::spill(const size_t p) {
+  if (buffers[p].empty())
+    return;
+  std::ofstream out(partition_file(p).c_str(),
+                    std::ios::binary | std::ios::app);
+  out.write(reinterpret_cast<const char *>(&buffers[p][0]),
+            sizeof(CandidateEdge)*buffers[p].size());
+  if (!out)
+    throw SMITHLABException("error writing: " + partition_file(p));
+  spilled_edges += buffers[p].size();
+  buffers[p].clear();
+}
+
+
+void
+CandidateEdgePartitions::flush() {
+  for (size_t p = 0; p < n_partitions; ++p)
+    spill(p);
+}
+
+
+static bool
+closer_neighbor(const SelectedNeighbor &a, const SelectedNeighbor &b) {
+  return a.first < b.first;
+}
+
+
+/* keeps the closest max_degree targets in a max-heap by angle; ties
+ * keep the edge seen first, as RegularNearestNeighborGraph does
+ */
+static void
+offer_neighbor(const size_t max_degree, const SelectedNeighbor &n,
+               vector<SelectedNeighbor> &heap) {
+  for (size_t i = 0; i < heap.size(); ++i)
+    if (heap[i].second == n.second)
+      return;
+  if (heap.size() < max_degree) {
+    heap.push_back(n);
+    std::push_heap(heap.begin(), heap.end(), closer_neighbor);
+  }
+  else if (n.first < heap.front().first) {
+    std::pop_heap(heap.begin(), heap.end(), closer_neighbor);
+    heap.back() = n;
+    std::push_heap(heap.begin(), heap.end(), closer_neighbor);
+  }
+}
+
+
+void
+CandidateEdgePartitions::select_neighbors(const size_t p,
+                                          const size_t max_degree,
+                                          vector<vector<SelectedNeighbor> >
+                                          &neighbors) {
+  const size_t begin = partition_begin(p);
+  neighbors.assign(partition_end(p) - begin, vector<SelectedNeighbor>());
+  if (max_degree == 0)
+    return;
+
+  spill(p);
+  std::ifstream in(partition_file(p).c_str(), std::ios::binary);
+  if (!in)
+    throw SMITHLABException("cannot read: " + partition_file(p));
+
+  vector<CandidateEdge> chunk(buffer_edges);
+  while (in) {
+    in.read(reinterpret_cast<char *>(&chunk[0]),
+            sizeof(CandidateEdge)*chunk.size());
+    const size_t n_read = in.gcount()/sizeof(CandidateEdge);
+    for (size_t i = 0; i < n_read; ++i)
+      if (chunk[i].src != chunk[i].dst)
+        offer_neighbor(max_degree,
+                       SelectedNeighbor(chunk[i].angle, chunk[i].dst),
+                       neighbors[chunk[i].src - begin]);
+  }
+
+  for (size_t i = 0; i < neighbors.size(); ++i)
+    std::sort_heap(neighbors[i].begin(), neighbors[i].end(), closer_neighbor);
+}
+
+
+void
+CandidateEdgePartitions::write_edges(std::ostream &out,
+                                     const size_t max_degree,
+                                     const vector<string> *ids) {
+  vector<vector<SelectedNeighbor> > neighbors;
+  for (size_t p = 0; p < n_partitions; ++p) {
+    select_neighbors(p, max_degree, neighbors);
+    const size_t begin = partition_begin(p);
+    for (size_t u = 0; u < neighbors.size(); ++u)
+      for (size_t j = 0; j < neighbors[u].size(); ++j) {
+        const SelectedNeighbor &n = neighbors[u][j];
+        if (ids != 0)
+          out << '\n' << (*ids)[begin + u] << '\t' << (*ids)[n.second];
+        else
+          out << '\n' << begin + u << '\t' << n.second;
+        out << '\t' << n.first;
+      }
+  }
+}
+
+
+size_t
+CandidateEdgePartitions::partitions_for_memory(const size_t n_vertices,
+                                               const size_t max_degree,
+                                               const size_t max_bytes) {
+  const size_t bytes_per_vertex =
+    sizeof(vector<SelectedNeighbor>) + max_degree*sizeof(SelectedNeighbor);
+  const size_t total = n_vertices*bytes_per_vertex;
+  return max((total + max_bytes - 1)/max(max_bytes, static_cast<size_t>(1)),
+             static_cast<size_t>(1));
+}
+
+
+void
+write_graph_vertices(std::ostream &out, const string &graph_name,
+                     const size_t max_degree, const vector<string> &ids) {
+  out << graph_name << '\n' << max_degree << '\n' << "VERTEX";
+  for (size_t i = 0; i < ids.size(); ++i)
+    out << '\n' << ids[i] << '\t' << i;
+  out << '\n' << "EDGE";
+}
@@ -0,0 +1,115 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANDIDATE_EDGE_PARTITIONS_HPP
+#define CANDIDATE_EDGE_PARTITIONS_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <iostream>
+#include <cstdint>
+
+/* a directed edge proposed for the graph, between vertex indices */
+struct CandidateEdge {
+  CandidateEdge() : src(0), dst(0), angle(0.0) {}
+  CandidateEdge(const uint32_t s, const uint32_t d, const double a) :
+    src(s), dst(d), angle(a) {}
+  uint32_t src;
+  uint32_t dst;
+  double angle;
+};
+
+/* (angle, target vertex) of one selected out-edge */
+typedef std::pair<double, uint32_t> SelectedNeighbor;
+
+/*
+ * Candidate edges for a graph too large to build in memory. Vertices
+ * are split into contiguous index ranges (partitions); each candidate
+ * edge is buffered for the partition of its source and written to
+ * that partition's file when the buffer fills. A partition is later
+ * read back on its own and reduced to the best out-edges per vertex
+ * with bounded heaps, so memory depends on the partition size and the
+ * degree, not on the number of candidates.
+ */
+class CandidateEdgePartitions {
+public:
+  CandidateEdgePartitions(const std::string &file_prefix,
+                          const size_t n_vertices,
+                          const size_t n_partitions,
+                          const size_t buffer_edges = 65536);
+  // removes the partition files
+  ~CandidateEdgePartitions();
+
+  void add(const CandidateEdge &e);
+  void add(const uint32_t src, const uint32_t dst, const double angle) {
+    add(CandidateEdge(src, dst, angle));
+  }
+  // writes out all buffered edges
+  void flush();
+
+  size_t get_n_partitions() const {return n_partitions;}
+  size_t partition_begin(const size_t p) const {return p*range;}
+  size_t partition_end(const size_t p) const;
+  size_t get_spilled_edges() const {return spilled_edges;}
+
+  // neighbors[u - partition_begin(p)] gets the (at most max_degree)
+  // closest distinct targets of u, sorted by angle
+  void select_neighbors(const size_t p, const size_t max_degree,
+                        std::vector<std::vector<SelectedNeighbor> > &neighbors);
+
+  // selects the edges of every partition and writes one per line as
+  // "\nu\tv\tangle", with u and v replaced by ids[u] and ids[v] if
+  // ids are given
+  void write_edges(std::ostream &out, const size_t max_degree,
+                   const std::vector<std::string> *ids = 0);
+
+  // partitions needed for heaps of max_degree to fit in max_bytes
+  static size_t partitions_for_memory(const size_t n_vertices,
+                                      const size_t max_degree,
+                                      const size_t max_bytes);
+
+private:
+  CandidateEdgePartitions(const CandidateEdgePartitions &);
+  CandidateEdgePartitions &operator=(const CandidateEdgePartitions &);
+
+  std::string file_prefix;
+  size_t n_vertices;
+  size_t n_partitions;
+  size_t range;
+  size_t buffer_edges;
+  size_t spilled_edges;
+  std::vector<std::vector<CandidateEdge> > buffers;
+
+  std::string partition_file(const size_t p) const;
+  void spill(const size_t p);
+};
+
+/* writes the graph name, degree and vertices in the format read by
+ * RegularNearestNeighborGraph, up to and including the "EDGE" line
+ */
+void
+write_graph_vertices(std::ostream &out, const std::string &graph_name,
+                     const size_t max_degree,
+                     const std::vector<std::string> &ids);
+
+#endif
@@ -0,0 +1,310 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ComparedPairFilter.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+
+// each block is one 64-byte cache line
+static const size_t words_per_block = 8;
+static const size_t bits_per_block = 64*words_per_block;
+
+
+/* the splitmix64 finalizer */
+static uint64_t
+mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+
+ComparedPairFilter::ComparedPairFilter(const size_t cap, const double fp_rate) :
+  capacity(std::max(cap, static_cast<size_t>(1))), n_salts(0), n_aged(0),
+  epoch_bytes(0) {
+  if (fp_rate <= 0.0 || fp_rate >= 1.0)
+    throw SMITHLABException("bad false positive rate: " + toa(fp_rate));
+
+  // the optimal bits per pair for a plain Bloom filter, plus some
+  // extra to make up for blocking
+  const double bits_per_pair = -std::log(fp_rate)/(M_LN2*M_LN2);
+  const double n_bits = 1.2*bits_per_pair*capacity;
+  n_blocks = std::max(static_cast<size_t>(std::ceil(n_bits/bits_per_block)),
+                      static_cast<size_t>(1));
+  n_hashes = std::min(std::max(static_cast<size_t>(bits_per_pair*M_LN2 + 0.5),
+                               static_cast<size_t>(1)),
+                      static_cast<size_t>(16));
+  current.words.resize(n_blocks*words_per_block, 0);
+  previous.words.resize(n_blocks*words_per_block, 0);
+}
+
+
+uint64_t
+ComparedPairFilter::pair_hash(const string &a, const string &b) {
+  const std::hash<string> hasher;
+  const uint64_t ha = hasher(a), hb = hasher(b);
+  // order the two so the pair is unordered
+  const uint64_t lo = std::min(ha, hb), hi = std::max(ha, hb);
+  return mix64(lo ^ mix64(hi + 0x9e3779b97f4a7c15ull));
+}
+
+
+uint64_t
+ComparedPairFilter::pair_hash(const uint64_t a, const uint64_t b) {
+  const uint64_t lo = std::min(a, b), hi = std::max(a, b);
+  return mix64(mix64(lo) ^ mix64(hi + 0x9e3779b97f4a7c15ull));
+}
+
+
+bool
+ComparedPairFilter::test(const Generation &g, const uint64_t h) const {
+  const uint64_t *block = &g.words[(h % n_blocks)*words_per_block];
+  uint64_t bits = mix64(h);
+  for (size_t i = 0; i < n_hashes; ++i) {
+    if (i > 0 && i % 7 == 0)
+      bits = mix64(bits);
+    const size_t pos = bits & (bits_per_block - 1);
+    bits >>= 9;
+    if (!(block[pos >> 6] & (1ull << (pos & 63))))
+      return false;
+  }
+  return true;
+}
+
+
+void
+ComparedPairFilter::set(Generation &g, const uint64_t h) const {
+  uint64_t *block = &g.words[(h % n_blocks)*words_per_block];
+  uint64_t bits = mix64(h);
+  for (size_t i = 0; i < n_hashes; ++i) {
+    if (i > 0 && i % 7 == 0)
+      bits = mix64(bits);
+    const size_t pos = bits & (bits_per_block - 1);
+    bits >>= 9;
+    block[pos >> 6] |= (1ull << (pos & 63));
+  }
+}
+
+
+bool
+ComparedPairFilter::contains(const uint64_t h) const {
+  return test(current, h) || (previous.n_pairs > 0 && test(previous, h));
+}
+
+
+void
+ComparedPairFilter::insert(const uint64_t h) {
+  if (current.n_pairs >= capacity)
+    age();
+  set(current, h);
+  ++current.n_pairs;
+}
+
+
+/* a hash node holding an epoch and its id */
+static size_t
+epoch_node_bytes(const string &id) {
+  return sizeof(string) + id.size() + 1 + 2*sizeof(uint64_t) +
+    2*sizeof(void *);
+}
+
+
+/* the hash of a vertex id, salted with its epoch if it was forgotten */
+uint64_t
+ComparedPairFilter::vertex_hash(const string &id) const {
+  const uint64_t h = std::hash<string>()(id);
+  std::unordered_map<string, Epoch>::const_iterator e(epochs.find(id));
+  return (e == epochs.end()) ? h : mix64(h ^ mix64(e->second.salt));
+}
+
+
+uint64_t
+ComparedPairFilter::epoch_pair_hash(const string &a, const string &b) const {
+  if (epochs.empty())
+    return pair_hash(a, b);
+  const uint64_t ha = vertex_hash(a), hb = vertex_hash(b);
+  const uint64_t lo = std::min(ha, hb), hi = std::max(ha, hb);
+  return mix64(lo ^ mix64(hi + 0x9e3779b97f4a7c15ull));
+}
+
+
+bool
+ComparedPairFilter::contains(const string &a, const string &b) const {
+  return contains(epoch_pair_hash(a, b));
+}
+
+
+void
+ComparedPairFilter::insert(const string &a, const string &b) {
+  insert(epoch_pair_hash(a, b));
+}
+
+
+bool
+ComparedPairFilter::check_and_insert(const string &a, const string &b) {
+  const uint64_t h = epoch_pair_hash(a, b);
+  if (contains(h))
+    return true;
+  insert(h);
+  return false;
+}
+
+
+void
+ComparedPairFilter::age() {
+  std::swap(previous, current);
+  std::fill(current.words.begin(), current.words.end(), 0);
+  current.n_pairs = 0;
+
+  // a vertex forgotten two generations ago has no pairs left from
+  // before, so it can go back to its plain hash
+  ++n_aged;
+  for (std::unordered_map<string, Epoch>::iterator i(epochs.begin());
+       i != epochs.end();) {
+    if (i->second.forgotten + 2 <= n_aged) {
+      epoch_bytes -= epoch_node_bytes(i->first);
+      i = epochs.erase(i);
+    }
+    else
+      ++i;
+  }
+}
+
+
+void
+ComparedPairFilter::clear() {
+  std::fill(current.words.begin(), current.words.end(), 0);
+  std::fill(previous.words.begin(), previous.words.end(), 0);
+  current.n_pairs = previous.n_pairs = 0;
+  epochs.clear();
+  epoch_bytes = 0;
+}
+
+
+void
+ComparedPairFilter::forget(const string &id) {
+  // salts are never reused, so no pair inserted under an earlier
+  // epoch of the vertex is found again
+  const Epoch e = {++n_salts, n_aged};
+  const std::pair<std::unordered_map<string, Epoch>::iterator, bool>
+    i(epochs.insert(std::make_pair(id, e)));
+  if (i.second)
+    epoch_bytes += epoch_node_bytes(id);
+  else
+    i.first->second = e;
+}
+
+
+size_t
+ComparedPairFilter::memory_bytes() const {
+  return sizeof(uint64_t)*(current.words.size() + previous.words.size()) +
+    epochs.bucket_count()*sizeof(void *) + epoch_bytes;
+}
+
+
+/* zero marks an empty slot, so it is never stored as a pair hash */
+static uint64_t
+nonzero_hash(const uint64_t h) {
+  return (h == 0) ? 1 : h;
+}
+
+
+bool
+ComparedPairSet::contains(const uint64_t pair_hash) const {
+  if (slots.empty())
+    return false;
+  const uint64_t h = nonzero_hash(pair_hash);
+  const size_t mask = slots.size() - 1;
+  for (size_t i = mix64(h) & mask; slots[i] != 0; i = (i + 1) & mask)
+    if (slots[i] == h)
+      return true;
+  return false;
+}
+
+
+bool
+ComparedPairSet::check_and_insert(const uint64_t pair_hash) {
+  if (2*(n_pairs + 1) > slots.size())
+    grow();
+  const uint64_t h = nonzero_hash(pair_hash);
+  const size_t mask = slots.size() - 1;
+  size_t i = mix64(h) & mask;
+  for (; slots[i] != 0; i = (i + 1) & mask)
+    if (slots[i] == h)
+      return true;
+  slots[i] = h;
+  ++n_pairs;
+  return false;
+}
+
+
+void
+ComparedPairSet::grow() {
+  vector<uint64_t> old_slots(std::max(2*slots.size(),
+                                      static_cast<size_t>(1024)), 0);
+  std::swap(slots, old_slots);
+  const size_t mask = slots.size() - 1;
+  for (size_t j = 0; j < old_slots.size(); ++j)
+    if (old_slots[j] != 0) {
+      size_t i = mix64(old_slots[j]) & mask;
+      while (slots[i] != 0)
+        i = (i + 1) & mask;
+      slots[i] = old_slots[j];
+    }
+}
+
+
+bool
+ComparedPairSet::contains(const string &a, const string &b) const {
+  return contains(ComparedPairFilter::pair_hash(a, b));
+}
+
+
+void
+ComparedPairSet::insert(const string &a, const string &b) {
+  check_and_insert(ComparedPairFilter::pair_hash(a, b));
+}
+
+
+bool
+ComparedPairSet::check_and_insert(const string &a, const string &b) {
+  return check_and_insert(ComparedPairFilter::pair_hash(a, b));
+}
+
+
+void
+ComparedPairSet::clear() {
+  vector<uint64_t>().swap(slots);
+  n_pairs = 0;
+}
@@ -0,0 +1,134 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPARED_PAIR_FILTER_HPP
+#define COMPARED_PAIR_FILTER_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+/*
+ * Remembers which (unordered) pairs of vertices have been compared,
+ * in bounded memory. It is a blocked Bloom filter: a pair selects one
+ * 512-bit block and sets a few bits inside it, so a lookup touches a
+ * single cache line. A pair never reported as compared has not been
+ * inserted; a false positive (at the configured rate) only skips one
+ * comparison.
+ *
+ * To bound memory and let old comparisons be redone, the filter has
+ * two generations. Insertions go to the current one; when it holds
+ * "capacity" pairs it becomes the previous generation and the old
+ * previous generation is forgotten.
+ *
+ * A vertex whose vector changes (deleted, or inserted again under the
+ * same id) must be compared again. Bits cannot be removed, so forget()
+ * instead moves the vertex to a new epoch that is hashed with its id,
+ * and its earlier pairs are no longer found. Once two generations have
+ * been retired since, none of those pairs is left and the epoch is
+ * dropped; the pairs found under it are then compared again.
+ */
+class ComparedPairFilter {
+public:
+  ComparedPairFilter(const size_t capacity, const double fp_rate);
+
+  bool contains(const std::string &a, const std::string &b) const;
+  void insert(const std::string &a, const std::string &b);
+  // true if the pair was already there
+  bool check_and_insert(const std::string &a, const std::string &b);
+
+  // forget the previous generation and start a new one
+  void age();
+  void clear();
+  // forget the pairs of this vertex
+  void forget(const std::string &id);
+
+  size_t get_capacity() const {return capacity;}
+  size_t size() const {return current.n_pairs + previous.n_pairs;}
+  size_t memory_bytes() const;
+
+  static uint64_t pair_hash(const std::string &a, const std::string &b);
+  static uint64_t pair_hash(const uint64_t a, const uint64_t b);
+  bool contains(const uint64_t h) const;
+  void insert(const uint64_t h);
+
+private:
+  struct Generation {
+    Generation() : n_pairs(0) {}
+    std::vector<uint64_t> words;
+    size_t n_pairs;
+  };
+
+  Generation current;
+  Generation previous;
+  size_t capacity;
+  size_t n_blocks;
+  size_t n_hashes;
+
+  struct Epoch {
+    uint64_t salt;       // unique to each call of forget()
+    uint64_t forgotten;  // the number of generations retired before it
+  };
+  // epochs of the vertices forgotten since the oldest generation began
+  std::unordered_map<std::string, Epoch> epochs;
+  uint64_t n_salts;
+  uint64_t n_aged;
+  size_t epoch_bytes;
+
+  uint64_t vertex_hash(const std::string &id) const;
+  uint64_t epoch_pair_hash(const std::string &a, const std::string &b) const;
+
+  bool test(const Generation &g, const uint64_t h) const;
+  void set(Generation &g, const uint64_t h) const;
+};
+
+
+/*
+ * Exact counterpart of ComparedPairFilter: an open-addressing set of
+ * 64-bit pair hashes, at 8 bytes per slot and at most half full. Two
+ * pairs only collide if their 64-bit hashes are equal.
+ */
+class ComparedPairSet {
+public:
+  ComparedPairSet() : n_pairs(0) {}
+
+  bool contains(const std::string &a, const std::string &b) const;
+  void insert(const std::string &a, const std::string &b);
+  // true if the pair was already there
+  bool check_and_insert(const std::string &a, const std::string &b);
+  void clear();
+
+  size_t size() const {return n_pairs;}
+  size_t memory_bytes() const {return sizeof(uint64_t)*slots.size();}
+
+  bool contains(const uint64_t h) const;
+  bool check_and_insert(const uint64_t h);
+
+private:
+  std::vector<uint64_t> slots;
+  size_t n_pairs;
+
+  void grow();
+};
+
+#endif
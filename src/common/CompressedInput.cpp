@@ -0,0 +1,114 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "CompressedInput.hpp"
+
+#include <zlib.h>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+
+static const size_t BUFFER_SIZE = 1 << 17;
+
+
+/* after gzread returns n: true if it failed, which includes a
+ * truncated file (0 returned, with Z_BUF_ERROR) */
+static bool
+read_failed(gzFile file, const int n, string &message) {
+  int error = Z_OK;
+  const char *m = gzerror(file, &error);
+  if (n < 0 || (error != Z_OK && error != Z_STREAM_END)) {
+    message = m;
+    return true;
+  }
+  return false;
+}
+
+
+CompressedStreamBuf::CompressedStreamBuf(const string &fn) :
+  filename(fn), file(gzopen(fn.c_str(), "rb")), buffer(BUFFER_SIZE) {
+  if (file)
+    gzbuffer(static_cast<gzFile>(file), BUFFER_SIZE);
+  setg(&buffer[0], &buffer[0], &buffer[0]);
+}
+
+
+CompressedStreamBuf::~CompressedStreamBuf() {
+  if (file)
+    gzclose(static_cast<gzFile>(file));
+}
+
+
+CompressedStreamBuf::int_type
+CompressedStreamBuf::underflow() {
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+  if (!file)
+    return traits_type::eof();
+  const int n = gzread(static_cast<gzFile>(file), &buffer[0], buffer.size());
+  string message;
+  if (n <= 0 && read_failed(static_cast<gzFile>(file), n, message))
+    throw SMITHLABException("error reading " + filename + ": " + message);
+  if (n == 0)
+    return traits_type::eof();
+  setg(&buffer[0], &buffer[0], &buffer[0] + n);
+  return traits_type::to_int_type(*gptr());
+}
+
+
+CompressedInputStream::CompressedInputStream(const string &filename) :
+  std::istream(0), buf(filename) {
+  init(&buf);
+  if (!buf.is_open())
+    setstate(std::ios::failbit);
+  // the stream catches what underflow throws, setting badbit, and
+  // throws it on only if asked to
+  exceptions(std::ios::badbit);
+}
+
+
+void
+read_compressed_file(const string &filename, string &contents) {
+  gzFile file = gzopen(filename.c_str(), "rb");
+  if (!file)
+    throw SMITHLABException("bad file: " + filename);
+  gzbuffer(file, BUFFER_SIZE);
+
+  // grow by the chunk size, reusing the capacity the string has
+  size_t size = 0;
+  int n = 0;
+  do {
+    if (contents.size() < size + BUFFER_SIZE)
+      contents.resize(size + BUFFER_SIZE);
+    n = gzread(file, &contents[size], BUFFER_SIZE);
+    if (n > 0)
+      size += n;
+  } while (n > 0);
+
+  string message;
+  const bool failed = read_failed(file, n, message);
+  gzclose(file);
+  if (failed)
+    throw SMITHLABException("error reading " + filename + ": " + message);
+  contents.resize(size);
+}
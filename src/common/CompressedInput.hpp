@@ -0,0 +1,74 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPRESSED_INPUT_HPP
+#define COMPRESSED_INPUT_HPP
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <streambuf>
+
+/*
+ * Input files that may be gzip compressed. zlib recognizes the gzip
+ * header and reads any other file unchanged, so these replace
+ * std::ifstream for reading feature vectors, hash functions, hash
+ * tables and graphs whether or not a file was compressed; no suffix
+ * is needed.
+ */
+class CompressedStreamBuf : public std::streambuf {
+public:
+  explicit CompressedStreamBuf(const std::string &filename);
+  ~CompressedStreamBuf();
+  bool is_open() const {return file != 0;}
+
+protected:
+  int_type underflow();
+
+private:
+  CompressedStreamBuf(const CompressedStreamBuf &);
+  CompressedStreamBuf &operator=(const CompressedStreamBuf &);
+
+  std::string filename;
+  // a zlib gzFile
+  void *file;
+  std::vector<char> buffer;
+};
+
+
+/* reads like std::ifstream; the stream fails if the file can't open,
+ * and a corrupt or truncated compressed file throws SMITHLABException
+ * rather than reading as a shorter file */
+class CompressedInputStream : public std::istream {
+public:
+  explicit CompressedInputStream(const std::string &filename);
+
+private:
+  CompressedStreamBuf buf;
+};
+
+
+/* the whole (decompressed) contents of a file */
+void
+read_compressed_file(const std::string &filename, std::string &contents);
+
+#endif
@@ -44,18 +44,6 @@ using std::vector;
 using std::endl;
 using std::queue;
 
-std::ostream &
-operator<<(std::ostream &os, const Result &r) {
-  return os << r.id << '\t' << r.val;
-}
-
-
-std::ostream &
-operator<<(std::ostream &os, const Edge &e) {
-  return os << e.src << "->" << e.dst << '\t' << e.dist;
-}
-
-
 EngineDB:: EngineDB(const std::string db, const std::string server,
                     const std::string user, const std::string pass) :
   db(db), server(server), user(user), pass(pass) {
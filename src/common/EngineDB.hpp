@@ -31,38 +31,9 @@
 #include <queue>
 #include <limits>
 
-
-struct Result {
-  Result(const std::string &i, const double v) : id(i), val(v) {}
-  Result() : val(std::numeric_limits<double>::max()) {}
-  bool operator<(const Result &other) const {return val < other.val;}
-  std::string id;
-  double val;
-};
-
-std::ostream &
-operator<<(std::ostream &os, const Result &r);
-
-struct Edge {
-  Edge(const std::string &u, const std::string &v, const double d)
-    : src(u), dst(v), dist(d) {}
-  Edge() : dist(std::numeric_limits<double>::max()) {}
-  std::string src;
-  std::string dst;
-  double dist;
-};
-
-std::ostream &
-operator<<(std::ostream &os, const Edge &e);
+#include "QueryEngine.hpp"
 
 
-class LSHAngleHashFunction;
-class LSHAngleHashTable;
-class FeatureVector;
-class RegularNearestNeighborGraph;
-typedef std::unordered_map<std::string, LSHAngleHashFunction> HashFunLookup;
-typedef std::unordered_map<std::string, LSHAngleHashTable> HashTabLookup;
-typedef std::unordered_map<std::string, FeatureVector> FeatVecLookup;
 typedef std::unordered_map<std::string, std::string> PathLookup;
 
 class EngineDB {
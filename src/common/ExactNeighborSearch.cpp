@@ -0,0 +1,196 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ExactNeighborSearch.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <thread>
+#include <functional>
+#include <cmath>
+
+#include <gsl/gsl_cblas.h>
+
+#include "smithlab_utils.hpp"
+
+#include "FeatureVector.hpp"
+
+using std::string;
+using std::vector;
+using std::min;
+using std::max;
+
+
+/* copies the feature vectors into a row-major matrix with each row
+ * scaled to unit length; a zero vector has no angle to anything, so
+ * its row is filled with NaN and never passes a distance cutoff
+ */
+void
+pack_unit_rows(const vector<FeatureVector> &fvs, vector<double> &rows) {
+  const size_t n_features = fvs.empty() ? 0 : fvs.front().size();
+  rows.resize(fvs.size()*n_features);
+  for (size_t i = 0; i < fvs.size(); ++i) {
+    if (fvs[i].size() != n_features)
+      throw SMITHLABException("inconsistent feature vector size: " +
+                              fvs[i].get_id());
+    fvs[i].get_values(rows.data() + i*n_features);
+    vector<double>::iterator row(rows.begin() + i*n_features);
+    const double norm = std::sqrt(std::inner_product(row, row + n_features,
+                                                     row, 0.0));
+    if (norm > 0.0)
+      for (size_t j = 0; j < n_features; ++j)
+        row[j] /= norm;
+    else
+      std::fill(row, row + n_features,
+                std::numeric_limits<double>::quiet_NaN());
+  }
+}
+
+
+static bool
+closer_neighbor(const ExactNeighbor &a, const ExactNeighbor &b) {
+  return a.first < b.first || (a.first == b.first && a.second < b.second);
+}
+
+
+/* cosine below which no angle can be within the radius */
+static double
+radius_to_cosine(const double max_proximity_radius) {
+  return (max_proximity_radius >= M_PI) ?
+    -std::numeric_limits<double>::max() : std::cos(max_proximity_radius);
+}
+
+
+ExactNeighborSearch::ExactNeighborSearch(const vector<FeatureVector> &database,
+                                         const size_t nt, const size_t bs) :
+  n_features(database.empty() ? 0 : database.front().size()),
+  n_threads(max(nt, static_cast<size_t>(1))),
+  block_size(max(bs, static_cast<size_t>(1))) {
+  ids.reserve(database.size());
+  for (size_t i = 0; i < database.size(); ++i)
+    ids.push_back(database[i].get_id());
+  pack_unit_rows(database, unit_rows);
+}
+
+
+/* Scores every query against the database blocks first_block,
+ * first_block + block_step, ... and keeps, for each query, a max-heap
+ * (by angle) of the best n_neighbors seen in those blocks.
+ */
+void
+ExactNeighborSearch::search_slice(const vector<double> &query_rows,
+                                  const size_t n_queries,
+                                  const size_t first_block,
+                                  const size_t block_step,
+                                  const size_t n_neighbors,
+                                  const double cos_cutoff,
+                                  vector<vector<ExactNeighbor> > &heaps) const {
+
+  heaps.assign(n_queries, vector<ExactNeighbor>());
+  vector<double> cutoffs(n_queries, cos_cutoff);
+
+  const size_t n_blocks = (ids.size() + block_size - 1)/block_size;
+  vector<double> dots(block_size*block_size);
+
+  for (size_t q = 0; q < n_queries; q += block_size) {
+    const size_t q_rows = min(block_size, n_queries - q);
+    for (size_t b = first_block; b < n_blocks; b += block_step) {
+      const size_t d = b*block_size;
+      const size_t d_rows = min(block_size, ids.size() - d);
+
+      // dots = Q_block * D_block^T, both blocks being unit rows
+      cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                  q_rows, d_rows, n_features, 1.0,
+                  &query_rows[q*n_features], n_features,
+                  &unit_rows[d*n_features], n_features,
+                  0.0, &dots[0], d_rows);
+
+      for (size_t i = 0; i < q_rows; ++i) {
+        vector<ExactNeighbor> &heap = heaps[q + i];
+        const double *row = &dots[i*d_rows];
+        for (size_t j = 0; j < d_rows; ++j) {
+          if (row[j] > cutoffs[q + i]) {
+            const double angle = std::acos(max(-1.0, min(1.0, row[j])));
+            if (heap.size() == n_neighbors) {
+              std::pop_heap(heap.begin(), heap.end(), closer_neighbor);
+              heap.pop_back();
+            }
+            heap.push_back(ExactNeighbor(angle, d + j));
+            std::push_heap(heap.begin(), heap.end(), closer_neighbor);
+            if (heap.size() == n_neighbors)
+              cutoffs[q + i] = std::cos(heap.front().first);
+          }
+        }
+      }
+    }
+  }
+}
+
+
+void
+ExactNeighborSearch::query(const vector<FeatureVector> &queries,
+                           const size_t n_neighbors,
+                           const double max_proximity_radius,
+                           vector<vector<ExactNeighbor> > &results) const {
+
+  results.assign(queries.size(), vector<ExactNeighbor>());
+  if (queries.empty() || ids.empty() || n_neighbors == 0)
+    return;
+
+  for (size_t i = 0; i < queries.size(); ++i)
+    if (queries[i].size() != n_features)
+      throw SMITHLABException("query dimension does not match database: " +
+                              queries[i].get_id());
+
+  vector<double> query_rows;
+  pack_unit_rows(queries, query_rows);
+
+  const double cos_cutoff = radius_to_cosine(max_proximity_radius);
+  const size_t n_blocks = (ids.size() + block_size - 1)/block_size;
+  const size_t n_workers = min(n_threads, n_blocks);
+
+  // each worker takes every n_workers-th database block
+  vector<vector<vector<ExactNeighbor> > > partial(n_workers);
+  vector<std::thread> workers;
+  for (size_t t = 1; t < n_workers; ++t)
+    workers.push_back(std::thread(&ExactNeighborSearch::search_slice, this,
+                                  std::cref(query_rows), queries.size(),
+                                  t, n_workers, n_neighbors, cos_cutoff,
+                                  std::ref(partial[t])));
+  search_slice(query_rows, queries.size(), 0, n_workers,
+               n_neighbors, cos_cutoff, partial[0]);
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+
+  // merge the per-worker top-k lists
+  for (size_t i = 0; i < queries.size(); ++i) {
+    vector<ExactNeighbor> &r = results[i];
+    for (size_t t = 0; t < n_workers; ++t)
+      r.insert(r.end(), partial[t][i].begin(), partial[t][i].end());
+    std::sort(r.begin(), r.end(), closer_neighbor);
+    if (r.size() > n_neighbors)
+      r.resize(n_neighbors);
+  }
+}
@@ -0,0 +1,76 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXACT_NEIGHBOR_SEARCH_HPP
+#define EXACT_NEIGHBOR_SEARCH_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+
+class FeatureVector;
+
+/* (angle, index into the database) for a single neighbor */
+typedef std::pair<double, size_t> ExactNeighbor;
+
+/*
+ * Exact k-NN under the angle distance. Database vectors are scaled to
+ * unit length and packed into a row-major matrix so that a block of
+ * queries can be scored against a block of the database with a single
+ * matrix product. Each thread owns a slice of the database blocks and
+ * keeps its own top-k for every query; these are merged at the end.
+ */
+class ExactNeighborSearch {
+public:
+  ExactNeighborSearch(const std::vector<FeatureVector> &database,
+                      const size_t n_threads = 1,
+                      const size_t block_size = 256);
+
+  // results[i] holds neighbors of queries[i], sorted by increasing angle
+  void query(const std::vector<FeatureVector> &queries,
+             const size_t n_neighbors,
+             const double max_proximity_radius,
+             std::vector<std::vector<ExactNeighbor> > &results) const;
+
+  size_t size() const {return ids.size();}
+  size_t get_dimension() const {return n_features;}
+  const std::string &get_id(const size_t i) const {return ids[i];}
+
+private:
+  std::vector<std::string> ids;
+  std::vector<double> unit_rows;
+  size_t n_features;
+  size_t n_threads;
+  size_t block_size;
+
+  void search_slice(const std::vector<double> &query_rows,
+                    const size_t n_queries,
+                    const size_t first_block, const size_t block_step,
+                    const size_t n_neighbors, const double cos_cutoff,
+                    std::vector<std::vector<ExactNeighbor> > &heaps) const;
+};
+
+void
+pack_unit_rows(const std::vector<FeatureVector> &fvs,
+               std::vector<double> &rows);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FeaturePack.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+#include <cmath>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "smithlab_utils.hpp"
+
+#include "FeatureVector.hpp"
+
+using std::string;
+using std::vector;
+
+static const char pack_magic[] = "AMORPACK";
+static const uint64_t pack_version = 1;
+
+// magic followed by six uint64 fields
+static const size_t header_bytes = 8 + 6*sizeof(uint64_t);
+
+enum {VERSION, N_VECTORS, N_FEATURES, NORMS_OFFSET, IDS_OFFSET, IDS_BYTES};
+
+
+FeaturePack::FeaturePack(const string &fn) :
+  filename(fn), mapped(0), mapped_bytes(0),
+  n_vectors(0), n_features(0), values(0), norms(0) {
+
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw SMITHLABException("cannot open feature pack: " + filename);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < header_bytes) {
+    ::close(fd);
+    throw SMITHLABException("bad feature pack: " + filename);
+  }
+  mapped_bytes = st.st_size;
+  mapped = mmap(0, mapped_bytes, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    mapped = 0;
+    throw SMITHLABException("cannot map feature pack: " + filename);
+  }
+
+  const char *base = static_cast<const char *>(mapped);
+  uint64_t header[6];
+  std::memcpy(header, base + 8, sizeof(header));
+  if (std::memcmp(base, pack_magic, 8) != 0 ||
+      header[VERSION] != pack_version) {
+    munmap(mapped, mapped_bytes);
+    throw SMITHLABException("not a feature pack: " + filename);
+  }
+  n_vectors = header[N_VECTORS];
+  n_features = header[N_FEATURES];
+
+  const size_t values_bytes = sizeof(double)*n_vectors*n_features;
+  if (header[NORMS_OFFSET] != header_bytes + values_bytes ||
+      header[IDS_OFFSET] != header[NORMS_OFFSET] + sizeof(double)*n_vectors ||
+      header[IDS_OFFSET] + header[IDS_BYTES] > mapped_bytes) {
+    munmap(mapped, mapped_bytes);
+    throw SMITHLABException("truncated feature pack: " + filename);
+  }
+  values = reinterpret_cast<const double *>(base + header_bytes);
+  norms = reinterpret_cast<const double *>(base + header[NORMS_OFFSET]);
+
+  // rows are fetched in the order vectors share buckets
+  posix_madvise(mapped, mapped_bytes, POSIX_MADV_RANDOM);
+
+  // the ids are small compared to the values, so they are copied
+  const char *id_ptr = base + header[IDS_OFFSET];
+  const char *id_end = id_ptr + header[IDS_BYTES];
+  ids.reserve(n_vectors);
+  while (id_ptr < id_end) {
+    const char *newline =
+      static_cast<const char *>(std::memchr(id_ptr, '\n', id_end - id_ptr));
+    if (newline == 0)
+      break;
+    ids.push_back(string(id_ptr, newline));
+    id_ptr = newline + 1;
+  }
+  if (ids.size() != n_vectors) {
+    munmap(mapped, mapped_bytes);
+    throw SMITHLABException("bad ids in feature pack: " + filename);
+  }
+  id_to_index.reserve(n_vectors);
+  for (size_t i = 0; i < n_vectors; ++i)
+    if (!id_to_index.insert(std::make_pair(ids[i], i)).second) {
+      munmap(mapped, mapped_bytes);
+      throw SMITHLABException("duplicate id in feature pack: " + ids[i]);
+    }
+}
+
+
+FeaturePack::~FeaturePack() {
+  if (mapped != 0)
+    munmap(mapped, mapped_bytes);
+}
+
+
+bool
+FeaturePack::find(const string &id, size_t &i) const {
+  std::unordered_map<string, size_t>::const_iterator j(id_to_index.find(id));
+  if (j == id_to_index.end())
+    return false;
+  i = j->second;
+  return true;
+}
+
+
+double
+FeaturePack::compute_angle(const size_t i, const size_t j) const {
+  const double *a = get_values(i), *b = get_values(j);
+  double angle = std::inner_product(a, a + n_features, b, 0.0)/
+    (norms[i]*norms[j]);
+  angle = std::max(-1.0, std::min(1.0, angle));
+  return std::acos(angle);
+}
+
+
+FeatureVector
+FeaturePack::get_feature_vector(const size_t i) const {
+  const double *a = get_values(i);
+  return FeatureVector(ids[i], vector<double>(a, a + n_features));
+}
+
+
+FeaturePackWriter::FeaturePackWriter(const string &fn) :
+  filename(fn), out(fn.c_str(), std::ios::binary), n_features(0) {
+  if (!out)
+    throw SMITHLABException("cannot write to file: " + filename);
+  // the header is filled in by close()
+  out.write(string(header_bytes, '\0').data(), header_bytes);
+}
+
+
+void
+FeaturePackWriter::add(const FeatureVector &fv) {
+  if (norms.empty())
+    n_features = fv.size();
+  else if (fv.size() != n_features)
+    throw SMITHLABException("inconsistent feature vector size: " +
+                            fv.get_id());
+  if (fv.get_id().find('\n') != string::npos)
+    throw SMITHLABException("bad feature vector id: " + fv.get_id());
+
+  vector<double> row(fv.size());
+  fv.get_values(row.data());
+  out.write(reinterpret_cast<const char *>(&row[0]),
+            sizeof(double)*row.size());
+  norms.push_back(std::sqrt(std::inner_product(row.begin(), row.end(),
+                                               row.begin(), 0.0)));
+  ids += fv.get_id();
+  ids += '\n';
+}
+
+
+void
+FeaturePackWriter::close() {
+  if (!norms.empty())
+    out.write(reinterpret_cast<const char *>(&norms[0]),
+              sizeof(double)*norms.size());
+  out.write(ids.data(), ids.size());
+
+  uint64_t header[6];
+  header[VERSION] = pack_version;
+  header[N_VECTORS] = norms.size();
+  header[N_FEATURES] = n_features;
+  header[NORMS_OFFSET] = header_bytes + sizeof(double)*norms.size()*n_features;
+  header[IDS_OFFSET] = header[NORMS_OFFSET] + sizeof(double)*norms.size();
+  header[IDS_BYTES] = ids.size();
+  out.seekp(0);
+  out.write(pack_magic, 8);
+  out.write(reinterpret_cast<const char *>(header), sizeof(header));
+  out.close();
+  if (!out)
+    throw SMITHLABException("error writing feature pack: " + filename);
+}
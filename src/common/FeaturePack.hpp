@@ -0,0 +1,104 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FEATURE_PACK_HPP
+#define FEATURE_PACK_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+#include <cstdint>
+
+class FeatureVector;
+
+/*
+ * A feature pack holds many feature vectors of the same dimension in
+ * one binary file, in native byte order:
+ *
+ *   header:  "AMORPACK", version, n_vectors, n_features,
+ *            norms offset, ids offset, ids bytes (all uint64)
+ *   values:  n_vectors x n_features doubles, row-major
+ *   norms:   n_vectors doubles
+ *   ids:     n_vectors ids, each followed by '\n'
+ *
+ * The file is mapped read-only, so the values are paged in by the
+ * kernel as rows are used rather than read up front.
+ */
+class FeaturePack {
+public:
+  explicit FeaturePack(const std::string &filename);
+  ~FeaturePack();
+
+  size_t size() const {return n_vectors;}
+  size_t get_dimension() const {return n_features;}
+  const std::string &get_id(const size_t i) const {return ids[i];}
+  const std::vector<std::string> &get_ids() const {return ids;}
+  // false if no vector has this id
+  bool find(const std::string &id, size_t &i) const;
+
+  const double *get_values(const size_t i) const {
+    return values + i*n_features;
+  }
+  double get_norm(const size_t i) const {return norms[i];}
+
+  // same as FeatureVector::compute_angle for rows i and j
+  double compute_angle(const size_t i, const size_t j) const;
+  FeatureVector get_feature_vector(const size_t i) const;
+
+private:
+  FeaturePack(const FeaturePack &);
+  FeaturePack &operator=(const FeaturePack &);
+
+  std::string filename;
+  void *mapped;
+  size_t mapped_bytes;
+
+  size_t n_vectors;
+  size_t n_features;
+  const double *values;
+  const double *norms;
+  std::vector<std::string> ids;
+  std::unordered_map<std::string, size_t> id_to_index;
+};
+
+
+/* writes a feature pack one vector at a time */
+class FeaturePackWriter {
+public:
+  explicit FeaturePackWriter(const std::string &filename);
+
+  void add(const FeatureVector &fv);
+  // writes the norms, ids and header; nothing is usable before this
+  void close();
+
+  size_t size() const {return norms.size();}
+
+private:
+  std::string filename;
+  std::ofstream out;
+  size_t n_features;
+  std::vector<double> norms;
+  std::string ids;
+};
+
+#endif
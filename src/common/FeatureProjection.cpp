@@ -0,0 +1,323 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FeatureProjection.hpp"
+
+#include <cmath>
+#include <sstream>
+#include <iterator>
+#include <numeric>
+#include <algorithm>
+#include <random>
+
+#include "smithlab_utils.hpp"
+
+#include "FeatureVector.hpp"
+
+using std::string;
+using std::vector;
+
+typedef vector<vector<double> > Matrix;
+
+// columns added to the subspace beyond those kept, so that the
+// leading components converge in a few iterations
+static const size_t OVERSAMPLING = 10;
+
+
+FeatureProjection::FeatureProjection(const size_t n_features,
+                                     const size_t n_dims,
+                                     const uint64_t seed) :
+  method("random") {
+  if (n_dims == 0)
+    throw SMITHLABException("projection needs at least one dimension");
+  std::mt19937_64 rng(seed);
+  std::normal_distribution<double> gaussian(0.0, 1.0/std::sqrt(n_dims));
+  rows.resize(n_dims, vector<double>(n_features));
+  for (size_t i = 0; i < n_dims; ++i)
+    for (size_t j = 0; j < n_features; ++j)
+      rows[i][j] = gaussian(rng);
+  set_row_sums();
+}
+
+
+FeatureProjection::FeatureProjection(const string &method_in,
+                                     const Matrix &rows_in) :
+  method(method_in), rows(rows_in) {
+  for (size_t i = 1; i < rows.size(); ++i)
+    if (rows[i].size() != rows[0].size())
+      throw SMITHLABException("inconsistent projection rows");
+  set_row_sums();
+}
+
+
+/* the sums of the rows, for projecting centered sparse vectors */
+void
+FeatureProjection::set_row_sums() {
+  row_sums.resize(rows.size());
+  for (size_t i = 0; i < rows.size(); ++i)
+    row_sums[i] = std::accumulate(rows[i].begin(), rows[i].end(), 0.0);
+}
+
+
+FeatureVector
+FeatureProjection::operator()(const FeatureVector &fv) const {
+  if (fv.size() != get_n_features())
+    throw SMITHLABException("cannot project " + fv.get_id() + ": " +
+                            toa(fv.size()) + " features, expected " +
+                            toa(get_n_features()));
+  vector<double> projected(rows.size());
+  for (size_t i = 0; i < rows.size(); ++i)
+    projected[i] = fv.dot(rows[i], row_sums[i]);
+  return FeatureVector(fv.get_id(), std::move(projected));
+}
+
+
+void
+FeatureProjection::truncate(const size_t n_dims) {
+  if (n_dims == 0 || n_dims > rows.size())
+    throw SMITHLABException("cannot keep " + toa(n_dims) + " of " +
+                            toa(rows.size()) + " projection rows");
+  rows.resize(n_dims);
+  row_sums.resize(n_dims);
+}
+
+
+string
+FeatureProjection::tostring() const {
+  std::ostringstream oss;
+  oss << method;
+  for (size_t i = 0; i < rows.size(); ++i) {
+    oss << '\n';
+    copy(rows[i].begin(), rows[i].end(),
+         std::ostream_iterator<double>(oss, "\t"));
+  }
+  return oss.str();
+}
+
+
+std::ostream&
+operator<<(std::ostream &os, const FeatureProjection &p) {
+  return os << p.tostring();
+}
+
+
+std::istream&
+operator>>(std::istream &in, FeatureProjection &p) {
+  string method;
+  if (!getline(in, method))
+    throw SMITHLABException("empty projection file");
+  Matrix rows;
+  string line;
+  while (getline(in, line)) {
+    std::istringstream iss(line);
+    rows.push_back(vector<double>());
+    double x = 0.0;
+    while (iss >> x)
+      rows.back().push_back(x);
+    if (rows.back().empty())
+      rows.pop_back();
+  }
+  p = FeatureProjection(method, rows);
+  return in;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+///////   PRINCIPAL COMPONENTS
+
+static double
+dot(const vector<double> &a, const vector<double> &b) {
+  return std::inner_product(a.begin(), a.end(), b.begin(), 0.0);
+}
+
+
+/* Gram-Schmidt, applied twice for accuracy. A column that vanishes,
+ * as when the sample spans fewer dimensions than the subspace, is
+ * replaced by a random one. */
+static void
+orthonormalize(std::mt19937_64 &rng, Matrix &q) {
+  std::normal_distribution<double> gaussian(0.0, 1.0);
+  for (size_t j = 0; j < q.size(); ++j) {
+    for (size_t attempt = 0; ; ++attempt) {
+      const double initial = std::sqrt(dot(q[j], q[j]));
+      for (size_t pass = 0; pass < 2; ++pass)
+        for (size_t i = 0; i < j; ++i) {
+          const double d = dot(q[i], q[j]);
+          for (size_t k = 0; k < q[j].size(); ++k)
+            q[j][k] -= d*q[i][k];
+        }
+      const double norm = std::sqrt(dot(q[j], q[j]));
+      if (norm > 1e-10*initial) {
+        for (size_t k = 0; k < q[j].size(); ++k)
+          q[j][k] /= norm;
+        break;
+      }
+      if (attempt == 10)
+        throw SMITHLABException("cannot orthonormalize projection");
+      for (size_t k = 0; k < q[j].size(); ++k)
+        q[j][k] = gaussian(rng);
+    }
+  }
+}
+
+
+/* eigenvalues and eigenvectors (the columns of v) of the symmetric
+ * matrix a, by cyclic Jacobi rotations */
+static void
+symmetric_eigen(Matrix a, vector<double> &eigenvalues, Matrix &v) {
+  const size_t n = a.size();
+  v.assign(n, vector<double>(n, 0.0));
+  for (size_t i = 0; i < n; ++i)
+    v[i][i] = 1.0;
+
+  for (size_t sweep = 0; sweep < 100; ++sweep) {
+    double off = 0.0, total = 0.0;
+    for (size_t p = 0; p < n; ++p)
+      for (size_t q = 0; q < n; ++q) {
+        total += a[p][q]*a[p][q];
+        if (p != q)
+          off += a[p][q]*a[p][q];
+      }
+    if (off <= 1e-30*total)
+      break;
+
+    for (size_t p = 0; p + 1 < n; ++p)
+      for (size_t q = p + 1; q < n; ++q) {
+        if (a[p][q] == 0.0)
+          continue;
+        const double theta = (a[q][q] - a[p][p])/(2.0*a[p][q]);
+        const double t = (theta >= 0.0 ? 1.0 : -1.0)/
+          (std::fabs(theta) + std::sqrt(theta*theta + 1.0));
+        const double c = 1.0/std::sqrt(t*t + 1.0), s = t*c;
+        for (size_t k = 0; k < n; ++k) {
+          const double akp = a[k][p], akq = a[k][q];
+          a[k][p] = c*akp - s*akq;
+          a[k][q] = s*akp + c*akq;
+        }
+        for (size_t k = 0; k < n; ++k) {
+          const double apk = a[p][k], aqk = a[q][k];
+          a[p][k] = c*apk - s*aqk;
+          a[q][k] = s*apk + c*aqk;
+        }
+        for (size_t k = 0; k < n; ++k) {
+          const double vkp = v[k][p], vkq = v[k][q];
+          v[k][p] = c*vkp - s*vkq;
+          v[k][q] = s*vkp + c*vkq;
+        }
+      }
+  }
+  eigenvalues.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    eigenvalues[i] = a[i][i];
+}
+
+
+/* projections of the sample onto each column of q, one row each */
+static void
+project_sample(const vector<FeatureVector> &sample, const Matrix &q,
+               const vector<double> &q_sums, Matrix &w) {
+  w.assign(sample.size(), vector<double>(q.size()));
+  for (size_t i = 0; i < sample.size(); ++i)
+    for (size_t j = 0; j < q.size(); ++j)
+      w[i][j] = sample[i].dot(q[j], q_sums[j]);
+}
+
+
+static void
+column_sums(const Matrix &q, vector<double> &sums) {
+  sums.resize(q.size());
+  for (size_t j = 0; j < q.size(); ++j)
+    sums[j] = std::accumulate(q[j].begin(), q[j].end(), 0.0);
+}
+
+
+void
+fit_pca_projection(const vector<FeatureVector> &sample, const size_t n_dims,
+                   const size_t n_iterations, const uint64_t seed,
+                   FeatureProjection &projection) {
+  if (sample.empty())
+    throw SMITHLABException("no feature vectors to fit a projection");
+  const size_t n_features = sample.front().size();
+  for (size_t i = 0; i < sample.size(); ++i)
+    if (sample[i].size() != n_features)
+      throw SMITHLABException("inconsistent feature vector size: " +
+                              sample[i].get_id());
+  if (n_dims == 0 || n_dims > n_features)
+    throw SMITHLABException("cannot project " + toa(n_features) +
+                            " features into " + toa(n_dims));
+
+  // a random subspace, drawn toward the leading components by
+  // repeated multiplication with the second moments X'X
+  std::mt19937_64 rng(seed);
+  std::normal_distribution<double> gaussian(0.0, 1.0);
+  const size_t n_cols = std::min(n_features, n_dims + OVERSAMPLING);
+  Matrix q(n_cols, vector<double>(n_features));
+  for (size_t j = 0; j < n_cols; ++j)
+    for (size_t k = 0; k < n_features; ++k)
+      q[j][k] = gaussian(rng);
+  orthonormalize(rng, q);
+
+  vector<double> q_sums, x(n_features);
+  Matrix w;
+  for (size_t iteration = 0; iteration < n_iterations; ++iteration) {
+    column_sums(q, q_sums);
+    project_sample(sample, q, q_sums, w);
+    Matrix z(n_cols, vector<double>(n_features, 0.0));
+    for (size_t i = 0; i < sample.size(); ++i) {
+      sample[i].get_values(x.data());
+      for (size_t j = 0; j < n_cols; ++j)
+        for (size_t k = 0; k < n_features; ++k)
+          z[j][k] += w[i][j]*x[k];
+    }
+    q.swap(z);
+    orthonormalize(rng, q);
+  }
+
+  // the second moments within the subspace, whose eigenvectors
+  // rotate it onto the components
+  column_sums(q, q_sums);
+  project_sample(sample, q, q_sums, w);
+  Matrix b(n_cols, vector<double>(n_cols, 0.0));
+  for (size_t i = 0; i < sample.size(); ++i)
+    for (size_t r = 0; r < n_cols; ++r)
+      for (size_t c = 0; c < n_cols; ++c)
+        b[r][c] += w[i][r]*w[i][c];
+  vector<double> eigenvalues;
+  Matrix v;
+  symmetric_eigen(b, eigenvalues, v);
+
+  vector<size_t> order(n_cols);
+  for (size_t j = 0; j < n_cols; ++j)
+    order[j] = j;
+  std::sort(order.begin(), order.end(), [&](const size_t i, const size_t j) {
+    return eigenvalues[i] > eigenvalues[j];
+  });
+
+  Matrix rows(n_dims, vector<double>(n_features, 0.0));
+  for (size_t r = 0; r < n_dims; ++r)
+    for (size_t j = 0; j < n_cols; ++j) {
+      const double coefficient = v[j][order[r]];
+      for (size_t k = 0; k < n_features; ++k)
+        rows[r][k] += coefficient*q[j][k];
+    }
+  projection = FeatureProjection("pca", rows);
+}
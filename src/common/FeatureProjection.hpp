@@ -0,0 +1,87 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FEATURE_PROJECTION_HPP
+#define FEATURE_PROJECTION_HPP
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdint.h>
+
+class FeatureVector;
+
+/*
+ * A linear map of feature vectors into fewer dimensions, in which they
+ * can be hashed and compared for less; the rows are the directions
+ * projected onto. Angles are preserved approximately, either by random
+ * Gaussian rows (Johnson-Lindenstrauss) or by the principal components
+ * of a sample. The components are those of the uncentered second
+ * moments, so inner products rather than covariances are kept, as
+ * angles need. Either way the leading rows alone are a projection into
+ * fewer dimensions.
+ */
+class FeatureProjection {
+public:
+  FeatureProjection() {}
+  // random Gaussian rows, scaled by 1/sqrt(n_dims)
+  FeatureProjection(const size_t n_features, const size_t n_dims,
+                    const uint64_t seed);
+  FeatureProjection(const std::string &method_in,
+                    const std::vector<std::vector<double> > &rows_in);
+
+  FeatureVector operator()(const FeatureVector &fv) const;
+
+  bool empty() const {return rows.empty();}
+  size_t size() const {return rows.size();}
+  size_t get_n_features() const {return rows.empty() ? 0 : rows[0].size();}
+  std::string get_method() const {return method;}
+
+  // keeps the first n_dims rows
+  void truncate(const size_t n_dims);
+
+  std::string tostring() const;
+
+private:
+  std::string method;
+  std::vector<std::vector<double> > rows;
+  std::vector<double> row_sums;
+
+  void set_row_sums();
+};
+
+std::ostream&
+operator<<(std::ostream &os, const FeatureProjection &p);
+
+std::istream&
+operator>>(std::istream &in, FeatureProjection &p);
+
+/* Fits the projection onto the n_dims leading principal components
+ * of the sample by randomized subspace iteration: a few passes over
+ * the sample, each costing one product with a block of n_dims + 10
+ * vectors, then an eigendecomposition of that small block. */
+void
+fit_pca_projection(const std::vector<FeatureVector> &sample,
+                   const size_t n_dims, const size_t n_iterations,
+                   const uint64_t seed, FeatureProjection &projection);
+
+#endif
@@ -18,16 +18,24 @@
  *    GNU General Public License for more details.
  */
 #include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 
 #include <cmath>
+#include <cassert>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <sstream>
 #include <climits>
 #include <numeric>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 using std::string;
 using std::vector;
@@ -50,81 +58,507 @@ string
 FeatureVector::tostring() const {
   std::ostringstream oss;
   oss << id << endl;
-  copy(values.begin(), values.end(), 
-       std::ostream_iterator<double>(oss, "\n"));
+  for (size_t i = 0; i < n_features; ++i)
+    oss << (*this)[i] << '\n';
   return oss.str();
 }
 
 
 string
 FeatureVector::tostring_with_labels(const vector<string> &labels) const {
-  if (values.size() != labels.size())
+  if (n_features != labels.size())
     throw SMITHLABException("feature vector values size is not "
         "equal to labels size");
 
   std::ostringstream oss;
   oss << id;
   for (size_t i = 0; i < labels.size(); ++i)
-    oss << endl << labels[i] << '\t' << values[i];
+    oss << endl << labels[i] << '\t' << (*this)[i];
   return oss.str();
 }
 
 
 std::istream&
 operator>>(std::istream &in, FeatureVector &fv) {
-  string id;
-  if(!getline(in, id))
-    throw SMITHLABException("bad feature vector: empty file");
-  
-  string label, value, line;
-  vector<double> values;
-  while (getline(in, line)) {
-    std::istringstream iss(line);
-    if (!(iss >> label >> value))
-      throw SMITHLABException("bad feature vector line: " + line);
-    values.push_back(strtod(value.c_str(), 0));
+  std::ostringstream text;
+  if (in.peek() != EOF)
+    text << in.rdbuf();
+  in.setstate(std::ios::eofbit);
+  FeatureVectorReader reader;
+  reader.parse(text.str(), fv);
+  return in;
+}
+
+
+void
+load_features_and_labels(const string &filename,
+                         FeatureVector &fv, vector<string> &labels) {
+  FeatureVectorReader reader;
+  reader.read(filename, fv, labels);
+}
+
+
+static const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+static const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+static inline uint64_t
+add_label(uint64_t h, const char *b, const char *e) {
+  for (; b != e; ++b)
+    h = (h ^ static_cast<unsigned char>(*b))*FNV_PRIME;
+  return (h ^ '\n')*FNV_PRIME;
+}
+
+
+uint64_t
+label_fingerprint(const vector<string> &labels) {
+  uint64_t h = FNV_OFFSET;
+  for (size_t i = 0; i < labels.size(); ++i)
+    h = add_label(h, labels[i].data(), labels[i].data() + labels[i].size());
+  return h;
+}
+
+
+/* the characters separating fields, as for operator>> on a string */
+static inline bool
+is_blank(const char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+
+/* Converts the value in [b, e), which is followed by a blank, newline
+ * or the terminating null. Decimals with at most 19 significant digits
+ * and a power of ten up to 22 are exact as one multiplication or
+ * division of doubles (Clinger's fast path); others go to strtod.
+ */
+static double
+parse_value(const char *b, const char *e) {
+  static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char *p = b;
+  const bool negative = (*p == '-');
+  if (*p == '-' || *p == '+')
+    ++p;
+
+  uint64_t mantissa = 0;
+  int n_digits = 0, exponent = 0;
+  bool any_digits = false;
+  for (; p != e && *p >= '0' && *p <= '9'; ++p) {
+    any_digits = true;
+    if (mantissa == 0 && *p == '0')
+      continue;
+    if (++n_digits > 19)
+      return strtod(b, 0);
+    mantissa = 10*mantissa + (*p - '0');
+  }
+  if (p != e && *p == '.')
+    for (++p; p != e && *p >= '0' && *p <= '9'; ++p) {
+      any_digits = true;
+      if (mantissa == 0 && *p == '0') {
+        --exponent;
+        continue;
+      }
+      if (++n_digits > 19)
+        return strtod(b, 0);
+      mantissa = 10*mantissa + (*p - '0');
+      --exponent;
+    }
+  if (!any_digits)
+    return strtod(b, 0);
+  if (p != e && (*p == 'e' || *p == 'E')) {
+    ++p;
+    const bool negative_exponent = (p != e && *p == '-');
+    if (p != e && (*p == '-' || *p == '+'))
+      ++p;
+    if (p == e)
+      return strtod(b, 0);
+    int e10 = 0;
+    for (; p != e && *p >= '0' && *p <= '9' && e10 < 10000; ++p)
+      e10 = 10*e10 + (*p - '0');
+    exponent += negative_exponent ? -e10 : e10;
+  }
+  if (p != e)
+    return strtod(b, 0);
+
+  if (mantissa == 0)
+    return negative ? -0.0 : 0.0;
+  if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22)
+    return strtod(b, 0);
+  const double x = (exponent < 0) ?
+    mantissa/powers_of_ten[-exponent] : mantissa*powers_of_ten[exponent];
+  return negative ? -x : x;
+}
+
+
+void
+FeatureVectorReader::load(const string &filename) {
+  read_compressed_file(filename, buffer);
+}
+
+
+/* Follows operator>> on the lines of the file: the first line is the
+ * id, and each other line needs a label and a value, with anything
+ * after them ignored.
+ */
+void
+FeatureVectorReader::parse_buffer(FeatureVector &fv, vector<string> *labels,
+                                  uint64_t *fingerprint) {
+  const char *p = buffer.c_str();
+  const char *end = p + buffer.size();
+
+  const char *line_end = static_cast<const char *>(memchr(p, '\n', end - p));
+  if (!line_end)
+    line_end = end;
+  const string id(p, line_end);
+  p = (line_end == end) ? end : line_end + 1;
+
+  values.clear();
+  if (labels)
+    labels->clear();
+  uint64_t h = FNV_OFFSET;
+  while (p < end) {
+    line_end = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (!line_end)
+      line_end = end;
+
+    const char *label = p;
+    while (label != line_end && is_blank(*label))
+      ++label;
+    const char *label_end = label;
+    while (label_end != line_end && !is_blank(*label_end))
+      ++label_end;
+    const char *value = label_end;
+    while (value != line_end && is_blank(*value))
+      ++value;
+    const char *value_end = value;
+    while (value_end != line_end && !is_blank(*value_end))
+      ++value_end;
+    if (value == value_end)
+      throw SMITHLABException("bad feature vector line: " +
+                              string(p, line_end));
+
+    values.push_back(parse_value(value, value_end));
+    if (labels)
+      labels->push_back(string(label, label_end));
+    if (fingerprint)
+      h = add_label(h, label, label_end);
+    p = line_end + 1;
   }
+  if (fingerprint)
+    *fingerprint = h;
+  // values gets back storage fv no longer needs, for the next file
+  fv.assign(id, values);
+}
+
+
+void
+FeatureVectorReader::read(const string &filename, FeatureVector &fv) {
+  load(filename);
+  parse(buffer, fv);
+}
 
-  if(values.empty())
+
+void
+FeatureVectorReader::read(const string &filename, FeatureVector &fv,
+                          vector<string> &labels) {
+  load(filename);
+  parse_buffer(fv, &labels, 0);
+}
+
+
+void
+FeatureVectorReader::read(const string &filename, FeatureVector &fv,
+                          uint64_t &fingerprint) {
+  load(filename);
+  parse_buffer(fv, 0, &fingerprint);
+}
+
+
+void
+FeatureVectorReader::parse(const string &text, FeatureVector &fv) {
+  if (text.empty())
+    throw SMITHLABException("bad feature vector: empty file");
+  if (&text != &buffer)
+    buffer = text;
+  parse_buffer(fv, 0, 0);
+  if (fv.size() == 0)
     throw SMITHLABException("bad feature vector: only with ID");
+}
 
-  fv = FeatureVector(id, values);
-  return in;
+
+////////////////////////////////////////////////////////////////////////
+///////   REPRESENTATION
+
+/* vectors with at most this fraction of nonzero values are sparse */
+static const double MAX_SPARSE_DENSITY = 0.25;
+
+
+void
+FeatureVector::assign(const string &id_in, vector<double> &v) {
+  id = id_in;
+  n_features = v.size();
+  values.swap(v);
+  v.clear();
+  choose_representation(&v);
 }
 
 
+/* a sparse vector gives its dense values to spare, if there is one,
+ * instead of freeing them */
 void
-load_features_and_labels(const string &filename,
-                         FeatureVector &fv, vector<string> &labels) {
-  
-  std::ifstream in(filename.c_str());
-  if (!in)
-    throw SMITHLABException("bad file: " + filename);
-  
-  string id;
-  getline(in, id);
-  
-  string label, value, line;
-  vector<double> values;
-  while (getline(in, line)) {
-    std::istringstream iss(line);
-    if (!(iss >> label >> value))
-      throw SMITHLABException("bad feature vector line: " + line);
-    values.push_back(strtod(value.c_str(), 0));
-    labels.push_back(label);
+FeatureVector::choose_representation(vector<double> *spare) {
+  sparse = false;
+  shift = 0.0;
+  scale = 1.0;
+  nonzero_sum = 0.0;
+  indices.clear();
+  nonzeros.clear();
+  norm = sqrt(inner_product(values.begin(), values.end(),
+                            values.begin(), 0.0));
+
+  const size_t n_nz = n_features - std::count(values.begin(), values.end(),
+                                              0.0);
+  if (n_features == 0 || n_nz > MAX_SPARSE_DENSITY*n_features)
+    return;
+
+  indices.reserve(n_nz);
+  nonzeros.reserve(n_nz);
+  for (size_t i = 0; i < n_features; ++i)
+    if (values[i] != 0.0) {
+      indices.push_back(i);
+      nonzeros.push_back(values[i]);
+      nonzero_sum += values[i];
+    }
+  sparse = true;
+  if (spare != 0 && spare->capacity() < values.capacity()) {
+    spare->swap(values);
+    spare->clear();
   }
-  fv = FeatureVector(id, values);
+  vector<double>().swap(values);
+}
+
+
+void
+FeatureVector::make_dense() {
+  if (!sparse)
+    return;
+  values.resize(n_features);
+  get_values(values.data());
+  sparse = false;
+  shift = 0.0;
+  scale = 1.0;
+  nonzero_sum = 0.0;
+  vector<uint32_t>().swap(indices);
+  vector<double>().swap(nonzeros);
+  norm = sqrt(inner_product(values.begin(), values.end(),
+                            values.begin(), 0.0));
+}
+
+
+double
+FeatureVector::operator[](const size_t i) const {
+  if (!sparse)
+    return values[i];
+  const vector<uint32_t>::const_iterator j =
+    std::lower_bound(indices.begin(), indices.end(), i);
+  const double x = (j != indices.end() && *j == i) ?
+    nonzeros[j - indices.begin()] : 0.0;
+  return (x - shift)*scale;
+}
+
+
+size_t
+FeatureVector::n_nonzero() const {
+  if (!sparse)
+    return n_features - std::count(values.begin(), values.end(), 0.0);
+  // centered, the zeros are nonzero too
+  return (shift*scale != 0.0) ? n_features : nonzeros.size();
+}
+
+
+size_t
+FeatureVector::memory_bytes() const {
+  // by sizes rather than capacities, so a copy measures the same
+  return sizeof(FeatureVector) + id.size() + 1 +
+    values.size()*sizeof(double) + indices.size()*sizeof(uint32_t) +
+    nonzeros.size()*sizeof(double);
+}
+
+
+void
+FeatureVector::get_values(double *out) const {
+  if (!sparse) {
+    std::copy(values.begin(), values.end(), out);
+    return;
+  }
+  std::fill(out, out + n_features, (0.0 - shift)*scale);
+  for (size_t j = 0; j < indices.size(); ++j)
+    out[indices[j]] = (nonzeros[j] - shift)*scale;
+}
+
+
+/* the sum of squares over all n_features, with the shifted zeros
+ * counted together */
+double
+FeatureVector::sparse_norm() const {
+  double sum_sq = 0.0;
+  for (size_t j = 0; j < nonzeros.size(); ++j)
+    sum_sq += (nonzeros[j] - shift)*(nonzeros[j] - shift);
+  sum_sq += (n_features - nonzeros.size())*shift*shift;
+  return std::fabs(scale)*sqrt(sum_sq);
+}
+
+
+void
+FeatureVector::normalize() {
+  const size_t n = n_features;
+  if (n == 0)
+    return;
+
+  if (sparse) {
+    // the z-scores of scale*(x - shift) are those of x unless scale is
+    // 0, so only the shift and scale of the nonzeros change
+    if (scale == 0.0)
+      return;
+    const double mean = nonzero_sum/n;
+    double deviation_sq = (n - nonzeros.size())*mean*mean;
+    for (size_t j = 0; j < nonzeros.size(); ++j)
+      deviation_sq += (nonzeros[j] - mean)*(nonzeros[j] - mean);
+    shift = mean;
+    scale = deviation_sq > 0.0 ? 1.0/sqrt(deviation_sq) : 0.0;
+    norm = sparse_norm();
+    return;
+  }
+
+  double *v = &values[0];
+
+  // sums of the values shifted by the first, which keeps the sum of
+  // squared deviations accurate when the mean is large
+  const double first = v[0];
+  double sum = 0.0, sum_sq = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    const double d = v[i] - first;
+    sum += d;
+    sum_sq += d*d;
+  }
+  const double mean = first + sum/n;
+  const double deviation_sq = std::max(0.0, sum_sq - sum*sum/n);
+  const double unit_scale =
+    deviation_sq > 0.0 ? 1.0/sqrt(deviation_sq) : 0.0;
+
+  double norm_sq = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    v[i] = (v[i] - mean)*unit_scale;
+    norm_sq += v[i]*v[i];
+  }
+  norm = sqrt(norm_sq);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+///////   KERNELS
+
+/* the sparse-dense kernel: only the nonzeros are multiplied, and the
+ * shift of all values by -shift adds -shift*sum(w) */
+double
+FeatureVector::dot(const vector<double> &w, const double w_sum) const {
+  assert(w.size() == n_features);
+  if (!sparse)
+    return inner_product(values.begin(), values.end(), w.begin(), 0.0);
+  const double *x = nonzeros.data();
+  const uint32_t *idx = indices.data();
+  double total = 0.0;
+  for (size_t j = 0; j < nonzeros.size(); ++j)
+    total += x[j]*w[idx[j]];
+  return (shift == 0.0) ? scale*total : scale*(total - shift*w_sum);
+}
+
+
+double
+FeatureVector::dot(const vector<double> &w) const {
+  const double w_sum = (sparse && shift != 0.0) ?
+    std::accumulate(w.begin(), w.end(), 0.0) : 0.0;
+  return dot(w, w_sum);
+}
+
+
+/* The sparse-sparse kernel merges the sorted indices. With value i
+ * being a*(x_i - s) and b*(y_i - t), the inner product expands to
+ * a*b*(x.y - t*sum(x) - s*sum(y) + n*s*t). */
+double
+FeatureVector::dot_product(const FeatureVector &other) const {
+  if (!sparse && !other.sparse)
+    return inner_product(values.begin(), values.end(),
+                         other.values.begin(), 0.0);
+  if (!other.sparse)
+    return dot(other.values);
+  if (!sparse)
+    return other.dot(values);
+
+  // advancing both positions by comparisons rather than branches
+  // avoids mispredicting which index comes next
+  const uint32_t *a = indices.data(), *b = other.indices.data();
+  const double *x = nonzeros.data(), *y = other.nonzeros.data();
+  const size_t n_a = indices.size(), n_b = other.indices.size();
+  double xy = 0.0;
+  size_t i = 0, j = 0;
+  while (i < n_a && j < n_b) {
+    const uint32_t a_i = a[i], b_j = b[j];
+    xy += (a_i == b_j) ? x[i]*y[j] : 0.0;
+    i += (a_i <= b_j);
+    j += (b_j <= a_i);
+  }
+  const double s = shift, t = other.shift;
+  return scale*other.scale*(xy - t*nonzero_sum - s*other.nonzero_sum +
+                            n_features*s*t);
 }
 
 
 double
 FeatureVector::compute_angle(const FeatureVector &other) const {
-  if (values.size() != other.values.size())
+  if (n_features != other.n_features)
     throw SMITHLABException("cannot compute angle: different feature"
         "vector size: (" + id + ',' + other.get_id() + ")");
-  double angle = inner_product(values.begin(), values.end(), 
-                               other.values.begin(), 0.0)/(norm*other.norm);
+  double angle = dot_product(other)/(norm*other.norm);
   angle = std::max(-1.0, std::min(1.0, angle));
   assert(abs(angle) <= 1);
   return acos(angle); // scale factor 180/M_PI for "degree" conversion
 }
+
+
+void
+read_feature_vectors(const vector<string> &filenames, const size_t n_threads,
+                     vector<FeatureVector> &fvs) {
+  fvs.clear();
+  fvs.resize(filenames.size());
+
+  std::atomic<size_t> next_file(0);
+  std::mutex error_mutex;
+  string error;
+  vector<std::thread> workers;
+  const size_t n_workers =
+    std::max(static_cast<size_t>(1), std::min(n_threads, filenames.size()));
+  for (size_t t = 0; t < n_workers; ++t)
+    workers.push_back(std::thread([&] {
+      FeatureVectorReader reader;
+      for (size_t i = next_file++; i < filenames.size(); i = next_file++) {
+        try {
+          reader.read(filenames[i], fvs[i]);
+        }
+        catch (const SMITHLABException &e) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (error.empty()) {
+            error = e.what();
+            if (error.find(filenames[i]) == string::npos)
+              error += " (" + filenames[i] + ")";
+          }
+          next_file = filenames.size();
+        }
+      }
+    }));
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  if (!error.empty())
+    throw SMITHLABException(error);
+}
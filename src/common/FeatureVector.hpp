@@ -28,27 +28,67 @@
 #include <vector>
 #include <cmath>
 #include <numeric>
+#include <utility>
+#include <stdint.h>
 
+/*
+ * A feature vector is kept dense, or sparse when at most a quarter of
+ * its values are nonzero, as for profiles of long k-mers; the choice
+ * is made when it is constructed. A sparse vector holds its nonzeros
+ * at sorted indices and, as value i, scale*(x_i - shift): normalizing
+ * only sets shift and scale, so centering leaves it sparse. Angles and
+ * projections use sparse kernels; changing the values in place first
+ * makes the vector dense.
+ */
 class FeatureVector {
 public:
 
-  FeatureVector() {}
+  FeatureVector() : n_features(0), sparse(false), shift(0.0), scale(1.0),
+                    nonzero_sum(0.0), norm(0.0) {}
   FeatureVector(const std::string &id_in,
-                const std::vector<double>& fv) : 
-    id(id_in), values(fv), 
-    norm(std::sqrt(std::inner_product(values.begin(), values.end(), 
-                                      values.begin(), 0.0))) {}
-  
-  const double& operator[](const size_t i) const {return values[i];}
-  double& operator[](const size_t i) {return values[i];}
+                const std::vector<double>& fv) :
+    id(id_in), n_features(fv.size()), values(fv) {choose_representation();}
+  // takes the values without copying them
+  FeatureVector(const std::string &id_in,
+                std::vector<double> &&fv) :
+    id(id_in), n_features(fv.size()), values(std::move(fv)) {
+    choose_representation();
+  }
   
-  std::vector<double>::const_iterator begin() const {return values.begin();}
-  std::vector<double>::const_iterator end() const {return values.end();}
-  std::vector<double>::iterator begin() {return values.begin();}
-  std::vector<double>::iterator end() {return values.end();}
+  // replaces the id and values, taking the values without copying;
+  // v is left empty but with storage the vector no longer needs, so a
+  // reader can parse into it again without allocating
+  void assign(const std::string &id_in, std::vector<double> &v);
+
+  double operator[](const size_t i) const;
+
+  // the values for changing in place, which makes the vector dense
+  double *data() {make_dense(); return values.data();}
+  std::vector<double>::iterator begin() {make_dense(); return values.begin();}
+  std::vector<double>::iterator end() {make_dense(); return values.end();}
   
   std::string get_id() const {return id;}
-  size_t size() const {return values.size();}
+  size_t size() const {return n_features;}
+  bool is_sparse() const {return sparse;}
+  size_t n_nonzero() const;
+  // approximate bytes held, by the dense values or the sparse nonzeros
+  // and their indices
+  size_t memory_bytes() const;
+
+  // writes all size() values, dense, to out
+  void get_values(double *out) const;
+  void make_dense();
+
+  // inner product with a dense vector of size() values; w_sum is the
+  // sum of w, needed for centered sparse vectors
+  double dot(const std::vector<double> &w, const double w_sum) const;
+  double dot(const std::vector<double> &w) const;
+
+  // Centers the values and scales them to unit length, in place and in
+  // two passes. These are the z-scores up to a constant factor, which
+  // changes no angle, so the norm becomes 1. A constant vector becomes
+  // all zeros with norm 0.
+  void normalize();
   
   std::string tostring() const;
   
@@ -60,8 +100,21 @@ public:
   
 private:
   std::string id;
+  size_t n_features;
+  // the values of a dense vector; empty when sparse
   std::vector<double> values;
+  // the nonzeros x_i of a sparse vector, by increasing index
+  bool sparse;
+  std::vector<uint32_t> indices;
+  std::vector<double> nonzeros;
+  double shift;
+  double scale;
+  double nonzero_sum;
   double norm;
+
+  void choose_representation(std::vector<double> *spare = 0);
+  double sparse_norm() const;
+  double dot_product(const FeatureVector &other) const;
 };
 
 
@@ -76,4 +129,44 @@ load_features_and_labels(const std::string &filename,
                          FeatureVector &fv,
                          std::vector<std::string> &labels);
 
+/* 64-bit fingerprint of a sequence of labels, so that files can be
+ * checked for consistent labels without comparing every string */
+uint64_t
+label_fingerprint(const std::vector<std::string> &labels);
+
+/*
+ * Reads feature vector files ("id" line, then "label value" lines),
+ * which may be gzip compressed, into a buffer kept between files, and
+ * parses them in place: no string is made per line, and common
+ * decimal values are converted without strtod. Labels may be skipped,
+ * or reduced to their label_fingerprint. Parsing gives the same
+ * results as operator>>.
+ */
+class FeatureVectorReader {
+public:
+  void read(const std::string &filename, FeatureVector &fv);
+  void read(const std::string &filename, FeatureVector &fv,
+            std::vector<std::string> &labels);
+  void read(const std::string &filename, FeatureVector &fv,
+            uint64_t &fingerprint);
+  // parses text already in memory, as from a stream
+  void parse(const std::string &text, FeatureVector &fv);
+
+private:
+  std::string buffer;
+  std::vector<double> values;
+
+  void load(const std::string &filename);
+  void parse_buffer(FeatureVector &fv, std::vector<std::string> *labels,
+                    uint64_t *fingerprint);
+};
+
+/* Reads fvs[i] from filenames[i] as operator>> would, with the files
+ * shared among threads so that parsing (and decompressing gzip files)
+ * proceeds in parallel */
+void
+read_feature_vectors(const std::vector<std::string> &filenames,
+                     const size_t n_threads,
+                     std::vector<FeatureVector> &fvs);
+
 #endif
@@ -0,0 +1,227 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "HttpClient.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+
+
+ServerAddress::ServerAddress(const string &host_port) : port(0) {
+  const size_t colon = host_port.rfind(':');
+  if (colon == string::npos || colon == 0 || colon + 1 == host_port.size())
+    throw SMITHLABException("bad server address (need host:port): " +
+                            host_port);
+  host = host_port.substr(0, colon);
+  const unsigned long p = strtoul(host_port.c_str() + colon + 1, 0, 10);
+  if (p == 0 || p > 65535)
+    throw SMITHLABException("bad port in server address: " + host_port);
+  port = p;
+}
+
+
+string
+ServerAddress::tostring() const {
+  return host + ":" + toa(port);
+}
+
+
+void
+parse_server_addresses(const string &addresses,
+                       vector<ServerAddress> &servers) {
+  servers.clear();
+  size_t start = 0;
+  while (start <= addresses.size()) {
+    size_t comma = addresses.find(',', start);
+    if (comma == string::npos)
+      comma = addresses.size();
+    if (comma > start)
+      servers.push_back(ServerAddress(addresses.substr(start, comma - start)));
+    start = comma + 1;
+  }
+}
+
+
+/* waits for the socket to be ready, up to the deadline */
+static void
+wait_for_socket(const int fd, const short events, const size_t timeout_millis,
+                const ServerAddress &server) {
+  struct pollfd p;
+  p.fd = fd;
+  p.events = events;
+  p.revents = 0;
+  int r = 0;
+  while ((r = poll(&p, 1, timeout_millis)) < 0 && errno == EINTR)
+    ;
+  if (r == 0)
+    throw SMITHLABException("timeout talking to " + server.tostring());
+  if (r < 0)
+    throw SMITHLABException("error talking to " + server.tostring());
+}
+
+
+/* connects without blocking for longer than the timeout: a server
+ * that is down would otherwise hold the caller for the kernel's TCP
+ * connect timeout; true if connected */
+static bool
+connect_with_timeout(const int fd, const struct addrinfo *a,
+                     const size_t timeout_millis) {
+  const int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return false;
+  if (connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+    if (errno != EINPROGRESS)
+      return false;
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLOUT;
+    p.revents = 0;
+    int r = 0;
+    while ((r = poll(&p, 1, timeout_millis)) < 0 && errno == EINTR)
+      ;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (r <= 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 ||
+        error != 0)
+      return false;
+  }
+  // the request itself is sent and read with poll and blocking calls
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+
+static int
+connect_to(const ServerAddress &server, const size_t timeout_millis) {
+  struct addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses = 0;
+  if (getaddrinfo(server.host.c_str(), toa(server.port).c_str(),
+                  &hints, &addresses) != 0)
+    throw SMITHLABException("cannot resolve " + server.tostring());
+
+  int fd = -1;
+  for (struct addrinfo *a = addresses; a != 0 && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && !connect_with_timeout(fd, a, timeout_millis)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0)
+    throw SMITHLABException("cannot connect to " + server.tostring());
+  return fd;
+}
+
+
+int
+http_request(const ServerAddress &server, const string &method,
+             const string &target, const string &body,
+             const size_t timeout_millis, string &response_body) {
+
+  const int fd = connect_to(server, timeout_millis);
+
+  string request = method + " " + target + " HTTP/1.0\r\n" +
+    "Host: " + server.tostring() + "\r\n" +
+    "Connection: close\r\n";
+  if (!body.empty() || method == "POST")
+    request += "Content-Length: " + toa(body.size()) + "\r\n";
+  request += "\r\n" + body;
+
+  string response;
+  try {
+    size_t sent = 0;
+    while (sent < request.size()) {
+      wait_for_socket(fd, POLLOUT, timeout_millis, server);
+      const ssize_t n = send(fd, request.data() + sent,
+                             request.size() - sent, MSG_NOSIGNAL);
+      if (n < 0 && errno != EINTR)
+        throw SMITHLABException("error sending to " + server.tostring());
+      if (n > 0)
+        sent += n;
+    }
+    // the server closes the connection at the end of the response
+    char buffer[65536];
+    for (;;) {
+      wait_for_socket(fd, POLLIN, timeout_millis, server);
+      const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+      if (n < 0 && errno != EINTR)
+        throw SMITHLABException("error reading from " + server.tostring());
+      if (n == 0)
+        break;
+      if (n > 0)
+        response.append(buffer, n);
+    }
+  }
+  catch (const SMITHLABException &) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+
+  // status line: "HTTP/1.x NNN reason"
+  const size_t space = response.find(' ');
+  const size_t header_end = response.find("\r\n\r\n");
+  if (response.compare(0, 5, "HTTP/") != 0 || space == string::npos ||
+      header_end == string::npos)
+    throw SMITHLABException("bad response from " + server.tostring());
+  response_body = response.substr(header_end + 4);
+  return atoi(response.c_str() + space + 1);
+}
+
+
+string
+url_encode(const string &value) {
+  static const char hex[] = "0123456789ABCDEF";
+  string encoded;
+  for (size_t i = 0; i < value.size(); ++i) {
+    const unsigned char c = value[i];
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+        c == '/')
+      encoded += c;
+    else {
+      encoded += '%';
+      encoded += hex[c >> 4];
+      encoded += hex[c & 15];
+    }
+  }
+  return encoded;
+}
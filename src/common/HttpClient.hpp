@@ -0,0 +1,66 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HTTP_CLIENT_HPP
+#define HTTP_CLIENT_HPP
+
+#include <string>
+#include <vector>
+
+/* host and port of an amordad server, parsed from "host:port" */
+struct ServerAddress {
+  ServerAddress() : port(0) {}
+  explicit ServerAddress(const std::string &host_port);
+  std::string host;
+  unsigned short port;
+  std::string tostring() const;
+};
+
+/* parses a comma separated list of "host:port" */
+void
+parse_server_addresses(const std::string &addresses,
+                       std::vector<ServerAddress> &servers);
+
+/*
+ * Minimal blocking HTTP/1.0 client for talking to other amordad
+ * servers: one request per connection, the whole response body is
+ * returned. The timeout bounds connecting as well as each wait to send
+ * or receive. Connection problems and timeouts throw SMITHLABException;
+ * otherwise the HTTP status code is returned.
+ */
+int
+http_request(const ServerAddress &server, const std::string &method,
+             const std::string &target, const std::string &body,
+             const size_t timeout_millis, std::string &response_body);
+
+inline int
+http_get(const ServerAddress &server, const std::string &target,
+         const size_t timeout_millis, std::string &response_body) {
+  return http_request(server, "GET", target, std::string(),
+                      timeout_millis, response_body);
+}
+
+/* percent-encodes a query parameter value */
+std::string
+url_encode(const std::string &value);
+
+#endif
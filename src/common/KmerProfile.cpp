@@ -0,0 +1,198 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "KmerProfile.hpp"
+
+#include <algorithm>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+
+
+/* 2-bit codes of the bases; 4 for anything else */
+struct BaseCodes {
+  BaseCodes() {
+    std::fill(code, code + 256, 4);
+    code['A'] = code['a'] = 0;
+    code['C'] = code['c'] = 1;
+    code['G'] = code['g'] = 2;
+    code['T'] = code['t'] = 3;
+  }
+  unsigned char code[256];
+};
+static const BaseCodes base_codes;
+
+
+static inline uint64_t
+reverse_complement(uint64_t code, const size_t k) {
+  uint64_t rc = 0;
+  for (size_t i = 0; i < k; ++i) {
+    rc = (rc << 2) | (3 - (code & 3));
+    code >>= 2;
+  }
+  return rc;
+}
+
+
+void
+canonical_kmer_labels(const size_t k, vector<string> &labels) {
+  static const char bases[] = "ACGT";
+  labels.clear();
+  for (uint64_t code = 0; code < (1ULL << 2*k); ++code)
+    if (code <= reverse_complement(code, k)) {
+      string kmer(k, 'A');
+      for (size_t i = 0; i < k; ++i)
+        kmer[k - 1 - i] = bases[(code >> 2*i) & 3];
+      labels.push_back(kmer);
+    }
+}
+
+
+KmerCounter::KmerCounter(const size_t k_in) :
+  k(k_in), mask((1ULL << 2*k_in) - 1), total(0) {
+  if (k == 0 || k > MAX_KMER_SIZE)
+    throw SMITHLABException("k-mer size must be from 1 to " +
+                            toa(MAX_KMER_SIZE));
+  counts.resize(1ULL << 2*k, 0);
+}
+
+
+void
+KmerCounter::add_sequence(const char *sequence, const size_t length) {
+  const size_t shift = 2*(k - 1);
+  uint64_t *c = &counts[0];
+  uint64_t forward = 0, reverse = 0;
+  size_t valid = 0;
+  uint64_t counted = 0;
+  for (size_t i = 0; i < length; ++i) {
+    const uint64_t b =
+      base_codes.code[static_cast<unsigned char>(sequence[i])];
+    if (b > 3) {
+      valid = 0;
+      continue;
+    }
+    forward = ((forward << 2) | b) & mask;
+    reverse = (reverse >> 2) | ((3 - b) << shift);
+    if (++valid >= k) {
+      ++c[std::min(forward, reverse)];
+      ++counted;
+    }
+  }
+  total += counted;
+}
+
+
+void
+KmerCounter::merge(const KmerCounter &other) {
+  if (other.k != k)
+    throw SMITHLABException("cannot merge counts of different k");
+  for (size_t i = 0; i < counts.size(); ++i)
+    counts[i] += other.counts[i];
+  total += other.total;
+}
+
+
+void
+KmerCounter::clear() {
+  std::fill(counts.begin(), counts.end(), 0);
+  total = 0;
+}
+
+
+void
+KmerCounter::get_frequencies(vector<double> &frequencies) const {
+  frequencies.clear();
+  const double scale = total > 0 ? 1.0/total : 0.0;
+  for (uint64_t code = 0; code < counts.size(); ++code)
+    if (code <= reverse_complement(code, k))
+      frequencies.push_back(counts[code]*scale);
+}
+
+
+SequenceReader::SequenceReader(const string &fn) :
+  filename(fn), in(new CompressedInputStream(fn)), fastq(false),
+  have_header(false) {
+  if (!*in)
+    throw SMITHLABException("cannot open sequence file: " + filename);
+  while (getline(*in, line) && line.empty())
+    ;
+  if (!line.empty()) {
+    if (line[0] != '>' && line[0] != '@')
+      throw SMITHLABException("not FASTA or FASTQ: " + filename);
+    fastq = (line[0] == '@');
+    have_header = true;
+  }
+}
+
+
+/* the line holding the next header has been read when this is called */
+bool
+SequenceReader::read_record(string &sequence) {
+  sequence.clear();
+  if (!have_header)
+    return false;
+  have_header = false;
+
+  if (fastq) {
+    if (!getline(*in, sequence))
+      throw SMITHLABException("truncated FASTQ record in: " + filename);
+    string quality;
+    if (!getline(*in, line) || line.empty() || line[0] != '+' ||
+        !getline(*in, quality))
+      throw SMITHLABException("bad FASTQ record in: " + filename);
+    while (getline(*in, line))
+      if (!line.empty()) {
+        if (line[0] != '@')
+          throw SMITHLABException("bad FASTQ header in: " + filename);
+        have_header = true;
+        break;
+      }
+    return true;
+  }
+
+  while (getline(*in, line)) {
+    if (!line.empty() && line[0] == '>') {
+      have_header = true;
+      break;
+    }
+    sequence += line;
+  }
+  return true;
+}
+
+
+bool
+SequenceReader::read_batch(vector<string> &sequences,
+                           const size_t max_bases) {
+  size_t n = 0, bases = 0;
+  while (bases < max_bases) {
+    if (n == sequences.size())
+      sequences.push_back(string());
+    if (!read_record(sequences[n]))
+      break;
+    bases += sequences[n++].size();
+  }
+  sequences.resize(n);
+  return n > 0;
+}
@@ -0,0 +1,98 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KMER_PROFILE_HPP
+#define KMER_PROFILE_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+#include "CompressedInput.hpp"
+
+/* largest k whose counts (4^k 64-bit counters, 128MB at k = 12 for each
+ * counting thread) are kept in memory */
+static const size_t MAX_KMER_SIZE = 12;
+
+/* the canonical k-mers, each no greater than its reverse complement,
+ * in order of their 2-bit codes (A < C < G < T) */
+void
+canonical_kmer_labels(const size_t k, std::vector<std::string> &labels);
+
+/*
+ * Counts the canonical k-mers of DNA sequences. Bases are encoded in
+ * 2 bits by table lookup and the codes of the k-mer and its reverse
+ * complement are rolled along the sequence, so each base costs a few
+ * shifts and one increment; k-mers containing any other character are
+ * skipped. Counters for disjoint parts of the input merge, so each
+ * thread can count into its own.
+ */
+class KmerCounter {
+public:
+  explicit KmerCounter(const size_t k);
+
+  void add_sequence(const char *sequence, const size_t length);
+  void add_sequence(const std::string &s) {add_sequence(s.data(), s.size());}
+  void merge(const KmerCounter &other);
+  void clear();
+
+  size_t get_k() const {return k;}
+  uint64_t get_total() const {return total;}
+  // frequency of each k-mer in canonical_kmer_labels order
+  void get_frequencies(std::vector<double> &frequencies) const;
+
+private:
+  size_t k;
+  uint64_t mask;
+  uint64_t total;
+  // 64 bits, as a sample of billions of bases can hold any one k-mer
+  // more than 2^32 times
+  std::vector<uint64_t> counts;
+};
+
+
+/*
+ * Reads the sequences of a FASTA or FASTQ file, which may be gzip
+ * compressed; the format is told by the first character. Lines of a
+ * FASTA record are joined, so k-mers spanning them are counted.
+ */
+class SequenceReader {
+public:
+  explicit SequenceReader(const std::string &filename);
+
+  // replaces the sequences with the next records, stopping once they
+  // hold max_bases; false when no record was left
+  bool read_batch(std::vector<std::string> &sequences,
+                  const size_t max_bases);
+
+private:
+  std::string filename;
+  std::unique_ptr<CompressedInputStream> in;
+  bool fastq;
+  std::string line;
+  bool have_header;
+
+  bool read_record(std::string &sequence);
+};
+
+#endif
@@ -24,10 +24,12 @@
 #include <vector>
 #include <sstream>
 #include <iterator>
-#include <cassert>
-#include <cstdlib>
 #include <cmath>
+#include <cstring>
 #include <numeric>
+#include <algorithm>
+#include <queue>
+#include <thread>
 
 #include "smithlab_utils.hpp"
 
@@ -39,43 +41,179 @@ using std::vector;
 using std::pair;
 
 
-static double
-get_gaussian(const double mu, const double sd) {
-  const double u1 = static_cast<double>((rand() % RAND_MAX)) / RAND_MAX;
-  const double u2 = static_cast<double>((rand() % RAND_MAX)) / RAND_MAX;
-  return (((rand() % 2) == 0) ?
-          sd*sqrt(-2 * log(u1)) * cos(2 * M_PI * u2) :
-          sd*sqrt(-2 * log(u1)) * sin(2 * M_PI * u2)) + mu;
+// the families of seeded hash functions, and the tags beginning the
+// line after the ids in their files
+static const string GAUSSIAN = "gaussian";
+static const string HADAMARD = "hadamard";
+static const string SEED_TAG = "SEED";
+static const string HADAMARD_TAG = "HADAMARD";
+
+// sign flips and transforms rotating a vector for the hadamard family
+static const size_t HADAMARD_ROUNDS = 3;
+
+// coordinates generated before the hyperplanes are split over threads
+static const size_t MIN_PARALLEL_COORDS = 1 << 18;
+
+
+/* SplitMix64 as a counter-based generator: the output for a counter
+ * depends only on the seed and the counter */
+static inline uint64_t
+splitmix64(const uint64_t seed, const uint64_t counter) {
+  uint64_t z = seed + (counter + 1)*0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
 }
 
 
-static void 
-generate_random_unit_vec(const size_t dim, vector<double> &v) {
-  //if x1, x2, ..., xn are normal(0, 1)
-  //then normalized (x1, x2, .., xn) is a random point on unit hypersphere.
+// uniform in (0, 1]
+static inline double
+to_uniform(const uint64_t x) {
+  return ((x >> 11) + 1)*(1.0/9007199254740992.0);
+}
+
+
+/* Hyperplane i of a seeded hash function: Gaussian coordinates, a
+ * pair from each Box-Muller transform of the uniforms at counters
+ * 2p and 2p + 1 past the row's offset, normalized; a normalized
+ * Gaussian vector is a random point on the unit hypersphere. */
+static void
+generate_unit_vec(const uint64_t seed, const size_t i, vector<double> &v) {
+  const size_t dim = v.size();
+  const uint64_t offset = static_cast<uint64_t>(i)*(dim + (dim & 1));
   double r = 0.0;
-  for (size_t i = 0; i < dim; ++i) {
-    const double n = get_gaussian(0.0, 1.0);
-    v[i] = n;
-    r += n*n;
+  for (size_t j = 0; j < dim; j += 2) {
+    const double u1 = to_uniform(splitmix64(seed, offset + j));
+    const double u2 = to_uniform(splitmix64(seed, offset + j + 1));
+    const double radius = std::sqrt(-2.0*std::log(u1));
+    v[j] = radius*std::cos(2.0*M_PI*u2);
+    r += v[j]*v[j];
+    if (j + 1 < dim) {
+      v[j + 1] = radius*std::sin(2.0*M_PI*u2);
+      r += v[j + 1]*v[j + 1];
+    }
+  }
+  r = std::sqrt(r);
+  for (size_t j = 0; j < dim; ++j)
+    v[j] /= r;
+}
+
+
+/* in-place unnormalized Walsh-Hadamard transform; the size is a power
+ * of two. The first two levels are done together, so that the inner
+ * loops of the rest run over at least four contiguous values. */
+static void
+walsh_hadamard(double *x, const size_t n) {
+  size_t h = 1;
+  if (n >= 4) {
+    for (size_t i = 0; i < n; i += 4) {
+      const double a = x[i] + x[i + 1], b = x[i] - x[i + 1];
+      const double c = x[i + 2] + x[i + 3], d = x[i + 2] - x[i + 3];
+      x[i] = a + c;
+      x[i + 1] = b + d;
+      x[i + 2] = a - c;
+      x[i + 3] = b - d;
+    }
+    h = 4;
+  }
+  for (; h < n; h <<= 1)
+    for (size_t i = 0; i < n; i += 2*h)
+      for (size_t j = i; j < i + h; ++j) {
+        const double a = x[j], b = x[j + h];
+        x[j] = a + b;
+        x[j + h] = a - b;
+      }
+}
+
+
+/* random signs for one round, one bit per coordinate from each 64-bit
+ * output, starting at the given counter; a sign is flipped by setting
+ * the sign bit of the value */
+static void
+flip_signs(const uint64_t seed, const uint64_t counter, double *x,
+           const size_t n) {
+  for (size_t w = 0; w < n; w += 64) {
+    const uint64_t bits = splitmix64(seed, counter + w/64);
+    const size_t m = std::min(n - w, static_cast<size_t>(64));
+    uint64_t values[64];
+    std::memcpy(values, x + w, m*sizeof(double));
+    for (size_t j = 0; j < m; ++j)
+      values[j] ^= ((bits >> j) & 1) << 63;
+    std::memcpy(x + w, values, m*sizeof(double));
   }
-  for (vector<double>::iterator i = v.begin(); i != v.end(); ++i)
-    (*i) /= std::sqrt(r);
+}
+
+
+uint64_t
+derive_hash_seed(const uint64_t base_seed, const string &key) {
+  // FNV-1a over the key, then mixed with the base seed
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < key.size(); ++i)
+    h = (h ^ static_cast<unsigned char>(key[i]))*0x100000001B3ULL;
+  const uint64_t seed = splitmix64(base_seed, h);
+  return seed == 0 ? 1 : seed;
 }
 
 
 // CONSTRUCTORS
 LSHAngleHashFunction::LSHAngleHashFunction(const string &id_in,
                                            const string &fsi,
-                                           const size_t n_features,
-                                           const size_t n_bits) :
-  id(id_in), feature_set_id(fsi) {
-  // generate the hyperplanes
+                                           const size_t n_features_in,
+                                           const size_t n_bits_in,
+                                           const uint64_t seed_in,
+                                           const string &family_in) :
+  id(id_in), feature_set_id(fsi), family(family_in), seed(seed_in),
+  n_features(n_features_in), n_bits(n_bits_in), padded(1) {
+  if (seed == 0)
+    throw SMITHLABException("hash function needs a nonzero seed: " + id);
+  if (family == HADAMARD) {
+    while (padded < n_features)
+      padded <<= 1;
+    return;
+  }
+  if (family != GAUSSIAN)
+    throw SMITHLABException("unknown hash function family: " + family);
+  // the rows are independent, so threads take them in strides
   unit_vecs.resize(n_bits, vector<double>(n_features, 0.0));
-  for (size_t i = 0; i < n_bits; ++i) {
-    generate_random_unit_vec(n_features, unit_vecs[i]);
-    assert(unit_vecs[i].size() == n_features);
+  const size_t n_threads =
+    (n_bits*n_features < MIN_PARALLEL_COORDS) ? 1 :
+    std::min(n_bits, static_cast<size_t>(std::max(
+      std::thread::hardware_concurrency(), 1u)));
+  if (n_threads <= 1)
+    for (size_t i = 0; i < n_bits; ++i)
+      generate_unit_vec(seed, i, unit_vecs[i]);
+  else {
+    vector<std::thread> workers;
+    for (size_t t = 0; t < n_threads; ++t)
+      workers.push_back(std::thread([this, t, n_threads] {
+        for (size_t i = t; i < n_bits; i += n_threads)
+          generate_unit_vec(seed, i, unit_vecs[i]);
+      }));
+    for (size_t t = 0; t < workers.size(); ++t)
+      workers[t].join();
   }
+  set_unit_sums();
+}
+
+
+LSHAngleHashFunction::LSHAngleHashFunction(const string &id_in,
+                                           const string &fsi,
+                                           const vector<vector<double> > &uvs)
+  : id(id_in), feature_set_id(fsi), family(GAUSSIAN), seed(0),
+    n_features(uvs.empty() ? 0 : uvs.front().size()), n_bits(uvs.size()),
+    unit_vecs(uvs), padded(0) {
+  set_unit_sums();
+}
+
+
+/* the sums of the unit vectors, for projecting centered sparse
+ * vectors */
+void
+LSHAngleHashFunction::set_unit_sums() {
+  unit_sums.resize(unit_vecs.size());
+  for (size_t i = 0; i < unit_vecs.size(); ++i)
+    unit_sums[i] = std::accumulate(unit_vecs[i].begin(),
+                                   unit_vecs[i].end(), 0.0);
 }
 
 
@@ -96,11 +234,26 @@ operator>>(std::istream &in, LSHAngleHashFunction &hf) {
   // second line is for the feature set
   string fs_id;
   getline(in, fs_id);
-  
+
+  // a seeded hash function is regenerated from one line
+  string line;
+  if ((in.peek() == SEED_TAG[0] || in.peek() == HADAMARD_TAG[0]) &&
+      getline(in, line)) {
+    std::istringstream iss(line);
+    string tag;
+    uint64_t seed = 0;
+    size_t n_features = 0, n_bits = 0;
+    if (!(iss >> tag >> seed >> n_features >> n_bits) ||
+        (tag != SEED_TAG && tag != HADAMARD_TAG))
+      throw SMITHLABException("bad hash function seed line: " + line);
+    hf = LSHAngleHashFunction(hf_id, fs_id, n_features, n_bits, seed,
+                              tag == SEED_TAG ? GAUSSIAN : HADAMARD);
+    return in;
+  }
+
   size_t n_dimensions = 0;
   
   vector<vector<double> > uvs;
-  string line;
   while (getline(in, line)) {
     
     vector<double> current(n_dimensions);
@@ -144,6 +297,11 @@ string
 LSHAngleHashFunction::tostring() const {
   std::ostringstream oss;
   oss << id << '\n' << feature_set_id;
+  if (seed != 0) {
+    oss << '\n' << (family == HADAMARD ? HADAMARD_TAG : SEED_TAG) << ' '
+        << seed << ' ' << n_features << ' ' << n_bits;
+    return oss.str();
+  }
   for (size_t i = 0; i < unit_vecs.size(); ++i) {
     oss << '\n';
     copy(unit_vecs[i].begin(), unit_vecs[i].end(), 
@@ -153,13 +311,124 @@ LSHAngleHashFunction::tostring() const {
 }
 
 
+/* the projections of fv that the hadamard family takes the signs of:
+ * for each block of bits the leading coordinates of the vector,
+ * zero-padded, after each round of sign flips and transform */
+void
+LSHAngleHashFunction::rotate(const FeatureVector &fv,
+                             vector<double> &proj) const {
+  if (fv.size() != n_features)
+    throw SMITHLABException("cannot hash " + fv.get_id() + ": " +
+                            toa(fv.size()) + " features, expected " +
+                            toa(n_features));
+  proj.resize(n_bits);
+  // the buffer is kept by each thread, as large vectors would
+  // otherwise be fresh pages from the allocator on every call
+  static thread_local vector<double> y;
+  y.resize(padded);
+  const uint64_t words = (padded + 63)/64;
+  for (size_t block = 0; block*padded < n_bits; ++block) {
+    fv.get_values(y.data());
+    std::fill(y.begin() + n_features, y.end(), 0.0);
+    for (size_t r = 0; r < HADAMARD_ROUNDS; ++r) {
+      flip_signs(seed, (block*HADAMARD_ROUNDS + r)*words, y.data(), padded);
+      walsh_hadamard(y.data(), padded);
+    }
+    const size_t first = block*padded;
+    const size_t n = std::min(padded, n_bits - first);
+    std::copy(y.begin(), y.begin() + n, proj.begin() + first);
+  }
+}
+
+
 size_t 
 LSHAngleHashFunction::operator()(const FeatureVector &fv) const {
   size_t value = 0;
+  if (family == HADAMARD) {
+    vector<double> proj;
+    rotate(fv, proj);
+    for (size_t i = 0; i < proj.size(); ++i)
+      value = (value << 1ul) + (proj[i] >= 0);
+    return value;
+  }
   for (size_t i = 0; i < unit_vecs.size(); ++i) {
     value <<= 1ul;
-    value += (inner_product(unit_vecs[i].begin(),
-                            unit_vecs[i].end(), fv.begin(), 0.0) >= 0);
+    value += (fv.dot(unit_vecs[i], unit_sums[i]) >= 0);
   }
   return value;
 }
+
+
+/* A perturbation set flips a set of bits of the query's hash value,
+ * identified by their ranks in the order of increasing margin. The
+ * score is the total margin (|projection|) of the flipped bits, so a
+ * low score is a bucket the query nearly fell into.
+ */
+struct ProbeSet {
+  ProbeSet() : score(0.0) {}
+  bool operator<(const ProbeSet &other) const {return score > other.score;}
+  vector<size_t> ranks;
+  double score;
+};
+
+
+void
+LSHAngleHashFunction::get_probes(const FeatureVector &fv,
+                                 const size_t n_probes,
+                                 vector<size_t> &probes) const {
+  probes.clear();
+  if (n_probes == 0)
+    return;
+
+  // the first unit vector gives the most significant bit
+  vector<double> proj;
+  if (family == HADAMARD)
+    rotate(fv, proj);
+  else {
+    proj.resize(n_bits);
+    for (size_t i = 0; i < n_bits; ++i)
+      proj[i] = fv.dot(unit_vecs[i], unit_sums[i]);
+  }
+  size_t value = 0;
+  vector<pair<double, size_t> > margins(n_bits);
+  for (size_t i = 0; i < n_bits; ++i) {
+    value <<= 1ul;
+    value += (proj[i] >= 0);
+    margins[i] = std::make_pair(std::fabs(proj[i]), n_bits - 1 - i);
+  }
+  std::sort(margins.begin(), margins.end());
+  probes.push_back(value);
+
+  // generate perturbation sets in order of score: from each set, the
+  // "shift" replaces its largest rank r with r + 1 and the "expand"
+  // adds r + 1; every set of ranks is reached exactly once this way
+  std::priority_queue<ProbeSet> sets;
+  if (n_bits > 0) {
+    ProbeSet first;
+    first.ranks.push_back(0);
+    first.score = margins[0].first;
+    sets.push(first);
+  }
+  while (probes.size() < n_probes && !sets.empty()) {
+    const ProbeSet current(sets.top());
+    sets.pop();
+
+    size_t probe = value;
+    for (size_t i = 0; i < current.ranks.size(); ++i)
+      probe ^= (1ul << margins[current.ranks[i]].second);
+    probes.push_back(probe);
+
+    const size_t r = current.ranks.back();
+    if (r + 1 < n_bits) {
+      ProbeSet shifted(current);
+      shifted.ranks.back() = r + 1;
+      shifted.score += margins[r + 1].first - margins[r].first;
+      sets.push(shifted);
+
+      ProbeSet expanded(current);
+      expanded.ranks.push_back(r + 1);
+      expanded.score += margins[r + 1].first;
+      sets.push(expanded);
+    }
+  }
+}
@@ -25,29 +25,67 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 
 class FeatureVector;
 
+/*
+ * Random hyperplanes hashing feature vectors by the sides they fall
+ * on. A hash function defined by a seed regenerates its hyperplanes
+ * from (seed, n_features, n_bits) alone, each coordinate from its own
+ * counter in a stateless generator, so its file holds just those
+ * numbers and the hyperplanes come out the same on every machine.
+ * Hash functions read with explicit hyperplanes have seed 0.
+ *
+ * Seeded hash functions are of one of two families. The "gaussian"
+ * hyperplanes cost n_bits*n_features per vector. The "hadamard"
+ * hyperplanes are never stored: the vector, padded to a power of two
+ * P, is rotated by three rounds of random sign flips each followed by
+ * a Walsh-Hadamard transform (HD3 HD2 HD1), and each block of up to P
+ * bits takes the signs of the leading coordinates. That costs
+ * 3*P*log2(P) additions per block, which is less than the gaussian
+ * family for dense vectors once n_bits is several times log2(P). The
+ * bits of a block come from orthogonal hyperplanes.
+ */
 class LSHAngleHashFunction {
 public:
-  LSHAngleHashFunction() {}
+  LSHAngleHashFunction() : seed(0), n_features(0), n_bits(0), padded(0) {}
   LSHAngleHashFunction(const std::string &id_in, const std::string &fsi,
-                       const size_t n_features, const size_t n_bits);
+                       const size_t n_features_in, const size_t n_bits_in,
+                       const uint64_t seed_in, const std::string &family_in);
   LSHAngleHashFunction(const std::string &id_in, const std::string &fsi,
-                       const std::vector<std::vector<double> > &uvs) :
-    id(id_in), feature_set_id(fsi), unit_vecs(uvs) {}
+                       const std::vector<std::vector<double> > &uvs);
   
   size_t operator()(const FeatureVector &fv) const;
   
+  // multi-probe: hash values of the n_probes buckets most likely to
+  // hold neighbors of fv, in order, beginning with the bucket of fv
+  void get_probes(const FeatureVector &fv, const size_t n_probes,
+                  std::vector<size_t> &probes) const;
+  
   std::string tostring() const;
-  size_t size() const {return unit_vecs.size();};
+  size_t size() const {return n_bits;};
   std::string get_id() const {return id;}
   std::string get_feature_set_id() const {return feature_set_id;}
+  uint64_t get_seed() const {return seed;}
+  std::string get_family() const {return family;}
   
 private:
   std::string id;
   std::string feature_set_id;
+  std::string family;
+  uint64_t seed;
+  size_t n_features;
+  size_t n_bits;
   std::vector<std::vector<double> > unit_vecs;
+  std::vector<double> unit_sums;
+
+  // hadamard family: the transform size; the signs of each round are
+  // drawn from the seed as they are applied
+  size_t padded;
+
+  void set_unit_sums();
+  void rotate(const FeatureVector &fv, std::vector<double> &proj) const;
 };
 
 std::ostream&
@@ -56,4 +94,9 @@ operator<<(std::ostream &os, const LSHAngleHashFunction &hf);
 std::istream&
 operator>>(std::istream &in, LSHAngleHashFunction &hf);
 
+// a nonzero seed for the hash function named key, derived from a base
+// seed, so that the hash functions of one server differ
+uint64_t
+derive_hash_seed(const uint64_t base_seed, const std::string &key);
+
 #endif
@@ -31,11 +31,262 @@
 #include "smithlab_utils.hpp"
 
 #include "FeatureVector.hpp"
+#include "LSHAngleHashFunction.hpp"
 
 using std::vector;
 using std::string;
 using std::pair;
 using std::make_pair;
+using std::shared_ptr;
+using std::unordered_map;
+
+
+/*
+ * Splitting overloaded buckets: the members of a bucket with more than
+ * "max_load" vectors are hashed again with a few more hyperplanes, and
+ * any sub-bucket that is still overloaded is split the same way. The
+ * table keeps every bucket whole, so its text form and the engine
+ * database do not change; the splits are an index over the buckets
+ * that queries and refresh descend into, and they are rebuilt from
+ * the feature vectors after loading.
+ */
+struct BucketSplit {
+  BucketSplit() : depth(0) {}
+  LSHAngleHashFunction hf;
+  BucketMap buckets;
+  SplitMap splits;
+  size_t depth;
+};
+
+
+static shared_ptr<BucketSplit>
+clone_split(const BucketSplit &split) {
+  shared_ptr<BucketSplit> copy(new BucketSplit(split));
+  for (SplitMap::iterator i(copy->splits.begin()); i != copy->splits.end(); ++i)
+    i->second = clone_split(*i->second);
+  return copy;
+}
+
+
+/* by length rather than capacity, so an id costs the same to add and
+ * to remove whichever copy is measured */
+static size_t
+id_string_bytes(const string &s) {
+  return sizeof(string) + s.size() + 1;
+}
+
+
+LSHAngleHashTable::LSHAngleHashTable(const string &i, const BucketMap &bm) :
+  id(i), buckets(bm), id_bytes(0) {
+  for (BucketMap::const_iterator b(buckets.begin()); b != buckets.end(); ++b)
+    for (size_t j = 0; j < b->second.size(); ++j)
+      id_bytes += id_string_bytes(b->second[j]);
+  count_all_leaves();
+}
+
+
+LSHAngleHashTable::LSHAngleHashTable(const LSHAngleHashTable &other) :
+  id(other.id), buckets(other.buckets), leaf_loads(other.leaf_loads),
+  id_bytes(other.id_bytes) {
+  for (SplitMap::const_iterator i(other.splits.begin());
+       i != other.splits.end(); ++i)
+    splits[i->first] = clone_split(*i->second);
+}
+
+
+LSHAngleHashTable&
+LSHAngleHashTable::operator=(const LSHAngleHashTable &other) {
+  if (this != &other) {
+    LSHAngleHashTable tmp(other);
+    id.swap(tmp.id);
+    buckets.swap(tmp.buckets);
+    splits.swap(tmp.splits);
+    leaf_loads.swap(tmp.leaf_loads);
+    std::swap(id_bytes, tmp.id_bytes);
+  }
+  return *this;
+}
+
+
+static shared_ptr<BucketSplit>
+split_bucket(const string &table_id, const string &bucket_path,
+             const vector<string> &members,
+             const unordered_map<string, FeatureVector> &fvs,
+             const size_t max_load, const size_t extra_bits,
+             const size_t depth, const size_t max_depth, size_t &n_splits) {
+
+  unordered_map<string, FeatureVector>::const_iterator
+    first(fvs.find(members.front()));
+  if (first == fvs.end())
+    throw SMITHLABException("cannot split bucket with unknown vector: " +
+                            members.front());
+
+  shared_ptr<BucketSplit> split(new BucketSplit);
+  split->depth = depth;
+  // the seed follows from the table, the depth and the keys leading
+  // to the bucket, not from its members or their order, so the primary
+  // and every replica split a bucket the same way when they rebuild
+  const string split_id(table_id + "." + toa(depth));
+  split->hf = LSHAngleHashFunction(split_id, "", first->second.size(),
+                                   extra_bits,
+                                   derive_hash_seed(0, split_id + "." +
+                                                    bucket_path),
+                                   "gaussian");
+  for (size_t i = 0; i < members.size(); ++i) {
+    unordered_map<string, FeatureVector>::const_iterator
+      fv(fvs.find(members[i]));
+    if (fv == fvs.end())
+      throw SMITHLABException("cannot split bucket with unknown vector: " +
+                              members[i]);
+    split->buckets[split->hf(fv->second)].push_back(members[i]);
+  }
+  ++n_splits;
+
+  if (depth + 1 < max_depth)
+    for (BucketMap::const_iterator i(split->buckets.begin());
+         i != split->buckets.end(); ++i)
+      if (i->second.size() > max_load)
+        split->splits[i->first] =
+          split_bucket(table_id, bucket_path + "." + toa(i->first),
+                       i->second, fvs, max_load, extra_bits,
+                       depth + 1, max_depth, n_splits);
+  return split;
+}
+
+
+size_t
+LSHAngleHashTable::split_overloaded_buckets(const unordered_map<string,
+                                                               FeatureVector> &fvs,
+                                            const size_t max_load,
+                                            const size_t extra_bits,
+                                            const size_t max_depth) {
+  splits.clear();
+  size_t n_splits = 0;
+  if (max_load > 0 && extra_bits > 0 && max_depth > 0)
+    for (BucketMap::const_iterator i(buckets.begin()); i != buckets.end(); ++i)
+      if (i->second.size() > max_load)
+        splits[i->first] = split_bucket(id, toa(i->first), i->second, fvs,
+                                        max_load, extra_bits, 1,
+                                        max_depth + 1, n_splits);
+  count_all_leaves();
+  return n_splits;
+}
+
+
+const vector<string> *
+LSHAngleHashTable::find_leaf_bucket(const size_t hash_key,
+                                    const FeatureVector &fv) const {
+  BucketMap::const_iterator bucket(buckets.find(hash_key));
+  if (bucket == buckets.end())
+    return 0;
+
+  const SplitMap *current_splits = &splits;
+  size_t key = hash_key;
+  const vector<string> *leaf = &bucket->second;
+  for (SplitMap::const_iterator s(current_splits->find(key));
+       s != current_splits->end(); s = current_splits->find(key)) {
+    key = s->second->hf(fv);
+    BucketMap::const_iterator sub(s->second->buckets.find(key));
+    if (sub == s->second->buckets.end())
+      return 0;
+    leaf = &sub->second;
+    current_splits = &s->second->splits;
+  }
+  return leaf;
+}
+
+
+static void
+collect_leaves(const BucketMap &buckets, const SplitMap &splits,
+               vector<const vector<string> *> &leaves);
+
+
+/* the leaves under one bucket: the bucket itself unless it was split */
+static void
+collect_bucket_leaves(const BucketMap::const_iterator bucket,
+                      const SplitMap &splits,
+                      vector<const vector<string> *> &leaves) {
+  SplitMap::const_iterator s(splits.find(bucket->first));
+  if (s == splits.end())
+    leaves.push_back(&bucket->second);
+  else
+    collect_leaves(s->second->buckets, s->second->splits, leaves);
+}
+
+
+static void
+collect_leaves(const BucketMap &buckets, const SplitMap &splits,
+               vector<const vector<string> *> &leaves) {
+  for (BucketMap::const_iterator i(buckets.begin()); i != buckets.end(); ++i)
+    collect_bucket_leaves(i, splits, leaves);
+}
+
+
+/* adds the leaves under the bucket for hash_key to the leaf loads, or
+ * removes them; the mutators remove them before changing the bucket
+ * and add them back after, at the cost of its leaves */
+void
+LSHAngleHashTable::count_leaves(const size_t hash_key, const bool add) {
+  const BucketMap::const_iterator bucket(buckets.find(hash_key));
+  if (bucket == buckets.end())
+    return;
+  vector<const vector<string> *> leaves;
+  collect_bucket_leaves(bucket, splits, leaves);
+  for (size_t i = 0; i < leaves.size(); ++i) {
+    const size_t load = leaves[i]->size();
+    if (add)
+      ++leaf_loads[load];
+    else if (--leaf_loads[load] == 0)
+      leaf_loads.erase(load);
+  }
+}
+
+
+void
+LSHAngleHashTable::count_all_leaves() {
+  leaf_loads.clear();
+  vector<const vector<string> *> leaves;
+  get_leaf_buckets(leaves);
+  for (size_t i = 0; i < leaves.size(); ++i)
+    ++leaf_loads[leaves[i]->size()];
+}
+
+
+size_t
+LSHAngleHashTable::memory_bytes() const {
+  return id_bytes + buckets.size()*(sizeof(size_t) + sizeof(vector<string>) +
+                                    2*sizeof(void *));
+}
+
+
+void
+LSHAngleHashTable::get_leaf_buckets(vector<const vector<string> *> &leaves) const {
+  leaves.clear();
+  collect_leaves(buckets, splits, leaves);
+}
+
+
+static void
+collect_split_stats(const SplitMap &splits, SplitStats &stats) {
+  for (SplitMap::const_iterator i(splits.begin()); i != splits.end(); ++i) {
+    ++stats.splits;
+    stats.max_depth = std::max(stats.max_depth, i->second->depth);
+    collect_split_stats(i->second->splits, stats);
+  }
+}
+
+
+SplitStats
+LSHAngleHashTable::get_split_stats() const {
+  SplitStats stats;
+  stats.split_buckets = splits.size();
+  collect_split_stats(splits, stats);
+  vector<const vector<string> *> leaves;
+  get_leaf_buckets(leaves);
+  for (size_t i = 0; i < leaves.size(); ++i)
+    stats.max_leaf_load = std::max(stats.max_leaf_load, leaves[i]->size());
+  return stats;
+}
 
 size_t
 LSHAngleHashTable::max_bucket_load() const {
@@ -48,21 +299,41 @@ LSHAngleHashTable::max_bucket_load() const {
 
 void
 LSHAngleHashTable::insert(const FeatureVector &fv, const size_t hash_key) {
+  count_leaves(hash_key, false);
+  id_bytes += id_string_bytes(fv.get_id());
   const BucketMap::iterator x(buckets.find(hash_key));
   if (x == buckets.end())
     buckets[hash_key] = vector<string>(1, fv.get_id());
   else 
     x->second.push_back(fv.get_id());
+  
+  // place it in the sub-buckets of any splits as well
+  SplitMap *current_splits = &splits;
+  size_t key = hash_key;
+  for (SplitMap::iterator s(current_splits->find(key));
+       s != current_splits->end(); s = current_splits->find(key)) {
+    key = s->second->hf(fv);
+    s->second->buckets[key].push_back(fv.get_id());
+    current_splits = &s->second->splits;
+  }
+  count_leaves(hash_key, true);
 }
 
 
 void
 LSHAngleHashTable::insert(const string &fv_id, const size_t hash_key) {
+  count_leaves(hash_key, false);
+  id_bytes += id_string_bytes(fv_id);
   const BucketMap::iterator x(buckets.find(hash_key));
   if (x == buckets.end())
     buckets[hash_key] = vector<string>(1, fv_id);
   else 
     x->second.push_back(fv_id);
+  
+  // without the vector it cannot be placed in a split, so the split
+  // no longer covers the bucket
+  splits.erase(hash_key);
+  count_leaves(hash_key, true);
 }
 
 
@@ -81,10 +352,42 @@ LSHAngleHashTable::remove(const FeatureVector &fv, const size_t hash_key) {
       throw SMITHLABException("attempt to remove unknown point: " 
                               + fv.get_id());
     else {
+      count_leaves(hash_key, false);
+      id_bytes -= std::min(id_bytes, id_string_bytes(*pos));
       x->second.erase(pos);
-      if(x->second.empty())
+      if(x->second.empty()) {
         buckets.erase(hash_key);
+        splits.erase(hash_key);
+      }
+      else
+        remove_from_splits(fv, hash_key);
+      count_leaves(hash_key, true);
+    }
+  }
+}
+
+
+void
+LSHAngleHashTable::remove_from_splits(const FeatureVector &fv,
+                                      const size_t hash_key) {
+  SplitMap *current_splits = &splits;
+  size_t key = hash_key;
+  for (SplitMap::iterator s(current_splits->find(key));
+       s != current_splits->end(); s = current_splits->find(key)) {
+    key = s->second->hf(fv);
+    BucketMap::iterator sub(s->second->buckets.find(key));
+    if (sub == s->second->buckets.end())
+      return;
+    vector<string>::iterator pos = std::find(sub->second.begin(),
+                                             sub->second.end(), fv.get_id());
+    if (pos != sub->second.end())
+      sub->second.erase(pos);
+    if (sub->second.empty()) {
+      s->second->buckets.erase(sub);
+      s->second->splits.erase(key);
+      return;
     }
+    current_splits = &s->second->splits;
   }
 }
 
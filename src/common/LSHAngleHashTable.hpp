@@ -27,19 +27,34 @@
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <memory>
+#include <map>
 
 class FeatureVector;
 
 typedef std::unordered_map<size_t, std::vector<std::string> > BucketMap;
 
+// overloaded buckets are split with extra hyperplane bits (see .cpp)
+struct BucketSplit;
+typedef std::unordered_map<size_t, std::shared_ptr<BucketSplit> > SplitMap;
+
+struct SplitStats {
+  SplitStats() : split_buckets(0), splits(0), max_depth(0), max_leaf_load(0) {}
+  size_t split_buckets; // top-level buckets that were split
+  size_t splits;        // split nodes at all depths
+  size_t max_depth;
+  size_t max_leaf_load;
+};
+
 class LSHAngleHashTable {
 public:
 
   // Constructors
-  LSHAngleHashTable() {}
-  LSHAngleHashTable(const std::string id_in) : id(id_in) {}
-  LSHAngleHashTable(const std::string &i, const BucketMap &bm) : 
-    id(i), buckets(bm) {}
+  LSHAngleHashTable() : id_bytes(0) {}
+  LSHAngleHashTable(const std::string id_in) : id(id_in), id_bytes(0) {}
+  LSHAngleHashTable(const std::string &i, const BucketMap &bm);
+  LSHAngleHashTable(const LSHAngleHashTable &other);
+  LSHAngleHashTable& operator=(const LSHAngleHashTable &other);
 
   // Accessors
   std::string tostring() const;
@@ -52,14 +67,43 @@ public:
   BucketMap::const_iterator end() const {return buckets.end();}
   BucketMap::const_iterator find(const size_t &x) const {return buckets.find(x);}
   
+  // the bucket of fv within the bucket for hash_key, descending into
+  // splits; null if there is no such bucket
+  const std::vector<std::string> *
+  find_leaf_bucket(const size_t hash_key, const FeatureVector &fv) const;
+  // every bucket after splitting (the buckets that were not split)
+  void get_leaf_buckets(std::vector<const std::vector<std::string> *> &l) const;
+  SplitStats get_split_stats() const;
+  // the number of leaf buckets of each load, kept up to date by the
+  // mutators so that reading it does not walk the buckets
+  const std::map<size_t, size_t> &get_leaf_loads() const {return leaf_loads;}
+  // approximate bytes of the buckets and their ids, not the splits
+  size_t memory_bytes() const;
+  
   // Mutators
   void insert(const FeatureVector &fv, const size_t hash_value);
   void insert(const std::string &fv_id, const size_t hash_value);
   void remove(const FeatureVector &fv, const size_t hash_value);
   
+  // splits (recursively) each bucket holding more than max_load
+  // vectors, hashing its members with extra_bits more hyperplanes;
+  // returns the number of splits made
+  size_t
+  split_overloaded_buckets(const std::unordered_map<std::string,
+                                                   FeatureVector> &fvs,
+                           const size_t max_load, const size_t extra_bits,
+                           const size_t max_depth = 4);
+  
 private:
   std::string id;
   BucketMap buckets;
+  SplitMap splits;
+  std::map<size_t, size_t> leaf_loads;
+  size_t id_bytes;
+
+  void count_leaves(const size_t hash_key, const bool add);
+  void count_all_leaves();
+  void remove_from_splits(const FeatureVector &fv, const size_t hash_value);
 };
 
 
@@ -192,9 +192,7 @@ LSHEuclideanHashFunction::operator()(const FeatureVector &fv) const {
   const size_t PRIME = (1ul << 32) - 5;
   size_t hash_value = 0ul;
   for (size_t i = 0; i < parameters.size(); ++i) {
-    double inner = inner_product(parameters[i].rand_vec.begin(),
-                                 parameters[i].rand_vec.end(),
-                                 fv.begin(), 0.0);
+    double inner = fv.dot(parameters[i].rand_vec);
     size_t inner_hash_value = static_cast<size_t>(floor(
                               (inner + parameters[i].rand_uniform)
                               / uniform_seed));
@@ -0,0 +1,267 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Metrics.hpp"
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+
+static const size_t EXACT_LIMIT = 128;
+static const size_t SUB_BUCKETS = 64;
+static const size_t SUB_BUCKET_BITS = 6;
+// the largest shift is 57, for values with the top bit set
+static const size_t N_HDR_BUCKETS = EXACT_LIMIT + 57*SUB_BUCKETS;
+
+
+static inline size_t
+highest_bit(uint64_t x) {
+  size_t b = 0;
+  while (x >>= 1)
+    ++b;
+  return b;
+}
+
+
+static inline size_t
+hdr_index(const uint64_t value) {
+  if (value < EXACT_LIMIT)
+    return value;
+  const size_t shift = highest_bit(value) - SUB_BUCKET_BITS;
+  return EXACT_LIMIT + (shift - 1)*SUB_BUCKETS +
+    ((value >> shift) - SUB_BUCKETS);
+}
+
+
+/* the largest value counted in the bucket */
+static inline uint64_t
+hdr_upper(const size_t index) {
+  if (index < EXACT_LIMIT)
+    return index;
+  const size_t shift = (index - EXACT_LIMIT)/SUB_BUCKETS + 1;
+  const uint64_t mantissa = (index - EXACT_LIMIT) % SUB_BUCKETS + SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+
+HdrHistogram::HdrHistogram() :
+  counts(N_HDR_BUCKETS, 0), total_count(0), total_sum(0) {}
+
+
+void
+HdrHistogram::record(const uint64_t value, const size_t count) {
+  counts[hdr_index(value)] += count;
+  total_count += count;
+  total_sum += value*count;
+}
+
+
+size_t
+HdrHistogram::count_at_most(const uint64_t bound) const {
+  size_t n = 0;
+  for (size_t i = 0; i < counts.size() && hdr_upper(i) <= bound; ++i)
+    n += counts[i];
+  return n;
+}
+
+
+void
+latency_bounds(const double lo, const double hi, vector<double> &bounds) {
+  bounds.clear();
+  for (double b = lo; b <= hi*1.0001; b *= 10.0) {
+    bounds.push_back(b);
+    if (2.5*b <= hi*1.0001)
+      bounds.push_back(2.5*b);
+    if (5.0*b <= hi*1.0001)
+      bounds.push_back(5.0*b);
+  }
+}
+
+
+void
+power_of_two_bounds(const double hi, vector<double> &bounds) {
+  bounds.clear();
+  for (double b = 1.0; b <= hi; b *= 2.0)
+    bounds.push_back(b);
+}
+
+
+MetricsRegistry::Family &
+MetricsRegistry::get_family(const string &name, const string &type) {
+  map<string, Family>::iterator f(families.find(name));
+  if (f == families.end() || f->second.type != type)
+    throw SMITHLABException("undefined " + type + " metric: " + name);
+  return f->second;
+}
+
+
+void
+MetricsRegistry::define_counter(const string &name, const string &help) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  Family &f = families[name];
+  f.type = "counter";
+  f.help = help;
+}
+
+
+void
+MetricsRegistry::define_gauge(const string &name, const string &help) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  Family &f = families[name];
+  f.type = "gauge";
+  f.help = help;
+}
+
+
+void
+MetricsRegistry::define_histogram(const string &name, const string &help,
+                                  const double unit,
+                                  const vector<double> &bounds) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  Family &f = families[name];
+  f.type = "histogram";
+  f.help = help;
+  f.unit = unit;
+  f.bounds = bounds;
+}
+
+
+void
+MetricsRegistry::increment(const string &name, const string &labels,
+                           const double amount) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  get_family(name, "counter").values[labels] += amount;
+}
+
+
+void
+MetricsRegistry::set(const string &name, const string &labels,
+                     const double value) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  get_family(name, "gauge").values[labels] = value;
+}
+
+
+void
+MetricsRegistry::observe(const string &name, const string &labels,
+                         const double value, const size_t count) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  Family &f = get_family(name, "histogram");
+  const double units = std::max(0.0, value/f.unit);
+  f.histograms[labels].record(static_cast<uint64_t>(units + 0.5), count);
+}
+
+
+static string
+series(const string &name, const string &labels, const string &extra) {
+  string s = name;
+  if (!labels.empty() || !extra.empty()) {
+    s += '{' + labels;
+    if (!labels.empty() && !extra.empty())
+      s += ',';
+    s += extra + '}';
+  }
+  return s;
+}
+
+
+void
+MetricsRegistry::write_prometheus(std::ostream &out) const {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (map<string, Family>::const_iterator i(families.begin());
+       i != families.end(); ++i) {
+    const string &name = i->first;
+    const Family &f = i->second;
+    out << "# HELP " << name << ' ' << f.help << '\n'
+        << "# TYPE " << name << ' ' << f.type << '\n';
+
+    for (map<string, double>::const_iterator j(f.values.begin());
+         j != f.values.end(); ++j)
+      out << series(name, j->first, "") << ' ' << j->second << '\n';
+
+    for (map<string, HdrHistogram>::const_iterator j(f.histograms.begin());
+         j != f.histograms.end(); ++j) {
+      const HdrHistogram &h = j->second;
+      for (size_t b = 0; b < f.bounds.size(); ++b) {
+        const uint64_t bound =
+          static_cast<uint64_t>(std::floor(f.bounds[b]/f.unit + 1e-9));
+        out << series(name + "_bucket", j->first,
+                      "le=\"" + toa(f.bounds[b]) + "\"")
+            << ' ' << h.count_at_most(bound) << '\n';
+      }
+      out << series(name + "_bucket", j->first, "le=\"+Inf\"")
+          << ' ' << h.get_count() << '\n'
+          << series(name + "_sum", j->first, "") << ' '
+          << h.get_sum()*f.unit << '\n'
+          << series(name + "_count", j->first, "") << ' '
+          << h.get_count() << '\n';
+    }
+  }
+}
+
+
+const char *
+stage_name(const size_t stage) {
+  static const char *names[N_REQUEST_STAGES] = {
+    "parse", "hash", "gather", "expand", "score", "persist", "project",
+    "rerank"
+  };
+  return names[stage];
+}
+
+
+RequestProfile::RequestProfile() :
+  candidates(0), last(std::chrono::steady_clock::now()),
+  current(N_REQUEST_STAGES) {
+  for (size_t i = 0; i < N_REQUEST_STAGES; ++i) {
+    seconds[i] = 0.0;
+    entered[i] = false;
+  }
+}
+
+
+void
+RequestProfile::enter(const RequestStage stage) {
+  const std::chrono::steady_clock::time_point now =
+    std::chrono::steady_clock::now();
+  if (current < N_REQUEST_STAGES)
+    seconds[current] += std::chrono::duration<double>(now - last).count();
+  last = now;
+  current = stage;
+  entered[stage] = true;
+}
+
+
+void
+RequestProfile::finish() {
+  if (current < N_REQUEST_STAGES)
+    seconds[current] += std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - last).count();
+  current = N_REQUEST_STAGES;
+}
@@ -0,0 +1,139 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+#include <stdint.h>
+
+/*
+ * Histogram of non-negative integers in the style of HdrHistogram:
+ * values below 128 are counted exactly, and each larger power of two
+ * is divided into 64 equal sub-buckets, so any value is known to
+ * within 1.6% using a fixed 30KB of counts.
+ */
+class HdrHistogram {
+public:
+  HdrHistogram();
+  // records count occurrences of the value
+  void record(const uint64_t value, const size_t count = 1);
+  size_t get_count() const {return total_count;}
+  uint64_t get_sum() const {return total_sum;}
+  // number of recorded values certainly no larger than the bound
+  size_t count_at_most(const uint64_t bound) const;
+
+private:
+  std::vector<size_t> counts;
+  size_t total_count;
+  uint64_t total_sum;
+};
+
+
+/*
+ * Named counters, gauges and histograms, exported in the Prometheus
+ * text format. Each metric is defined once with its help text; its
+ * series are then addressed by a label string such as
+ * "route=\"query\"" (empty for none). Histograms store integers in
+ * units of "unit" (e.g. 1e-6 for seconds measured in microseconds)
+ * and export the given cumulative bucket bounds. All members are
+ * thread safe.
+ */
+class MetricsRegistry {
+public:
+  void define_counter(const std::string &name, const std::string &help);
+  void define_gauge(const std::string &name, const std::string &help);
+  void define_histogram(const std::string &name, const std::string &help,
+                        const double unit, const std::vector<double> &bounds);
+
+  void increment(const std::string &name, const std::string &labels,
+                 const double amount = 1.0);
+  void set(const std::string &name, const std::string &labels,
+           const double value);
+  void observe(const std::string &name, const std::string &labels,
+               const double value, const size_t count = 1);
+
+  void write_prometheus(std::ostream &out) const;
+
+private:
+  struct Family {
+    Family() : unit(1.0) {}
+    std::string type;
+    std::string help;
+    double unit;
+    std::vector<double> bounds;
+    std::map<std::string, double> values;
+    std::map<std::string, HdrHistogram> histograms;
+  };
+  std::map<std::string, Family> families;
+  mutable std::mutex registry_mutex;
+
+  Family &get_family(const std::string &name, const std::string &type);
+};
+
+/* bounds in steps of 1, 2.5 and 5 per decade: lo, 2.5lo, 5lo, 10lo... */
+void
+latency_bounds(const double lo, const double hi, std::vector<double> &bounds);
+
+/* bounds growing by factors of 2: 1, 2, 4, ... up to hi */
+void
+power_of_two_bounds(const double hi, std::vector<double> &bounds);
+
+
+/* the stages of a request timed for the metrics */
+enum RequestStage {
+  STAGE_PARSE, STAGE_HASH, STAGE_GATHER, STAGE_EXPAND, STAGE_SCORE,
+  STAGE_PERSIST, STAGE_PROJECT, STAGE_RERANK, N_REQUEST_STAGES
+};
+
+const char *
+stage_name(const size_t stage);
+
+/*
+ * Time spent in each stage of one request. Calling enter() charges
+ * the time since the previous call to the stage then in progress, so
+ * a request costs one clock read per change of stage.
+ */
+class RequestProfile {
+public:
+  RequestProfile();
+  void enter(const RequestStage stage);
+  void finish();
+  double get_seconds(const size_t stage) const {return seconds[stage];}
+  bool was_entered(const size_t stage) const {return entered[stage];}
+
+  // candidate vectors scored by a query
+  size_t candidates;
+
+private:
+  std::chrono::steady_clock::time_point last;
+  size_t current;
+  double seconds[N_REQUEST_STAGES];
+  bool entered[N_REQUEST_STAGES];
+};
+
+#endif
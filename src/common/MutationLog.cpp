@@ -0,0 +1,217 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MutationLog.hpp"
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cstdlib>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+
+
+static void
+split_tabs(const string &line, vector<string> &parts) {
+  parts.clear();
+  size_t start = 0;
+  for (;;) {
+    const size_t tab = line.find('\t', start);
+    parts.push_back(line.substr(start, tab - start));
+    if (tab == string::npos)
+      break;
+    start = tab + 1;
+  }
+}
+
+
+static void
+check_field(const string &field) {
+  if (field.find_first_of("\t\n") != string::npos)
+    throw SMITHLABException("tab or newline in mutation log field: " + field);
+}
+
+
+MutationLogWriter::MutationLogWriter(const string &fn) :
+  filename(fn), seq(0) {
+
+  // continue numbering after every transaction already logged, also
+  // one left without its COMMIT by a crash, so that readers can tell
+  // its records from those of the next transaction
+  std::ifstream in(filename.c_str());
+  string line;
+  vector<string> parts;
+  bool ends_line = true;
+  while (getline(in, line)) {
+    ends_line = !in.eof();
+    split_tabs(line, parts);
+    if (parts.size() >= 2)
+      seq = std::max(seq, static_cast<size_t>(strtoul(parts[0].c_str(),
+                                                      0, 10)));
+  }
+  in.close();
+
+  out.open(filename.c_str(), std::ios::app);
+  if (!out)
+    throw SMITHLABException("cannot write to mutation log: " + filename);
+  // end a line cut short by a crash, so it is not joined to the next
+  if (!ends_line)
+    out << '\n' << std::flush;
+}
+
+
+void
+MutationLogWriter::begin() {
+  ++seq;
+  pending.clear();
+}
+
+
+void
+MutationLogWriter::add_record(const string &type, const string &fields) {
+  pending += toa(seq) + '\t' + type + '\t' + fields + '\n';
+}
+
+
+void
+MutationLogWriter::insert_vector(const string &id, const string &path) {
+  check_field(id);
+  check_field(path);
+  add_record("INSERT", id + '\t' + path);
+}
+
+
+void
+MutationLogWriter::bucket_add(const string &table, const size_t bucket,
+                              const string &id) {
+  add_record("BUCKET_ADD", table + '\t' + toa(bucket) + '\t' + id);
+}
+
+
+void
+MutationLogWriter::bucket_remove(const string &table, const size_t bucket,
+                                 const string &id) {
+  add_record("BUCKET_DEL", table + '\t' + toa(bucket) + '\t' + id);
+}
+
+
+void
+MutationLogWriter::delete_vector(const string &id) {
+  check_field(id);
+  add_record("DELETE", id);
+}
+
+
+void
+MutationLogWriter::refresh(const string &hash_fun_path,
+                           const size_t split_load, const size_t split_bits) {
+  check_field(hash_fun_path);
+  add_record("REFRESH", hash_fun_path + '\t' + toa(split_load) + '\t' +
+             toa(split_bits));
+}
+
+
+void
+MutationLogWriter::edges(const string &id, const vector<string> &neighbors,
+                         const vector<double> &distances) {
+  std::ostringstream oss;
+  oss.precision(std::numeric_limits<double>::max_digits10);
+  oss << id << '\t' << neighbors.size();
+  for (size_t i = 0; i < neighbors.size(); ++i)
+    oss << '\t' << neighbors[i] << '\t' << distances[i];
+  add_record("EDGES", oss.str());
+}
+
+
+void
+MutationLogWriter::commit() {
+  const size_t now = std::chrono::duration_cast<std::chrono::milliseconds>
+    (std::chrono::system_clock::now().time_since_epoch()).count();
+  add_record("COMMIT", toa(now));
+  out << pending << std::flush;
+  if (!out)
+    throw SMITHLABException("error writing mutation log: " + filename);
+  pending.clear();
+}
+
+
+MutationLogReader::MutationLogReader(const string &fn) :
+  filename(fn), offset(0) {}
+
+
+size_t
+MutationLogReader::read_transactions(vector<MutationTransaction> &txns) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if (!in)
+    throw SMITHLABException("cannot read mutation log: " + filename);
+  in.seekg(0, std::ios::end);
+  const size_t size = in.tellg();
+  if (size < offset)
+    throw SMITHLABException("mutation log was truncated: " + filename);
+  if (size == offset)
+    return 0;
+
+  string data(size - offset, '\0');
+  in.seekg(offset);
+  in.read(&data[0], data.size());
+  data.resize(in.gcount());
+  offset += data.size();
+  data = partial_line + data;
+
+  size_t n_read = 0, start = 0, newline = 0;
+  vector<string> parts;
+  while ((newline = data.find('\n', start)) != string::npos) {
+    split_tabs(data.substr(start, newline - start), parts);
+    start = newline + 1;
+    if (parts.size() < 2)
+      continue;
+    const size_t seq = strtoul(parts[0].c_str(), 0, 10);
+    // records of a transaction that never committed are followed by
+    // those of a later one, and are dropped rather than applied
+    if (current.seq != seq) {
+      current.records.clear();
+      current.seq = seq;
+      current.time_millis = 0;
+    }
+    if (parts[1] == "COMMIT") {
+      current.time_millis =
+        (parts.size() > 2) ? strtoul(parts[2].c_str(), 0, 10) : 0;
+      txns.push_back(current);
+      current.records.clear();
+      ++n_read;
+    }
+    else {
+      MutationRecord r;
+      r.type = parts[1];
+      r.fields.assign(parts.begin() + 2, parts.end());
+      current.records.push_back(r);
+    }
+  }
+  partial_line = data.substr(start);
+  return n_read;
+}
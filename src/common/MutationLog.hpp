@@ -0,0 +1,112 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MUTATION_LOG_HPP
+#define MUTATION_LOG_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+/*
+ * The mutation log is an append-only text file written by the primary
+ * amordad server and followed by read-only replicas. Each mutation
+ * (insert, delete or refresh) is one transaction: a sequence of
+ * tab-separated records sharing a sequence number, closed by a COMMIT
+ * record carrying the time of the mutation:
+ *
+ *   seq INSERT     id path
+ *   seq BUCKET_ADD table bucket id
+ *   seq BUCKET_DEL table bucket id
+ *   seq DELETE     id
+ *   seq REFRESH    hash-function-path split-load split-bits
+ *   seq EDGES      id n neighbor_1 distance_1 ... neighbor_n distance_n
+ *   seq COMMIT     unix-time-millis
+ *
+ * EDGES gives the complete out-neighbor list of a vertex after the
+ * mutation, so applying it twice is harmless.
+ */
+
+struct MutationRecord {
+  std::string type;
+  std::vector<std::string> fields;
+};
+
+struct MutationTransaction {
+  MutationTransaction() : seq(0), time_millis(0) {}
+  size_t seq;
+  size_t time_millis;
+  std::vector<MutationRecord> records;
+};
+
+
+class MutationLogWriter {
+public:
+  // appends to the log, continuing its sequence numbers
+  explicit MutationLogWriter(const std::string &filename);
+
+  void begin();
+  void insert_vector(const std::string &id, const std::string &path);
+  void bucket_add(const std::string &table, const size_t bucket,
+                  const std::string &id);
+  void bucket_remove(const std::string &table, const size_t bucket,
+                     const std::string &id);
+  void delete_vector(const std::string &id);
+  void refresh(const std::string &hash_fun_path, const size_t split_load,
+               const size_t split_bits);
+  void edges(const std::string &id,
+             const std::vector<std::string> &neighbors,
+             const std::vector<double> &distances);
+  // writes the whole transaction at once and flushes it
+  void commit();
+
+  size_t get_seq() const {return seq;}
+
+private:
+  std::string filename;
+  std::ofstream out;
+  size_t seq;
+  std::string pending;
+
+  void add_record(const std::string &type, const std::string &fields);
+};
+
+
+/* reads the transactions appended to a log since the previous read */
+class MutationLogReader {
+public:
+  explicit MutationLogReader(const std::string &filename);
+
+  // appends complete transactions and returns how many; an incomplete
+  // transaction at the end of the log is left for the next read
+  size_t read_transactions(std::vector<MutationTransaction> &txns);
+
+  size_t get_offset() const {return offset;}
+
+private:
+  std::string filename;
+  size_t offset;
+  std::string partial_line;
+  MutationTransaction current;
+};
+
+#endif
@@ -0,0 +1,699 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "QueryEngine.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+#include <queue>
+#include <cassert>
+
+#include "smithlab_utils.hpp"
+
+#include "FeatureVector.hpp"
+#include "FeatureProjection.hpp"
+#include "LSHAngleHashTable.hpp"
+#include "LSHAngleHashFunction.hpp"
+#include "RegularNearestNeighborGraph.hpp"
+#include "ComparedPairFilter.hpp"
+#include "QueryResultCache.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::make_pair;
+using std::unordered_map;
+using std::unordered_set;
+
+
+std::ostream &
+operator<<(std::ostream &os, const Result &r) {
+  return os << r.id << '\t' << r.val;
+}
+
+
+std::ostream &
+operator<<(std::ostream &os, const Edge &e) {
+  return os << e.src << "->" << e.dst << '\t' << e.dist;
+}
+
+
+bool
+BudgetTracker::allows_more() {
+  if (budget.max_candidates > 0 && evaluated >= budget.max_candidates)
+    return false;
+  if (budget.max_millis > 0.0 && !out_of_time && evaluated % 16 == 0) {
+    const std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+    out_of_time = (elapsed.count() > budget.max_millis);
+  }
+  return !out_of_time;
+}
+
+
+bool
+BudgetTracker::within(const double fraction) const {
+  if (budget.max_millis <= 0.0)
+    return true;
+  const std::chrono::duration<double, std::milli> elapsed =
+    std::chrono::steady_clock::now() - start;
+  return elapsed.count() <= fraction*budget.max_millis;
+}
+
+
+void
+evaluate_candidates(const FeatVecLookup &fvs, const FeatureVector &query,
+                    const size_t n_neighbors,
+                    const double max_proximity_radius,
+                    const unordered_set<string> &candidates,
+                    vector<Result> &results) {
+
+  std::priority_queue<Result, vector<Result>, std::less<Result> > pq;
+  double current_dist_cutoff = max_proximity_radius;
+  for (unordered_set<string>::const_iterator i(candidates.begin());
+       i != candidates.end(); ++i) {
+    const double dist = query.compute_angle(fvs.find(*i)->second);
+    if (dist < current_dist_cutoff) {
+      if (pq.size() == n_neighbors)
+        pq.pop();
+      pq.push(Result(*i, dist));
+
+      if (pq.size() == n_neighbors)
+        current_dist_cutoff = pq.top().val;
+    }
+  }
+
+  results.clear();
+  while (!pq.empty()) {
+    results.push_back(pq.top());
+    pq.pop();
+  }
+  reverse(results.begin(), results.end());
+}
+
+
+/* the members of the buckets the query is hashed to (or, with n_probes
+ * > 1, nearly hashed to) over all tables */
+static void
+gather_probed_buckets(const HashFunLookup &hfs, const HashTabLookup &hts,
+                      const FeatureVector &query, const size_t n_probes,
+                      RequestProfile &profile,
+                      unordered_set<string> &candidates) {
+  for (HashTabLookup::const_iterator i(hts.begin()); i != hts.end(); ++i) {
+
+    HashFunLookup::const_iterator hf(hfs.find(i->first));
+    assert(hf != hfs.end());
+
+    profile.enter(STAGE_HASH);
+    vector<size_t> probes;
+    hf->second.get_probes(query, n_probes, probes);
+    profile.enter(STAGE_GATHER);
+    for (size_t j = 0; j < probes.size(); ++j) {
+      const vector<string> *bucket =
+        i->second.find_leaf_bucket(probes[j], query);
+      if (bucket != 0)
+        candidates.insert(bucket->begin(), bucket->end());
+    }
+  }
+}
+
+
+/* adds the graph neighbors of the candidates to them */
+static void
+add_graph_neighbors(RegularNearestNeighborGraph &g,
+                    unordered_set<string> &candidates) {
+  unordered_set<string> candidates_from_graph;
+  for (unordered_set<string>::const_iterator i(candidates.begin());
+       i != candidates.end(); ++i) {
+    vector<string> neighbors;
+    vector<double> neighbor_dists;
+    g.get_neighbors(*i, neighbors, neighbor_dists);
+    candidates_from_graph.insert(neighbors.begin(), neighbors.end());
+  }
+  candidates.insert(candidates_from_graph.begin(), candidates_from_graph.end());
+}
+
+
+void
+execute_query(const FeatVecLookup &fvs, const HashFunLookup &hfs,
+              const HashTabLookup &hts, RegularNearestNeighborGraph &g,
+              const FeatureVector &query, const size_t n_neighbors,
+              const double max_proximity_radius, const size_t n_probes,
+              RequestProfile &profile, vector<Result> &results) {
+
+  unordered_set<string> candidates;
+  gather_probed_buckets(hfs, hts, query, n_probes, profile, candidates);
+
+  profile.enter(STAGE_EXPAND);
+  add_graph_neighbors(g, candidates);
+
+  profile.enter(STAGE_SCORE);
+  profile.candidates = candidates.size();
+  evaluate_candidates(fvs, query, n_neighbors,
+                      max_proximity_radius, candidates, results);
+}
+
+
+bool
+gather_bucket_candidates(const HashFunLookup &hfs, const HashTabLookup &hts,
+                         const FeatureVector &query, const size_t n_probes,
+                         const size_t max_load, const BudgetTracker &tracker,
+                         RequestProfile &profile,
+                         unordered_map<string, size_t> &credit,
+                         vector<string> &candidates) {
+  // a bucket, ordered by size, then by the rank of its probe among
+  // the n_probes of its table
+  struct ProbedBucket {
+    size_t size;
+    size_t rank;
+    size_t n_probes;
+    const vector<string> *members;
+    bool operator<(const ProbedBucket &other) const {
+      return size < other.size || (size == other.size && rank < other.rank);
+    }
+  };
+  vector<ProbedBucket> buckets;
+  for (HashTabLookup::const_iterator i(hts.begin()); i != hts.end(); ++i) {
+
+    HashFunLookup::const_iterator hf(hfs.find(i->first));
+    assert(hf != hfs.end());
+
+    profile.enter(STAGE_HASH);
+    vector<size_t> probes;
+    hf->second.get_probes(query, n_probes, probes);
+    profile.enter(STAGE_GATHER);
+    for (size_t j = 0; j < probes.size(); ++j) {
+      const vector<string> *bucket =
+        i->second.find_leaf_bucket(probes[j], query);
+      if (bucket != 0) {
+        const ProbedBucket b = {bucket->size(), j, probes.size(), bucket};
+        buckets.push_back(b);
+      }
+    }
+  }
+  std::stable_sort(buckets.begin(), buckets.end());
+
+  // the clock is read every so many members walked; a bucket cut
+  // short is dropped with those after it
+  static const size_t members_per_check = 1024;
+  bool complete = true;
+  size_t n_walked = 0;
+  unordered_map<string, size_t> all_credit;
+  for (size_t i = 0; i < buckets.size() && complete; ++i) {
+    const vector<string> &members = *buckets[i].members;
+    const size_t weight = buckets[i].n_probes - buckets[i].rank;
+    for (size_t k = 0; k < members.size(); ++k) {
+      if (++n_walked % members_per_check == 0 && !tracker.within(0.5)) {
+        buckets.resize(i);
+        complete = false;
+        break;
+      }
+      all_credit[members[k]] += weight;
+    }
+  }
+
+  // ties are broken by id, so the choice does not depend on the order
+  // the vectors were inserted in
+  const auto more_credit = [&all_credit](const string &a, const string &b) {
+    const size_t ca = all_credit[a], cb = all_credit[b];
+    return ca > cb || (ca == cb && a < b);
+  };
+
+  credit.clear();
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    const vector<string> &bucket = *buckets[i].members;
+    if (max_load == 0 || bucket.size() <= max_load) {
+      for (size_t j = 0; j < bucket.size(); ++j)
+        credit[bucket[j]] = all_credit[bucket[j]];
+      continue;
+    }
+    complete = false;
+    vector<string> members(bucket);
+    std::partial_sort(members.begin(), members.begin() + max_load,
+                      members.end(), more_credit);
+    for (size_t j = 0; j < max_load; ++j)
+      credit[members[j]] = all_credit[members[j]];
+  }
+
+  candidates.clear();
+  for (unordered_map<string, size_t>::const_iterator i(credit.begin());
+       i != credit.end(); ++i)
+    candidates.push_back(i->first);
+  sort(candidates.begin(), candidates.end(), more_credit);
+  return complete;
+}
+
+
+bool
+execute_budgeted_query(const FeatVecLookup &fvs, const HashFunLookup &hfs,
+                       const HashTabLookup &hts,
+                       RegularNearestNeighborGraph &g,
+                       const FeatureVector &query, const size_t n_neighbors,
+                       const double max_proximity_radius,
+                       const size_t n_probes, const QueryBudget &budget,
+                       RequestProfile &profile, vector<Result> &results) {
+
+  BudgetTracker tracker(budget);
+  bool complete = true;
+  bool exhausted = false;
+
+  unordered_map<string, size_t> credit;
+  vector<string> candidates;
+  if (!gather_bucket_candidates(hfs, hts, query, n_probes,
+                                budget.max_bucket_load, tracker, profile,
+                                credit, candidates))
+    complete = false;
+
+  // score the bucket candidates in order of credit
+  profile.enter(STAGE_SCORE);
+  vector<Result> scored;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (!tracker.allows_more()) {
+      exhausted = true;
+      break;
+    }
+    scored.push_back(Result(candidates[i], query.compute_angle(
+                              fvs.find(candidates[i])->second)));
+    tracker.charge();
+  }
+  sort(scored.begin(), scored.end());
+
+  // then graph neighbors of the closest candidates first
+  profile.enter(STAGE_EXPAND);
+  const size_t n_bucket_scored = scored.size();
+  for (size_t i = 0; i < n_bucket_scored && !exhausted; ++i) {
+    vector<string> neighbors;
+    vector<double> neighbor_dists;
+    g.get_neighbors(scored[i].id, neighbors, neighbor_dists);
+    for (size_t j = 0; j < neighbors.size(); ++j)
+      if (credit.find(neighbors[j]) == credit.end()) {
+        if (!tracker.allows_more()) {
+          exhausted = true;
+          break;
+        }
+        credit[neighbors[j]] = 0;
+        scored.push_back(Result(neighbors[j], query.compute_angle(
+                                  fvs.find(neighbors[j])->second)));
+        tracker.charge();
+      }
+  }
+
+  profile.candidates = tracker.get_evaluated();
+  sort(scored.begin(), scored.end());
+  results.clear();
+  for (size_t i = 0; i < scored.size() && results.size() < n_neighbors &&
+         scored[i].val < max_proximity_radius; ++i)
+    results.push_back(scored[i]);
+
+  return complete && !exhausted;
+}
+
+
+/* orders a heap so that the closest result is on top */
+struct FurtherResult {
+  bool operator()(const Result &a, const Result &b) const {
+    return b < a;
+  }
+};
+
+
+bool
+execute_beam_query(const FeatVecLookup &fvs, const HashFunLookup &hfs,
+                   const HashTabLookup &hts, RegularNearestNeighborGraph &g,
+                   const FeatureVector &query, const size_t n_neighbors,
+                   const double max_proximity_radius,
+                   const size_t beam_width, const size_t n_probes,
+                   const QueryBudget &budget, RequestProfile &profile,
+                   vector<Result> &results) {
+
+  const size_t ef = std::max(beam_width, n_neighbors);
+  BudgetTracker tracker(budget);
+  bool complete = true;
+
+  std::priority_queue<Result, vector<Result>, FurtherResult> frontier;
+  std::priority_queue<Result, vector<Result>, std::less<Result> > beam;
+  unordered_set<string> visited;
+
+  // seed the search with the bucket hits, most credited first
+  unordered_map<string, size_t> credit;
+  vector<string> seeds;
+  const bool all_seeds =
+    gather_bucket_candidates(hfs, hts, query, n_probes,
+                             budget.max_bucket_load, tracker, profile,
+                             credit, seeds);
+  for (size_t i = 0; i < seeds.size(); ++i) {
+    if (!tracker.allows_more()) {
+      complete = false;
+      break;
+    }
+    visited.insert(seeds[i]);
+    tracker.charge();
+    const Result r(seeds[i], query.compute_angle(fvs.find(seeds[i])->second));
+    frontier.push(r);
+    beam.push(r);
+    if (beam.size() > ef)
+      beam.pop();
+  }
+
+  // expand the closest vertex until the beam can no longer improve
+  profile.enter(STAGE_EXPAND);
+  while (!frontier.empty() && complete) {
+    const Result current(frontier.top());
+    if (beam.size() == ef && beam.top() < current)
+      break;
+    frontier.pop();
+
+    vector<string> neighbors;
+    vector<double> neighbor_dists;
+    g.get_neighbors(current.id, neighbors, neighbor_dists);
+    for (size_t j = 0; j < neighbors.size(); ++j)
+      if (visited.insert(neighbors[j]).second) {
+        if (!tracker.allows_more()) {
+          complete = false;
+          break;
+        }
+        tracker.charge();
+        const Result r(neighbors[j],
+                       query.compute_angle(fvs.find(neighbors[j])->second));
+        if (beam.size() < ef || r < beam.top()) {
+          frontier.push(r);
+          beam.push(r);
+          if (beam.size() > ef)
+            beam.pop();
+        }
+      }
+  }
+
+  profile.candidates = tracker.get_evaluated();
+  results.clear();
+  while (!beam.empty()) {
+    if (beam.top().val < max_proximity_radius)
+      results.push_back(beam.top());
+    beam.pop();
+  }
+  reverse(results.begin(), results.end());
+  if (results.size() > n_neighbors)
+    results.resize(n_neighbors);
+  return complete && all_seeds;
+}
+
+
+void
+rerank_results(const FeatVecLookup &full_fvs, const FeatureVector &query,
+               const size_t n_neighbors, const double max_proximity_radius,
+               vector<Result> &results) {
+  vector<Result> reranked;
+  for (size_t i = 0; i < results.size(); ++i) {
+    FeatVecLookup::const_iterator fv(full_fvs.find(results[i].id));
+    if (fv == full_fvs.end())
+      continue;
+    const double angle = query.compute_angle(fv->second);
+    if (angle < max_proximity_radius)
+      reranked.push_back(Result(results[i].id, angle));
+  }
+  std::sort(reranked.begin(), reranked.end());
+  if (reranked.size() > n_neighbors)
+    reranked.resize(n_neighbors);
+  results.swap(reranked);
+}
+
+
+bool
+execute_search(const FeatVecLookup &fvs, const FeatVecLookup &full_fvs,
+               const FeatureProjection &projection,
+               const HashFunLookup &hfs, const HashTabLookup &hts,
+               RegularNearestNeighborGraph &g, const FeatureVector &query,
+               const QuerySettings &settings, QueryResultCache *cache,
+               RequestProfile &profile, vector<Result> &results,
+               bool &from_cache) {
+  vector<double> key_settings;
+  key_settings.push_back(settings.n_neighbors);
+  key_settings.push_back(settings.max_proximity_radius);
+  key_settings.push_back(settings.beam_width);
+  key_settings.push_back(settings.n_probes);
+  key_settings.push_back(settings.budget.max_candidates);
+  key_settings.push_back(settings.budget.max_bucket_load);
+  key_settings.push_back(settings.budget.max_millis);
+  const QueryKey key = QueryResultCache::make_key(query, key_settings);
+
+  CachedResult cached;
+  from_cache = (cache != 0 && cache->lookup(key, cached));
+  if (from_cache) {
+    results.clear();
+    for (size_t i = 0; i < cached.neighbors.size(); ++i)
+      results.push_back(Result(cached.neighbors[i].first,
+                               cached.neighbors[i].second));
+    return cached.complete;
+  }
+
+  const bool projected = !projection.empty();
+  const size_t n_found = projected ?
+    settings.rerank*settings.n_neighbors : settings.n_neighbors;
+  const double found_radius = projected ?
+    std::numeric_limits<double>::max() : settings.max_proximity_radius;
+  FeatureVector projected_query;
+  if (projected) {
+    profile.enter(STAGE_PROJECT);
+    projected_query = projection(query);
+  }
+  const FeatureVector &indexed = projected ? projected_query : query;
+
+  bool complete = true;
+  if (settings.beam_width > 0)
+    complete = execute_beam_query(fvs, hfs, hts, g, indexed, n_found,
+                                  found_radius, settings.beam_width,
+                                  settings.n_probes, settings.budget,
+                                  profile, results);
+  else if (!settings.budget.unlimited())
+    complete = execute_budgeted_query(fvs, hfs, hts, g, indexed, n_found,
+                                      found_radius, settings.n_probes,
+                                      settings.budget, profile, results);
+  else
+    execute_query(fvs, hfs, hts, g, indexed, n_found, found_radius,
+                  settings.n_probes, profile, results);
+
+  if (projected) {
+    profile.enter(STAGE_RERANK);
+    rerank_results(full_fvs, query, settings.n_neighbors,
+                   settings.max_proximity_radius, results);
+  }
+
+  if (complete && cache != 0) {
+    for (size_t i = 0; i < results.size(); ++i)
+      cached.neighbors.push_back(make_pair(results[i].id, results[i].val));
+    cache->store(key, cached);
+  }
+  return complete;
+}
+
+
+size_t
+vector_entry_bytes(const string &id, const FeatureVector &fv) {
+  return sizeof(string) + id.size() + 1 + fv.memory_bytes() +
+    2*sizeof(void *);
+}
+
+
+void
+store_vector(FeatVecLookup &fvs, const FeatureVector &fv, size_t &bytes) {
+  FeatVecLookup::iterator i(fvs.find(fv.get_id()));
+  if (i == fvs.end())
+    i = fvs.insert(make_pair(fv.get_id(), fv)).first;
+  else {
+    bytes -= std::min(bytes, vector_entry_bytes(i->first, i->second));
+    i->second = fv;
+  }
+  bytes += vector_entry_bytes(i->first, i->second);
+}
+
+
+void
+erase_vector(FeatVecLookup &fvs, const string &id, size_t &bytes) {
+  FeatVecLookup::iterator i(fvs.find(id));
+  if (i != fvs.end()) {
+    bytes -= std::min(bytes, vector_entry_bytes(i->first, i->second));
+    fvs.erase(i);
+  }
+}
+
+
+void
+insert_into_index(FeatVecLookup &fvs, size_t &fv_bytes,
+                  const HashFunLookup &hfs, HashTabLookup &hts,
+                  RegularNearestNeighborGraph &g,
+                  ComparedPairFilter *compared, const FeatureVector &fv,
+                  RequestProfile &profile, vector<Result> &neighbors,
+                  vector<pair<string, size_t> > &buckets_joined) {
+
+  if (!g.add_vertex_if_new(fv.get_id()))
+    throw SMITHLABException("cannot insert existing node: " + fv.get_id());
+  store_vector(fvs, fv, fv_bytes);
+
+  // the vector is compared with the members of the buckets it joins
+  buckets_joined.clear();
+  unordered_set<string> candidates;
+  for (HashTabLookup::iterator i(hts.begin()); i != hts.end(); ++i) {
+
+    HashFunLookup::const_iterator hf(hfs.find(i->first));
+    assert(hf != hfs.end());
+
+    profile.enter(STAGE_HASH);
+    const size_t bucket_number = hf->second(fv);
+    profile.enter(STAGE_GATHER);
+    const vector<string> *bucket =
+      i->second.find_leaf_bucket(bucket_number, fv);
+    if (bucket != 0)
+      candidates.insert(bucket->begin(), bucket->end());
+
+    i->second.insert(fv, bucket_number);
+    buckets_joined.push_back(make_pair(i->first, bucket_number));
+  }
+
+  // and with their graph neighbors
+  profile.enter(STAGE_EXPAND);
+  add_graph_neighbors(g, candidates);
+
+  profile.enter(STAGE_SCORE);
+  profile.candidates = candidates.size();
+  evaluate_candidates(fvs, fv, g.get_maximum_degree(),
+                      std::numeric_limits<double>::max(), candidates,
+                      neighbors);
+  for (size_t i = 0; i < neighbors.size(); ++i)
+    g.update_vertex(fv.get_id(), neighbors[i].id, neighbors[i].val);
+
+  // a vector inserted again under an earlier id is compared anew
+  if (compared != 0)
+    compared->forget(fv.get_id());
+}
+
+
+void
+remove_from_index(FeatVecLookup &fvs, size_t &fv_bytes,
+                  const HashFunLookup &hfs, HashTabLookup &hts,
+                  RegularNearestNeighborGraph &g,
+                  ComparedPairFilter *compared, const FeatureVector &fv,
+                  RequestProfile &profile,
+                  vector<pair<string, size_t> > &buckets_left) {
+
+  profile.enter(STAGE_HASH);
+  buckets_left.clear();
+  for (HashTabLookup::iterator i(hts.begin()); i != hts.end(); ++i) {
+
+    HashFunLookup::const_iterator hf(hfs.find(i->first));
+    assert(hf != hfs.end());
+
+    const size_t bucket_number = hf->second(fv);
+    if (i->second.find(bucket_number) != i->second.end()) {
+      i->second.remove(fv, bucket_number);
+      buckets_left.push_back(make_pair(i->first, bucket_number));
+    }
+  }
+
+  g.remove_vertex(fv.get_id());
+  erase_vector(fvs, fv.get_id(), fv_bytes);
+  if (compared != 0)
+    compared->forget(fv.get_id());
+}
+
+
+void
+build_hash_table(const FeatVecLookup &fvs, const LSHAngleHashFunction &hf,
+                 const size_t split_load, const size_t split_bits,
+                 LSHAngleHashTable &ht) {
+  ht = LSHAngleHashTable(hf.get_id());
+  for (FeatVecLookup::const_iterator i(fvs.begin()); i != fvs.end(); ++i)
+    ht.insert(i->second, hf(i->second));
+  ht.split_overloaded_buckets(fvs, split_load, split_bits);
+}
+
+
+/* compares all pairs in the bucket that the filter (if any) has not
+ * seen compared, returning the number of pairs skipped
+ */
+static size_t
+add_relations_from_bucket(const vector<string> &bucket,
+                          const FeatVecLookup &featvecs,
+                          RegularNearestNeighborGraph &nng,
+                          ComparedPairFilter *compared,
+                          vector<Edge> &added_edges) {
+
+  size_t n_skipped = 0;
+
+  // iterate over bucket
+  for (size_t i = 0; i < bucket.size(); ++i) {
+    FeatVecLookup::const_iterator ii(featvecs.find(bucket[i]));
+    assert(ii != featvecs.end());
+
+    // iterate over other members of bucket
+    for (size_t j = i + 1; j < bucket.size(); ++j) {
+      FeatVecLookup::const_iterator jj(featvecs.find(bucket[j]));
+      assert(jj != featvecs.end());
+
+      // skip pairs already compared for an earlier hash table
+      if (compared != 0 && compared->check_and_insert(bucket[i], bucket[j])) {
+        ++n_skipped;
+        continue;
+      }
+
+      // compare and update graph
+      const double w = ii->second.compute_angle(jj->second);
+
+      if (nng.update_vertex(bucket[j], bucket[i], w))
+        added_edges.push_back(Edge(bucket[j], bucket[i], w));
+      if (nng.update_vertex(bucket[i], bucket[j], w))
+        added_edges.push_back(Edge(bucket[i], bucket[j], w));
+    }
+  }
+  return n_skipped;
+}
+
+
+size_t
+add_relations_from_table(const LSHAngleHashTable &ht,
+                         const FeatVecLookup &fvs,
+                         RegularNearestNeighborGraph &g,
+                         ComparedPairFilter *compared,
+                         vector<Edge> &added_edges) {
+  size_t n_skipped = 0;
+  vector<const vector<string> *> leaves;
+  ht.get_leaf_buckets(leaves);
+  for (size_t i = 0; i < leaves.size(); ++i)
+    n_skipped += add_relations_from_bucket(*leaves[i], fvs, g,
+                                           compared, added_edges);
+  return n_skipped;
+}
+
+
+void
+replace_oldest_hash_table(const LSHAngleHashFunction &hf,
+                          const LSHAngleHashTable &ht, HashFunLookup &hfs,
+                          std::queue<string> &hf_queue, HashTabLookup &hts) {
+  const string oldest_hf = hf_queue.front();
+  hf_queue.pop();
+  hts.erase(oldest_hf);
+  hfs.erase(oldest_hf);
+  hts[ht.get_id()] = ht;
+  hfs[hf.get_id()] = hf;
+  hf_queue.push(hf.get_id());
+}
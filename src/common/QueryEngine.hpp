@@ -0,0 +1,295 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUERY_ENGINE_HPP
+#define QUERY_ENGINE_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <queue>
+#include <utility>
+#include <limits>
+#include <chrono>
+#include <ostream>
+
+#include "Metrics.hpp"
+
+/*
+ * The searches over the in-memory index (feature vectors, hash tables
+ * and nearest neighbor graph), and the updates to it, shared by the
+ * server and the programs that keep an index of their own.
+ */
+
+struct Result {
+  Result(const std::string &i, const double v) : id(i), val(v) {}
+  Result() : val(std::numeric_limits<double>::max()) {}
+  bool operator<(const Result &other) const {return val < other.val;}
+  std::string id;
+  double val;
+};
+
+std::ostream &
+operator<<(std::ostream &os, const Result &r);
+
+struct Edge {
+  Edge(const std::string &u, const std::string &v, const double d)
+    : src(u), dst(v), dist(d) {}
+  Edge() : dist(std::numeric_limits<double>::max()) {}
+  std::string src;
+  std::string dst;
+  double dist;
+};
+
+std::ostream &
+operator<<(std::ostream &os, const Edge &e);
+
+
+class LSHAngleHashFunction;
+class LSHAngleHashTable;
+class FeatureVector;
+class FeatureProjection;
+class RegularNearestNeighborGraph;
+class ComparedPairFilter;
+class QueryResultCache;
+typedef std::unordered_map<std::string, LSHAngleHashFunction> HashFunLookup;
+typedef std::unordered_map<std::string, LSHAngleHashTable> HashTabLookup;
+typedef std::unordered_map<std::string, FeatureVector> FeatVecLookup;
+
+
+/* limits on the work done by a single query; zero means no limit */
+struct QueryBudget {
+  QueryBudget() : max_candidates(0), max_bucket_load(0), max_millis(0.0) {}
+  bool unlimited() const {
+    return max_candidates == 0 && max_bucket_load == 0 && max_millis == 0.0;
+  }
+  size_t max_candidates;
+  size_t max_bucket_load;
+  double max_millis;
+};
+
+
+/* counts the candidates a query evaluates against its budget */
+class BudgetTracker {
+public:
+  BudgetTracker(const QueryBudget &b) :
+    budget(b), evaluated(0), out_of_time(false),
+    start(std::chrono::steady_clock::now()) {}
+
+  // true if one more candidate may be evaluated; the clock is only
+  // read every few candidates to keep the check cheap
+  bool allows_more();
+  void charge() {++evaluated;}
+  size_t get_evaluated() const {return evaluated;}
+  // true unless the given fraction of the time budget has passed
+  bool within(const double fraction) const;
+
+private:
+  const QueryBudget budget;
+  size_t evaluated;
+  bool out_of_time;
+  std::chrono::steady_clock::time_point start;
+};
+
+
+/* the settings of one query; all but rerank also key its results in
+ * the cache */
+struct QuerySettings {
+  QuerySettings() : n_neighbors(1), max_proximity_radius(0.75),
+                    beam_width(0), n_probes(1), rerank(1) {}
+  size_t n_neighbors;
+  double max_proximity_radius;
+  size_t beam_width;
+  size_t n_probes;
+  QueryBudget budget;
+  size_t rerank;
+};
+
+
+/* the n_neighbors candidates closest to the query within the radius */
+void
+evaluate_candidates(const FeatVecLookup &fvs, const FeatureVector &query,
+                    const size_t n_neighbors,
+                    const double max_proximity_radius,
+                    const std::unordered_set<std::string> &candidates,
+                    std::vector<Result> &results);
+
+/* evaluates the members of the query's buckets and their graph
+ * neighbors */
+void
+execute_query(const FeatVecLookup &fvs, const HashFunLookup &hfs,
+              const HashTabLookup &hts, RegularNearestNeighborGraph &g,
+              const FeatureVector &query, const size_t n_neighbors,
+              const double max_proximity_radius, const size_t n_probes,
+              RequestProfile &profile, std::vector<Result> &results);
+
+/*
+ * The candidates a query's buckets (over all tables and probes) give,
+ * each credited by the buckets it shares with the query, weighted by
+ * how near the probe is: a bucket at the query's own signature counts
+ * n_probes, and the r-th perturbed probe n_probes - r. The more of
+ * the query's signature bits a candidate agrees on, the closer it is
+ * likely to be. A bucket over max_load (0 for no limit) contributes
+ * only its max_load members of highest credit. The buckets are
+ * credited smallest first, and, under a time budget, gathering stops
+ * once half of it has passed, leaving the rest for scoring what was
+ * gathered; the largest buckets, least telling of the query and
+ * costliest to walk, are then the ones skipped. Candidates are in
+ * order of decreasing credit; returns false if a bucket was limited
+ * or skipped.
+ */
+bool
+gather_bucket_candidates(const HashFunLookup &hfs, const HashTabLookup &hts,
+                         const FeatureVector &query, const size_t n_probes,
+                         const size_t max_load, const BudgetTracker &tracker,
+                         RequestProfile &profile,
+                         std::unordered_map<std::string, size_t> &credit,
+                         std::vector<std::string> &candidates);
+
+/*
+ * A query under a budget. Candidates from the query's buckets (see
+ * gather_bucket_candidates) are scored by decreasing credit, then the
+ * graph neighbors of the closest scored candidates, until the budget
+ * runs out. Returns false if anything was skipped.
+ */
+bool
+execute_budgeted_query(const FeatVecLookup &fvs, const HashFunLookup &hfs,
+                       const HashTabLookup &hts,
+                       RegularNearestNeighborGraph &g,
+                       const FeatureVector &query, const size_t n_neighbors,
+                       const double max_proximity_radius,
+                       const size_t n_probes, const QueryBudget &budget,
+                       RequestProfile &profile, std::vector<Result> &results);
+
+/*
+ * Best-first search over the nearest neighbor graph. The vertices in
+ * the query's buckets (limited as in gather_bucket_candidates) seed a
+ * frontier; the closest unexpanded vertex is repeatedly expanded, and
+ * its graph neighbors enter a beam that keeps the best "beam_width"
+ * vertices seen so far. The search stops when the closest vertex on
+ * the frontier is further than everything in a full beam, since no
+ * expansion can then improve the answer. Returns false if the budget
+ * stopped the search early or a bucket over the load limit was not
+ * fully seeded.
+ */
+bool
+execute_beam_query(const FeatVecLookup &fvs, const HashFunLookup &hfs,
+                   const HashTabLookup &hts, RegularNearestNeighborGraph &g,
+                   const FeatureVector &query, const size_t n_neighbors,
+                   const double max_proximity_radius,
+                   const size_t beam_width, const size_t n_probes,
+                   const QueryBudget &budget, RequestProfile &profile,
+                   std::vector<Result> &results);
+
+/* the results of a search among projected vectors, scored again by
+ * the angles of the full vectors; the n_neighbors closest within the
+ * radius are kept */
+void
+rerank_results(const FeatVecLookup &full_fvs, const FeatureVector &query,
+               const size_t n_neighbors, const double max_proximity_radius,
+               std::vector<Result> &results);
+
+/*
+ * A query as the server answers it. Results found before under the
+ * same settings come from the cache, if there is one. Otherwise the
+ * search is a beam search if beam_width > 0, a budgeted query if the
+ * budget has limits, and a plain query if not. With a projection, fvs
+ * hold the projected vectors and full_fvs the full ones: rerank times
+ * as many neighbors are found among the projected, at any angle since
+ * their angles are approximate, and then re-ranked by their full
+ * angles. Complete results are cached. Returns false if the budget cut
+ * the search short.
+ */
+bool
+execute_search(const FeatVecLookup &fvs, const FeatVecLookup &full_fvs,
+               const FeatureProjection &projection,
+               const HashFunLookup &hfs, const HashTabLookup &hts,
+               RegularNearestNeighborGraph &g, const FeatureVector &query,
+               const QuerySettings &settings, QueryResultCache *cache,
+               RequestProfile &profile, std::vector<Result> &results,
+               bool &from_cache);
+
+
+/* approximate bytes of one entry of a map of feature vectors */
+size_t
+vector_entry_bytes(const std::string &id, const FeatureVector &fv);
+
+/* puts fv in fvs, keeping "bytes" the total of vector_entry_bytes over
+ * fvs so that the metrics need not walk the vectors */
+void
+store_vector(FeatVecLookup &fvs, const FeatureVector &fv, size_t &bytes);
+
+void
+erase_vector(FeatVecLookup &fvs, const std::string &id, size_t &bytes);
+
+/*
+ * Adds fv to the vectors, to a bucket of each hash table and to the
+ * graph, as a vertex linked to the closest of the members of its
+ * buckets and their graph neighbors. The filter (if any) forgets the
+ * pairs of an earlier vector under the same id. Its new neighbors go
+ * in "neighbors" and the buckets it joined, as (table, bucket), in
+ * "buckets_joined".
+ */
+void
+insert_into_index(FeatVecLookup &fvs, size_t &fv_bytes,
+                  const HashFunLookup &hfs, HashTabLookup &hts,
+                  RegularNearestNeighborGraph &g,
+                  ComparedPairFilter *compared, const FeatureVector &fv,
+                  RequestProfile &profile, std::vector<Result> &neighbors,
+                  std::vector<std::pair<std::string, size_t> > &buckets_joined);
+
+/* removes fv from the vectors, the hash tables and the graph; the
+ * buckets it left, as (table, bucket), go in "buckets_left" */
+void
+remove_from_index(FeatVecLookup &fvs, size_t &fv_bytes,
+                  const HashFunLookup &hfs, HashTabLookup &hts,
+                  RegularNearestNeighborGraph &g,
+                  ComparedPairFilter *compared, const FeatureVector &fv,
+                  RequestProfile &profile,
+                  std::vector<std::pair<std::string, size_t> > &buckets_left);
+
+/* a table of all the vectors hashed by hf, with the buckets holding
+ * more than split_load vectors split (if possible) */
+void
+build_hash_table(const FeatVecLookup &fvs, const LSHAngleHashFunction &hf,
+                 const size_t split_load, const size_t split_bits,
+                 LSHAngleHashTable &ht);
+
+/* compares all pairs within each leaf bucket of the table that the
+ * filter (if any) has not seen compared, updating the graph; returns
+ * the number of pairs skipped */
+size_t
+add_relations_from_table(const LSHAngleHashTable &ht,
+                         const FeatVecLookup &fvs,
+                         RegularNearestNeighborGraph &g,
+                         ComparedPairFilter *compared,
+                         std::vector<Edge> &added_edges);
+
+/* makes hf and its table current in place of the oldest ones */
+void
+replace_oldest_hash_table(const LSHAngleHashFunction &hf,
+                          const LSHAngleHashTable &ht, HashFunLookup &hfs,
+                          std::queue<std::string> &hf_queue,
+                          HashTabLookup &hts);
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "QueryProtocol.hpp"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+
+static const char QUERY_MAGIC[] = "AMQ1";
+static const char RESULTS_MAGIC[] = "AMR1";
+static const size_t MAGIC_SIZE = 4;
+
+
+static void
+put_uint32(const uint32_t x, string &buffer) {
+  for (size_t i = 0; i < 4; ++i)
+    buffer += static_cast<char>((x >> (8*i)) & 0xff);
+}
+
+
+static void
+put_double(const double x, string &buffer) {
+  uint64_t bits = 0;
+  std::memcpy(&bits, &x, sizeof(bits));
+  for (size_t i = 0; i < 8; ++i)
+    buffer += static_cast<char>((bits >> (8*i)) & 0xff);
+}
+
+
+static void
+put_string(const string &s, string &buffer) {
+  put_uint32(s.size(), buffer);
+  buffer += s;
+}
+
+
+/* reads fields in order, throwing if the buffer runs out */
+class BufferReader {
+public:
+  BufferReader(const string &b) : buffer(b), pos(0) {}
+
+  void expect_magic(const char *magic) {
+    need(MAGIC_SIZE);
+    if (buffer.compare(pos, MAGIC_SIZE, magic) != 0)
+      throw SMITHLABException("bad magic in encoded " + string(magic));
+    pos += MAGIC_SIZE;
+  }
+  uint32_t get_uint32() {
+    need(4);
+    uint32_t x = 0;
+    for (size_t i = 0; i < 4; ++i)
+      x |= static_cast<uint32_t>(
+        static_cast<unsigned char>(buffer[pos + i])) << (8*i);
+    pos += 4;
+    return x;
+  }
+  double get_double() {
+    need(8);
+    uint64_t bits = 0;
+    for (size_t i = 0; i < 8; ++i)
+      bits |= static_cast<uint64_t>(
+        static_cast<unsigned char>(buffer[pos + i])) << (8*i);
+    pos += 8;
+    double x = 0.0;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+  }
+  string get_string() {
+    const size_t n = get_uint32();
+    need(n);
+    pos += n;
+    return buffer.substr(pos - n, n);
+  }
+  // a count of items each taking at least item_size bytes
+  size_t get_count(const size_t item_size) {
+    const size_t n = get_uint32();
+    need(n*item_size);
+    return n;
+  }
+  bool done() const {return pos == buffer.size();}
+
+private:
+  const string &buffer;
+  size_t pos;
+
+  void need(const size_t n) const {
+    if (buffer.size() - pos < n)
+      throw SMITHLABException("truncated binary message");
+  }
+};
+
+
+void
+encode_query(const FeatureVector &fv, string &buffer) {
+  buffer.clear();
+  buffer.reserve(MAGIC_SIZE + 8 + fv.get_id().size() + 8*fv.size());
+  buffer.append(QUERY_MAGIC, MAGIC_SIZE);
+  put_string(fv.get_id(), buffer);
+  put_uint32(fv.size(), buffer);
+  vector<double> values(fv.size());
+  fv.get_values(values.data());
+  for (size_t i = 0; i < values.size(); ++i)
+    put_double(values[i], buffer);
+}
+
+
+FeatureVector
+decode_query(const string &buffer) {
+  BufferReader in(buffer);
+  in.expect_magic(QUERY_MAGIC);
+  const string id(in.get_string());
+  vector<double> values(in.get_count(8));
+  for (size_t i = 0; i < values.size(); ++i)
+    values[i] = in.get_double();
+  if (!in.done())
+    throw SMITHLABException("trailing bytes after encoded query");
+  return FeatureVector(id, values);
+}
+
+
+void
+encode_results(const vector<string> &ids, const vector<double> &distances,
+               const bool complete, string &buffer) {
+  buffer.clear();
+  buffer.append(RESULTS_MAGIC, MAGIC_SIZE);
+  put_uint32(complete ? 1 : 0, buffer);
+  put_uint32(ids.size(), buffer);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    put_string(ids[i], buffer);
+    put_double(distances[i], buffer);
+  }
+}
+
+
+void
+decode_results(const string &buffer, vector<string> &ids,
+               vector<double> &distances, bool &complete) {
+  BufferReader in(buffer);
+  in.expect_magic(RESULTS_MAGIC);
+  complete = (in.get_uint32() & 1);
+  const size_t n = in.get_count(12);
+  ids.resize(n);
+  distances.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    ids[i] = in.get_string();
+    distances[i] = in.get_double();
+  }
+  if (!in.done())
+    throw SMITHLABException("trailing bytes after encoded results");
+}
@@ -0,0 +1,63 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUERY_PROTOCOL_HPP
+#define QUERY_PROTOCOL_HPP
+
+#include <string>
+#include <vector>
+
+#include "FeatureVector.hpp"
+
+/*
+ * Binary encoding of the queries posted to the amordad server and of
+ * the results it returns, so that a feature vector can travel with
+ * the request instead of being read from a file on the server. All
+ * integers are little-endian uint32 and values are IEEE doubles in
+ * little-endian byte order.
+ *
+ *   query:   "AMQ1" id-length id n-values value_1 ... value_n
+ *   results: "AMR1" flags n-results
+ *            (id-length id distance) for each result
+ *
+ * Bit 0 of the flags is set if the search was complete.
+ */
+
+static const char QUERY_CONTENT_TYPE[] = "application/octet-stream";
+
+void
+encode_query(const FeatureVector &fv, std::string &buffer);
+
+// throws SMITHLABException if the buffer is not a valid query
+FeatureVector
+decode_query(const std::string &buffer);
+
+void
+encode_results(const std::vector<std::string> &ids,
+               const std::vector<double> &distances, const bool complete,
+               std::string &buffer);
+
+void
+decode_results(const std::string &buffer, std::vector<std::string> &ids,
+               std::vector<double> &distances, bool &complete);
+
+#endif
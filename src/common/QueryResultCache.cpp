@@ -0,0 +1,147 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "QueryResultCache.hpp"
+
+#include <cstring>
+
+using std::vector;
+
+
+/* mixes the bits of x (the splitmix64 finalizer) */
+static inline uint64_t
+mix(uint64_t x) {
+  x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+
+static inline uint64_t
+add_to_hash(const uint64_t h, const double x) {
+  uint64_t bits = 0;
+  std::memcpy(&bits, &x, sizeof(bits));
+  return mix(h ^ mix(bits + 0x9e3779b97f4a7c15ULL));
+}
+
+
+QueryResultCache::QueryResultCache(const size_t c) :
+  capacity(c), generation(0), hits(0), misses(0) {}
+
+
+/* a second hash, independent of add_to_hash: a different start,
+ * constant and combining step */
+static inline uint64_t
+add_to_check(const uint64_t h, const double x) {
+  uint64_t bits = 0;
+  std::memcpy(&bits, &x, sizeof(bits));
+  return mix((h + 0xc2b2ae3d27d4eb4fULL)*0x9fb21c651e98df25ULL ^ mix(bits));
+}
+
+
+QueryKey
+QueryResultCache::make_key(const FeatureVector &fv,
+                           const vector<double> &settings) {
+  vector<double> values(fv.size());
+  fv.get_values(values.data());
+  values.insert(values.end(), settings.begin(), settings.end());
+  QueryKey key;
+  key.n_values = values.size();
+  uint64_t h = mix(fv.size());
+  uint64_t c = mix(~static_cast<uint64_t>(fv.size()));
+  for (size_t i = 0; i < values.size(); ++i) {
+    h = add_to_hash(h, values[i]);
+    c = add_to_check(c, values[i]);
+  }
+  key.hash = h;
+  key.check = c;
+  return key;
+}
+
+
+bool
+QueryResultCache::lookup(const QueryKey &key, CachedResult &result) {
+  std::unordered_map<uint64_t, EntryList::iterator>::iterator
+    i(index.find(key.hash));
+  if (i == index.end()) {
+    ++misses;
+    return false;
+  }
+  // a different query with the same first 64 bits
+  if (i->second->key != key) {
+    ++misses;
+    return false;
+  }
+  if (i->second->generation != generation) {
+    entries.erase(i->second);
+    index.erase(i);
+    ++misses;
+    return false;
+  }
+  entries.splice(entries.begin(), entries, i->second);
+  result = i->second->result;
+  ++hits;
+  return true;
+}
+
+
+void
+QueryResultCache::store(const QueryKey &key, const CachedResult &result) {
+  if (capacity == 0)
+    return;
+
+  std::unordered_map<uint64_t, EntryList::iterator>::iterator
+    i(index.find(key.hash));
+  if (i != index.end()) {
+    // the newer query replaces one sharing its fingerprint
+    i->second->key = key;
+    i->second->generation = generation;
+    i->second->result = result;
+    entries.splice(entries.begin(), entries, i->second);
+    return;
+  }
+
+  if (entries.size() == capacity) {
+    index.erase(entries.back().key.hash);
+    entries.pop_back();
+  }
+  Entry e;
+  e.key = key;
+  e.generation = generation;
+  e.result = result;
+  entries.push_front(e);
+  index[key.hash] = entries.begin();
+}
+
+
+size_t
+QueryResultCache::memory_bytes() const {
+  size_t bytes = index.size()*(sizeof(uint64_t) + 4*sizeof(void *));
+  for (EntryList::const_iterator i(entries.begin()); i != entries.end(); ++i) {
+    bytes += sizeof(Entry) + 2*sizeof(void *);
+    const vector<std::pair<std::string, double> > &n = i->result.neighbors;
+    bytes += n.capacity()*sizeof(std::pair<std::string, double>);
+    for (size_t j = 0; j < n.size(); ++j)
+      bytes += n[j].first.capacity() + 1;
+  }
+  return bytes;
+}
@@ -0,0 +1,103 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUERY_RESULT_CACHE_HPP
+#define QUERY_RESULT_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <stdint.h>
+
+#include "FeatureVector.hpp"
+
+struct CachedResult {
+  CachedResult() : complete(true) {}
+  std::vector<std::pair<std::string, double> > neighbors;
+  bool complete;
+};
+
+/*
+ * Least recently used cache of query results. Entries are keyed by a
+ * 128-bit fingerprint of the normalized query values together with
+ * the search settings, and by the number of values, so repeated
+ * queries for the same vector skip the search whatever id they carry.
+ * The first 64 bits index the entries and the rest must also match on
+ * a hit, so two queries only share results if both of two independent
+ * hashes collide, while an entry holds no copy of its query. Any
+ * change to the
+ * database must call invalidate(), which advances a generation
+ * counter: entries from an earlier generation are misses and are
+ * dropped when found. The cache is not thread safe.
+ */
+struct QueryKey {
+  QueryKey() : hash(0), check(0), n_values(0) {}
+  bool operator==(const QueryKey &other) const {
+    return hash == other.hash && check == other.check &&
+      n_values == other.n_values;
+  }
+  bool operator!=(const QueryKey &other) const {return !(*this == other);}
+  uint64_t hash;
+  uint64_t check;
+  // the number of query values and settings hashed
+  size_t n_values;
+};
+
+class QueryResultCache {
+public:
+  explicit QueryResultCache(const size_t capacity);
+
+  static QueryKey
+  make_key(const FeatureVector &fv, const std::vector<double> &settings);
+
+  bool lookup(const QueryKey &key, CachedResult &result);
+  void store(const QueryKey &key, const CachedResult &result);
+  void invalidate() {++generation;}
+
+  size_t size() const {return entries.size();}
+  size_t get_capacity() const {return capacity;}
+  size_t get_generation() const {return generation;}
+  size_t get_hits() const {return hits;}
+  size_t get_misses() const {return misses;}
+  // approximate, counting the strings and list and index nodes
+  size_t memory_bytes() const;
+
+private:
+  struct Entry {
+    QueryKey key;
+    size_t generation;
+    CachedResult result;
+  };
+  typedef std::list<Entry> EntryList;
+
+  size_t capacity;
+  size_t generation;
+  size_t hits;
+  size_t misses;
+  // most recently used first
+  EntryList entries;
+  std::unordered_map<uint64_t, EntryList::iterator> index;
+};
+
+#endif
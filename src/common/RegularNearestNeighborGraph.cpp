@@ -23,6 +23,7 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <set>
 
 #include "RegularNearestNeighborGraph.hpp"
 
@@ -52,6 +53,60 @@ RegularNearestNeighborGraph::get_vertex_count() const {
 }
 
 
+void
+RegularNearestNeighborGraph::get_out_degree_counts(vector<size_t> &counts)
+  const {
+  counts = degree_counts;
+  while (!counts.empty() && counts.back() == 0)
+    counts.pop_back();
+}
+
+
+/* adds the out-degree of u to the counts, or removes it, if u is
+ * live; mutators remove it before changing the edges of u and add it
+ * back after */
+void
+RegularNearestNeighborGraph::count_degree(const nng_vertex &u,
+                                          const bool add) {
+  if (was_deleted(u))
+    return;
+  const size_t d = boost::out_degree(u, the_graph);
+  if (degree_counts.size() <= d)
+    degree_counts.resize(d + 1, 0);
+  if (add)
+    ++degree_counts[d];
+  else if (degree_counts[d] > 0)
+    --degree_counts[d];
+}
+
+
+/* makes a new vertex for the id */
+void
+RegularNearestNeighborGraph::add_name(const string &id) {
+  const size_t index = boost::num_vertices(the_graph);
+  name_to_index[id] = index;
+  index_to_name[index] = id;
+  boost::add_vertex(the_graph);
+  name_bytes += sizeof(string) + id.size() + 1;
+  count_degree(index, true);
+}
+
+
+size_t
+RegularNearestNeighborGraph::memory_bytes() const {
+  // out-edges are nodes of a set per vertex; names are stored in two
+  // hash maps, each node holding a name, an index and a link
+  const size_t node_overhead = 4*sizeof(void *);
+  size_t bytes =
+    boost::num_vertices(the_graph)*(sizeof(std::set<size_t>) + node_overhead) +
+    boost::num_edges(the_graph)*(sizeof(size_t) + sizeof(double) +
+                                 node_overhead) +
+    indices_deleted.size()*(sizeof(size_t) + node_overhead);
+  return bytes + 2*(name_bytes + name_to_index.size()*(sizeof(size_t) +
+                                                      node_overhead));
+}
+
+
 size_t 
 RegularNearestNeighborGraph::convert_name_to_index(const string &name) const {
   unordered_map<string, size_t>::const_iterator x(name_to_index.find(name));
@@ -91,8 +146,10 @@ RegularNearestNeighborGraph::update_vertex(const nng_vertex &u,
     double the_distance;
     get_most_distant_neighbor(u, most_distant, the_distance);
     if (the_distance > w) {
+      count_degree(u, false);
       boost::remove_edge(u, most_distant, the_graph);
       boost::add_edge(u, v, w, the_graph);
+      count_degree(u, true);
       return true;
     }
   }
@@ -128,7 +185,9 @@ RegularNearestNeighborGraph::add_edge(const size_t &u,
   if (already_exists)
     throw SMITHLABException("attempt to add existing edge");
   
+  count_degree(u, false);
   boost::add_edge(u, v, w, the_graph);
+  count_degree(u, true);
 }
 
 
@@ -153,15 +212,13 @@ RegularNearestNeighborGraph::add_vertex(const string &id) {
   if (u_idx != name_to_index.end()) {
     if (!was_deleted(id))
       throw SMITHLABException("cannot add existing vertex: " + id);
-    else
+    else {
       indices_deleted.erase(u_idx->second);
+      count_degree(u_idx->second, true);
+    }
   }
-  else {
-    const size_t index = boost::num_vertices(the_graph);
-    name_to_index[id] = index;
-    index_to_name[index] = id;
-    boost::add_vertex(the_graph);
-  }
+  else
+    add_name(id);
 }
 
 
@@ -169,20 +226,46 @@ bool
 RegularNearestNeighborGraph::add_vertex_if_new(const string &id) {
   unordered_map<string, size_t>::const_iterator u_idx(name_to_index.find(id));
   if (u_idx == name_to_index.end()) {
-    const size_t index = boost::num_vertices(the_graph);
-    name_to_index[id] = index;
-    index_to_name[index] = id;
-    boost::add_vertex(the_graph);
+    add_name(id);
     return true;
   }
   else if(was_deleted(u_idx->second)) {
     indices_deleted.erase(u_idx->second);
+    count_degree(u_idx->second, true);
     return true;
   }
   else return false;  
 }
 
 
+bool
+RegularNearestNeighborGraph::has_vertex(const string &id) const {
+  unordered_map<string, size_t>::const_iterator u_idx(name_to_index.find(id));
+  return u_idx != name_to_index.end() && !was_deleted(u_idx->second);
+}
+
+
+void
+RegularNearestNeighborGraph::set_neighbors(const string &u,
+                                           const vector<string> &neighbors,
+                                           const vector<double> &distances) {
+  unordered_map<string, size_t>::const_iterator u_idx(name_to_index.find(u));
+  if (u_idx == name_to_index.end())
+    throw SMITHLABException("cannot set neighbors of unknown vertex: " + u);
+
+  count_degree(u_idx->second, false);
+  boost::clear_out_edges(u_idx->second, the_graph);
+  for (size_t i = 0; i < neighbors.size(); ++i) {
+    unordered_map<string, size_t>::const_iterator
+      v_idx(name_to_index.find(neighbors[i]));
+    if (v_idx != name_to_index.end() && !was_deleted(v_idx->second) &&
+        v_idx->second != u_idx->second)
+      boost::add_edge(u_idx->second, v_idx->second, distances[i], the_graph);
+  }
+  count_degree(u_idx->second, true);
+}
+
+
 bool
 RegularNearestNeighborGraph::was_deleted(const nng_vertex &u) const {
   if(indices_deleted.find(u) == indices_deleted.end())
@@ -204,6 +287,7 @@ RegularNearestNeighborGraph::was_deleted(const std::string &id) const {
 
 void
 RegularNearestNeighborGraph::remove_vertex(const nng_vertex &u) {
+  count_degree(u, false);
   indices_deleted.insert(u);
   boost::clear_out_edges(u, the_graph);
 }
@@ -279,6 +363,9 @@ RegularNearestNeighborGraph::get_neighbors(const string &query,
   graph_traits<internal_graph>::out_edge_iterator e_begin, e_end;
   tie(e_begin, e_end) = boost::out_edges(query_itr->second, the_graph);
   
+  // edges to deleted vertices are removed after the loop, since
+  // removing an edge invalidates the iterators over it
+  vector<nng_vertex> stale;
   for (graph_traits<internal_graph>::out_edge_iterator 
          i(e_begin); i != e_end; ++i) {
     
@@ -288,12 +375,12 @@ RegularNearestNeighborGraph::get_neighbors(const string &query,
       distances.push_back(get_distance(*i));
       neighbors.push_back(name->second);
     }
-    else {
-      const nng_vertex u =  boost::source(*i, the_graph);
-      const nng_vertex v =  boost::target(*i, the_graph);
-      boost::remove_edge(u, v, the_graph);
-    }
+    else stale.push_back(boost::target(*i, the_graph));
   }
+  count_degree(query_itr->second, false);
+  for (size_t i = 0; i < stale.size(); ++i)
+    boost::remove_edge(query_itr->second, stale[i], the_graph);
+  count_degree(query_itr->second, true);
 }
 
 
@@ -401,6 +488,7 @@ RegularNearestNeighborGraph::get_most_distant_neighbor(const nng_vertex &query,
   graph_traits<internal_graph>::out_edge_iterator e_i, e_j;
   result = query;
   max_dist = 0.0;
+  vector<nng_vertex> stale;
   for (tie(e_i, e_j) = boost::out_edges(query, the_graph); e_i != e_j; ++e_i) {
 
     const nng_vertex v =  boost::target(*e_i, the_graph);
@@ -411,9 +499,10 @@ RegularNearestNeighborGraph::get_most_distant_neighbor(const nng_vertex &query,
         max_dist = curr_dist;
       }
     }
-    else {
-      const nng_vertex u =  boost::source(*e_i, the_graph);
-      boost::remove_edge(u, v, the_graph);
-    }
+    else stale.push_back(v);
   }
+  count_degree(query, false);
+  for (size_t i = 0; i < stale.size(); ++i)
+    boost::remove_edge(query, stale[i], the_graph);
+  count_degree(query, true);
 }
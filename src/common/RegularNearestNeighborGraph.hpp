@@ -43,13 +43,13 @@ boost::graph_traits<internal_graph>::vertex_descriptor nng_vertex;
 
 class RegularNearestNeighborGraph{
 public:
-  RegularNearestNeighborGraph() {}
+  RegularNearestNeighborGraph() : maximum_degree(0), name_bytes(0) {}
   RegularNearestNeighborGraph(const std::string &gn, const size_t deg) : 
-    graph_name(gn), maximum_degree(deg) {}
+    graph_name(gn), maximum_degree(deg), name_bytes(0) {}
   RegularNearestNeighborGraph(const std::string &gn, 
                               const std::vector<std::string> &ids,
                               const size_t deg) : 
-    graph_name(gn), maximum_degree(deg) {add_vertices(ids);}
+    graph_name(gn), maximum_degree(deg), name_bytes(0) {add_vertices(ids);}
   
   // graph accessors
   std::string get_graph_name() const {return graph_name;}
@@ -57,6 +57,13 @@ public:
   size_t get_vertex_count() const;
   // edge count might not be accurate due to lazy deletion
   size_t get_edge_count() const;
+  size_t get_deleted_count() const {return indices_deleted.size();}
+  // counts[d] is the number of live vertices with out-degree d; the
+  // counts and the bytes below are kept as the graph changes, so
+  // neither walks the vertices
+  void get_out_degree_counts(std::vector<size_t> &counts) const;
+  // approximate bytes held by the graph and its name lookups
+  size_t memory_bytes() const;
 
   /* vertex accessors */
   double get_distance(const nng_vertex &u, const nng_vertex &v) const;
@@ -77,6 +84,12 @@ public:
   void add_vertex(const std::string &id);
   void add_vertices(const std::vector<std::string> &id_list);
   bool add_vertex_if_new(const std::string &id);
+  // true if the vertex is in the graph and not deleted
+  bool has_vertex(const std::string &id) const;
+  // replaces the out-edges of u; unknown or deleted targets are skipped
+  void set_neighbors(const std::string &u,
+                     const std::vector<std::string> &neighbors,
+                     const std::vector<double> &distances);
   
   bool update_vertex(const nng_vertex &u, const nng_vertex &v, const double &w);
   bool update_vertex(const std::string &u, const std::string &v, 
@@ -93,6 +106,12 @@ private:
   std::unordered_map<size_t, std::string> index_to_name;
   std::unordered_set<size_t> indices_deleted;
   size_t maximum_degree;
+  // live vertices by out-degree, and the bytes of the names
+  std::vector<size_t> degree_counts;
+  size_t name_bytes;
+
+  void count_degree(const nng_vertex &u, const bool add);
+  void add_name(const std::string &id);
 
   // lookups
   size_t convert_name_to_index(const std::string &name) const;
@@ -0,0 +1,183 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "StreamingStats.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+using std::vector;
+using std::pair;
+using std::min;
+using std::max;
+
+
+void
+RunningMoments::add(const double x, const double weight) {
+  count += weight;
+  const double delta = x - mean;
+  mean += weight*delta/count;
+  m2 += weight*delta*(x - mean);
+}
+
+
+void
+RunningMoments::merge(const RunningMoments &other) {
+  if (other.count == 0.0)
+    return;
+  if (count == 0.0) {
+    *this = other;
+    return;
+  }
+  const double total = count + other.count;
+  const double delta = other.mean - mean;
+  mean += delta*other.count/total;
+  m2 += other.m2 + delta*delta*count*other.count/total;
+  count = total;
+}
+
+
+double
+RunningMoments::get_sd() const {
+  return count > 1.0 ? std::sqrt(m2/(count - 1.0)) : 0.0;
+}
+
+
+QuantileSketch::QuantileSketch(const size_t k_in, const uint64_t seed) :
+  k(max(k_in, static_cast<size_t>(8))), count(0),
+  random_state(seed), levels(1) {}
+
+
+/* compactors shrink by 2/3 per level below the top one */
+size_t
+QuantileSketch::capacity(const size_t level) const {
+  const size_t depth = levels.size() - 1 - level;
+  const double c = std::ceil(k*std::pow(2.0/3.0, static_cast<double>(depth)));
+  return max(static_cast<size_t>(c), static_cast<size_t>(2));
+}
+
+
+bool
+QuantileSketch::random_bit() {
+  // splitmix64
+  uint64_t z = (random_state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+  return (z ^ (z >> 31)) & 1;
+}
+
+
+void
+QuantileSketch::compress() {
+  for (size_t h = 0; h < levels.size(); ++h) {
+    if (levels[h].size() < capacity(h))
+      continue;
+    if (h + 1 == levels.size())
+      levels.push_back(vector<double>());
+    vector<double> &level = levels[h];
+    std::sort(level.begin(), level.end());
+    // an odd value out stays behind so that no weight is lost
+    const size_t n_compacted = level.size() - level.size() % 2;
+    for (size_t i = random_bit(); i < n_compacted; i += 2)
+      levels[h + 1].push_back(level[i]);
+    level.erase(level.begin(), level.begin() + n_compacted);
+  }
+}
+
+
+void
+QuantileSketch::add(const double x) {
+  levels.front().push_back(x);
+  ++count;
+  if (levels.front().size() >= capacity(0))
+    compress();
+}
+
+
+void
+QuantileSketch::merge(const QuantileSketch &other) {
+  if (other.levels.size() > levels.size())
+    levels.resize(other.levels.size());
+  for (size_t h = 0; h < other.levels.size(); ++h)
+    levels[h].insert(levels[h].end(),
+                     other.levels[h].begin(), other.levels[h].end());
+  count += other.count;
+  compress();
+}
+
+
+size_t
+QuantileSketch::retained() const {
+  size_t n = 0;
+  for (size_t h = 0; h < levels.size(); ++h)
+    n += levels[h].size();
+  return n;
+}
+
+
+void
+QuantileSketch::weighted_values(vector<pair<double, double> > &wv) const {
+  wv.clear();
+  for (size_t h = 0; h < levels.size(); ++h) {
+    const double weight = std::ldexp(1.0, static_cast<int>(h));
+    for (size_t i = 0; i < levels[h].size(); ++i)
+      wv.push_back(std::make_pair(levels[h][i], weight));
+  }
+  std::sort(wv.begin(), wv.end());
+}
+
+
+double
+QuantileSketch::quantile(const double q) const {
+  vector<pair<double, double> > wv;
+  weighted_values(wv);
+  if (wv.empty())
+    return 0.0;
+  const double target = min(max(q, 0.0), 1.0)*count;
+  double rank = 0.0;
+  for (size_t i = 0; i < wv.size(); ++i) {
+    rank += wv[i].second;
+    if (rank >= target)
+      return wv[i].first;
+  }
+  return wv.back().first;
+}
+
+
+RunningMoments
+QuantileSketch::moments_between(const double lo, const double hi) const {
+  vector<pair<double, double> > wv;
+  weighted_values(wv);
+  const double lo_rank = lo*count;
+  const double hi_rank = hi*count;
+  RunningMoments moments;
+  double rank = 0.0;
+  for (size_t i = 0; i < wv.size() && rank < hi_rank; ++i) {
+    // the part of this value's weight falling between the ranks
+    const double overlap =
+      min(rank + wv[i].second, hi_rank) - max(rank, lo_rank);
+    if (overlap > 0.0)
+      moments.add(wv[i].first, overlap);
+    rank += wv[i].second;
+  }
+  return moments;
+}
@@ -0,0 +1,91 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMING_STATS_HPP
+#define STREAMING_STATS_HPP
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <stdint.h>
+
+/*
+ * Count, mean and variance of a stream of values by Welford's method.
+ * Two accumulators over disjoint parts of a stream merge into the
+ * accumulator of the whole (Chan et al.), so parts can be summarized
+ * in parallel.
+ */
+class RunningMoments {
+public:
+  RunningMoments() : count(0.0), mean(0.0), m2(0.0) {}
+
+  void add(const double x, const double weight = 1.0);
+  void merge(const RunningMoments &other);
+
+  double get_count() const {return count;}
+  double get_mean() const {return mean;}
+  // sample standard deviation, dividing by count - 1 as gsl_stats_sd_m
+  double get_sd() const;
+
+private:
+  double count;
+  double mean;
+  double m2;
+};
+
+
+/*
+ * Mergeable quantile sketch of Karnin, Lang and Liberty (KLL). Values
+ * are kept in a stack of compactors; the compactor at level h holds
+ * values standing for 2^h of the originals, and when it fills it is
+ * sorted and every other value (starting at a random offset) moves up
+ * a level. With the default k = 200 ranks are within about 1% of the
+ * stream size using a few kilobytes. The offsets come from a seeded
+ * generator, so a sketch is reproducible.
+ */
+class QuantileSketch {
+public:
+  explicit QuantileSketch(const size_t k = 200, const uint64_t seed = 1);
+
+  void add(const double x);
+  void merge(const QuantileSketch &other);
+
+  uint64_t get_count() const {return count;}
+  // the value of rank q*count, for q in [0, 1]
+  double quantile(const double q) const;
+  // moments of the values ranked between lo*count and hi*count
+  RunningMoments moments_between(const double lo, const double hi) const;
+  size_t retained() const;
+
+private:
+  size_t k;
+  uint64_t count;
+  uint64_t random_state;
+  std::vector<std::vector<double> > levels;
+
+  size_t capacity(const size_t level) const;
+  void compress();
+  bool random_bit();
+  void weighted_values(std::vector<std::pair<double, double> > &wv) const;
+};
+
+#endif
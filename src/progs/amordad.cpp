@@ -23,6 +23,9 @@
 #include <vector>
 #include <algorithm>
 #include <climits>
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
 #include <cmath>
 #include <ctime>
 #include <unordered_set>
@@ -30,9 +33,13 @@
 #include <iterator>
 #include <queue>
 #include <iostream>
+#include <sstream>
 #include <chrono>
-
-#include <gsl/gsl_statistics_double.h>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
@@ -41,7 +48,15 @@
 #include "RegularNearestNeighborGraph.hpp"
 
 #include "FeatureVector.hpp"
+#include "FeatureProjection.hpp"
+#include "CompressedInput.hpp"
 #include "LSHAngleHashTable.hpp"
+#include "ComparedPairFilter.hpp"
+#include "MutationLog.hpp"
+#include "QueryProtocol.hpp"
+#include "QueryResultCache.hpp"
+#include "Metrics.hpp"
+#include "QueryEngine.hpp"
 #include "LSHAngleHashFunction.hpp"
 
 #include "EngineDB.hpp"
@@ -69,252 +84,180 @@ static FeatureVector
 get_feat_vec(const string &fv_path) {
 
   FeatureVector fv;
-  std::ifstream in(fv_path.c_str());
-  if (!in)
-    throw SMITHLABException("bad feature vector file: " + fv_path);
-  in >> fv;
-
-  // normalize feature vector
-  const double mean = gsl_stats_mean(&fv[0], 1, fv.size());
-  const double sd = gsl_stats_sd_m(&fv[0], 1, fv.size(), mean);
-
-  transform(fv.begin(), fv.end(), fv.begin(), 
-            bind2nd(std::minus<double>(), mean));
-  transform(fv.begin(), fv.end(), fv.begin(), 
-            bind2nd(std::divides<double>(), sd));
-
-  // don't forget to change norm
-  vector<double> values;
-  for(vector<double>::const_iterator it(fv.begin()); it != fv.end(); ++it)
-    values.push_back(*it);
-  FeatureVector valid_fv(fv.get_id(), values);
-
-  return valid_fv;
+  FeatureVectorReader reader;
+  reader.read(fv_path, fv);
+  fv.normalize();
+
+  return fv;
+}
+
+
+/* the vector the index holds: the projection of fv, if there is one,
+ * while the full vector is kept for re-ranking */
+static FeatureVector
+index_vector(const FeatureProjection &projection, const FeatureVector &fv) {
+  return projection.empty() ? fv : projection(fv);
 }
 
 
+/* a vector as JSON {"id": ..., "values": [...], "labels": [...]},
+ * labels being optional; the types are checked first, since crow's
+ * accessors throw its own exceptions on the wrong ones */
 static void
-evaluate_candidates(const unordered_map<string, FeatureVector> &fvs,
-                    const FeatureVector &query,
-                    const size_t n_neighbors,
-                    const double max_proximity_radius,
-                    const unordered_set<string> &candidates,
-                    vector<Result> &results) {
-
-  std::priority_queue<Result, vector<Result>, std::less<Result> > pq;
-  double current_dist_cutoff = max_proximity_radius;
-  for (unordered_set<string>::const_iterator i(candidates.begin());
-       i != candidates.end(); ++i) {
-    const FeatureVector fv(fvs.find(*i)->second);
-    const double dist = query.compute_angle(fv);
-    if (dist < current_dist_cutoff) {
-      if (pq.size() == n_neighbors) 
-        pq.pop();
-      pq.push(Result(*i, dist));
-
-      if(pq.size() == n_neighbors)
-        current_dist_cutoff = pq.top().val;
-    }
+parse_json_vector(const string &text, FeatureVector &fv,
+                  vector<string> &labels) {
+  using crow::json::type;
+  const crow::json::rvalue body = crow::json::load(text);
+  if (!body || body.t() != type::Object || !body.has("id") ||
+      !body.has("values") || body["id"].t() != type::String ||
+      body["values"].t() != type::List)
+    throw SMITHLABException("vector needs a string id and a list of values");
+  vector<double> values(body["values"].size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (body["values"][i].t() != type::Number)
+      throw SMITHLABException("vector values must be numbers");
+    values[i] = body["values"][i].d();
   }
-
-  results.clear();
-  while (!pq.empty()) {
-    results.push_back(pq.top());
-    pq.pop();
+  labels.clear();
+  if (body.has("labels")) {
+    if (body["labels"].t() != type::List ||
+        body["labels"].size() != values.size())
+      throw SMITHLABException("labels must be a list the size of values");
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (body["labels"][i].t() != type::String)
+        throw SMITHLABException("vector labels must be strings");
+      labels.push_back(body["labels"][i].s());
+    }
   }
-  reverse(results.begin(), results.end());
+  fv = FeatureVector(body["id"].s(), std::move(values));
 }
 
 
+/* the vector of a POST body: binary as in QueryProtocol.hpp, or JSON
+ * as in parse_json_vector */
 static void
-execute_query(const unordered_map<string, FeatureVector> &fvs,
-              const unordered_map<string, LSHFun> &hfs,
-              const unordered_map<string, LSHTab> &hts,
-              RegularNearestNeighborGraph &g,
-              const FeatureVector &query,
-              const size_t n_neighbors,
-              const double max_proximity_radius,
-              vector<Result> &results) {
-
-  unordered_set<string> candidates;
-
-  // iterate over hash tables
-  for (unordered_map<string, LSHTab>::const_iterator i(hts.begin());
-       i != hts.end(); ++i) {
-
-    unordered_map<string, LSHFun>::const_iterator hf(hfs.find(i->first));
-    assert(hf != hfs.end());
-
-    // hash the query
-    const size_t bucket_number = hf->second(query);
-    unordered_map<size_t, vector<string> >::const_iterator
-      bucket = i->second.find(bucket_number);
-
-    if (bucket != i->second.end())
-      candidates.insert(bucket->second.begin(), bucket->second.end());
-  }
+parse_posted_vector(const crow::request &req, FeatureVector &fv,
+                    vector<string> &labels) {
+  labels.clear();
+  if (req.get_header_value("Content-Type") == QUERY_CONTENT_TYPE)
+    fv = decode_query(req.body);
+  else
+    parse_json_vector(req.body, fv, labels);
+  if (labels.empty())
+    for (size_t i = 0; i < fv.size(); ++i)
+      labels.push_back(toa(i));
+}
 
-  // gather neighbors of candidates
-  unordered_set<string> candidates_from_graph;
-  for (unordered_set<string>::const_iterator i(candidates.begin());
-       i != candidates.end(); ++i) {
-    vector<string> neighbors;
-    vector<double> neighbor_dists;
-    g.get_neighbors(*i, neighbors, neighbor_dists);
 
-    candidates_from_graph.insert(neighbors.begin(), neighbors.end());
+/* writes the raw vector in full precision; the rename keeps a reader
+ * from seeing a partial file */
+static void
+write_stored_vector(const FeatureVector &fv, const vector<string> &labels,
+                    const string &fv_path) {
+  const string tmp_path(fv_path + ".tmp");
+  std::FILE *out = std::fopen(tmp_path.c_str(), "w");
+  if (!out)
+    throw SMITHLABException("cannot write to file: " + tmp_path);
+  bool good = std::fprintf(out, "%s", fv.get_id().c_str()) >= 0;
+  for (size_t i = 0; good && i < fv.size(); ++i)
+    good = std::fprintf(out, "\n%s\t%.17g", labels[i].c_str(), fv[i]) >= 0;
+  good = (std::fputc('\n', out) != EOF) && good;
+  good = (std::fclose(out) == 0) && good;
+  if (!good || std::rename(tmp_path.c_str(), fv_path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    throw SMITHLABException("cannot write to file: " + fv_path);
   }
-
-  candidates.insert(candidates_from_graph.begin(), candidates_from_graph.end());
-
-  evaluate_candidates(fvs, query, n_neighbors,
-                      max_proximity_radius, candidates, results);
 }
 
 
 static void
 execute_insertion(unordered_map<string, FeatureVector> &fvs,
+                  size_t &fv_bytes,
                   const unordered_map<string, LSHFun> &hfs,
                   unordered_map<string, LSHTab> &hts,
                   RegularNearestNeighborGraph &g,
+                  ComparedPairFilter *compared,
+                  const FeatureVector &query,
                   const string  &query_path,
+                  MutationLogWriter *mutation_log,
+                  RequestProfile &profile,
                   EngineDB &eng) {
 
-  FeatureVector query = get_feat_vec(query_path);
-
-  /// TEST WHETHER QUERY IS ALREADY IN GRAPH
-  /// IF NOT ADD QUERY AS A NEW VERTEX
-  if (!g.add_vertex_if_new(query.get_id()))
-    throw SMITHLABException("cannot insert existing node: " + query.get_id());
-
-  /// INSERT QUERY INTO THE FEATURE VECTOR MAP
-  fvs[query.get_id()] = query;
-
-  unordered_set<string> candidates;
-  
-  // iterate over hash tables
-  for (unordered_map<string, LSHTab>::iterator i(hts.begin());
-       i != hts.end(); ++i) {
-
-    unordered_map<string, LSHFun>::const_iterator hf(hfs.find(i->first));
-    assert(hf != hfs.end());
-
-    // hash the query
-    const size_t bucket_number = hf->second(query);
-    unordered_map<size_t, vector<string> >::const_iterator
-      bucket = i->second.find(bucket_number);
-
-    if (bucket != i->second.end())
-      candidates.insert(bucket->second.begin(), bucket->second.end());
-    
-    // INSERT THE QUERY INTO EACH HASH TABLE
-    i->second.insert(query, bucket_number);
-  }
-
-  // gather neighbors of candidates
-  unordered_set<string> candidates_from_graph;
-  for (unordered_set<string>::const_iterator i(candidates.begin());
-       i != candidates.end(); ++i) {
-    vector<string> neighbors;
-    vector<double> neighbor_dists;
-    g.get_neighbors(*i, neighbors, neighbor_dists);
-
-    candidates_from_graph.insert(neighbors.begin(), neighbors.end());
-  }
-
-  candidates.insert(candidates_from_graph.begin(), candidates_from_graph.end());
-
   vector<Result> neighbors;
-  double max = std::numeric_limits<double>::max();
-  size_t max_deg = g.get_maximum_degree();
-  evaluate_candidates(fvs, query, max_deg, max, candidates, neighbors);
-  
-  // CONNECT THE QUERY TO EACH OF THE "RESULT" NEIGHBORS
-  // IN THE GRAPH
-  for (vector<Result>::const_iterator i(neighbors.begin());
-       i != neighbors.end(); ++i)
-    g.update_vertex(query.get_id(), i->id, i->val);
+  vector<pair<string, size_t> > buckets_joined;
+  insert_into_index(fvs, fv_bytes, hfs, hts, g, compared, query, profile,
+                    neighbors, buckets_joined);
 
   // UPDATE THE DATABASE
+  profile.enter(STAGE_PERSIST);
   eng.process_insertion(query, query_path, hfs, neighbors);
+
+  if (mutation_log != 0) {
+    mutation_log->begin();
+    mutation_log->insert_vector(query.get_id(), query_path);
+    for (size_t i = 0; i < buckets_joined.size(); ++i)
+      mutation_log->bucket_add(buckets_joined[i].first,
+                               buckets_joined[i].second, query.get_id());
+    vector<string> ids;
+    vector<double> dists;
+    g.get_neighbors(query.get_id(), ids, dists);
+    mutation_log->edges(query.get_id(), ids, dists);
+    mutation_log->commit();
+  }
 }
 
 
 static void
 execute_deletion(unordered_map<string, FeatureVector> &fvs,
+                 size_t &fv_bytes,
                  const unordered_map<string, LSHFun> &hfs,
                  unordered_map<string, LSHTab> &hts,
                  RegularNearestNeighborGraph &g,
+                 ComparedPairFilter *compared,
                  const FeatureVector &query,
+                 MutationLogWriter *mutation_log,
+                 RequestProfile &profile,
                  EngineDB &eng) {
-  
-  // iterate over hash tables
-  for (unordered_map<string, LSHTab>::iterator i(hts.begin());
-       i != hts.end(); ++i) {
 
-    unordered_map<string, LSHFun>::const_iterator hf(hfs.find(i->first));
-    assert(hf != hfs.end());
-
-    // hash the query
-    const size_t bucket_number = hf->second(query);
-    unordered_map<size_t, vector<string> >::const_iterator
-      bucket = i->second.find(bucket_number);
-
-    // delete the query from each hash table
-    if (bucket != i->second.end())
-      i->second.remove(query, bucket_number);
-  }
-
-  g.remove_vertex(query.get_id());
-
-  // delete the query from the feature vectors map
-  fvs.erase(query.get_id());
+  vector<pair<string, size_t> > buckets_left;
+  remove_from_index(fvs, fv_bytes, hfs, hts, g, compared, query, profile,
+                    buckets_left);
 
   // update the database
+  profile.enter(STAGE_PERSIST);
   eng.process_deletion(query.get_id());
-}
-
-
-static void
-add_relations_from_bucket(const vector<string> &bucket, 
-                          const FeatVecLookup &featvecs,
-                          RegularNearestNeighborGraph &nng,
-                          vector<Edge> &added_edges) {
-
-  // iterate over bucket
-  for (size_t i = 0; i < bucket.size(); ++i) {
-    FeatVecLookup::const_iterator ii(featvecs.find(bucket[i]));
-    assert(ii != featvecs.end());
-
-    // iterate over other members of bucket
-    for (size_t j = i + 1; j < bucket.size(); ++j) {
-      FeatVecLookup::const_iterator jj(featvecs.find(bucket[j]));
-      assert(jj != featvecs.end());
 
-
-      // compare and update graph
-      const double w = ii->second.compute_angle(jj->second);
-
-      if(nng.update_vertex(bucket[j], bucket[i], w))
-        added_edges.push_back(Edge(bucket[j], bucket[i], w));
-      if(nng.update_vertex(bucket[i], bucket[j], w))
-        added_edges.push_back(Edge(bucket[i], bucket[j], w));
-    }
+  if (mutation_log != 0) {
+    mutation_log->begin();
+    for (size_t i = 0; i < buckets_left.size(); ++i)
+      mutation_log->bucket_remove(buckets_left[i].first,
+                                  buckets_left[i].second, query.get_id());
+    mutation_log->delete_vector(query.get_id());
+    mutation_log->commit();
   }
 }
 
 
-static void
+/* returns the number of comparisons skipped because the filter had
+ * already seen the pair compared in an earlier refresh
+ */
+static size_t
 execute_refresh(const unordered_map<string, FeatureVector> &fvs,
                 unordered_map<string, LSHFun> &hfs,
                 queue<string> &hf_queue,
                 unordered_map<string, LSHTab> &hts,
                 RegularNearestNeighborGraph &g,
                 const string &hash_fun_file,
+                const size_t split_load,
+                const size_t split_bits,
+                ComparedPairFilter *compared,
+                MutationLogWriter *mutation_log,
+                RequestProfile &profile,
                 EngineDB &eng) {
 
   // READ THE HASH FUNCTION
-  std::ifstream hash_fun_in(hash_fun_file.c_str());
+  profile.enter(STAGE_PARSE);
+  CompressedInputStream hash_fun_in(hash_fun_file);
   if (!hash_fun_in)
     throw SMITHLABException("cannot open: " + hash_fun_file);
   LSHAngleHashFunction hash_fun;
@@ -323,52 +266,230 @@ execute_refresh(const unordered_map<string, FeatureVector> &fvs,
   if(hfs.find(hash_fun.get_id()) != hfs.end())
     throw SMITHLABException("attempt to insert an existing hash function");
 
-  // INITIALIZE THE HASH TABLE
-  LSHAngleHashTable hash_table(hash_fun.get_id());
-  for (unordered_map<string, FeatureVector>::const_iterator i(fvs.begin());
-       i != fvs.end(); ++i)
-    hash_table.insert(i->second, hash_fun(i->second));
+  // INITIALIZE THE HASH TABLE, splitting the overloaded buckets so
+  // that no comparisons are made within a bucket larger than
+  // split_load (if possible)
+  profile.enter(STAGE_HASH);
+  LSHAngleHashTable hash_table;
+  build_hash_table(fvs, hash_fun, split_load, split_bits, hash_table);
 
+  profile.enter(STAGE_SCORE);
   vector<Edge> added_edges;
-  // iterate over buckets
-  for (BucketMap::const_iterator j(hash_table.begin()); 
-       j != hash_table.end(); ++j)
-    add_relations_from_bucket(j->second, fvs, g, added_edges);
+  const size_t n_skipped =
+    add_relations_from_table(hash_table, fvs, g, compared, added_edges);
 
   // remove the oldest hash function and associated hash table
   // replaced by the new ones
-
-  string oldest_hf = hf_queue.front();
-  hf_queue.pop();
-  hts.erase(oldest_hf);
-  hfs.erase(oldest_hf);
-  hts[hash_table.get_id()] = hash_table;
-  hfs[hash_fun.get_id()] = hash_fun;
-  hf_queue.push(hash_fun.get_id());
+  replace_oldest_hash_table(hash_fun, hash_table, hfs, hf_queue, hts);
 
   // update the database
+  profile.enter(STAGE_PERSIST);
   eng.process_refresh(hash_fun, hash_fun_file, fvs,
                       added_edges, g.get_maximum_degree());
+
+  // replicas rebuild the table themselves, but take the new
+  // neighbor lists from the log rather than repeat the comparisons
+  if (mutation_log != 0) {
+    mutation_log->begin();
+    mutation_log->refresh(hash_fun_file, split_load, split_bits);
+    unordered_set<string> changed;
+    for (size_t i = 0; i < added_edges.size(); ++i)
+      if (changed.insert(added_edges[i].src).second) {
+        vector<string> ids;
+        vector<double> dists;
+        g.get_neighbors(added_edges[i].src, ids, dists);
+        mutation_log->edges(added_edges[i].src, ids, dists);
+      }
+    mutation_log->commit();
+  }
+  return n_skipped;
 }
  
 
+/* replays one logged insertion on a replica; the vector is read from
+ * the path the primary was given, so that path must be visible here
+ */
+static void
+apply_logged_insertion(const MutationTransaction &txn,
+                       const FeatureProjection &projection,
+                       unordered_map<string, FeatureVector> &full_fvs,
+                       unordered_map<string, FeatureVector> &fvs,
+                       size_t &fv_bytes,
+                       unordered_map<string, LSHTab> &hts,
+                       RegularNearestNeighborGraph &g) {
+  const vector<string> &fields = txn.records.front().fields;
+  if (fields.size() != 2)
+    throw SMITHLABException("bad INSERT in mutation log: " + toa(txn.seq));
+  if (g.has_vertex(fields[0]))
+    return;
+
+  const FeatureVector full = get_feat_vec(fields[1]);
+  if (full.get_id() != fields[0])
+    throw SMITHLABException("logged id does not match: " + fields[1]);
+  const FeatureVector fv = index_vector(projection, full);
+  g.add_vertex_if_new(fv.get_id());
+  store_vector(fvs, fv, fv_bytes);
+  if (!projection.empty())
+    full_fvs[fv.get_id()] = full;
+
+  for (size_t i = 1; i < txn.records.size(); ++i)
+    if (txn.records[i].type == "BUCKET_ADD") {
+      unordered_map<string, LSHTab>::iterator
+        ht(hts.find(txn.records[i].fields[0]));
+      if (ht != hts.end())
+        ht->second.insert(fv,
+                          strtoul(txn.records[i].fields[1].c_str(), 0, 10));
+    }
+}
+
+
+static void
+apply_logged_deletion(const MutationTransaction &txn,
+                      unordered_map<string, FeatureVector> &full_fvs,
+                      unordered_map<string, FeatureVector> &fvs,
+                      size_t &fv_bytes,
+                      unordered_map<string, LSHTab> &hts,
+                      RegularNearestNeighborGraph &g) {
+  const MutationRecord &del = txn.records.back();
+  if (del.fields.size() != 1)
+    throw SMITHLABException("bad DELETE in mutation log: " + toa(txn.seq));
+  unordered_map<string, FeatureVector>::iterator fv(fvs.find(del.fields[0]));
+  if (fv == fvs.end())
+    return;
+
+  for (size_t i = 0; i + 1 < txn.records.size(); ++i)
+    if (txn.records[i].type == "BUCKET_DEL") {
+      unordered_map<string, LSHTab>::iterator
+        ht(hts.find(txn.records[i].fields[0]));
+      const size_t bucket_number =
+        strtoul(txn.records[i].fields[1].c_str(), 0, 10);
+      if (ht != hts.end() && ht->second.find(bucket_number) != ht->second.end())
+        ht->second.remove(fv->second, bucket_number);
+    }
+  g.remove_vertex(fv->first);
+  full_fvs.erase(fv->first);
+  erase_vector(fvs, del.fields[0], fv_bytes);
+}
+
+
+/* hash function ids are the numbers of the refreshes that made them */
+static size_t
+parse_hash_function_id(const string &id) {
+  errno = 0;
+  char *end = 0;
+  const unsigned long long value = strtoull(id.c_str(), &end, 10);
+  if (id.empty() || *end != '\0' || errno == ERANGE || id[0] == '-')
+    throw SMITHLABException("bad hash function id: " + id);
+  return value;
+}
+
+
+/* a refresh is replayed by hashing into a new table; the comparisons
+ * are not repeated since the changed neighbor lists follow in the log
+ */
+static void
+apply_logged_refresh(const MutationTransaction &txn,
+                     const unordered_map<string, FeatureVector> &fvs,
+                     unordered_map<string, LSHFun> &hfs,
+                     queue<string> &hf_queue,
+                     unordered_map<string, LSHTab> &hts) {
+  const vector<string> &fields = txn.records.front().fields;
+  if (fields.size() != 3)
+    throw SMITHLABException("bad REFRESH in mutation log: " + toa(txn.seq));
+
+  CompressedInputStream hash_fun_in(fields[0]);
+  if (!hash_fun_in)
+    throw SMITHLABException("cannot open: " + fields[0]);
+  LSHAngleHashFunction hash_fun;
+  hash_fun_in >> hash_fun;
+
+  // hash function ids increase with each refresh
+  if (hfs.find(hash_fun.get_id()) != hfs.end() ||
+      (!hf_queue.empty() &&
+       parse_hash_function_id(hash_fun.get_id()) <=
+       parse_hash_function_id(hf_queue.back())))
+    return;
+
+  LSHAngleHashTable hash_table;
+  build_hash_table(fvs, hash_fun, strtoul(fields[1].c_str(), 0, 10),
+                   strtoul(fields[2].c_str(), 0, 10), hash_table);
+  replace_oldest_hash_table(hash_fun, hash_table, hfs, hf_queue, hts);
+}
+
+
+/*
+ * Applies a transaction from the primary's mutation log. A replica
+ * starts from a database snapshot that may already include some of
+ * the logged mutations, so each one is skipped if its effect is
+ * already present: inserts of known ids, deletes of unknown ids and
+ * refreshes to hash functions no newer than the current ones.
+ */
+static void
+apply_mutation(const MutationTransaction &txn,
+               const FeatureProjection &projection,
+               unordered_map<string, FeatureVector> &full_fvs,
+               unordered_map<string, FeatureVector> &fvs,
+               size_t &fv_bytes,
+               unordered_map<string, LSHFun> &hfs,
+               queue<string> &hf_queue,
+               unordered_map<string, LSHTab> &hts,
+               RegularNearestNeighborGraph &g) {
+  if (txn.records.empty())
+    return;
+
+  const string &type = txn.records.front().type;
+  if (type == "INSERT")
+    apply_logged_insertion(txn, projection, full_fvs, fvs, fv_bytes, hts, g);
+  else if (type == "REFRESH")
+    apply_logged_refresh(txn, fvs, hfs, hf_queue, hts);
+  else if (type == "BUCKET_DEL" || type == "DELETE")
+    apply_logged_deletion(txn, full_fvs, fvs, fv_bytes, hts, g);
+  else
+    throw SMITHLABException("unknown mutation in log: " + type);
+
+  // neighbor lists are complete, so replaying them is idempotent
+  for (size_t i = 0; i < txn.records.size(); ++i)
+    if (txn.records[i].type == "EDGES") {
+      const vector<string> &f = txn.records[i].fields;
+      if (f.size() < 2 || !g.has_vertex(f[0]))
+        continue;
+      const size_t n = strtoul(f[1].c_str(), 0, 10);
+      if (f.size() != 2 + 2*n)
+        throw SMITHLABException("bad EDGES in mutation log: " + toa(txn.seq));
+      vector<string> neighbors(n);
+      vector<double> distances(n);
+      for (size_t j = 0; j < n; ++j) {
+        neighbors[j] = f[2 + 2*j];
+        distances[j] = strtod(f[3 + 2*j].c_str(), 0);
+      }
+      g.set_neighbors(f[0], neighbors, distances);
+    }
+}
+
+
 static void
 get_database(const bool VERBOSE, 
              unordered_map<string, string> &paths,
              unordered_map<string, FeatureVector> &db) {
 
-  size_t count = 0;
+  vector<string> ids, filenames;
   for(unordered_map<string, string>::const_iterator i(paths.begin());
       i != paths.end(); ++i) {
+    ids.push_back(i->first);
+    filenames.push_back(i->second);
+  }
 
-    FeatureVector fv = get_feat_vec(i->second.c_str());
+  // the files are parsed (and decompressed) on all cores
+  if (VERBOSE)
+    cerr << "loading feature vectors: " << filenames.size() << endl;
+  vector<FeatureVector> fvs;
+  read_feature_vectors(filenames, std::thread::hardware_concurrency(), fvs);
 
-    if(fv.get_id() != i->first)
+  for (size_t i = 0; i < fvs.size(); ++i) {
+    if(fvs[i].get_id() != ids[i])
       throw SMITHLABException("unconsistent feature vector ids");
-    db[fv.get_id()] = fv;
-    if (VERBOSE)
-      cerr << "\rloading feature vectors: "
-           << percent(count++, paths.size()) << "%\r";
+    fvs[i].normalize();
+    db[ids[i]] = fvs[i];
   }
   if (VERBOSE)
     cerr << "\rloading feature vectors: 100%" << endl;
@@ -378,13 +499,16 @@ get_database(const bool VERBOSE,
 static
 void add_hash_functions(size_t qsize, size_t n_bits, size_t n_features, 
                         const string &feature_set_id, const string &hf_dir, 
+                        const uint64_t hf_seed, const string &hf_family,
                         unordered_map<string, string> &hf_paths,
                         queue<string> &hash_func_queue) {
 
   for(size_t i = 0; i < qsize; ++i) {
     string id = toa(i);
     const LSHAngleHashFunction hash_function(id, feature_set_id,
-                                             n_features, n_bits);
+                                             n_features, n_bits,
+                                             derive_hash_seed(hf_seed, id),
+                                             hf_family);
     std::ofstream of;
     string outfile = path_join(hf_dir,id);
     outfile = outfile + ".hf";
@@ -402,13 +526,16 @@ void add_hash_functions(size_t qsize, size_t n_bits, size_t n_features,
 static
 string add_new_hash_function(size_t n_bits, size_t n_features, 
                              const string &feature_set_id, const string &hf_dir,
+                             const uint64_t hf_seed, const string &hf_family,
                              const queue<string> &hash_func_queue) {
 
     // find the newest hash function in queue, increase id by 1
     string newest = hash_func_queue.back();
-    string id = toa(std::stoi(newest) + 1);
+    string id = toa(parse_hash_function_id(newest) + 1);
     const LSHAngleHashFunction hash_function(id, feature_set_id,
-                                             n_features, n_bits);
+                                             n_features, n_bits,
+                                             derive_hash_seed(hf_seed, id),
+                                             hf_family);
     std::ofstream of;
     string outfile = path_join(hf_dir,id);
     outfile = outfile + ".hf";
@@ -421,6 +548,99 @@ string add_new_hash_function(size_t n_bits, size_t n_features,
 }
 
 
+static void
+define_server_metrics(MetricsRegistry &metrics) {
+  vector<double> seconds;
+  latency_bounds(1e-5, 100.0, seconds);
+  vector<double> counts;
+  power_of_two_bounds(1 << 24, counts);
+  metrics.define_counter("amordad_requests_total",
+                         "Requests served, by route and outcome.");
+  metrics.define_histogram("amordad_request_seconds",
+                           "Time to serve a request, by route.",
+                           1e-6, seconds);
+  metrics.define_histogram("amordad_stage_seconds",
+                           "Time spent in each stage of a request.",
+                           1e-6, seconds);
+  metrics.define_histogram("amordad_query_candidates",
+                           "Candidate vectors scored per query.",
+                           1.0, counts);
+}
+
+
+/* measures the structures in memory when the metrics are scraped; the
+ * hash tables, the graph and fv_bytes (of the vectors) are kept as
+ * they change, so this walks none of them while holding the state */
+static void
+add_structure_metrics(const unordered_map<string, FeatureVector> &fvs,
+                      const size_t fv_bytes,
+                      const unordered_map<string, LSHTab> &hts,
+                      const RegularNearestNeighborGraph &g,
+                      const QueryResultCache &cache,
+                      const ComparedPairFilter *compared,
+                      MetricsRegistry &metrics) {
+
+  metrics.define_gauge("amordad_feature_vectors",
+                       "Feature vectors in the database.");
+  metrics.set("amordad_feature_vectors", "", fvs.size());
+
+  // bucket loads over the leaves of all tables
+  vector<double> loads;
+  power_of_two_bounds(1 << 24, loads);
+  metrics.define_histogram("amordad_bucket_load",
+                           "Vectors per leaf bucket over all hash tables.",
+                           1.0, loads);
+  size_t table_bytes = 0;
+  for (unordered_map<string, LSHTab>::const_iterator i(hts.begin());
+       i != hts.end(); ++i) {
+    const std::map<size_t, size_t> &loads = i->second.get_leaf_loads();
+    for (std::map<size_t, size_t>::const_iterator j(loads.begin());
+         j != loads.end(); ++j)
+      metrics.observe("amordad_bucket_load", "", j->first, j->second);
+    table_bytes += i->second.memory_bytes();
+  }
+
+  // lazily deleted vertices stay in the graph until it is rebuilt
+  const size_t n_deleted = g.get_deleted_count();
+  const size_t n_live = g.get_vertex_count();
+  metrics.define_gauge("amordad_graph_vertices",
+                       "Live vertices in the nearest neighbor graph.");
+  metrics.set("amordad_graph_vertices", "", n_live);
+  metrics.define_gauge("amordad_graph_deleted_ratio",
+                       "Fraction of graph vertices deleted but not removed.");
+  metrics.set("amordad_graph_deleted_ratio", "", (n_live + n_deleted == 0) ?
+              0.0 : static_cast<double>(n_deleted)/(n_live + n_deleted));
+  vector<size_t> degrees;
+  g.get_out_degree_counts(degrees);
+  metrics.define_gauge("amordad_graph_out_degree",
+                       "Live graph vertices with each out-degree.");
+  for (size_t d = 0; d < degrees.size(); ++d)
+    metrics.set("amordad_graph_out_degree", "degree=\"" + toa(d) + "\"",
+                degrees[d]);
+
+  metrics.define_gauge("amordad_memory_bytes",
+                       "Approximate bytes held by each structure.");
+  metrics.set("amordad_memory_bytes", "structure=\"feature_vectors\"",
+              fv_bytes);
+  metrics.set("amordad_memory_bytes", "structure=\"hash_tables\"",
+              table_bytes);
+  metrics.set("amordad_memory_bytes", "structure=\"graph\"",
+              g.memory_bytes());
+  metrics.set("amordad_memory_bytes", "structure=\"result_cache\"",
+              cache.memory_bytes());
+  if (compared != 0)
+    metrics.set("amordad_memory_bytes", "structure=\"compared_filter\"",
+                compared->memory_bytes());
+
+  metrics.define_counter("amordad_cache_hits_total",
+                         "Queries answered from the result cache.");
+  metrics.increment("amordad_cache_hits_total", "", cache.get_hits());
+  metrics.define_counter("amordad_cache_misses_total",
+                         "Queries not found in the result cache.");
+  metrics.increment("amordad_cache_misses_total", "", cache.get_misses());
+}
+
+
 static bool
 validate_file(const string &filename, char open_mode) {
   if (open_mode == 'r')
@@ -468,6 +688,39 @@ main(int argc, const char **argv) {
     // results parameter
     size_t n_neighbors = 30;
     double max_proximity_radius = 0.75;
+    size_t beam_width = 0;
+    size_t n_probes = 1;
+
+    // bucket splitting (0 means buckets are never split)
+    size_t split_load = 0;
+    size_t split_bits = 4;
+
+    // pairs remembered as compared across refreshes (0 disables)
+    size_t filter_capacity = 0;
+    double filter_fp_rate = 0.01;
+
+    // per-query budget (0 means unlimited)
+    QueryBudget query_budget;
+
+    // replication: the primary appends to a mutation log that
+    // read-only replicas poll
+    string mutation_log_file;
+    string replica_log_file;
+    size_t poll_millis = 1000;
+
+    // query results remembered until the database changes (0 disables)
+    size_t cache_capacity = 10000;
+
+    // vectors posted to /insert are kept here
+    string store_dir;
+
+    // indexing in fewer dimensions, re-ranking by full angles
+    string projection_file;
+    size_t rerank = 4;
+
+    // hash functions are regenerated from seeds derived from this one
+    size_t hf_seed = 0;
+    string hf_family = "gaussian";
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), 
@@ -494,8 +747,56 @@ main(int argc, const char **argv) {
                       false, n_neighbors);
     opt_parse.add_opt("mpr", 'r', "maximum proximity radius",
                       false, max_proximity_radius);
+    opt_parse.add_opt("ef", 'e', "beam width for best-first graph search; "
+                      "0 expands one hop from the buckets (Default: 0)",
+                      false, beam_width);
+    opt_parse.add_opt("probes", 'T', "buckets probed per hash table "
+                      "(Default: 1)", false, n_probes);
+    opt_parse.add_opt("split", 'S', "split buckets holding more than this "
+                      "many vectors (Default: never)", false, split_load);
+    opt_parse.add_opt("splitbits", 'B', "hyperplane bits added in each "
+                      "bucket split (Default: 4)", false, split_bits);
+    opt_parse.add_opt("filter", 'f', "pairs remembered as compared between "
+                      "refreshes, skipping their comparisons; about 2.9 "
+                      "bytes per pair at -filterfp 0.01 "
+                      "(Default: 0, disabled)", false, filter_capacity);
+    opt_parse.add_opt("filterfp", 'F', "false positive rate of the compared "
+                      "pair filter: this fraction of pairs never compared "
+                      "are skipped, losing their edges (Default: 0.01)",
+                      false, filter_fp_rate);
+    opt_parse.add_opt("candidates", 'c', "maximum candidates evaluated per "
+                      "query (Default: unlimited)", false,
+                      query_budget.max_candidates);
+    opt_parse.add_opt("maxload", 'L', "take only this many members of "
+                      "larger buckets in queries, those agreeing most with "
+                      "the query's signatures (Default: unlimited)", false,
+                      query_budget.max_bucket_load);
+    opt_parse.add_opt("millis", 't', "time budget per query in milliseconds "
+                      "(Default: unlimited)", false, query_budget.max_millis);
+    opt_parse.add_opt("cache", 'C', "query results to cache, 0 to disable "
+                      "(Default: 10000)", false, cache_capacity);
     opt_parse.add_opt("initfile", 'i', "initialize database by providing "
                       "feature paths", false, init_file);
+    opt_parse.add_opt("log", 'l', "append mutations to this log for "
+                      "replicas", false, mutation_log_file);
+    opt_parse.add_opt("replica", 'R', "serve read-only queries, following "
+                      "the primary's mutation log", false, replica_log_file);
+    opt_parse.add_opt("poll", 'W', "replica log polling interval in "
+                      "milliseconds (Default: 1000)", false, poll_millis);
+    opt_parse.add_opt("store", 'D', "directory keeping vectors posted "
+                      "to /insert", false, store_dir);
+    opt_parse.add_opt("projection", 'j', "index vectors projected as in "
+                      "this file (from fit_projection); it is kept with "
+                      "the hash functions of a new database", false,
+                      projection_file);
+    opt_parse.add_opt("rerank", 'k', "with a projection, the multiple of "
+                      "the neighbors found before re-ranking by full "
+                      "angles (default: 4)", false, rerank);
+    opt_parse.add_opt("hfseed", 'H', "seed from which new hash functions "
+                      "derive theirs (default: random)", false, hf_seed);
+    opt_parse.add_opt("family", 'a', "hyperplanes of new hash functions: "
+                      "gaussian, or hadamard for fast structured rotations "
+                      "(default: gaussian)", false, hf_family);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
 
     vector<string> leftover_args;
@@ -514,6 +815,17 @@ main(int argc, const char **argv) {
       return EXIT_SUCCESS;
     }
     /****************** END COMMAND LINE OPTIONS *****************/
+    const bool replica = !replica_log_file.empty();
+    if (replica && (!mutation_log_file.empty() || !init_file.empty()))
+      throw SMITHLABException("a replica cannot log or initialize");
+    if (hf_family != "gaussian" && hf_family != "hadamard")
+      throw SMITHLABException("unknown hash function family: " + hf_family);
+    if (rerank == 0)
+      throw SMITHLABException("rerank must be positive");
+    if (hf_seed == 0) {
+      std::random_device rd;
+      hf_seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
 
     
     ////////////////////////////////////////////////////////////////////////
@@ -528,14 +840,56 @@ main(int argc, const char **argv) {
     unordered_map<string, LSHTab> ht_lookup;
     RegularNearestNeighborGraph nng(graph_name, max_degree);
 
+    // the hash functions and index are in the dimensions of the
+    // projection, so it is chosen with a new database and kept with
+    // its hash functions
+    FeatureProjection projection;
+    const string stored_projection(path_join(hf_dir, "projection.prj"));
+    if (eng.get_num_hash_functions() == 0 && !projection_file.empty()) {
+      CompressedInputStream projection_in(projection_file);
+      if (!projection_in)
+        throw SMITHLABException("cannot open: " + projection_file);
+      projection_in >> projection;
+      std::ofstream projection_out(stored_projection.c_str());
+      if (!(projection_out << projection << endl))
+        throw SMITHLABException("cannot write to file: " + stored_projection);
+    }
+    else if (eng.get_num_hash_functions() == 0) {
+      // a projection left from an earlier database must not be applied
+      // to the vectors of a new one indexed without
+      if (std::remove(stored_projection.c_str()) != 0 && errno != ENOENT)
+        throw SMITHLABException("cannot remove: " + stored_projection);
+    }
+    else {
+      CompressedInputStream projection_in(stored_projection);
+      if (projection_in)
+        projection_in >> projection;
+      else if (!projection_file.empty())
+        throw SMITHLABException("database was indexed without a "
+                                "projection: " + db);
+    }
+    if (!projection.empty() && projection.get_n_features() != n_features)
+      throw SMITHLABException("projection is of " +
+                              toa(projection.get_n_features()) +
+                              " features, expected " + toa(n_features));
+    const size_t index_features =
+      projection.empty() ? n_features : projection.size();
+    if (VERBOSE && !projection.empty())
+      cerr << "INDEXING A " << projection.get_method() << " PROJECTION TO "
+           << index_features << " DIMENSIONS" << endl;
+
     if(eng.get_num_hash_functions() == 0) {
 
+      // a replica only reads the snapshot the primary created
+      if (replica)
+        throw SMITHLABException("replica found an empty database: " + db);
+
       if(VERBOSE)
         cerr << "INITIALIZING HASH FUNCTIONS" << endl;
 
-      add_hash_functions(hf_queue_size, n_bits, n_features, 
-                         feature_set_id, hf_dir, hf_path_lookup,
-                         hash_func_queue);
+      add_hash_functions(hf_queue_size, n_bits, index_features, 
+                         feature_set_id, hf_dir, hf_seed, hf_family,
+                         hf_path_lookup, hash_func_queue);
       eng.initialize_db(fv_path_lookup, hf_path_lookup, hash_func_queue,
                         ht_lookup, nng, VERBOSE); 
     }
@@ -550,6 +904,20 @@ main(int argc, const char **argv) {
     unordered_map<string, FeatureVector> fv_lookup;
     get_database(VERBOSE, fv_path_lookup, fv_lookup);
 
+    // with a projection, the full vectors are kept for re-ranking
+    unordered_map<string, FeatureVector> full_lookup;
+    if (!projection.empty()) {
+      full_lookup.swap(fv_lookup);
+      for (FeatVecLookup::const_iterator i(full_lookup.begin());
+           i != full_lookup.end(); ++i)
+        fv_lookup[i->first] = projection(i->second);
+    }
+    // kept up to date by every insertion and deletion from here on
+    size_t fv_bytes = 0;
+    for (FeatVecLookup::const_iterator i(fv_lookup.begin());
+         i != fv_lookup.end(); ++i)
+      fv_bytes += vector_entry_bytes(i->first, i->second);
+
     ////////////////////////////////////////////////////////////////////////
     ////// READING THE HASH FUNCTIONS //////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////
@@ -558,7 +926,7 @@ main(int argc, const char **argv) {
     size_t count = 0;
     for(unordered_map<string, string>::const_iterator i(hf_path_lookup.begin());
         i != hf_path_lookup.end(); ++i) {
-      std::ifstream hf_in(i->second.c_str());
+      CompressedInputStream hf_in(i->second);
       if (!hf_in)
         throw SMITHLABException("bad hash function file: " +
                                 i->second);
@@ -581,6 +949,10 @@ main(int argc, const char **argv) {
       cerr << "load database time = " << elapsed.count() << "s\n";
 
 
+    std::unique_ptr<MutationLogWriter> mutation_log;
+    if (!mutation_log_file.empty())
+      mutation_log.reset(new MutationLogWriter(mutation_log_file));
+
     ////////////////////////////////////////////////////////////////////////
     // IF INITIALIZATION FEATURE PATHS FILE PROVIDED, INITIALIZE DATABASE ///
     // //////////////////////////////////////////////////////////////////////
@@ -605,8 +977,14 @@ main(int argc, const char **argv) {
         feature_vectors.push_back(fv_path);
 
       for(size_t i = 0; i < feature_vectors.size(); ++i) {
-         execute_insertion(fv_lookup, hf_lookup, ht_lookup, 
-                           nng, feature_vectors[i], eng);
+         RequestProfile profile;
+         profile.enter(STAGE_PARSE);
+         const FeatureVector fv = get_feat_vec(feature_vectors[i]);
+         execute_insertion(fv_lookup, fv_bytes, hf_lookup, ht_lookup, nng, 0,
+                           index_vector(projection, fv), feature_vectors[i],
+                           mutation_log.get(), profile, eng);
+         if (!projection.empty())
+           full_lookup[fv.get_id()] = fv;
          if (VERBOSE)
            cerr << "\rinitializing database: "
                 << percent(i, feature_vectors.size()) << "%\r";
@@ -622,20 +1000,177 @@ main(int argc, const char **argv) {
     }
 
 
+    ////////////////////////////////////////////////////////////////////////
+    ////// SPLIT THE OVERLOADED BUCKETS ////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////
+    if (split_load > 0) {
+      SplitStats total;
+      for (unordered_map<string, LSHTab>::iterator i(ht_lookup.begin());
+           i != ht_lookup.end(); ++i) {
+        i->second.split_overloaded_buckets(fv_lookup, split_load, split_bits);
+        const SplitStats stats(i->second.get_split_stats());
+        total.split_buckets += stats.split_buckets;
+        total.splits += stats.splits;
+        total.max_depth = std::max(total.max_depth, stats.max_depth);
+        total.max_leaf_load = std::max(total.max_leaf_load,
+                                       stats.max_leaf_load);
+      }
+      if (VERBOSE)
+        cerr << "BUCKET SPLITS: "
+             << "[split_buckets=" << total.split_buckets << "]"
+             << "[splits=" << total.splits << "]"
+             << "[max_depth=" << total.max_depth << "]"
+             << "[max_leaf_load=" << total.max_leaf_load << "]" << endl;
+    }
+
+    // pairs compared by one refresh need not be compared again by the
+    // next ones, as long as the filter still remembers them
+    std::unique_ptr<ComparedPairFilter> compared;
+    if (filter_capacity > 0) {
+      compared.reset(new ComparedPairFilter(filter_capacity, filter_fp_rate));
+      if (VERBOSE)
+        cerr << "COMPARED PAIR FILTER: "
+             << "[capacity=" << compared->get_capacity() << "]"
+             << "[bytes=" << compared->memory_bytes() << "]" << endl;
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////
+    ///// FOLLOW THE PRIMARY'S MUTATION LOG (REPLICAS ONLY) ////////////////
+    ////////////////////////////////////////////////////////////////////////
+
+    // requests are served while the log is applied, so both hold this
+    std::mutex state_mutex;
+    QueryResultCache result_cache(cache_capacity);
+    size_t applied_seq = 0, applied_commit_millis = 0;
+    std::chrono::steady_clock::time_point last_poll =
+      std::chrono::steady_clock::now();
+    std::atomic<bool> stop_following(false);
+    std::thread follower;
+    if (replica) {
+      follower = std::thread([&]() {
+        MutationLogReader reader(replica_log_file);
+        while (!stop_following) {
+          vector<MutationTransaction> txns;
+          try {
+            reader.read_transactions(txns);
+          }
+          catch (const SMITHLABException &e) {
+            cerr << e.what() << endl;
+          }
+          catch (const std::exception &e) {
+            cerr << e.what() << endl;
+          }
+          {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            if (!txns.empty())
+              result_cache.invalidate();
+            for (size_t i = 0; i < txns.size(); ++i) {
+              try {
+                apply_mutation(txns[i], projection, full_lookup, fv_lookup,
+                               fv_bytes, hf_lookup, hash_func_queue,
+                               ht_lookup, nng);
+              }
+              catch (const SMITHLABException &e) {
+                cerr << "mutation " << txns[i].seq << ": " << e.what() << endl;
+              }
+              // a bad record is reported and skipped, rather than
+              // ending the thread and with it the replica
+              catch (const std::exception &e) {
+                cerr << "mutation " << txns[i].seq << ": " << e.what() << endl;
+              }
+              applied_seq = txns[i].seq;
+              applied_commit_millis = txns[i].time_millis;
+            }
+            last_poll = std::chrono::steady_clock::now();
+          }
+          if (VERBOSE && !txns.empty())
+            cerr << "APPLIED MUTATIONS: [through=" << applied_seq << "]"
+                 << "[count=" << txns.size() << "]" << endl;
+          std::this_thread::sleep_for(std::chrono::milliseconds(poll_millis));
+        }
+      });
+    }
+
+
     ////////////////////////////////////////////////////////////////////////
     ///// EXECUTE THE REQUESTS FROM URL ///////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////
 
+    MetricsRegistry metrics;
+    define_server_metrics(metrics);
+
+    // records a request served, with the time it spent in each stage
+    auto record_request = [&](const string &route,
+                              RequestProfile &profile, const bool ok) {
+      profile.finish();
+      const string label = "route=\"" + route + "\"";
+      metrics.increment("amordad_requests_total", label +
+                        (ok ? ",status=\"ok\"" : ",status=\"error\""));
+      if (!ok)
+        return;
+      double total = 0.0;
+      for (size_t i = 0; i < N_REQUEST_STAGES; ++i)
+        if (profile.was_entered(i)) {
+          total += profile.get_seconds(i);
+          metrics.observe("amordad_stage_seconds", label + ",stage=\"" +
+                          stage_name(i) + "\"", profile.get_seconds(i));
+        }
+      metrics.observe("amordad_request_seconds", label, total);
+      if (profile.was_entered(STAGE_SCORE) ||
+          profile.was_entered(STAGE_EXPAND))
+        metrics.observe("amordad_query_candidates", label,
+                        profile.candidates);
+    };
+
     crow::SimpleApp app;
     CROW_ROUTE(app, "/")
     ([]() {
      return "Amordad Web Server";
      });
 
+    // the search settings, which requests may override
+    QuerySettings default_settings;
+    default_settings.n_neighbors = n_neighbors;
+    default_settings.max_proximity_radius = max_proximity_radius;
+    default_settings.beam_width = beam_width;
+    default_settings.n_probes = n_probes;
+    default_settings.budget = query_budget;
+    default_settings.rerank = rerank;
+    auto read_query_settings = [&](const crow::request &req,
+                                   QuerySettings &settings) {
+      settings = default_settings;
+      if (req.url_params.get("ef") != 0)
+        settings.beam_width = strtoul(req.url_params.get("ef"), 0, 10);
+      if (req.url_params.get("probes") != 0)
+        settings.n_probes = strtoul(req.url_params.get("probes"), 0, 10);
+      if (req.url_params.get("candidates") != 0)
+        settings.budget.max_candidates =
+          strtoul(req.url_params.get("candidates"), 0, 10);
+      if (req.url_params.get("maxload") != 0)
+        settings.budget.max_bucket_load =
+          strtoul(req.url_params.get("maxload"), 0, 10);
+      if (req.url_params.get("millis") != 0)
+        settings.budget.max_millis = strtod(req.url_params.get("millis"), 0);
+    };
+
+    // returns false if the budget cut the search short; complete
+    // results are cached under the normalized vector and settings
+    auto run_query = [&](const FeatureVector &fv,
+                         const QuerySettings &settings,
+                         RequestProfile &profile, vector<Result> &result,
+                         bool &from_cache) {
+      return execute_search(fv_lookup, full_lookup, projection, hf_lookup,
+                            ht_lookup, nng, fv, settings,
+                            (cache_capacity > 0) ? &result_cache : 0,
+                            profile, result, from_cache);
+    };
+
     CROW_ROUTE(app, "/query")
     ([&](const crow::request &req) {
 
       crow::json::wvalue ret;
+      RequestProfile profile;
 
       try {
         string fv_path = req.url_params.get("path");
@@ -643,13 +1178,19 @@ main(int argc, const char **argv) {
         if(fv_path.empty())
           throw SMITHLABException("invalid file path");
 
+        // the beam width and budget may be chosen per request
+        QuerySettings settings;
+        read_query_settings(req, settings);
+
+        std::lock_guard<std::mutex> lock(state_mutex);
         std::chrono::time_point<std::chrono::system_clock> start, end;
         start = std::chrono::system_clock::now();
         vector<Result> result;
+        profile.enter(STAGE_PARSE);
         FeatureVector fv = get_feat_vec(fv_path);
-        execute_query(fv_lookup, hf_lookup, ht_lookup, 
-                      nng, fv, n_neighbors, max_proximity_radius,
-                      result);
+        bool cached = false;
+        const bool complete =
+          run_query(fv, settings, profile, result, cached);
         end = std::chrono::system_clock::now();
         std::chrono::duration<double> elapsed = end - start;
 
@@ -663,33 +1204,149 @@ main(int argc, const char **argv) {
         ret["total"] = fv_lookup.size();
         ret["time"] = elapsed.count();
         ret["id"] = fv.get_id();
+        ret["complete"] = complete;
+        ret["cached"] = cached;
         for (size_t i = 0; i < result.size(); ++i)
           ret[result[i].id] = result[i].val;
 
+        record_request("query", profile, true);
         return ret;
       }
       catch (const SMITHLABException &e) {
         cerr << e.what() << endl;
+        record_request("query", profile, false);
         ret["error"] = e.what();
         return ret;
       }
     });
 
-    CROW_ROUTE(app, "/insert")
+    // the query travels in the request body, either in the binary
+    // encoding of QueryProtocol.hpp or as {"id": ..., "values": [...]};
+    // results come back in the same encoding
+    CROW_ROUTE(app, "/search").methods("POST"_method)
+    ([&](const crow::request &req) {
+
+      const bool binary =
+        (req.get_header_value("Content-Type") == QUERY_CONTENT_TYPE);
+      RequestProfile profile;
+      try {
+        profile.enter(STAGE_PARSE);
+        FeatureVector fv;
+        vector<string> labels;
+        parse_posted_vector(req, fv, labels);
+        if (fv.size() != n_features)
+          throw SMITHLABException("query has " + toa(fv.size()) +
+                                  " features, expected " + toa(n_features));
+        fv.normalize();
+
+        QuerySettings settings;
+        read_query_settings(req, settings);
+
+        std::lock_guard<std::mutex> lock(state_mutex);
+        std::chrono::time_point<std::chrono::system_clock> start, end;
+        start = std::chrono::system_clock::now();
+        vector<Result> result;
+        bool cached = false;
+        const bool complete =
+          run_query(fv, settings, profile, result, cached);
+        end = std::chrono::system_clock::now();
+        std::chrono::duration<double> elapsed = end - start;
+        if(VERBOSE)
+          cerr << "Wall time = " << elapsed.count() << "s\n";
+        record_request("search", profile, true);
+
+        if (binary) {
+          vector<string> ids(result.size());
+          vector<double> dists(result.size());
+          for (size_t i = 0; i < result.size(); ++i) {
+            ids[i] = result[i].id;
+            dists[i] = result[i].val;
+          }
+          string encoded;
+          encode_results(ids, dists, complete, encoded);
+          crow::response res(encoded);
+          res.set_header("Content-Type", QUERY_CONTENT_TYPE);
+          return res;
+        }
+
+        // ids and distances as parallel lists keep the result order
+        crow::json::wvalue ret;
+        ret["total"] = fv_lookup.size();
+        ret["time"] = elapsed.count();
+        ret["id"] = fv.get_id();
+        ret["complete"] = complete;
+        ret["cached"] = cached;
+        for (size_t i = 0; i < result.size(); ++i) {
+          ret["ids"][i] = result[i].id;
+          ret["dists"][i] = result[i].val;
+        }
+        return crow::response(std::move(ret));
+      }
+      catch (const SMITHLABException &e) {
+        cerr << e.what() << endl;
+        record_request("search", profile, false);
+        if (binary)
+          return crow::response(400, e.what());
+        crow::json::wvalue ret;
+        ret["error"] = e.what();
+        return crow::response(std::move(ret));
+      }
+    });
+
+    // GET inserts the vector in the file named by the "path" parameter;
+    // POST carries the vector in the body, as for /search, and the
+    // server keeps its own copy under the store directory, since the
+    // database refers to vectors by path
+    CROW_ROUTE(app, "/insert").methods("GET"_method, "POST"_method)
     ([&](const crow::request &req) {
 
       crow::json::wvalue ret;
+      RequestProfile profile;
+      string stored_path;
 
       try {
-        string fv_path = req.url_params.get("path");
-
-        if(fv_path.empty())
-          throw SMITHLABException("invalid file path");
+        if (replica)
+          throw SMITHLABException("read-only replica cannot insert");
+
+        std::lock_guard<std::mutex> lock(state_mutex);
+        profile.enter(STAGE_PARSE);
+        FeatureVector fv;
+        string fv_path;
+        if (req.method == "POST"_method) {
+          vector<string> labels;
+          parse_posted_vector(req, fv, labels);
+          if (fv.size() != n_features)
+            throw SMITHLABException("vector has " + toa(fv.size()) +
+                                    " features, expected " +
+                                    toa(n_features));
+          if (store_dir.empty())
+            throw SMITHLABException("no store directory for posted vectors");
+          const string id(fv.get_id());
+          if (id.empty() || id.find('/') != string::npos || id[0] == '.')
+            throw SMITHLABException("bad vector id: " + id);
+          fv_path = path_join(store_dir, id + ".fv");
+          if (fv_lookup.find(id) != fv_lookup.end())
+            throw SMITHLABException("cannot insert existing node: " + id);
+          write_stored_vector(fv, labels, fv_path);
+          stored_path = fv_path;
+          fv.normalize();
+        }
+        else {
+          fv_path = req.url_params.get("path") ? req.url_params.get("path") :
+            string();
+          if (fv_path.empty())
+            throw SMITHLABException("invalid file path");
+          fv = get_feat_vec(fv_path);
+        }
 
+        result_cache.invalidate();
         std::chrono::time_point<std::chrono::system_clock> start, end;
         start = std::chrono::system_clock::now();
-        execute_insertion(fv_lookup, hf_lookup, ht_lookup, 
-                          nng, fv_path, eng);
+        execute_insertion(fv_lookup, fv_bytes, hf_lookup, ht_lookup, nng,
+                          compared.get(), index_vector(projection, fv),
+                          fv_path, mutation_log.get(), profile, eng);
+        if (!projection.empty())
+          full_lookup[fv.get_id()] = fv;
         end = std::chrono::system_clock::now();
         std::chrono::duration<double> elapsed = end - start;
         if(VERBOSE)
@@ -697,11 +1354,16 @@ main(int argc, const char **argv) {
 
         ret["total"] = fv_lookup.size();
         ret["time"] = elapsed.count();
+        ret["id"] = fv.get_id();
 
+        record_request("insert", profile, true);
         return ret;
       }
       catch (const SMITHLABException &e) {
         cerr << e.what() << endl;
+        if (!stored_path.empty())
+          std::remove(stored_path.c_str());
+        record_request("insert", profile, false);
         ret["error"] = e.what();
         return ret;
       }
@@ -712,6 +1374,7 @@ main(int argc, const char **argv) {
     ([&](const crow::request &req) {
 
       crow::json::wvalue ret;
+      RequestProfile profile;
 
       try {
         string fv_path = req.url_params.get("path");
@@ -719,11 +1382,19 @@ main(int argc, const char **argv) {
         if(fv_path.empty())
           throw SMITHLABException("invalid file path");
 
+        if (replica)
+          throw SMITHLABException("read-only replica cannot delete");
+
+        std::lock_guard<std::mutex> lock(state_mutex);
+        result_cache.invalidate();
         std::chrono::time_point<std::chrono::system_clock> start, end;
         start = std::chrono::system_clock::now();
+        profile.enter(STAGE_PARSE);
         FeatureVector fv = get_feat_vec(fv_path);
-        execute_deletion(fv_lookup, hf_lookup, ht_lookup, 
-                         nng, fv, eng);
+        execute_deletion(fv_lookup, fv_bytes, hf_lookup, ht_lookup, nng,
+                         compared.get(), index_vector(projection, fv),
+                         mutation_log.get(), profile, eng);
+        full_lookup.erase(fv.get_id());
         end = std::chrono::system_clock::now();
         std::chrono::duration<double> elapsed = end - start;
         if(VERBOSE)
@@ -732,10 +1403,12 @@ main(int argc, const char **argv) {
         ret["total"] = fv_lookup.size();
         ret["time"] = elapsed.count();
 
+        record_request("delete", profile, true);
         return ret;
       }
       catch (const SMITHLABException &e) {
         cerr << e.what() << endl;
+        record_request("delete", profile, false);
         ret["error"] = e.what();
         return ret;
       }
@@ -746,35 +1419,110 @@ main(int argc, const char **argv) {
     ([&]() {
 
       crow::json::wvalue ret;
+      RequestProfile profile;
 
       try {
-        string hf_path = add_new_hash_function(n_bits, n_features, feature_set_id,
-                                               hf_dir, hash_func_queue);
+        if (replica)
+          throw SMITHLABException("read-only replica cannot refresh");
+
+        std::lock_guard<std::mutex> lock(state_mutex);
+        result_cache.invalidate();
+        string hf_path = add_new_hash_function(n_bits, index_features,
+                                               feature_set_id, hf_dir,
+                                               hf_seed, hf_family,
+                                               hash_func_queue);
         std::chrono::time_point<std::chrono::system_clock> start, end;
         start = std::chrono::system_clock::now();
-        execute_refresh(fv_lookup, hf_lookup, hash_func_queue, ht_lookup, 
-                        nng, hf_path, eng);
+        const size_t n_skipped =
+          execute_refresh(fv_lookup, hf_lookup, hash_func_queue, ht_lookup,
+                          nng, hf_path, split_load, split_bits,
+                          compared.get(), mutation_log.get(), profile, eng);
         end = std::chrono::system_clock::now();
         std::chrono::duration<double> elapsed = end - start;
 
         if(VERBOSE)
-          cerr << "Wall time = " << elapsed.count() << "s\n";
+          cerr << "Wall time = " << elapsed.count() << "s\n"
+               << "Skipped comparisons = " << n_skipped << "\n";
 
         ret["total"] = fv_lookup.size();
         ret["time"] = elapsed.count();
         ret["id"] = hash_func_queue.back();
-
+        const SplitStats
+          stats(ht_lookup[hash_func_queue.back()].get_split_stats());
+        ret["split_buckets"] = stats.split_buckets;
+        ret["splits"] = stats.splits;
+        ret["max_leaf_load"] = stats.max_leaf_load;
+        ret["skipped"] = n_skipped;
+
+        record_request("refresh", profile, true);
         return ret;
       }
       catch (const SMITHLABException &e) {
         cerr << e.what() << endl;
+        record_request("refresh", profile, false);
         ret["error"] = e.what();
         return ret;
       }
     });
 
+    // cache effectiveness, and how far behind the primary a replica may be
+    CROW_ROUTE(app, "/status")
+    ([&]() {
+
+      crow::json::wvalue ret;
+      std::lock_guard<std::mutex> lock(state_mutex);
+      ret["total"] = fv_lookup.size();
+      ret["replica"] = replica;
+      const size_t lookups =
+        result_cache.get_hits() + result_cache.get_misses();
+      ret["cache_entries"] = result_cache.size();
+      ret["cache_hits"] = result_cache.get_hits();
+      ret["cache_misses"] = result_cache.get_misses();
+      ret["cache_hit_rate"] = (lookups == 0) ? 0.0 :
+        static_cast<double>(result_cache.get_hits())/lookups;
+      ret["generation"] = result_cache.get_generation();
+      if (replica) {
+        const std::chrono::duration<double> since_poll =
+          std::chrono::steady_clock::now() - last_poll;
+        const size_t now_millis =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        ret["seq"] = applied_seq;
+        ret["since_poll"] = since_poll.count();
+        if (applied_commit_millis > 0)
+          ret["since_commit"] =
+            (now_millis - std::min(now_millis, applied_commit_millis))/1000.0;
+      }
+      else if (mutation_log)
+        ret["seq"] = mutation_log->get_seq();
+      return ret;
+    });
+
+    // request and structure metrics in the Prometheus text format
+    CROW_ROUTE(app, "/metrics")
+    ([&]() {
+
+      std::ostringstream out;
+      metrics.write_prometheus(out);
+      MetricsRegistry structures;
+      {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        add_structure_metrics(fv_lookup, fv_bytes, ht_lookup, nng,
+                              result_cache, compared.get(), structures);
+      }
+      structures.write_prometheus(out);
+      crow::response res(out.str());
+      res.set_header("Content-Type", "text/plain; version=0.0.4");
+      return res;
+    });
+
     app.port(PORT)
        .run();
+
+    if (follower.joinable()) {
+      stop_following = true;
+      follower.join();
+    }
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
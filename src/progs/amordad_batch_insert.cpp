@@ -36,6 +36,7 @@
 #include "RegularNearestNeighborGraph.hpp"
 
 #include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
 #include "LSHAngleHashTable.hpp"
 #include "LSHAngleHashFunction.hpp"
 
@@ -217,7 +218,7 @@ get_insertions(const string &insertions_file, vector<FeatureVector> &insertions)
 
   for(size_t i = 0; i < insertion_files.size(); ++i) {
     FeatureVector fv;
-    std::ifstream in(insertion_files[i].c_str());
+    CompressedInputStream in(insertion_files[i]);
     if (!in)
       throw SMITHLABException("bad feature vector file: " + insertion_files[i]);
     in >> fv;
@@ -238,7 +239,7 @@ get_database(const bool VERBOSE,
 
   for(size_t i = 0; i < fv_files.size(); ++i) {
     FeatureVector fv;
-    std::ifstream in(fv_files[i].c_str());
+    CompressedInputStream in(fv_files[i]);
     if (!in)
       throw SMITHLABException("bad feature vector file: " + fv_files[i]);
     in >> fv;
@@ -327,7 +328,7 @@ main(int argc, const char **argv) {
     ////// READING THE GRAPH ///////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////
 
-    std::ifstream g_in(graph_file.c_str());
+    CompressedInputStream g_in(graph_file);
     if (!g_in)
       throw SMITHLABException("cannot load graph: " + graph_file);
 
@@ -355,7 +356,7 @@ main(int argc, const char **argv) {
     //loading hash functions
     unordered_map<string, LSHFun> hf_lookup;
     for (size_t i = 0; i < hash_function_files.size(); ++i) {
-      std::ifstream hf_in(hash_function_files[i].c_str());
+      CompressedInputStream hf_in(hash_function_files[i]);
       if (!hf_in)
         throw SMITHLABException("bad hash function file: " +
                                 hash_function_files[i]);
@@ -376,7 +377,7 @@ main(int argc, const char **argv) {
     unordered_map<string, LSHTab> ht_lookup;
     unordered_map<string, string> id_to_path_ht;
     for (size_t i = 0; i < hash_table_files.size(); ++i) {
-      std::ifstream ht_in(hash_table_files[i].c_str());
+      CompressedInputStream ht_in(hash_table_files[i]);
       if (!ht_in)
         throw SMITHLABException("bad hash table file: " +
                                 hash_table_files[i]);
@@ -36,8 +36,10 @@
 #include "RegularNearestNeighborGraph.hpp"
 
 #include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
 #include "LSHAngleHashTable.hpp"
 #include "LSHAngleHashFunction.hpp"
+#include "QueryEngine.hpp"
 
 using std::string;
 using std::vector;
@@ -55,101 +57,6 @@ typedef LSHAngleHashFunction LSHFun;
 
 size_t comparisons = 0;
 
-struct Result {
-  Result(const string &i, const double v) : id(i), val(v) {}
-  Result() : val(std::numeric_limits<double>::max()) {}
-  bool operator<(const Result &other) const {return val < other.val;}
-  string id;
-  double val;
-};
-
-
-std::ostream &
-operator<<(std::ostream &os, const Result &r) {
-  return os << r.id << '\t' << r.val;
-}
-
-
-static void
-evaluate_candidates(const unordered_map<string, FeatureVector> &fvs,
-                    const FeatureVector &query,
-                    const size_t n_neighbors,
-                    const double max_proximity_radius,
-                    const unordered_set<string> &candidates,
-                    vector<Result> &results) {
-
-  std::priority_queue<Result, vector<Result>, std::less<Result> > pq;
-  double current_dist_cutoff = max_proximity_radius;
-  for (unordered_set<string>::const_iterator i(candidates.begin());
-       i != candidates.end(); ++i) {
-    const FeatureVector fv(fvs.find(*i)->second);
-    const double dist = query.compute_angle(fv);
-    ++comparisons;
-    if (dist < current_dist_cutoff) {
-      if (pq.size() == n_neighbors) 
-        pq.pop();
-      pq.push(Result(*i, dist));
-
-      if(pq.size() == n_neighbors)
-        current_dist_cutoff = pq.top().val;
-    }
-  }
-
-  results.clear();
-  while (!pq.empty()) {
-    results.push_back(pq.top());
-    pq.pop();
-  }
-  reverse(results.begin(), results.end());
-}
-
-
-static void
-execute_query(const unordered_map<string, FeatureVector> &fvs,
-              const unordered_map<string, LSHFun> &hfs,
-              const unordered_map<string, LSHTab> &hts,
-              RegularNearestNeighborGraph &g,
-              const FeatureVector &query,
-              const size_t n_neighbors,
-              const double max_proximity_radius,
-              vector<Result> &results) {
-
-  unordered_set<string> candidates;
-
-  // iterate over hash tables
-  for (unordered_map<string, LSHTab>::const_iterator i(hts.begin());
-       i != hts.end(); ++i) {
-
-    unordered_map<string, LSHFun>::const_iterator hf(hfs.find(i->first));
-    assert(hf != hfs.end());
-
-    // hash the query
-    const size_t bucket_number = hf->second(query);
-    ++comparisons;
-    unordered_map<size_t, vector<string> >::const_iterator
-      bucket = i->second.find(bucket_number);
-
-    if (bucket != i->second.end())
-      candidates.insert(bucket->second.begin(), bucket->second.end());
-  }
-
-  // gather neighbors of candidates
-  unordered_set<string> candidates_from_graph;
-  for (unordered_set<string>::const_iterator i(candidates.begin());
-       i != candidates.end(); ++i) {
-    vector<string> neighbors;
-    vector<double> neighbor_dists;
-    g.get_neighbors(*i, neighbors, neighbor_dists);
-
-    candidates_from_graph.insert(neighbors.begin(), neighbors.end());
-  }
-
-  candidates.insert(candidates_from_graph.begin(), candidates_from_graph.end());
-
-  evaluate_candidates(fvs, query, n_neighbors,
-                      max_proximity_radius, candidates, results);
-}
-
 
 /*
  * Config file has this structure:
@@ -200,7 +107,7 @@ get_queries(const string &queries_file, vector<FeatureVector> &queries) {
 
   for(size_t i = 0; i < query_files.size(); ++i) {
     FeatureVector fv;
-    std::ifstream in(query_files[i].c_str());
+    CompressedInputStream in(query_files[i]);
     if (!in)
       throw SMITHLABException("bad feature vector file: " + query_files[i]);
     in >> fv;
@@ -220,7 +127,7 @@ get_database(const bool VERBOSE, const string &db_file,
 
   for(size_t i = 0; i < fv_files.size(); ++i) {
     FeatureVector fv;
-    std::ifstream in(fv_files[i].c_str());
+    CompressedInputStream in(fv_files[i]);
     if (!in)
       throw SMITHLABException("bad feature vector file: " + fv_files[i]);
     in >> fv;
@@ -254,6 +161,8 @@ main(int argc, const char **argv) {
     bool VERBOSE = false;
     size_t n_neighbors = 1;
     double max_proximity_radius = 0.75;
+    size_t beam_width = 0;
+    size_t n_probes = 1;
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "batch query an amordad "
@@ -263,6 +172,11 @@ main(int argc, const char **argv) {
                       false, n_neighbors);
     opt_parse.add_opt("mpr", 'r', "maximum proximity radius",
                       false, max_proximity_radius);
+    opt_parse.add_opt("ef", 'e', "beam width for best-first graph search; "
+                      "0 expands one hop from the buckets (default: 0)",
+                      false, beam_width);
+    opt_parse.add_opt("probes", 'T', "buckets probed per hash table "
+                      "(default: 1)", false, n_probes);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -317,7 +231,7 @@ main(int argc, const char **argv) {
     ////// READING THE GRAPH ///////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////
 
-    std::ifstream g_in(graph_file.c_str());
+    CompressedInputStream g_in(graph_file);
     if (!g_in)
       throw SMITHLABException("cannot load graph: " + graph_file);
 
@@ -338,7 +252,7 @@ main(int argc, const char **argv) {
     //loading hash functions
     unordered_map<string, LSHFun> hf_lookup;
     for (size_t i = 0; i < hash_function_files.size(); ++i) {
-      std::ifstream hf_in(hash_function_files[i].c_str());
+      CompressedInputStream hf_in(hash_function_files[i]);
       if (!hf_in)
         throw SMITHLABException("bad hash function file: " +
                                 hash_function_files[i]);
@@ -358,7 +272,7 @@ main(int argc, const char **argv) {
 
     unordered_map<string, LSHTab> ht_lookup;
     for (size_t i = 0; i < hash_table_files.size(); ++i) {
-      std::ifstream ht_in(hash_table_files[i].c_str());
+      CompressedInputStream ht_in(hash_table_files[i]);
       if (!ht_in)
         throw SMITHLABException("bad hash table file: " +
                                 hash_table_files[i]);
@@ -388,8 +302,16 @@ main(int argc, const char **argv) {
     // "n" query points requires a "n*t" results
     vector<vector<Result> > results(queries.size());
     for (size_t i = 0; i < queries.size(); ++i) {
-      execute_query(fv_lookup, hf_lookup, ht_lookup, nng, queries[i],
-                    n_neighbors, max_proximity_radius, results[i]);
+      RequestProfile profile;
+      if (beam_width > 0)
+        execute_beam_query(fv_lookup, hf_lookup, ht_lookup, nng, queries[i],
+                           n_neighbors, max_proximity_radius, beam_width,
+                           n_probes, QueryBudget(), profile, results[i]);
+      else
+        execute_query(fv_lookup, hf_lookup, ht_lookup, nng, queries[i],
+                      n_neighbors, max_proximity_radius, n_probes,
+                      profile, results[i]);
+      comparisons += profile.candidates;
       if (VERBOSE)
         cerr << '\r' << "processing queries: "
              << percent(i, queries.size()) << "%\r";
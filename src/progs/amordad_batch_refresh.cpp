@@ -21,6 +21,7 @@
 #include <vector>
 #include <algorithm>
 #include <unordered_set>
+#include <memory>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
@@ -28,7 +29,9 @@
 
 #include "RegularNearestNeighborGraph.hpp"
 #include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
 #include "LSHAngleHashTable.hpp"
+#include "ComparedPairFilter.hpp"
 
 using std::string;
 using std::vector;
@@ -60,7 +63,7 @@ load_feature_vectors(const bool VERBOSE,
   
   fvs.clear();
   for (size_t i = 0; i < filenames.size(); ++i) {
-    std::ifstream in(filenames[i].c_str());
+    CompressedInputStream in(filenames[i]);
     if (!in)
       throw SMITHLABException("problem reading: " + filenames[i]);
     
@@ -89,7 +92,7 @@ load_hash_tables(const string &hash_tables_file,
   hts.clear();
   string filename;
   while (ht_filenames_in >> filename) {
-    ifstream in(filename.c_str());
+    CompressedInputStream in(filename);
     if (!in)
       throw SMITHLABException("problem reading: " + filename);
     
@@ -100,11 +103,17 @@ load_hash_tables(const string &hash_tables_file,
 }
 
 
-static void
+/* compares all pairs in the bucket that the filter (if any) has not
+ * seen compared, returning the number of pairs skipped
+ */
+static size_t
 add_relations_from_bucket(const vector<string> &bucket, 
                           const FeatVecLookup &featvecs,
+                          ComparedPairFilter *compared,
                           RegularNearestNeighborGraph &nng) {
   
+  size_t n_skipped = 0;
+  
   // iterate over bucket
   for (size_t i = 0; i < bucket.size(); ++i) {
     FeatVecLookup::const_iterator ii(featvecs.find(bucket[i]));
@@ -116,6 +125,12 @@ add_relations_from_bucket(const vector<string> &bucket,
       assert(jj != featvecs.end());
 
 
+      // skip pairs already compared for an earlier hash table
+      if (compared != 0 && compared->check_and_insert(bucket[i], bucket[j])) {
+        ++n_skipped;
+        continue;
+      }
+
       // compare and update graph
       const double w = ii->second.compute_angle(jj->second);
 
@@ -123,6 +138,7 @@ add_relations_from_bucket(const vector<string> &bucket,
       nng.update_vertex(bucket[i], bucket[j], w);
     }
   }
+  return n_skipped;
 }
 
 
@@ -134,6 +150,10 @@ main(int argc, const char **argv) {
     bool VERBOSE = false;
 
     string outfile;
+    size_t split_load = 0;
+    size_t split_bits = 4;
+    size_t filter_capacity = 0;
+    double filter_fp_rate = 0.01;
     
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
@@ -141,6 +161,17 @@ main(int argc, const char **argv) {
                            "<feat-vecs> <hash-tables> <graph-file>");
     opt_parse.add_opt("out", 'o', "output file (default: stdout)", 
                       true, outfile);
+    opt_parse.add_opt("split", 'S', "split buckets holding more than this "
+                      "many vectors (default: never)", false, split_load);
+    opt_parse.add_opt("splitbits", 'B', "hyperplane bits added in each "
+                      "bucket split (default: 4)", false, split_bits);
+    opt_parse.add_opt("filter", 'f', "pairs remembered as compared across "
+                      "hash tables, skipping their comparisons "
+                      "(default: 0, disabled)", false, filter_capacity);
+    opt_parse.add_opt("filterfp", 'F', "false positive rate of the compared "
+                      "pair filter: this fraction of pairs never compared "
+                      "are skipped, losing their edges (default: 0.01)",
+                      false, filter_fp_rate);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     
     vector<string> leftover_args;
@@ -183,7 +214,7 @@ main(int argc, const char **argv) {
     ////// READING THE GRAPH ///////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////
 
-    std::ifstream g_in(graph_file.c_str());
+    CompressedInputStream g_in(graph_file);
     if (!g_in)
       throw SMITHLABException("cannot load graph: " + graph_file);
 
@@ -200,16 +231,33 @@ main(int argc, const char **argv) {
            << "[edges=" << nng.get_edge_count() << "]"
            << "[max_degree=" << nng.get_maximum_degree() << "]" << endl;
 
+    // pairs sharing a bucket in several tables are compared only once
+    std::unique_ptr<ComparedPairFilter> compared;
+    if (filter_capacity > 0)
+      compared.reset(new ComparedPairFilter(filter_capacity, filter_fp_rate));
+
     // iterate over hash tables
+    size_t n_split_buckets = 0, n_splits = 0, n_skipped = 0;
     for (size_t i = 0; i < hts.size(); ++i) {
       if (VERBOSE)
         cerr << '\r' << "hashing: " << percent(i, hts.size()) << "%\r";
-      // iterate over buckets
-      for (BucketMap::const_iterator j(hts[i].begin()); j != hts[i].end(); ++j)
-        add_relations_from_bucket(j->second, featvecs, nng);
+      // split overloaded buckets, then iterate over the leaf buckets
+      n_splits += hts[i].split_overloaded_buckets(featvecs, split_load,
+                                                  split_bits);
+      n_split_buckets += hts[i].get_split_stats().split_buckets;
+      vector<const vector<string> *> leaves;
+      hts[i].get_leaf_buckets(leaves);
+      for (size_t j = 0; j < leaves.size(); ++j)
+        n_skipped += add_relations_from_bucket(*leaves[j], featvecs,
+                                               compared.get(), nng);
     }
     if (VERBOSE)
       cerr << '\r' << "hashing: 100%" << endl;
+    if (VERBOSE && split_load > 0)
+      cerr << "split buckets: " << n_split_buckets << endl
+           << "splits: " << n_splits << endl;
+    if (VERBOSE && compared)
+      cerr << "skipped comparisons: " << n_skipped << endl;
     
     //Finally: write the graph on the outfile.
     std::ofstream of;
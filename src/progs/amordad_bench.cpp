@@ -0,0 +1,518 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <unordered_set>
+#include <unordered_map>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <queue>
+#include <chrono>
+#include <memory>
+
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "RegularNearestNeighborGraph.hpp"
+#include "FeatureVector.hpp"
+#include "LSHAngleHashTable.hpp"
+#include "LSHAngleHashFunction.hpp"
+#include "ExactNeighborSearch.hpp"
+#include "ComparedPairFilter.hpp"
+#include "QueryResultCache.hpp"
+#include "FeatureProjection.hpp"
+#include "QueryEngine.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+using std::pair;
+using std::make_pair;
+using std::queue;
+
+using std::unordered_map;
+using std::unordered_set;
+
+typedef LSHAngleHashTable LSHTab;
+typedef LSHAngleHashFunction LSHFun;
+typedef std::chrono::steady_clock bench_clock;
+
+
+static double
+seconds_since(const bench_clock::time_point &start) {
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+
+/*
+ * Synthetic metagenome-like vectors: each belongs to one of the
+ * clusters, whose centers are standard normal, and is its center plus
+ * normal noise of the given spread. Vectors are normalized as the
+ * server normalizes the vectors it reads.
+ */
+class ClusteredVectorSource {
+public:
+  ClusteredVectorSource(const size_t n_clusters, const size_t n_features,
+                        const double sd, const size_t seed) :
+    spread(sd), rng(gsl_rng_alloc(gsl_rng_mt19937)) {
+    gsl_rng_set(rng, seed);
+    centers.resize(n_clusters, vector<double>(n_features));
+    for (size_t i = 0; i < n_clusters; ++i)
+      for (size_t j = 0; j < n_features; ++j)
+        centers[i][j] = gsl_ran_gaussian(rng, 1.0);
+  }
+  ~ClusteredVectorSource() {gsl_rng_free(rng);}
+
+  FeatureVector next(const string &id) {
+    const vector<double> &center =
+      centers[gsl_rng_uniform_int(rng, centers.size())];
+    vector<double> values(center.size());
+    for (size_t j = 0; j < values.size(); ++j)
+      values[j] = center[j] + gsl_ran_gaussian(rng, spread);
+    FeatureVector fv(id, std::move(values));
+    fv.normalize();
+    return fv;
+  }
+  size_t uniform(const size_t n) {return gsl_rng_uniform_int(rng, n);}
+
+private:
+  double spread;
+  gsl_rng *rng;
+  vector<vector<double> > centers;
+};
+
+
+/* latencies of one kind of operation, summarized as JSON; queries
+ * also report recall, and how many were cut short by the budget or
+ * answered from the cache */
+struct PhaseStats {
+  PhaseStats() : total_seconds(0.0), recall(-1.0), incomplete(0), cached(0) {}
+  vector<double> latencies;
+  double total_seconds;
+  double recall;
+  size_t incomplete;
+  size_t cached;
+
+  void add(const double seconds) {
+    latencies.push_back(seconds);
+    total_seconds += seconds;
+  }
+  string tojson() const;
+};
+
+
+static double
+percentile(const vector<double> &sorted, const double p) {
+  if (sorted.empty())
+    return 0.0;
+  const size_t rank = static_cast<size_t>(std::ceil(p*sorted.size()));
+  return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+
+string
+PhaseStats::tojson() const {
+  vector<double> sorted(latencies);
+  sort(sorted.begin(), sorted.end());
+  std::ostringstream oss;
+  oss.precision(6);
+  oss << "{\"count\": " << sorted.size()
+      << ", \"seconds\": " << total_seconds
+      << ", \"per_second\": "
+      << ((total_seconds > 0.0) ? sorted.size()/total_seconds : 0.0)
+      << ", \"mean\": "
+      << (sorted.empty() ? 0.0 : total_seconds/sorted.size())
+      << ", \"p50\": " << percentile(sorted, 0.50)
+      << ", \"p90\": " << percentile(sorted, 0.90)
+      << ", \"p99\": " << percentile(sorted, 0.99)
+      << ", \"max\": " << (sorted.empty() ? 0.0 : sorted.back());
+  if (recall >= 0.0)
+    oss << ", \"recall\": " << recall
+        << ", \"incomplete\": " << incomplete
+        << ", \"cached\": " << cached;
+  oss << "}";
+  return oss.str();
+}
+
+
+/* a new hash function and table whose buckets update the graph;
+ * returns the comparisons the filter (if any) skipped */
+static size_t
+make_hash_table(const FeatVecLookup &fvs, const string &id,
+                const size_t n_features, const size_t n_bits,
+                const size_t split_load, const size_t split_bits,
+                const uint64_t seed, const string &family,
+                RegularNearestNeighborGraph &g, ComparedPairFilter *compared,
+                LSHFun &hf, LSHTab &ht) {
+  hf = LSHFun(id, "FEATURES", n_features, n_bits,
+              derive_hash_seed(seed, id), family);
+  build_hash_table(fvs, hf, split_load, split_bits, ht);
+  vector<Edge> added_edges;
+  return add_relations_from_table(ht, fvs, g, compared, added_edges);
+}
+
+
+/*
+ * Times every query, run as the server runs it, and measures recall@k
+ * against an exact search of the current database; the exact search
+ * is not timed.
+ */
+static void
+run_queries(const FeatVecLookup &fvs,
+            const unordered_map<string, LSHFun> &hfs,
+            const unordered_map<string, LSHTab> &hts,
+            RegularNearestNeighborGraph &g,
+            const vector<FeatureVector> &queries,
+            const QuerySettings &settings, QueryResultCache *cache,
+            const size_t n_threads, PhaseStats &stats) {
+
+  vector<FeatureVector> database;
+  for (FeatVecLookup::const_iterator i(fvs.begin()); i != fvs.end(); ++i)
+    database.push_back(i->second);
+  const ExactNeighborSearch exact(database, n_threads);
+  vector<vector<ExactNeighbor> > truth;
+  exact.query(queries, settings.n_neighbors,
+              settings.max_proximity_radius, truth);
+
+  const FeatVecLookup no_full_fvs;
+  const FeatureProjection no_projection;
+  size_t found = 0, expected = 0;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    const bench_clock::time_point start(bench_clock::now());
+    RequestProfile profile;
+    vector<Result> results;
+    bool from_cache = false;
+    const bool complete =
+      execute_search(fvs, no_full_fvs, no_projection, hfs, hts, g,
+                     queries[i], settings, cache, profile, results,
+                     from_cache);
+    stats.add(seconds_since(start));
+    stats.incomplete += !complete;
+    stats.cached += from_cache;
+
+    unordered_set<string> reported;
+    for (size_t j = 0; j < results.size(); ++j)
+      reported.insert(results[j].id);
+    for (size_t j = 0; j < truth[i].size(); ++j)
+      found += reported.count(exact.get_id(truth[i][j].second));
+    expected += truth[i].size();
+  }
+  stats.recall = (expected == 0) ? 1.0 :
+    static_cast<double>(found)/expected;
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+
+    // synthetic data
+    size_t n_vectors = 10000;
+    size_t n_features = 64;
+    size_t n_clusters = 100;
+    double spread = 0.5;
+    size_t seed = 1;
+
+    // index parameters
+    size_t n_tables = 8;
+    size_t n_bits = 12;
+    string family = "gaussian";
+    size_t max_degree = 10;
+    size_t split_load = 0;
+    size_t split_bits = 4;
+
+    // workload
+    size_t n_queries = 200;
+    size_t n_updates = 200;
+    size_t n_refreshes = 2;
+    size_t n_neighbors = 10;
+    size_t n_probes = 1;
+    size_t n_threads = 1;
+
+    // search settings, as the server takes them
+    size_t beam_width = 0;
+    QueryBudget budget;
+    size_t filter_capacity = 0;
+    double filter_fp_rate = 0.01;
+    size_t cache_capacity = 0;
+
+    string outfile;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "benchmark query, insert, "
+                           "delete and refresh on synthetic clustered "
+                           "vectors, reporting JSON");
+    opt_parse.add_opt("output", 'o', "output file (default: stdout)",
+                      false, outfile);
+    opt_parse.add_opt("vectors", 'n', "vectors in the database "
+                      "(default: 10000)", false, n_vectors);
+    opt_parse.add_opt("dim", 'd', "features per vector (default: 64)",
+                      false, n_features);
+    opt_parse.add_opt("clusters", 'k', "clusters the vectors are drawn "
+                      "from (default: 100)", false, n_clusters);
+    opt_parse.add_opt("spread", 's', "standard deviation within a cluster "
+                      "(default: 0.5)", false, spread);
+    opt_parse.add_opt("seed", 'S', "random seed for data and hash "
+                      "functions (default: 1)", false, seed);
+    opt_parse.add_opt("tables", 't', "hash tables (default: 8)",
+                      false, n_tables);
+    opt_parse.add_opt("bits", 'b', "bits in hash value (default: 12)",
+                      false, n_bits);
+    opt_parse.add_opt("family", 'a', "hyperplanes: gaussian or hadamard "
+                      "(default: gaussian)", false, family);
+    opt_parse.add_opt("deg", 'D', "max out degree of graph (default: 10)",
+                      false, max_degree);
+    opt_parse.add_opt("split", 'L', "split buckets holding more than this "
+                      "many vectors (default: never)", false, split_load);
+    opt_parse.add_opt("queries", 'q', "queries per query phase "
+                      "(default: 200)", false, n_queries);
+    opt_parse.add_opt("updates", 'u', "insertions and deletions "
+                      "(default: 200)", false, n_updates);
+    opt_parse.add_opt("refreshes", 'r', "refreshes (default: 2)",
+                      false, n_refreshes);
+    opt_parse.add_opt("neighbors", 'N', "neighbors per query (default: 10)",
+                      false, n_neighbors);
+    opt_parse.add_opt("probes", 'T', "buckets probed per hash table "
+                      "(default: 1)", false, n_probes);
+    opt_parse.add_opt("threads", 'x', "threads for the exact search "
+                      "(default: 1)", false, n_threads);
+    opt_parse.add_opt("ef", 'e', "beam width for best-first graph search; "
+                      "0 expands one hop from the buckets (default: 0)",
+                      false, beam_width);
+    opt_parse.add_opt("candidates", 'c', "most candidates scored per query "
+                      "(default: unlimited)", false, budget.max_candidates);
+    opt_parse.add_opt("maxload", 'l', "most members taken from one bucket "
+                      "per query (default: unlimited)", false,
+                      budget.max_bucket_load);
+    opt_parse.add_opt("millis", 'm', "time budget per query in "
+                      "milliseconds (default: unlimited)", false,
+                      budget.max_millis);
+    opt_parse.add_opt("filter", 'f', "pairs remembered as compared between "
+                      "refreshes, 0 to disable (default: 0)", false,
+                      filter_capacity);
+    opt_parse.add_opt("filterfp", 'F', "false positive rate of the compared "
+                      "pair filter (default: 0.01)", false, filter_fp_rate);
+    opt_parse.add_opt("cache", 'C', "query results to cache, 0 to disable "
+                      "(default: 0)", false, cache_capacity);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    if (n_tables == 0 || n_vectors == 0 || n_clusters == 0)
+      throw SMITHLABException("need vectors, clusters and hash tables");
+    if (n_updates > n_vectors)
+      throw SMITHLABException("more deletions than vectors");
+
+    ClusteredVectorSource source(n_clusters, n_features, spread, seed);
+
+    FeatVecLookup fvs;
+    for (size_t i = 0; i < n_vectors; ++i) {
+      const FeatureVector fv(source.next("V" + toa(i)));
+      fvs[fv.get_id()] = fv;
+    }
+    vector<FeatureVector> queries, insertions;
+    for (size_t i = 0; i < n_queries; ++i)
+      queries.push_back(source.next("Q" + toa(i)));
+    for (size_t i = 0; i < n_updates; ++i)
+      insertions.push_back(source.next("I" + toa(i)));
+    vector<string> deletions;
+    vector<string> ids;
+    for (size_t i = 0; i < n_vectors; ++i)
+      ids.push_back("V" + toa(i));
+    for (size_t i = 0; i < n_updates; ++i) {
+      std::swap(ids[i], ids[i + source.uniform(ids.size() - i)]);
+      deletions.push_back(ids[i]);
+    }
+
+    QuerySettings settings;
+    settings.n_neighbors = n_neighbors;
+    settings.max_proximity_radius = M_PI;
+    settings.beam_width = beam_width;
+    settings.n_probes = n_probes;
+    settings.budget = budget;
+
+    std::unique_ptr<ComparedPairFilter> compared;
+    if (filter_capacity > 0)
+      compared.reset(new ComparedPairFilter(filter_capacity, filter_fp_rate));
+    QueryResultCache cache(cache_capacity);
+    QueryResultCache *const cache_used = (cache_capacity > 0) ? &cache : 0;
+
+    /**************** BUILD **************************************/
+    if (VERBOSE)
+      cerr << "building " << n_tables << " tables over "
+           << n_vectors << " vectors" << endl;
+    bench_clock::time_point start(bench_clock::now());
+    RegularNearestNeighborGraph g("BENCH", max_degree);
+    for (FeatVecLookup::const_iterator i(fvs.begin()); i != fvs.end(); ++i)
+      g.add_vertex(i->first);
+    unordered_map<string, LSHFun> hfs;
+    unordered_map<string, LSHTab> hts;
+    queue<string> hf_queue;
+    for (size_t i = 0; i < n_tables; ++i) {
+      const string id = toa(i);
+      make_hash_table(fvs, id, n_features, n_bits, split_load, split_bits,
+                      seed, family, g, compared.get(), hfs[id], hts[id]);
+      hf_queue.push(id);
+      if (VERBOSE)
+        cerr << "\rbuilding tables: " << percent(i, n_tables) << "%\r";
+    }
+    const double build_seconds = seconds_since(start);
+    if (VERBOSE)
+      cerr << "building tables: 100% (" << build_seconds << "s)" << endl;
+
+    /**************** WORKLOAD ***********************************/
+    // the second round of queries repeats the first, so with a cache
+    // it measures queries answered from it
+    PhaseStats query_stats, repeat_stats;
+    run_queries(fvs, hfs, hts, g, queries, settings, cache_used,
+                n_threads, query_stats);
+    run_queries(fvs, hfs, hts, g, queries, settings, cache_used,
+                n_threads, repeat_stats);
+    if (VERBOSE)
+      cerr << "queries: recall=" << query_stats.recall << endl;
+
+    // as in the server, every update invalidates the cached results
+    size_t fv_bytes = 0;
+    for (FeatVecLookup::const_iterator i(fvs.begin()); i != fvs.end(); ++i)
+      fv_bytes += vector_entry_bytes(i->first, i->second);
+    vector<Result> neighbors;
+    vector<pair<string, size_t> > buckets;
+
+    PhaseStats insert_stats;
+    for (size_t i = 0; i < insertions.size(); ++i) {
+      start = bench_clock::now();
+      cache.invalidate();
+      RequestProfile profile;
+      insert_into_index(fvs, fv_bytes, hfs, hts, g, compared.get(),
+                        insertions[i], profile, neighbors, buckets);
+      insert_stats.add(seconds_since(start));
+    }
+
+    PhaseStats delete_stats;
+    for (size_t i = 0; i < deletions.size(); ++i) {
+      const FeatureVector fv(fvs.find(deletions[i])->second);
+      start = bench_clock::now();
+      cache.invalidate();
+      RequestProfile profile;
+      remove_from_index(fvs, fv_bytes, hfs, hts, g, compared.get(), fv,
+                        profile, buckets);
+      delete_stats.add(seconds_since(start));
+    }
+
+    // each refresh replaces the oldest table with a new one
+    PhaseStats refresh_stats;
+    size_t n_skipped = 0;
+    for (size_t i = 0; i < n_refreshes; ++i) {
+      const string id = toa(n_tables + i);
+      start = bench_clock::now();
+      cache.invalidate();
+      LSHFun hf;
+      LSHTab ht;
+      n_skipped += make_hash_table(fvs, id, n_features, n_bits, split_load,
+                                   split_bits, seed, family, g,
+                                   compared.get(), hf, ht);
+      replace_oldest_hash_table(hf, ht, hfs, hf_queue, hts);
+      refresh_stats.add(seconds_since(start));
+      if (VERBOSE)
+        cerr << "refresh " << id << ": " << refresh_stats.latencies.back()
+             << "s" << endl;
+    }
+
+    PhaseStats requery_stats;
+    run_queries(fvs, hfs, hts, g, queries, settings, cache_used,
+                n_threads, requery_stats);
+    if (VERBOSE)
+      cerr << "queries after updates: recall=" << requery_stats.recall
+           << endl;
+
+    /**************** REPORT *************************************/
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    if (!outfile.empty() && !of)
+      throw SMITHLABException("cannot write to file: " + outfile);
+    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+
+    out << "{\n"
+        << "  \"config\": {\"vectors\": " << n_vectors
+        << ", \"dim\": " << n_features
+        << ", \"clusters\": " << n_clusters
+        << ", \"spread\": " << spread
+        << ", \"seed\": " << seed
+        << ", \"tables\": " << n_tables
+        << ", \"bits\": " << n_bits
+        << ", \"family\": \"" << family << "\""
+        << ", \"deg\": " << max_degree
+        << ", \"split\": " << split_load
+        << ", \"neighbors\": " << n_neighbors
+        << ", \"probes\": " << n_probes
+        << ", \"ef\": " << beam_width
+        << ", \"candidates\": " << budget.max_candidates
+        << ", \"maxload\": " << budget.max_bucket_load
+        << ", \"millis\": " << budget.max_millis
+        << ", \"filter\": " << filter_capacity
+        << ", \"cache\": " << cache_capacity << "},\n"
+        << "  \"build_seconds\": " << build_seconds << ",\n"
+        << "  \"query\": " << query_stats.tojson() << ",\n"
+        << "  \"query_repeated\": " << repeat_stats.tojson() << ",\n"
+        << "  \"insert\": " << insert_stats.tojson() << ",\n"
+        << "  \"delete\": " << delete_stats.tojson() << ",\n"
+        << "  \"refresh\": " << refresh_stats.tojson() << ",\n"
+        << "  \"refresh_skipped\": " << n_skipped << ",\n"
+        << "  \"vector_bytes\": " << fv_bytes << ",\n"
+        << "  \"query_after_updates\": " << requery_stats.tojson() << "\n"
+        << "}" << endl;
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,564 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <functional>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "HttpClient.hpp"
+
+#include "crow.h"
+#include "json.h"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+using std::unordered_map;
+
+
+struct Result {
+  Result(const string &i, const double v) : id(i), val(v) {}
+  bool operator<(const Result &other) const {
+    return val < other.val || (val == other.val && id < other.id);
+  }
+  string id;
+  double val;
+};
+
+
+/* reply of one shard to one request */
+struct ShardReply {
+  ShardReply() : ok(false), millis(0.0) {}
+  bool ok;
+  string error;
+  string body;
+  double millis;
+};
+
+
+/* what the router knows about one shard */
+struct ShardState {
+  ShardState() : known(false), total(0), calls(0), errors(0), inserts(0),
+                 results(0), millis(0.0) {}
+  bool known;      // the shard has reported its total
+  size_t total;    // vectors held, as last reported by the shard
+  size_t calls;
+  size_t errors;
+  size_t inserts;  // inserts routed to this shard
+  size_t results;  // results contributed to merged answers
+  double millis;
+};
+
+
+/* Counters for the quality of merged answers: how many shards had
+ * results in each final top-k, and how often shards were missing.
+ */
+struct RouterStats {
+  RouterStats() : queries(0), incomplete(0), contributing(0) {}
+  size_t queries;
+  size_t incomplete;    // queries missing a shard or a budget ran out
+  size_t contributing;  // sum over queries of shards in the top-k
+  vector<ShardState> shards;
+};
+
+
+// keys of a query reply that are not result ids
+static bool
+is_reply_field(const string &key) {
+  return key == "total" || key == "time" || key == "id" ||
+    key == "complete" || key == "error";
+}
+
+
+static void
+call_shard(const ServerAddress &server, const string &target,
+           const size_t timeout_millis, ShardReply &reply) {
+  const std::chrono::time_point<std::chrono::steady_clock>
+    start(std::chrono::steady_clock::now());
+  try {
+    const int status = http_get(server, target, timeout_millis, reply.body);
+    reply.ok = (status == 200);
+    if (!reply.ok)
+      reply.error = "HTTP status " + toa(status);
+  }
+  catch (const SMITHLABException &e) {
+    reply.ok = false;
+    reply.error = e.what();
+  }
+  const std::chrono::duration<double, std::milli>
+    elapsed(std::chrono::steady_clock::now() - start);
+  reply.millis = elapsed.count();
+}
+
+
+/* sends the same request to every shard at once */
+static void
+scatter(const vector<ServerAddress> &shards, const string &target,
+        const size_t timeout_millis, vector<ShardReply> &replies) {
+  replies.assign(shards.size(), ShardReply());
+  vector<std::thread> callers;
+  for (size_t i = 1; i < shards.size(); ++i)
+    callers.push_back(std::thread(call_shard, std::cref(shards[i]),
+                                  std::cref(target), timeout_millis,
+                                  std::ref(replies[i])));
+  call_shard(shards[0], target, timeout_millis, replies[0]);
+  for (size_t i = 0; i < callers.size(); ++i)
+    callers[i].join();
+}
+
+
+/* reads a shard reply; shards report failures in an "error" field */
+static bool
+parse_reply(ShardReply &reply, crow::json::rvalue &json) {
+  if (!reply.ok)
+    return false;
+  json = crow::json::load(reply.body);
+  if (!json) {
+    reply.ok = false;
+    reply.error = "bad JSON reply";
+  }
+  else if (json.has("error")) {
+    reply.ok = false;
+    reply.error = string(json["error"]);
+  }
+  return reply.ok;
+}
+
+
+/* appends the query parameters given to the router, if present */
+static string
+forward_params(const crow::request &req, const char *names[],
+               const size_t n_names) {
+  string params;
+  for (size_t i = 0; i < n_names; ++i)
+    if (req.url_params.get(names[i]) != 0)
+      params += string("&") + names[i] + "=" +
+        url_encode(req.url_params.get(names[i]));
+  return params;
+}
+
+
+static void
+record_reply(const ShardReply &reply, ShardState &shard) {
+  ++shard.calls;
+  shard.millis += reply.millis;
+  if (!reply.ok)
+    ++shard.errors;
+}
+
+
+/* asks every shard whose total is not known for its status; inserts
+ * are balanced by these totals, so they must not start from 0 */
+static void
+read_shard_totals(const vector<ServerAddress> &shards,
+                  const size_t timeout_millis, std::mutex &stats_mutex,
+                  RouterStats &stats) {
+  vector<ShardReply> replies;
+  scatter(shards, "/status", timeout_millis, replies);
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  for (size_t i = 0; i < replies.size(); ++i) {
+    crow::json::rvalue json;
+    if (parse_reply(replies[i], json) && json.has("total") &&
+        json["total"].t() == crow::json::type::Number) {
+      stats.shards[i].total = static_cast<size_t>(json["total"].d());
+      stats.shards[i].known = true;
+    }
+  }
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    string shard_list;
+    size_t PORT = 18090;
+    size_t n_neighbors = 10;
+    size_t timeout_millis = 10000;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]),
+                           "routes amordad requests over several shard "
+                           "servers, merging their query results");
+    opt_parse.add_opt("shards", 's', "comma separated host:port of the "
+                      "shard servers", true, shard_list);
+    opt_parse.add_opt("PORT", 'P', "Port for the router to run at "
+                      "(Default: 18090)", false, PORT);
+    opt_parse.add_opt("neighbors", 'N', "number of nearest neighbors to "
+                      "report (Default: 10)", false, n_neighbors);
+    opt_parse.add_opt("timeout", 't', "milliseconds to wait for a shard "
+                      "(Default: 10000)", false, timeout_millis);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (!leftover_args.empty()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    vector<ServerAddress> shards;
+    parse_server_addresses(shard_list, shards);
+    if (shards.empty())
+      throw SMITHLABException("no shard servers given");
+    if (VERBOSE)
+      for (size_t i = 0; i < shards.size(); ++i)
+        cerr << "shard " << i << ": " << shards[i].tostring() << endl;
+
+    RouterStats stats;
+    stats.shards.resize(shards.size());
+    std::mutex stats_mutex;
+    read_shard_totals(shards, timeout_millis, stats_mutex, stats);
+    if (VERBOSE)
+      for (size_t i = 0; i < shards.size(); ++i)
+        cerr << "shard " << i << " total: "
+             << (stats.shards[i].known ? toa(stats.shards[i].total) :
+                 string("unknown")) << endl;
+
+    crow::SimpleApp app;
+    CROW_ROUTE(app, "/")
+    ([]() {
+     return "Amordad Router";
+     });
+
+
+    CROW_ROUTE(app, "/query")
+    ([&](const crow::request &req) {
+
+      crow::json::wvalue ret;
+
+      try {
+        if (req.url_params.get("path") == 0)
+          throw SMITHLABException("invalid file path");
+        static const char *params[] = {"ef", "probes", "candidates",
+                                       "maxload", "millis"};
+        const string target = "/query?path=" +
+          url_encode(req.url_params.get("path")) +
+          forward_params(req, params, sizeof(params)/sizeof(params[0]));
+
+        std::chrono::time_point<std::chrono::system_clock> start, end;
+        start = std::chrono::system_clock::now();
+        vector<ShardReply> replies;
+        scatter(shards, target, timeout_millis, replies);
+
+        // merge the top-k lists; every shard holds different vectors
+        vector<Result> merged;
+        vector<size_t> owner;
+        bool complete = true;
+        size_t total = 0, n_answered = 0;
+        string query_id;
+        vector<size_t> totals(shards.size(), 0);
+        for (size_t i = 0; i < replies.size(); ++i) {
+          crow::json::rvalue json;
+          if (!parse_reply(replies[i], json)) {
+            complete = false;
+            if (VERBOSE)
+              cerr << "shard " << shards[i].tostring() << ": "
+                   << replies[i].error << endl;
+            continue;
+          }
+          ++n_answered;
+          totals[i] = static_cast<size_t>(json["total"].d());
+          total += totals[i];
+          if (json.has("complete") &&
+              json["complete"].t() == crow::json::type::False)
+            complete = false;
+          if (query_id.empty() && json.has("id"))
+            query_id = string(json["id"]);
+          for (const crow::json::rvalue *r = json.begin();
+               r != json.end(); ++r)
+            if (!is_reply_field(r->key()) &&
+                r->t() == crow::json::type::Number) {
+              merged.push_back(Result(r->key(), r->d()));
+              owner.push_back(i);
+            }
+        }
+        if (n_answered == 0)
+          throw SMITHLABException("no shard answered the query");
+
+        vector<size_t> order(merged.size());
+        for (size_t i = 0; i < order.size(); ++i)
+          order[i] = i;
+        std::sort(order.begin(), order.end(),
+                  [&merged](const size_t a, const size_t b) {
+                    return merged[a] < merged[b];
+                  });
+        if (order.size() > n_neighbors)
+          order.resize(n_neighbors);
+
+        vector<size_t> contributed(shards.size(), 0);
+        for (size_t i = 0; i < order.size(); ++i) {
+          ret[merged[order[i]].id] = merged[order[i]].val;
+          ++contributed[owner[order[i]]];
+        }
+        const size_t n_contributing =
+          shards.size() - std::count(contributed.begin(),
+                                     contributed.end(), 0);
+
+        end = std::chrono::system_clock::now();
+        std::chrono::duration<double> elapsed = end - start;
+        if (VERBOSE)
+          cerr << "Wall time = " << elapsed.count() << "s\n";
+
+        {
+          std::lock_guard<std::mutex> lock(stats_mutex);
+          ++stats.queries;
+          if (!complete)
+            ++stats.incomplete;
+          stats.contributing += n_contributing;
+          for (size_t i = 0; i < shards.size(); ++i) {
+            record_reply(replies[i], stats.shards[i]);
+            stats.shards[i].results += contributed[i];
+            if (replies[i].ok) {
+              stats.shards[i].total = totals[i];
+              stats.shards[i].known = true;
+            }
+          }
+        }
+
+        ret["total"] = total;
+        ret["time"] = elapsed.count();
+        ret["id"] = query_id;
+        ret["complete"] = complete;
+        return ret;
+      }
+      catch (const SMITHLABException &e) {
+        cerr << e.what() << endl;
+        ret["error"] = e.what();
+        return ret;
+      }
+    });
+
+
+    // each insert goes to the shard holding the fewest vectors
+    CROW_ROUTE(app, "/insert")
+    ([&](const crow::request &req) {
+
+      crow::json::wvalue ret;
+
+      try {
+        if (req.url_params.get("path") == 0)
+          throw SMITHLABException("invalid file path");
+
+        // shards that did not answer at startup are asked again, and
+        // only shards with known totals are chosen while any are known
+        bool all_known = true;
+        {
+          std::lock_guard<std::mutex> lock(stats_mutex);
+          for (size_t i = 0; i < shards.size(); ++i)
+            all_known = all_known && stats.shards[i].known;
+        }
+        if (!all_known)
+          read_shard_totals(shards, timeout_millis, stats_mutex, stats);
+
+        size_t target_shard = 0;
+        {
+          std::lock_guard<std::mutex> lock(stats_mutex);
+          for (size_t i = 1; i < shards.size(); ++i) {
+            const ShardState &a = stats.shards[i];
+            const ShardState &b = stats.shards[target_shard];
+            if ((a.known && !b.known) ||
+                (a.known == b.known &&
+                 (a.total < b.total ||
+                  (a.total == b.total && a.inserts < b.inserts))))
+              target_shard = i;
+          }
+          ++stats.shards[target_shard].inserts;
+        }
+
+        ShardReply reply;
+        call_shard(shards[target_shard], "/insert?path=" +
+                   url_encode(req.url_params.get("path")),
+                   timeout_millis, reply);
+        crow::json::rvalue json;
+        const bool ok = parse_reply(reply, json);
+        {
+          std::lock_guard<std::mutex> lock(stats_mutex);
+          record_reply(reply, stats.shards[target_shard]);
+          if (ok) {
+            stats.shards[target_shard].total =
+              static_cast<size_t>(json["total"].d());
+            stats.shards[target_shard].known = true;
+          }
+        }
+        if (!ok)
+          throw SMITHLABException("shard " +
+                                  shards[target_shard].tostring() +
+                                  ": " + reply.error);
+
+        ret["total"] = static_cast<size_t>(json["total"].d());
+        ret["time"] = json["time"].d();
+        ret["shard"] = shards[target_shard].tostring();
+        return ret;
+      }
+      catch (const SMITHLABException &e) {
+        cerr << e.what() << endl;
+        ret["error"] = e.what();
+        return ret;
+      }
+    });
+
+
+    // the router does not track where vectors live, so every shard
+    // is asked to delete and the ones holding the vector succeed
+    CROW_ROUTE(app, "/delete")
+    ([&](const crow::request &req) {
+
+      crow::json::wvalue ret;
+
+      try {
+        if (req.url_params.get("path") == 0)
+          throw SMITHLABException("invalid file path");
+
+        vector<ShardReply> replies;
+        scatter(shards, "/delete?path=" +
+                url_encode(req.url_params.get("path")),
+                timeout_millis, replies);
+        size_t n_deleted = 0;
+        string errors;
+        for (size_t i = 0; i < replies.size(); ++i) {
+          crow::json::rvalue json;
+          if (parse_reply(replies[i], json)) {
+            ++n_deleted;
+            ret["shard"] = shards[i].tostring();
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            stats.shards[i].total = static_cast<size_t>(json["total"].d());
+            stats.shards[i].known = true;
+          }
+          else
+            errors += shards[i].tostring() + ": " + replies[i].error + "; ";
+        }
+        if (n_deleted == 0)
+          throw SMITHLABException("no shard deleted the vector: " + errors);
+        ret["deleted"] = n_deleted;
+        return ret;
+      }
+      catch (const SMITHLABException &e) {
+        cerr << e.what() << endl;
+        ret["error"] = e.what();
+        return ret;
+      }
+    });
+
+
+    // every shard refreshes its own hash tables and graph
+    CROW_ROUTE(app, "/refresh")
+    ([&]() {
+
+      crow::json::wvalue ret;
+
+      try {
+        vector<ShardReply> replies;
+        scatter(shards, "/refresh", timeout_millis, replies);
+        double max_time = 0.0;
+        size_t n_refreshed = 0;
+        for (size_t i = 0; i < replies.size(); ++i) {
+          crow::json::rvalue json;
+          if (parse_reply(replies[i], json)) {
+            ++n_refreshed;
+            max_time = std::max(max_time, json["time"].d());
+          }
+          else
+            ret["errors"][shards[i].tostring()] = replies[i].error;
+        }
+        ret["refreshed"] = n_refreshed;
+        ret["time"] = max_time;
+        return ret;
+      }
+      catch (const SMITHLABException &e) {
+        cerr << e.what() << endl;
+        ret["error"] = e.what();
+        return ret;
+      }
+    });
+
+
+    // cross-shard quality: how results and load spread over shards
+    CROW_ROUTE(app, "/stats")
+    ([&]() {
+
+      crow::json::wvalue ret;
+      std::lock_guard<std::mutex> lock(stats_mutex);
+
+      ret["queries"] = stats.queries;
+      ret["incomplete"] = stats.incomplete;
+      ret["mean_contributing_shards"] = (stats.queries == 0) ? 0.0 :
+        static_cast<double>(stats.contributing)/stats.queries;
+      size_t all_results = 0;
+      for (size_t i = 0; i < stats.shards.size(); ++i)
+        all_results += stats.shards[i].results;
+      for (size_t i = 0; i < stats.shards.size(); ++i) {
+        const ShardState &s = stats.shards[i];
+        crow::json::wvalue &out = ret["shards"][i];
+        out["address"] = shards[i].tostring();
+        out["total"] = s.total;
+        out["calls"] = s.calls;
+        out["errors"] = s.errors;
+        out["inserts"] = s.inserts;
+        out["result_share"] = (all_results == 0) ? 0.0 :
+          static_cast<double>(s.results)/all_results;
+        out["mean_millis"] = (s.calls == 0) ? 0.0 : s.millis/s.calls;
+      }
+      return ret;
+    });
+
+    app.port(PORT)
+       .multithreaded()
+       .run();
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
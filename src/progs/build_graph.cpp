@@ -21,6 +21,10 @@
 #include <vector>
 #include <algorithm>
 #include <unordered_set>
+#include <memory>
+#include <limits>
+
+#include <sys/resource.h>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
@@ -28,7 +32,11 @@
 
 #include "RegularNearestNeighborGraph.hpp"
 #include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
 #include "LSHAngleHashTable.hpp"
+#include "ComparedPairFilter.hpp"
+#include "FeaturePack.hpp"
+#include "CandidateEdgePartitions.hpp"
 
 using std::string;
 using std::vector;
@@ -40,14 +48,13 @@ using std::unordered_map;
 using std::unordered_set;
 
 
-typedef unordered_map<string, unordered_set<string> > ComparedLookup;
 typedef unordered_map<string, FeatureVector> FeatVecLookup;
 
 
-/* read all feature vectors (fvs)
+/* read all feature vectors (fvs), parsing the files in parallel
  */
 static void
-load_feature_vectors(const bool VERBOSE,
+load_feature_vectors(const bool VERBOSE, const size_t n_threads,
                      const string &feat_vecs_file, FeatVecLookup &fvs) {
   
   ifstream fv_filenames_in(feat_vecs_file.c_str());
@@ -58,54 +65,84 @@ load_feature_vectors(const bool VERBOSE,
   while (fv_filenames_in >> filename)
     filenames.push_back(filename);
   
+  if (VERBOSE)
+    cerr << "loading data: " << filenames.size() << " files" << endl;
+  vector<FeatureVector> loaded;
+  read_feature_vectors(filenames, n_threads, loaded);
   fvs.clear();
-  for (size_t i = 0; i < filenames.size(); ++i) {
-    std::ifstream in(filenames[i].c_str());
-    if (!in)
-      throw SMITHLABException("problem reading: " + filenames[i]);
-    
-    FeatureVector fv;
-    in >> fv;
-    fvs[fv.get_id()] = fv;
-    if (VERBOSE)
-      cerr << '\r' << "loading data: " 
-           << percent(i, filenames.size()) << "%\r";
-  }
+  for (size_t i = 0; i < loaded.size(); ++i)
+    fvs[loaded[i].get_id()] = loaded[i];
   if (VERBOSE)
     cerr << '\r' << "loading data: 100%" << endl;
 }
 
 
-/* reads all hash tables (hts)
+/* reads the names of the hash table files; the tables themselves
+ * are loaded one at a time, so only one is ever held in memory
  */
 static void
-load_hash_tables(const string &hash_tables_file, 
-                 vector<LSHAngleHashTable> &hts) {
+load_hash_table_names(const string &hash_tables_file, 
+                      vector<string> &ht_files) {
   
   ifstream ht_filenames_in(hash_tables_file.c_str());
   if (!ht_filenames_in)
     throw SMITHLABException("problem reading: " + hash_tables_file);
   
-  hts.clear();
+  ht_files.clear();
   string filename;
-  while (ht_filenames_in >> filename) {
-    ifstream in(filename.c_str());
-    if (!in)
-      throw SMITHLABException("problem reading: " + filename);
-    
-    LSHAngleHashTable ht;
-    in >> ht;
-    hts.push_back(ht);
-  }
+  while (ht_filenames_in >> filename)
+    ht_files.push_back(filename);
 }
 
 
 static void
+load_hash_table(const string &filename, LSHAngleHashTable &ht) {
+  CompressedInputStream in(filename);
+  if (!in)
+    throw SMITHLABException("problem reading: " + filename);
+  ht = LSHAngleHashTable();
+  in >> ht;
+}
+
+
+/* peak resident set size of this process, in kilobytes */
+static size_t
+peak_memory_kb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss;
+}
+
+
+/* A shard owns a subset of the buckets of every table, chosen by
+ * hashing the table number and bucket key. Each pair is compared by
+ * the shards owning buckets where it co-occurs, and the partial edge
+ * lists of all shards are merged by merge_graph_shards.
+ */
+struct BucketShard {
+  BucketShard(const size_t s, const size_t n) : shard(s), n_shards(n) {}
+  bool owns(const size_t table, const size_t key) const {
+    return n_shards <= 1 ||
+      ComparedPairFilter::pair_hash(table, key) % n_shards == shard;
+  }
+  size_t shard;
+  size_t n_shards;
+};
+
+
+/* The "compared" structure remembers pairs already compared, either
+ * exactly (ComparedPairSet) or approximately in bounded memory
+ * (ComparedPairFilter); returns the number of comparisons made.
+ */
+template <class T> static size_t
 add_relations_from_bucket(const vector<string> &bucket, 
                           const FeatVecLookup &featvecs,
-                          ComparedLookup &compared, 
+                          T &compared,
                           RegularNearestNeighborGraph &nng) {
   
+  size_t n_compared = 0;
+
   // iterate over bucket
   for (size_t i = 0; i < bucket.size(); ++i) {
     FeatVecLookup::const_iterator ii(featvecs.find(bucket[i]));
@@ -116,23 +153,218 @@ add_relations_from_bucket(const vector<string> &bucket,
       FeatVecLookup::const_iterator jj(featvecs.find(bucket[j]));
       assert(jj != featvecs.end());
       
-      // check if previously compared
-      ComparedLookup::const_iterator c(compared.find(bucket[i]));
-      assert(c != compared.end());
-      if (c->second.find(bucket[j]) == c->second.end()) {
+      // check if previously compared, marking the pair if not
+      if (!compared.check_and_insert(bucket[i], bucket[j])) {
         
         // compare and update graph
         const double w = ii->second.compute_angle(jj->second);
         
         nng.update_vertex(bucket[j], bucket[i], w);
         nng.update_vertex(bucket[i], bucket[j], w);
-        
-        // add them both to "compared"
-        compared[bucket[j]].insert(bucket[i]);
-        compared[bucket[i]].insert(bucket[j]);
+        ++n_compared;
       }
     }
   }
+  return n_compared;
+}
+
+
+template <class T> static void
+add_relations_from_tables(const bool VERBOSE,
+                          const BucketShard &shard,
+                          const vector<string> &ht_files,
+                          const FeatVecLookup &featvecs,
+                          T &compared,
+                          RegularNearestNeighborGraph &nng) {
+
+  size_t n_compared = 0;
+
+  // iterate over hash tables, loading each in turn
+  for (size_t i = 0; i < ht_files.size(); ++i) {
+    if (VERBOSE)
+      cerr << '\r' << "hashing: " << percent(i, ht_files.size()) << "%\r";
+    LSHAngleHashTable ht;
+    load_hash_table(ht_files[i], ht);
+    // iterate over buckets
+    for (BucketMap::const_iterator j(ht.begin()); j != ht.end(); ++j)
+      if (shard.owns(i, j->first))
+        n_compared += add_relations_from_bucket(j->second, featvecs,
+                                                compared, nng);
+  }
+  if (VERBOSE)
+    cerr << '\r' << "hashing: 100%" << endl
+         << "comparisons: " << n_compared << endl
+         << "compared pairs memory: " << compared.memory_bytes()
+         << " bytes" << endl;
+}
+
+
+/* pairs of pack rows held before they are scored, 8 bytes each */
+static const size_t MAX_PENDING_PAIRS = 1 << 22;
+/* bytes of pack rows in one block of the scoring order */
+static const size_t PACK_BLOCK_BYTES = 64 << 20;
+
+
+/* Scores the pairs of rows in blocks of the pack: sorted by the block
+ * of each row, all pairs between two blocks are scored together, so
+ * the mapped pages are read in long runs and each block is paged in
+ * once per batch rather than once per bucket. */
+static void
+score_pending_pairs(const FeaturePack &pack,
+                    vector<std::pair<uint32_t, uint32_t> > &pairs,
+                    CandidateEdgePartitions &candidates) {
+  const size_t block_rows =
+    std::max(PACK_BLOCK_BYTES/(sizeof(double)*
+                               std::max(pack.get_dimension(),
+                                        static_cast<size_t>(1))),
+             static_cast<size_t>(1));
+  std::sort(pairs.begin(), pairs.end(),
+            [block_rows](const std::pair<uint32_t, uint32_t> &x,
+                         const std::pair<uint32_t, uint32_t> &y) {
+              const size_t xa = x.first/block_rows, ya = y.first/block_rows;
+              if (xa != ya)
+                return xa < ya;
+              const size_t xb = x.second/block_rows, yb = y.second/block_rows;
+              return xb < yb || (xb == yb && x < y);
+            });
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    const uint32_t a = pairs[i].first, b = pairs[i].second;
+    const double w = pack.compute_angle(a, b);
+    candidates.add(a, b, w);
+    candidates.add(b, a, w);
+  }
+  pairs.clear();
+}
+
+
+/* Candidate edges from one hash table at a time, between rows of the
+ * mapped feature pack, going to per-partition spill files. Pairs are
+ * gathered from the buckets and scored in batches ordered by row (see
+ * score_pending_pairs), not bucket by bucket, whose rows are scattered
+ * over the pack. The optional filter skips most pairs repeated across
+ * tables; any that remain only produce duplicate candidates, dropped
+ * when selecting.
+ */
+static void
+spill_candidates_from_tables(const bool VERBOSE,
+                             const BucketShard &shard,
+                             const vector<string> &ht_files,
+                             const FeaturePack &pack,
+                             ComparedPairFilter *compared,
+                             CandidateEdgePartitions &candidates) {
+
+  size_t n_compared = 0;
+  vector<uint32_t> members;
+  vector<std::pair<uint32_t, uint32_t> > pairs;
+  for (size_t i = 0; i < ht_files.size(); ++i) {
+    if (VERBOSE)
+      cerr << '\r' << "hashing: " << percent(i, ht_files.size()) << "%\r";
+    LSHAngleHashTable ht;
+    load_hash_table(ht_files[i], ht);
+    for (BucketMap::const_iterator j(ht.begin()); j != ht.end(); ++j) {
+      if (!shard.owns(i, j->first))
+        continue;
+      // ids in the bucket as rows of the pack
+      members.clear();
+      for (size_t k = 0; k < j->second.size(); ++k) {
+        size_t idx = 0;
+        if (!pack.find(j->second[k], idx))
+          throw SMITHLABException("hashed id not in feature pack: " +
+                                  j->second[k]);
+        members.push_back(idx);
+      }
+      for (size_t a = 0; a < members.size(); ++a)
+        for (size_t b = a + 1; b < members.size(); ++b) {
+          if (compared != 0) {
+            const uint64_t h =
+              ComparedPairFilter::pair_hash(members[a], members[b]);
+            if (compared->contains(h))
+              continue;
+            compared->insert(h);
+          }
+          pairs.push_back(std::make_pair(std::min(members[a], members[b]),
+                                         std::max(members[a], members[b])));
+          ++n_compared;
+          if (pairs.size() >= MAX_PENDING_PAIRS)
+            score_pending_pairs(pack, pairs, candidates);
+        }
+    }
+  }
+  score_pending_pairs(pack, pairs, candidates);
+  candidates.flush();
+  if (VERBOSE)
+    cerr << '\r' << "hashing: 100%" << endl
+         << "comparisons: " << n_compared << endl
+         << "spilled candidate edges: " << candidates.get_spilled_edges()
+         << endl;
+}
+
+
+/* builds the graph out of core: vectors come from a mapped feature
+ * pack, candidate edges are spilled by source partition, and each
+ * partition is reduced to its best edges and written straight to the
+ * output in the format read by RegularNearestNeighborGraph (or, for
+ * one shard of the buckets, as a partial edge list)
+ */
+static void
+build_graph_external(const bool VERBOSE,
+                     const BucketShard &shard,
+                     const string &pack_file,
+                     const vector<string> &ht_files,
+                     const string &graph_name,
+                     const size_t max_degree,
+                     const string &tmp_prefix,
+                     const size_t memory_bytes,
+                     ComparedPairFilter *compared,
+                     std::ostream &out) {
+
+  const FeaturePack pack(pack_file);
+  if (VERBOSE)
+    cerr << "number of feature vectors: " << pack.size() << endl;
+
+  const size_t n_partitions =
+    CandidateEdgePartitions::partitions_for_memory(pack.size(), max_degree,
+                                                   memory_bytes);
+  if (VERBOSE)
+    cerr << "vertex partitions: " << n_partitions << endl;
+  CandidateEdgePartitions candidates(tmp_prefix, pack.size(), n_partitions);
+
+  spill_candidates_from_tables(VERBOSE, shard, ht_files, pack,
+                               compared, candidates);
+
+  if (VERBOSE)
+    cerr << "selecting neighbors" << endl;
+  write_graph_vertices(out, graph_name, max_degree, pack.get_ids());
+  candidates.write_edges(out, max_degree,
+                         shard.n_shards > 1 ? &pack.get_ids() : 0);
+  out << endl;
+}
+
+
+/* A partial edge list has the graph header and vertices, but its
+ * edges name their endpoints by id, so lists from shards that ordered
+ * the vertices differently can still be merged.
+ */
+static void
+write_partial_edge_list(const FeatVecLookup &featvecs,
+                        RegularNearestNeighborGraph &nng,
+                        std::ostream &out) {
+
+  vector<string> ids;
+  for (FeatVecLookup::const_iterator i(featvecs.begin());
+       i != featvecs.end(); ++i)
+    ids.push_back(i->first);
+  write_graph_vertices(out, nng.get_graph_name(),
+                       nng.get_maximum_degree(), ids);
+
+  vector<string> neighbors;
+  vector<double> distances;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    nng.get_neighbors(ids[i], neighbors, distances);
+    for (size_t j = 0; j < neighbors.size(); ++j)
+      out << '\n' << ids[i] << '\t' << neighbors[j] << '\t' << distances[j];
+  }
+  out << endl;
 }
 
 
@@ -147,6 +379,14 @@ main(int argc, const char **argv) {
     string id;
     string outfile;
     size_t max_degree = 1;
+    size_t filter_capacity = 0;
+    double filter_fp_rate = 0.01;
+    bool external = false;
+    string tmp_prefix;
+    size_t memory_mb = 4096;
+    size_t shard = 0;
+    size_t n_shards = 1;
+    size_t n_threads = 1;
     
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
@@ -155,6 +395,24 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("name", 'n', "name for the graph", false, graph_name);
     opt_parse.add_opt("out", 'o', "output file (default: stdout)", 
                       true, outfile);
+    opt_parse.add_opt("filter", 'f', "remember compared pairs in a filter "
+                      "of this many pairs instead of exactly "
+                      "(default: exact)", false, filter_capacity);
+    opt_parse.add_opt("filterfp", 'F', "false positive rate of the compared "
+                      "pair filter (default: 0.01)", false, filter_fp_rate);
+    opt_parse.add_opt("external", 'x', "build out of core; <feat-vecs> is "
+                      "then a feature pack", false, external);
+    opt_parse.add_opt("tmp", 't', "prefix for spill files in out of core "
+                      "builds (default: output file)", false, tmp_prefix);
+    opt_parse.add_opt("memory", 'M', "MB for neighbor heaps in out of core "
+                      "builds (default: 4096)", false, memory_mb);
+    opt_parse.add_opt("shard", 's', "shard of the buckets to compare; the "
+                      "output is then a partial edge list (default: 0)",
+                      false, shard);
+    opt_parse.add_opt("nshards", 'N', "number of shards (default: 1)",
+                      false, n_shards);
+    opt_parse.add_opt("threads", 'T', "threads reading feature vector "
+                      "files (default: 1)", false, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     
     vector<string> leftover_args;
@@ -180,17 +438,53 @@ main(int argc, const char **argv) {
     const string hash_tables_filename(leftover_args.back());
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    if (n_shards == 0 || shard >= n_shards)
+      throw SMITHLABException("bad shard: " + toa(shard) + " of " +
+                              toa(n_shards));
+    const BucketShard bucket_shard(shard, n_shards);
+
+    if (external) {
+      vector<string> ht_files;
+      load_hash_table_names(hash_tables_filename, ht_files);
+      if (VERBOSE)
+        cerr << "number of hash tables: " << ht_files.size() << endl;
+
+      // without a filter, repeated pairs are still removed when the
+      // neighbors are selected
+      std::unique_ptr<ComparedPairFilter> compared;
+      if (filter_capacity > 0)
+        compared.reset(new ComparedPairFilter(filter_capacity,
+                                              filter_fp_rate));
+
+      std::ofstream of;
+      if (!outfile.empty()) of.open(outfile.c_str());
+      if (!of) throw SMITHLABException("cannot write to file: " + outfile);
+      std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+      // partial edge lists keep full precision for merging
+      if (n_shards > 1)
+        out.precision(std::numeric_limits<double>::max_digits10);
+
+      build_graph_external(VERBOSE, bucket_shard,
+                           feat_vecs_filename, ht_files,
+                           graph_name, max_degree,
+                           tmp_prefix.empty() ? outfile : tmp_prefix,
+                           memory_mb << 20, compared.get(), out);
+      if (VERBOSE)
+        cerr << "peak memory: " << peak_memory_kb() << " kB" << endl;
+      return EXIT_SUCCESS;
+    }
+
     // first load the feature vectors
     FeatVecLookup featvecs;
-    load_feature_vectors(VERBOSE, feat_vecs_filename, featvecs);
+    load_feature_vectors(VERBOSE, n_threads, feat_vecs_filename, featvecs);
     if (VERBOSE)
       cerr << "number of feature vectors: " << featvecs.size() << endl;
     
-    // next load the hash tables
-    vector<LSHAngleHashTable> hts;
-    load_hash_tables(hash_tables_filename, hts);
+    // next get the hash tables, which are read as they are used
+    vector<string> ht_files;
+    load_hash_table_names(hash_tables_filename, ht_files);
     if (VERBOSE)
-      cerr << "number of hash tables: " << hts.size() << endl;
+      cerr << "number of hash tables: " << ht_files.size() << endl;
     
     // now intialize the graph
     RegularNearestNeighborGraph nng(graph_name, max_degree);
@@ -198,26 +492,19 @@ main(int argc, const char **argv) {
          i != featvecs.end(); ++i)
       nng.add_vertex(i->first);
     
-    // Initializing "compared": 
-    // compared<FV_ID, {Chk_ID1, Chk_ID2, ...}  for each feature
-    // vector "FV_ID", keeps the set of feature vectors that have been
-    // already compared in searching for nearest feature vector to
-    // "FV_ID".
-    ComparedLookup compared;
-    for (FeatVecLookup::const_iterator i(featvecs.begin()); 
-         i != featvecs.end(); ++i)
-      compared.insert(make_pair(i->first, unordered_set<string>()));
-    
-    // iterate over hash tables
-    for (size_t i = 0; i < hts.size(); ++i) {
-      if (VERBOSE)
-        cerr << '\r' << "hashing: " << percent(i, hts.size()) << "%\r";
-      // iterate over buckets
-      for (BucketMap::const_iterator j(hts[i].begin()); j != hts[i].end(); ++j)
-        add_relations_from_bucket(j->second, featvecs, compared, nng);
+    // "compared" keeps the (unordered) pairs of feature vectors that
+    // have already been compared, so pairs sharing buckets in several
+    // hash tables are compared once
+    if (filter_capacity > 0) {
+      ComparedPairFilter compared(filter_capacity, filter_fp_rate);
+      add_relations_from_tables(VERBOSE, bucket_shard, ht_files,
+                                featvecs, compared, nng);
+    }
+    else {
+      ComparedPairSet compared;
+      add_relations_from_tables(VERBOSE, bucket_shard, ht_files,
+                                featvecs, compared, nng);
     }
-    if (VERBOSE)
-      cerr << '\r' << "hashing: 100%" << endl;
     
     //Finally: write the graph on the outfile.
     std::ofstream of;
@@ -225,7 +512,15 @@ main(int argc, const char **argv) {
     if (!of) throw SMITHLABException("cannot write to file: " + outfile);
     std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
     
-    out << nng << endl;
+    if (n_shards > 1) {
+      out.precision(std::numeric_limits<double>::max_digits10);
+      write_partial_edge_list(featvecs, nng, out);
+    }
+    else
+      out << nng << endl;
+
+    if (VERBOSE)
+      cerr << "peak memory: " << peak_memory_kb() << " kB" << endl;
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
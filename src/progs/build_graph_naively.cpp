@@ -87,14 +87,15 @@ load_feature_vectors(const bool VERBOSE,
                      const vector<string> &fv_filenames, 
                      vector<FeatureVector> &fvs) {
   fvs.clear();
-  vector<string> labels;
+  FeatureVectorReader reader;
+  uint64_t fingerprint = 0;
   for (size_t i = 0; i < fv_filenames.size(); ++i) {
     FeatureVector fv;
-    vector<string> curr_labels;
-    load_features_and_labels(fv_filenames[i], fv, curr_labels);
-    if (labels.empty())
-      curr_labels.swap(labels);
-    else if (labels != curr_labels)
+    uint64_t curr_fingerprint = 0;
+    reader.read(fv_filenames[i], fv, curr_fingerprint);
+    if (i == 0)
+      fingerprint = curr_fingerprint;
+    else if (curr_fingerprint != fingerprint)
       throw SMITHLABException("incompatible labels: " + fv_filenames[i]);
     
     fvs.push_back(fv);
@@ -23,6 +23,8 @@
 #include <fstream>
 #include <unordered_map>
 #include <numeric>
+#include <thread>
+#include <atomic>
 
 #include <gsl/gsl_histogram.h>
 #include <gsl/gsl_statistics_double.h>
@@ -31,6 +33,7 @@
 #include "smithlab_os.hpp"
 
 #include "FeatureVector.hpp"
+#include "StreamingStats.hpp"
 
 using std::string;
 using std::vector;
@@ -55,6 +58,115 @@ remove_lower_tail(const size_t tail_size, vector<double> &vals) {
 }
 
 
+/* Accumulates the moments of each feature, and a quantile sketch of
+ * each if needed, over the files in [begin, end). Any error is left in
+ * the error string, to be reported by the main thread.
+ */
+static void
+summarize_shard(const vector<string> &filenames,
+                const size_t begin, const size_t end,
+                const vector<string> &labels, const bool VERBOSE,
+                vector<RunningMoments> &moments,
+                vector<QuantileSketch> &sketches,
+                std::atomic<size_t> &n_done, string &error) {
+  try {
+    const uint64_t fingerprint = label_fingerprint(labels);
+    FeatureVectorReader reader;
+    FeatureVector fv;
+    for (size_t i = begin; i < end; ++i) {
+      uint64_t curr_fingerprint = 0;
+      reader.read(filenames[i], fv, curr_fingerprint);
+      if (curr_fingerprint != fingerprint)
+        throw SMITHLABException("inconsistent labels: " +
+                                filenames[0] + "\t" + filenames[i]);
+      for (size_t j = 0; j < fv.size(); ++j)
+        moments[j].add(fv[j]);
+      for (size_t j = 0; j < sketches.size(); ++j)
+        sketches[j].add(fv[j]);
+
+      const size_t done = ++n_done;
+      // the first shard reports progress for all of them
+      if (VERBOSE && begin == 0)
+        cerr << '\r' << "summarizing feature vectors: "
+             << percent(done, filenames.size()) << "%\r";
+    }
+  }
+  catch (const SMITHLABException &e) {
+    error = e.what();
+  }
+}
+
+
+/* Single pass over the feature vectors, split into one contiguous
+ * shard of the paths per thread. Memory is flat in the number of
+ * vectors: exact moments take three numbers per feature, and the
+ * trimmed means, standard deviations and medians come from a
+ * quantile sketch per feature, so they are approximate.
+ */
+static void
+compute_normalizers_streaming(const vector<string> &filenames,
+                              const size_t n_threads,
+                              const size_t sketch_size,
+                              const double lower_tail,
+                              const double upper_tail,
+                              const bool use_median_values,
+                              const bool VERBOSE,
+                              vector<string> &labels,
+                              vector<double> &centers,
+                              vector<double> &sds) {
+  FeatureVector first;
+  load_features_and_labels(filenames.front(), first, labels);
+  const size_t n_features = first.size();
+  const bool need_sketch =
+    lower_tail > 0.0 || upper_tail > 0.0 || use_median_values;
+
+  const size_t n_shards =
+    std::max(static_cast<size_t>(1), std::min(n_threads, filenames.size()));
+  vector<vector<RunningMoments> > moments(n_shards,
+                                          vector<RunningMoments>(n_features));
+  vector<vector<QuantileSketch> > sketches(n_shards);
+  if (need_sketch)
+    for (size_t i = 0; i < n_shards; ++i)
+      sketches[i].resize(n_features, QuantileSketch(sketch_size, i + 1));
+
+  std::atomic<size_t> n_done(0);
+  vector<string> errors(n_shards);
+  vector<std::thread> workers;
+  for (size_t i = 0; i < n_shards; ++i)
+    workers.push_back(std::thread(summarize_shard, std::cref(filenames),
+                                  i*filenames.size()/n_shards,
+                                  (i + 1)*filenames.size()/n_shards,
+                                  std::cref(labels), VERBOSE,
+                                  std::ref(moments[i]), std::ref(sketches[i]),
+                                  std::ref(n_done), std::ref(errors[i])));
+  for (size_t i = 0; i < workers.size(); ++i)
+    workers[i].join();
+  if (VERBOSE)
+    cerr << '\r' << "summarizing feature vectors: 100%" << endl;
+  for (size_t i = 0; i < errors.size(); ++i)
+    if (!errors[i].empty())
+      throw SMITHLABException(errors[i]);
+
+  for (size_t i = 1; i < n_shards; ++i)
+    for (size_t j = 0; j < n_features; ++j) {
+      moments.front()[j].merge(moments[i][j]);
+      if (need_sketch)
+        sketches.front()[j].merge(sketches[i][j]);
+    }
+
+  centers.resize(n_features);
+  sds.resize(n_features);
+  const double lo = lower_tail, hi = 1.0 - upper_tail;
+  for (size_t j = 0; j < n_features; ++j) {
+    const RunningMoments m = (lower_tail > 0.0 || upper_tail > 0.0) ?
+      sketches.front()[j].moments_between(lo, hi) : moments.front()[j];
+    centers[j] = use_median_values ?
+      sketches.front()[j].quantile((lo + hi)/2.0) : m.get_mean();
+    sds[j] = m.get_sd();
+  }
+}
+
+
 int
 main(int argc, const char **argv) {
 
@@ -69,6 +181,10 @@ main(int argc, const char **argv) {
     bool use_lower_tail = false;
     bool use_median_values = false;
 
+    bool streaming = false;
+    size_t n_threads = 1;
+    size_t sketch_size = 200;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
                            "compute mean and sd for each feature",
@@ -79,6 +195,13 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("lower", 'l', "trim lower tail", false, use_lower_tail);
     opt_parse.add_opt("med", 'M', "use medians", false, use_median_values);
     opt_parse.add_opt("tail", 't', "size of tail to remove", false, tail_fraction);
+    opt_parse.add_opt("stream", 'S', "single pass in bounded memory; trimmed "
+                      "values and medians are approximate", false, streaming);
+    opt_parse.add_opt("threads", 'x', "threads for -stream (default: 1)",
+                      false, n_threads);
+    opt_parse.add_opt("sketch", 'k', "quantile sketch size for -stream; "
+                      "larger is more accurate (default: 200)",
+                      false, sketch_size);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
 
     vector<string> leftover_args;
@@ -115,22 +238,46 @@ main(int argc, const char **argv) {
     string feat_vec_file;
     while (paths_in >> feat_vec_file)
       feat_vec_filenames.push_back(feat_vec_file);
+    if (feat_vec_filenames.empty())
+      throw SMITHLABException("no feature vectors in: " + vectors_path_file);
+
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    if (!of) throw SMITHLABException("cannot write to file: " + outfile);
+    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+
+    if (streaming) {
+      vector<string> labels;
+      vector<double> centers, sds;
+      compute_normalizers_streaming(feat_vec_filenames, n_threads,
+                                    sketch_size,
+                                    use_lower_tail ? tail_fraction : 0.0,
+                                    use_upper_tail ? tail_fraction : 0.0,
+                                    use_median_values, VERBOSE,
+                                    labels, centers, sds);
+      for (size_t i = 0; i < centers.size(); ++i)
+        out << labels[i] << '\t' << centers[i] << '\t' << sds[i] << endl;
+      return EXIT_SUCCESS;
+    }
 
     ////////////////////////////////////////////////////////////
     //// READ IN THE FEATURE VECTORS
     vector<vector<double> > vals;
     vector<string> labels;
+    uint64_t fingerprint = 0;
+    FeatureVectorReader reader;
     size_t n_values = feat_vec_filenames.size();
     for (size_t i = 0; i < feat_vec_filenames.size(); ++i) {
 
       FeatureVector fv;
-      vector<string> curr_labels;
-      load_features_and_labels(feat_vec_filenames[i], fv, curr_labels);
+      uint64_t curr_fingerprint = 0;
       if (i == 0) {
+        reader.read(feat_vec_filenames[i], fv, labels);
+        fingerprint = label_fingerprint(labels);
         vals = vector<vector<double> >(fv.size(), vector<double>());
-        labels.swap(curr_labels);
       }
-      else if (labels != curr_labels)
+      else reader.read(feat_vec_filenames[i], fv, curr_fingerprint);
+      if (i > 0 && curr_fingerprint != fingerprint)
         throw SMITHLABException("inconsistent labels: " +
                                 feat_vec_filenames[0] + "\t" +
                                 feat_vec_filenames[i]);
@@ -149,16 +296,16 @@ main(int argc, const char **argv) {
     const size_t tail_size = tail_fraction*static_cast<double>(n_values);
     if (VERBOSE)
       cerr << "tail size: " << tail_size << endl;
+    if (use_upper_tail)
+      n_values -= tail_size;
+    if (use_lower_tail)
+      n_values -= tail_size;
     for (size_t i = 0; i < vals.size(); ++i) {
       sort(vals[i].begin(), vals[i].end());
-      if (use_upper_tail) {
+      if (use_upper_tail)
         remove_upper_tail(tail_size, vals[i]);
-        n_values -= tail_size;
-      }
-      if (use_lower_tail) {
+      if (use_lower_tail)
         remove_lower_tail(tail_size, vals[i]);
-        n_values -= tail_size;
-      }
       if (VERBOSE)
         cerr << '\r' << "trimming feature vectors: "
              << percent(i, vals.size()) << "%\r";
@@ -191,11 +338,6 @@ main(int argc, const char **argv) {
 
     ////////////////////////////////////////////////////////////
     //// WRITE THE NORMALIZERS TO DISK
-    std::ofstream of;
-    if (!outfile.empty()) of.open(outfile.c_str());
-    if (!of) throw SMITHLABException("cannot write to file: " + outfile);
-    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
-
     for (size_t i = 0; i < means.size(); ++i)
       out << labels[i] << '\t'
           << (use_median_values ? medians[i] : means[i]) << '\t'
@@ -0,0 +1,305 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <random>
+#include <chrono>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "FeatureVector.hpp"
+#include "FeatureProjection.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+using std::pair;
+
+
+static void
+load_feature_vectors(const bool VERBOSE, const size_t n_threads,
+                     const string &feat_vecs_file,
+                     vector<FeatureVector> &fvs) {
+  std::ifstream in(feat_vecs_file.c_str());
+  if (!in)
+    throw SMITHLABException("problem reading: " + feat_vecs_file);
+  vector<string> filenames;
+  string filename;
+  while (in >> filename)
+    filenames.push_back(filename);
+  if (VERBOSE)
+    cerr << "loading data: " << filenames.size() << " files" << endl;
+  read_feature_vectors(filenames, n_threads, fvs);
+  // as the server does, so the projection sees the vectors it indexes
+  for (size_t i = 0; i < fvs.size(); ++i)
+    fvs[i].normalize();
+}
+
+
+/* indices of the n_nearest vectors to fvs[query] by their angles in
+ * fvs, closest first, among the candidates (all if empty) */
+static void
+nearest(const vector<FeatureVector> &fvs, const size_t query,
+        const vector<size_t> &candidates, const size_t n_nearest,
+        vector<size_t> &result) {
+  vector<pair<double, size_t> > scored;
+  if (candidates.empty()) {
+    for (size_t i = 0; i < fvs.size(); ++i)
+      if (i != query)
+        scored.push_back(std::make_pair(fvs[query].compute_angle(fvs[i]), i));
+  }
+  else
+    for (size_t i = 0; i < candidates.size(); ++i)
+      scored.push_back(std::make_pair(
+        fvs[query].compute_angle(fvs[candidates[i]]), candidates[i]));
+  const size_t n = std::min(n_nearest, scored.size());
+  std::partial_sort(scored.begin(), scored.begin() + n, scored.end());
+  result.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    result[i] = scored[i].second;
+}
+
+
+static double
+recall(const vector<size_t> &truth, const vector<size_t> &found) {
+  if (truth.empty())
+    return 1.0;
+  size_t n_found = 0;
+  for (size_t i = 0; i < found.size(); ++i)
+    n_found += (std::find(truth.begin(), truth.end(), found[i]) !=
+                truth.end());
+  return static_cast<double>(n_found)/truth.size();
+}
+
+
+/* For each number of dimensions, the recall of the exact neighbors
+ * (by angles in all features) among the nearest in the projection,
+ * and after the rerank*k nearest in the projection are re-ranked by
+ * their full angles, with the times to score all vectors per query.
+ */
+static void
+write_recall_report(const bool VERBOSE, const vector<FeatureVector> &fvs,
+                    const FeatureProjection &projection,
+                    const vector<size_t> &dims, const size_t n_queries,
+                    const size_t n_neighbors, const size_t rerank,
+                    const uint64_t seed, std::ostream &out) {
+  std::mt19937_64 rng(seed);
+  vector<size_t> queries(fvs.size());
+  for (size_t i = 0; i < queries.size(); ++i)
+    queries[i] = i;
+  std::shuffle(queries.begin(), queries.end(), rng);
+  queries.resize(std::min(n_queries, queries.size()));
+
+  const vector<size_t> all;
+  vector<vector<size_t> > truth(queries.size());
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  for (size_t i = 0; i < queries.size(); ++i)
+    nearest(fvs, queries[i], all, n_neighbors, truth[i]);
+  const double full_seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  out << "dims\trecall\treranked_recall\tseconds_per_query\t"
+      << "full_seconds_per_query" << endl;
+  for (size_t d = 0; d < dims.size(); ++d) {
+    FeatureProjection reduced(projection);
+    reduced.truncate(dims[d]);
+    vector<FeatureVector> projected(fvs.size());
+    for (size_t i = 0; i < fvs.size(); ++i)
+      projected[i] = reduced(fvs[i]);
+
+    double total_recall = 0.0, total_reranked = 0.0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < queries.size(); ++i) {
+      vector<size_t> found, reranked;
+      nearest(projected, queries[i], all, rerank*n_neighbors, found);
+      nearest(fvs, queries[i], found, n_neighbors, reranked);
+      found.resize(std::min(found.size(), n_neighbors));
+      total_recall += recall(truth[i], found);
+      total_reranked += recall(truth[i], reranked);
+    }
+    const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    const size_t n = std::max(queries.size(), static_cast<size_t>(1));
+    out << dims[d] << '\t' << total_recall/n << '\t'
+        << total_reranked/n << '\t' << seconds/n << '\t'
+        << full_seconds/n << endl;
+    if (VERBOSE)
+      cerr << '\r' << "recall report: " << percent(d + 1, dims.size())
+           << "%\r";
+  }
+  if (VERBOSE)
+    cerr << "recall report: 100%" << endl;
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    string outfile;
+    string method = "pca";
+    size_t n_dims = 0;
+    size_t sample_size = 2000;
+    size_t n_iterations = 4;
+    size_t seed = 1;
+    size_t n_threads = 1;
+    string report_file;
+    string report_dims;
+    size_t n_queries = 100;
+    size_t n_neighbors = 10;
+    size_t rerank = 4;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]),
+                           "fit a projection of feature vectors into "
+                           "fewer dimensions for the server to index",
+                           "<feat-vecs>");
+    opt_parse.add_opt("out", 'o', "output file for the projection",
+                      true, outfile);
+    opt_parse.add_opt("dim", 'd', "dimensions to project into",
+                      true, n_dims);
+    opt_parse.add_opt("method", 'm', "pca or random (default: pca)",
+                      false, method);
+    opt_parse.add_opt("sample", 's', "vectors sampled to fit the principal "
+                      "components (default: 2000)", false, sample_size);
+    opt_parse.add_opt("iter", 'i', "subspace iterations for the principal "
+                      "components (default: 4)", false, n_iterations);
+    opt_parse.add_opt("seed", 'S', "random seed (default: 1)", false, seed);
+    opt_parse.add_opt("threads", 'T', "threads reading feature vector "
+                      "files (default: 1)", false, n_threads);
+    opt_parse.add_opt("report", 'r', "write recall against dimensions "
+                      "to this file", false, report_file);
+    opt_parse.add_opt("dims", 'D', "comma separated dimensions for the "
+                      "report (default: powers of 2 up to -dim)",
+                      false, report_dims);
+    opt_parse.add_opt("queries", 'q', "queries for the report "
+                      "(default: 100)", false, n_queries);
+    opt_parse.add_opt("neighbors", 'k', "neighbors for the report "
+                      "(default: 10)", false, n_neighbors);
+    opt_parse.add_opt("rerank", 'R', "multiple of the neighbors re-ranked "
+                      "by full angles in the report (default: 4)",
+                      false, rerank);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string feat_vecs_file(leftover_args.front());
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    if (method != "pca" && method != "random")
+      throw SMITHLABException("unknown projection method: " + method);
+    if (rerank == 0)
+      throw SMITHLABException("rerank must be positive");
+
+    vector<FeatureVector> fvs;
+    load_feature_vectors(VERBOSE, n_threads, feat_vecs_file, fvs);
+    if (fvs.empty())
+      throw SMITHLABException("no feature vectors in: " + feat_vecs_file);
+    const size_t n_features = fvs.front().size();
+
+    // the report's projections are the leading rows of the largest
+    vector<size_t> dims;
+    if (!report_dims.empty()) {
+      const vector<string> parts(smithlab::split(report_dims, ","));
+      for (size_t i = 0; i < parts.size(); ++i)
+        dims.push_back(std::stoul(parts[i]));
+    }
+    else
+      for (size_t d = 1; d < n_dims; d *= 2)
+        dims.push_back(d);
+    if (dims.empty() || dims.back() != n_dims)
+      dims.push_back(n_dims);
+    const size_t max_dims = *std::max_element(dims.begin(), dims.end());
+    if (max_dims > n_features && method == "pca")
+      throw SMITHLABException("cannot fit " + toa(max_dims) +
+                              " components to " + toa(n_features) +
+                              " features");
+
+    FeatureProjection projection;
+    if (method == "random")
+      projection = FeatureProjection(n_features, max_dims, seed);
+    else {
+      vector<size_t> order(fvs.size());
+      for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+      std::mt19937_64 rng(seed);
+      std::shuffle(order.begin(), order.end(), rng);
+      vector<FeatureVector> sample;
+      for (size_t i = 0; i < std::min(sample_size, order.size()); ++i)
+        sample.push_back(fvs[order[i]]);
+      if (VERBOSE)
+        cerr << "fitting " << max_dims << " components to "
+             << sample.size() << " vectors" << endl;
+      fit_pca_projection(sample, max_dims, n_iterations, seed, projection);
+    }
+
+    if (!report_file.empty()) {
+      std::ofstream report(report_file.c_str());
+      if (!report)
+        throw SMITHLABException("cannot write to file: " + report_file);
+      write_recall_report(VERBOSE, fvs, projection, dims, n_queries,
+                          n_neighbors, rerank, seed, report);
+    }
+
+    projection.truncate(n_dims);
+    std::ofstream out(outfile.c_str());
+    if (!out)
+      throw SMITHLABException("cannot write to file: " + outfile);
+    out << projection << endl;
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -47,6 +47,7 @@ main(int argc, const char **argv) {
     size_t n_bits = 0;
     size_t n_features = 0;
     size_t rng_key = 0;
+    string family = "gaussian";
     string id;
     string feature_set_id;
     string outfile;
@@ -59,8 +60,11 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("nfeat", 'n', "number of features", true, n_features);
     opt_parse.add_opt("bits", 'b', "bits in hash value", true, n_bits);
     opt_parse.add_opt("out", 'o', "output file (default: stdout)", false, outfile);
-    opt_parse.add_opt("key", 'k', "random generator key (for debugging)",
-                      false, rng_key);
+    opt_parse.add_opt("key", 'k', "seed regenerating the hyperplanes "
+                      "(default: random)", false, rng_key);
+    opt_parse.add_opt("family", 'a', "hyperplanes: gaussian, or hadamard "
+                      "for fast structured rotations (default: gaussian)",
+                      false, family);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
 
     vector<string> leftover_args;
@@ -84,10 +88,12 @@ main(int argc, const char **argv) {
     }
     /****************** END COMMAND LINE OPTIONS *****************/
 
-    srand((rng_key != 0) ? rng_key : time(0) + getpid());
+    if (rng_key == 0)
+      rng_key = derive_hash_seed(time(0) + getpid(), id);
 
     const LSHAngleHashFunction hash_function(id, feature_set_id,
-                                             n_features, n_bits);
+                                             n_features, n_bits, rng_key,
+                                             family);
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
     if (!of) throw SMITHLABException("cannot write to file: " + outfile);
@@ -0,0 +1,292 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <chrono>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "FeatureVector.hpp"
+#include "FeaturePack.hpp"
+#include "KmerProfile.hpp"
+#include "HttpClient.hpp"
+
+#include "crow.h"
+#include "json.h"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+
+/* a metagenome: its id and the sequence files holding its reads */
+struct Sample {
+  string id;
+  vector<string> files;
+};
+
+
+static void
+load_samples(const string &samples_file, vector<Sample> &samples) {
+  std::ifstream in(samples_file.c_str());
+  if (!in)
+    throw SMITHLABException("cannot open samples file: " + samples_file);
+  string line;
+  while (getline(in, line)) {
+    std::istringstream iss(line);
+    Sample s;
+    if (!(iss >> s.id))
+      continue;
+    string filename;
+    while (iss >> filename)
+      s.files.push_back(filename);
+    if (s.files.empty())
+      throw SMITHLABException("no sequence files for sample: " + s.id);
+    samples.push_back(s);
+  }
+}
+
+
+/* Counts the k-mers of one sample. The threads take turns reading a
+ * batch of reads from the current file, then count it into their own
+ * counters, which are merged at the end.
+ */
+static void
+profile_sample(const Sample &sample, const size_t n_threads,
+               const size_t batch_bases, vector<KmerCounter> &counters,
+               uint64_t &n_bases) {
+  for (size_t i = 0; i < counters.size(); ++i)
+    counters[i].clear();
+
+  std::mutex reader_mutex;
+  size_t current_file = 0;
+  std::unique_ptr<SequenceReader> reader;
+  string error;
+  n_bases = 0;
+
+  vector<std::thread> workers;
+  for (size_t t = 0; t < n_threads; ++t)
+    workers.push_back(std::thread([&, t] {
+      vector<string> batch;
+      while (true) {
+        {
+          std::lock_guard<std::mutex> lock(reader_mutex);
+          if (!error.empty())
+            return;
+          try {
+            bool got_batch = false;
+            while (!got_batch && current_file < sample.files.size()) {
+              if (!reader)
+                reader.reset(new SequenceReader(sample.files[current_file]));
+              got_batch = reader->read_batch(batch, batch_bases);
+              if (!got_batch) {
+                reader.reset();
+                ++current_file;
+              }
+            }
+            if (!got_batch)
+              return;
+          }
+          catch (const SMITHLABException &e) {
+            error = e.what();
+            return;
+          }
+          for (size_t i = 0; i < batch.size(); ++i)
+            n_bases += batch[i].size();
+        }
+        for (size_t i = 0; i < batch.size(); ++i)
+          counters[t].add_sequence(batch[i]);
+      }
+    }));
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  if (!error.empty())
+    throw SMITHLABException(error);
+
+  for (size_t t = 1; t < counters.size(); ++t)
+    counters.front().merge(counters[t]);
+}
+
+
+/* sends the profile to a server's inline insertion */
+static void
+insert_into_server(const ServerAddress &server, const FeatureVector &fv,
+                   const vector<string> &labels) {
+  crow::json::wvalue body;
+  body["id"] = fv.get_id();
+  for (size_t i = 0; i < fv.size(); ++i) {
+    body["labels"][i] = labels[i];
+    body["values"][i] = fv[i];
+  }
+  string response;
+  const size_t timeout_millis = 600000;
+  const int status = http_request(server, "POST", "/insert",
+                                  crow::json::dump(body), timeout_millis,
+                                  response);
+  const crow::json::rvalue reply = crow::json::load(response);
+  if (status != 200 || !reply)
+    throw SMITHLABException("insertion of " + fv.get_id() + " failed: " +
+                            toa(status) + " " + response);
+  if (reply.has("error"))
+    throw SMITHLABException("insertion of " + fv.get_id() + " failed: " +
+                            string(reply["error"]));
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    size_t k = 6;
+    size_t n_threads = 1;
+    size_t batch_bases = 1000000;
+    string pack_file;
+    string out_dir;
+    string server_address;
+    string suffix = ".fv";
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]),
+                           "k-mer frequency vectors of metagenomes from "
+                           "FASTA or FASTQ files, which may be gzip "
+                           "compressed; each line of the samples file "
+                           "is a sample id and its sequence files",
+                           "<samples-file>");
+    opt_parse.add_opt("kmer", 'k', "k-mer size (default: 6)", false, k);
+    opt_parse.add_opt("threads", 't', "counting threads (default: 1)",
+                      false, n_threads);
+    opt_parse.add_opt("batch", 'b', "bases read per batch "
+                      "(default: 1000000)", false, batch_bases);
+    opt_parse.add_opt("pack", 'p', "write the vectors to this feature pack",
+                      false, pack_file);
+    opt_parse.add_opt("dir", 'd', "write one feature vector file per sample "
+                      "in this directory", false, out_dir);
+    opt_parse.add_opt("suff", 's', "suffix of feature vector files "
+                      "(default: .fv)", false, suffix);
+    opt_parse.add_opt("server", 'S', "insert the vectors into the amordad "
+                      "server at host:port", false, server_address);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (pack_file.empty() && out_dir.empty() && server_address.empty()) {
+      cerr << "no output: give a pack, a directory or a server" << endl;
+      return EXIT_SUCCESS;
+    }
+    const string samples_file(leftover_args.front());
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    vector<Sample> samples;
+    load_samples(samples_file, samples);
+    if (VERBOSE)
+      cerr << "samples: " << samples.size() << endl;
+
+    vector<string> labels;
+    canonical_kmer_labels(k, labels);
+
+    std::unique_ptr<FeaturePackWriter> pack;
+    if (!pack_file.empty())
+      pack.reset(new FeaturePackWriter(pack_file));
+    ServerAddress server;
+    if (!server_address.empty())
+      server = ServerAddress(server_address);
+
+    n_threads = std::max(n_threads, static_cast<size_t>(1));
+    vector<KmerCounter> counters(n_threads, KmerCounter(k));
+    const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    uint64_t total_bases = 0;
+    vector<double> frequencies;
+    for (size_t i = 0; i < samples.size(); ++i) {
+      uint64_t n_bases = 0;
+      profile_sample(samples[i], n_threads, batch_bases, counters, n_bases);
+      total_bases += n_bases;
+      counters.front().get_frequencies(frequencies);
+      const FeatureVector fv(samples[i].id, frequencies);
+
+      if (pack)
+        pack->add(fv);
+      if (!out_dir.empty()) {
+        const string filename(path_join(out_dir, samples[i].id + suffix));
+        std::ofstream out(filename.c_str());
+        if (!out)
+          throw SMITHLABException("cannot write to file: " + filename);
+        out << fv.tostring_with_labels(labels) << endl;
+      }
+      if (!server_address.empty())
+        insert_into_server(server, fv, labels);
+
+      if (VERBOSE)
+        cerr << '\r' << "profiling samples: "
+             << percent(i + 1, samples.size()) << "%\r";
+    }
+    if (pack)
+      pack->close();
+
+    if (VERBOSE) {
+      const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+      cerr << '\r' << "profiling samples: 100%" << endl
+           << "profiled " << total_bases << " bases in " << seconds
+           << "s (" << total_bases/std::max(seconds, 1e-9)/1e6
+           << " Mbases/s)" << endl;
+    }
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,441 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "CandidateEdgePartitions.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+using std::unordered_map;
+
+
+/* One partial edge list, as written by build_graph with -nshards,
+ * read incrementally from a file or from the pipe of a worker.
+ */
+struct ShardSource {
+  ShardSource(const string &n, const int f, const pid_t p) :
+    name(n), fd(f), pid(p), line_number(0), n_vertices(0),
+    section(NAME), done(false) {}
+
+  enum Section {NAME, DEGREE, VERTEX_HEADER, VERTICES, EDGES};
+
+  string name;
+  int fd;
+  pid_t pid;
+  string pending;
+  size_t line_number;
+  size_t n_vertices;
+  Section section;
+  bool done;
+};
+
+
+/* The merged graph: the vertices of the first source, and the
+ * candidate edges of all sources reduced to the best per vertex.
+ */
+struct ShardMerger {
+  ShardMerger(const string &pfx, const size_t mb) :
+    tmp_prefix(pfx), memory_bytes(mb), max_degree(0),
+    defined(false), n_edges(0) {}
+
+  string tmp_prefix;
+  size_t memory_bytes;
+
+  string graph_name;
+  size_t max_degree;
+  vector<string> ids;
+  unordered_map<string, uint32_t> id_to_index;
+  bool defined;
+  std::unique_ptr<CandidateEdgePartitions> candidates;
+  size_t n_edges;
+
+  void define_vertices();
+  uint32_t get_index(const ShardSource &src, const string &id) const;
+};
+
+
+void
+ShardMerger::define_vertices() {
+  id_to_index.reserve(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+    if (!id_to_index.insert(std::make_pair(ids[i], i)).second)
+      throw SMITHLABException("duplicate vertex in partial edge list: " +
+                              ids[i]);
+  const size_t n_partitions =
+    CandidateEdgePartitions::partitions_for_memory(ids.size(), max_degree,
+                                                   memory_bytes);
+  candidates.reset(new CandidateEdgePartitions(tmp_prefix, ids.size(),
+                                               n_partitions));
+  defined = true;
+}
+
+
+uint32_t
+ShardMerger::get_index(const ShardSource &src, const string &id) const {
+  unordered_map<string, uint32_t>::const_iterator i(id_to_index.find(id));
+  if (i == id_to_index.end())
+    throw SMITHLABException("unknown vertex in " + src.name + ": " + id);
+  return i->second;
+}
+
+
+static void
+process_line(const string &line, ShardSource &src, ShardMerger &merger) {
+  ++src.line_number;
+  switch (src.section) {
+  case ShardSource::NAME:
+    if (!merger.defined)
+      merger.graph_name = line;
+    src.section = ShardSource::DEGREE;
+    break;
+  case ShardSource::DEGREE: {
+    const size_t degree = strtoul(line.c_str(), 0, 10);
+    if (!merger.defined)
+      merger.max_degree = degree;
+    else if (degree != merger.max_degree)
+      throw SMITHLABException("inconsistent degree in: " + src.name);
+    src.section = ShardSource::VERTEX_HEADER;
+    break;
+  }
+  case ShardSource::VERTEX_HEADER:
+    if (line != "VERTEX")
+      throw SMITHLABException("bad partial edge list: " + src.name);
+    src.section = ShardSource::VERTICES;
+    break;
+  case ShardSource::VERTICES:
+    if (line == "EDGE") {
+      if (!merger.defined)
+        merger.define_vertices();
+      else if (src.n_vertices != merger.ids.size())
+        throw SMITHLABException("inconsistent vertices in: " + src.name);
+      src.section = ShardSource::EDGES;
+    }
+    else {
+      if (!merger.defined)
+        merger.ids.push_back(line.substr(0, line.find('\t')));
+      ++src.n_vertices;
+    }
+    break;
+  case ShardSource::EDGES: {
+    const size_t first_tab = line.find('\t');
+    const size_t second_tab = (first_tab == string::npos) ?
+      string::npos : line.find('\t', first_tab + 1);
+    if (second_tab == string::npos)
+      throw SMITHLABException("bad edge line " + toa(src.line_number) +
+                              " in " + src.name + ": " + line);
+    const uint32_t u =
+      merger.get_index(src, line.substr(0, first_tab));
+    const uint32_t v =
+      merger.get_index(src, line.substr(first_tab + 1,
+                                        second_tab - first_tab - 1));
+    merger.candidates->add(u, v, strtod(line.c_str() + second_tab + 1, 0));
+    ++merger.n_edges;
+    break;
+  }
+  }
+}
+
+
+/* waits for the worker of a source, if it has one, and throws if it
+ * did not succeed */
+static void
+wait_for_worker(ShardSource &src) {
+  if (src.pid <= 0)
+    return;
+  int status = 0;
+  const pid_t pid = src.pid;
+  src.pid = 0;
+  if (waitpid(pid, &status, 0) < 0)
+    throw SMITHLABException("cannot wait for worker: " + src.name);
+  if (WIFSIGNALED(status))
+    throw SMITHLABException("worker killed by signal " +
+                            toa(WTERMSIG(status)) + ": " + src.name);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    throw SMITHLABException("worker failed with status " +
+                            toa(WEXITSTATUS(status)) + ": " + src.name);
+}
+
+
+/* Stops and reaps the workers still running when it goes out of scope,
+ * as when merging fails, so that none outlives the merge; closes the
+ * sources not yet read to the end. */
+struct WorkerGuard {
+  explicit WorkerGuard(vector<ShardSource> &s) : sources(s) {}
+  ~WorkerGuard() {
+    for (size_t i = 0; i < sources.size(); ++i) {
+      if (!sources[i].done && sources[i].fd >= 0)
+        close(sources[i].fd);
+      if (sources[i].pid > 0) {
+        kill(sources[i].pid, SIGTERM);
+        int status = 0;
+        waitpid(sources[i].pid, &status, 0);
+        sources[i].pid = 0;
+      }
+    }
+  }
+  vector<ShardSource> &sources;
+};
+
+
+/* reads what is available from the source and processes the
+ * complete lines; returns false at the end of the source
+ */
+static bool
+read_source(ShardSource &src, ShardMerger &merger) {
+  char buffer[65536];
+  const ssize_t n_read = read(src.fd, buffer, sizeof(buffer));
+  if (n_read < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return true;
+    throw SMITHLABException("error reading: " + src.name);
+  }
+  if (n_read == 0) {
+    if (!src.pending.empty())
+      process_line(src.pending, src, merger);
+    src.pending.clear();
+    return false;
+  }
+  src.pending.append(buffer, n_read);
+  size_t start = 0, newline = 0;
+  while ((newline = src.pending.find('\n', start)) != string::npos) {
+    const string line(src.pending, start, newline - start);
+    if (!line.empty())
+      process_line(line, src, merger);
+    start = newline + 1;
+  }
+  src.pending.erase(0, start);
+  return true;
+}
+
+
+/* Reads all sources together. Until the first source has given its
+ * vertices, only it is read; the others wait on their pipes.
+ */
+static void
+merge_sources(const bool VERBOSE, vector<ShardSource> &sources,
+              ShardMerger &merger) {
+
+  size_t n_done = 0;
+  vector<struct pollfd> fds;
+  vector<size_t> which;
+  while (n_done < sources.size()) {
+    fds.clear();
+    which.clear();
+    for (size_t i = 0; i < sources.size(); ++i)
+      if (!sources[i].done && (merger.defined || i == 0)) {
+        struct pollfd p;
+        p.fd = sources[i].fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        fds.push_back(p);
+        which.push_back(i);
+      }
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      throw SMITHLABException("error waiting for shards");
+    }
+    for (size_t j = 0; j < fds.size(); ++j)
+      if (fds[j].revents != 0) {
+        ShardSource &src = sources[which[j]];
+        if (!read_source(src, merger)) {
+          // a worker's own failure explains its list ending early
+          if (src.section != ShardSource::EDGES) {
+            wait_for_worker(src);
+            throw SMITHLABException("incomplete partial edge list: " +
+                                    src.name);
+          }
+          close(src.fd);
+          src.done = true;
+          ++n_done;
+          if (VERBOSE)
+            cerr << '\r' << "merging: " << percent(n_done, sources.size())
+                 << "%\r";
+        }
+      }
+  }
+  if (VERBOSE)
+    cerr << '\r' << "merging: 100%" << endl
+         << "candidate edges: " << merger.n_edges << endl;
+}
+
+
+/* starts one worker per shard, each running the build command with
+ * its shard options and writing its partial edge list into a pipe
+ */
+static void
+launch_workers(const string &command, const size_t n_workers,
+               vector<ShardSource> &sources) {
+
+  // options go right after the program name, before its arguments
+  const size_t program_end = command.find(' ');
+  const string program = command.substr(0, program_end);
+  const string arguments = (program_end == string::npos) ?
+    string() : command.substr(program_end);
+
+  for (size_t i = 0; i < n_workers; ++i) {
+    const string worker_command = program + " -s " + toa(i) +
+      " -N " + toa(n_workers) + " -o /dev/stdout" + arguments;
+    int fds[2];
+    if (pipe(fds) != 0)
+      throw SMITHLABException("cannot create pipe for shard " + toa(i));
+    const pid_t pid = fork();
+    if (pid < 0)
+      throw SMITHLABException("cannot start shard " + toa(i));
+    if (pid == 0) {
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      execl("/bin/sh", "sh", "-c", worker_command.c_str(),
+            static_cast<char *>(0));
+      _exit(127);
+    }
+    close(fds[1]);
+    sources.push_back(ShardSource("shard " + toa(i), fds[0], pid));
+  }
+}
+
+
+static void
+wait_for_workers(vector<ShardSource> &sources) {
+  for (size_t i = 0; i < sources.size(); ++i)
+    wait_for_worker(sources[i]);
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+
+    string outfile;
+    string graph_name;
+    string tmp_prefix;
+    size_t memory_mb = 4096;
+    size_t n_workers = 0;
+    string command;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]),
+                           "merge partial edge lists from sharded "
+                           "builds into one m-NNG graph",
+                           "[<partial-edge-lists>]");
+    opt_parse.add_opt("out", 'o', "output file", true, outfile);
+    opt_parse.add_opt("name", 'n', "name for the graph (default: name "
+                      "in the first partial list)", false, graph_name);
+    opt_parse.add_opt("tmp", 't', "prefix for spill files "
+                      "(default: output file)", false, tmp_prefix);
+    opt_parse.add_opt("memory", 'M', "MB for neighbor heaps "
+                      "(default: 4096)", false, memory_mb);
+    opt_parse.add_opt("workers", 'w', "run this many local shard workers "
+                      "and merge their output from pipes", false, n_workers);
+    opt_parse.add_opt("command", 'c', "build command run by each worker, "
+                      "e.g. \"build_graph -d 10 fvs hts\"; the shard "
+                      "options are added to it", false, command);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.empty() == (n_workers == 0) ||
+        (n_workers > 0) == command.empty()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    vector<ShardSource> sources;
+    const WorkerGuard guard(sources);
+    for (size_t i = 0; i < leftover_args.size(); ++i) {
+      const int fd = open(leftover_args[i].c_str(), O_RDONLY);
+      if (fd < 0)
+        throw SMITHLABException("cannot open: " + leftover_args[i]);
+      sources.push_back(ShardSource(leftover_args[i], fd, 0));
+    }
+    if (n_workers > 0) {
+      if (VERBOSE)
+        cerr << "starting " << n_workers << " shard workers" << endl;
+      launch_workers(command, n_workers, sources);
+    }
+
+    ShardMerger merger(tmp_prefix.empty() ? outfile : tmp_prefix,
+                       memory_mb << 20);
+    merge_sources(VERBOSE, sources, merger);
+    wait_for_workers(sources);
+    if (!graph_name.empty())
+      merger.graph_name = graph_name;
+
+    std::ofstream out(outfile.c_str());
+    if (!out)
+      throw SMITHLABException("cannot write to file: " + outfile);
+    if (VERBOSE)
+      cerr << "selecting neighbors" << endl;
+    write_graph_vertices(out, merger.graph_name, merger.max_degree,
+                         merger.ids);
+    merger.candidates->write_edges(out, merger.max_degree);
+    out << endl;
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
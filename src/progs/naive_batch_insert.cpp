@@ -33,6 +33,7 @@
 #include "smithlab_os.hpp"
 
 #include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
 
 using std::string;
 using std::vector;
@@ -63,7 +64,7 @@ load_feature_vectors(const bool VERBOSE, const string &fvs_file,
 
   for(size_t i = 0; i < fv_files.size(); ++i) {
     FeatureVector fv;
-    std::ifstream in(fv_files[i].c_str());
+    CompressedInputStream in(fv_files[i]);
     if (!in)
       throw SMITHLABException("bad feature vector file: " + fv_files[i]);
     in >> fv;
@@ -33,6 +33,8 @@
 #include "smithlab_os.hpp"
 
 #include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
+#include "ExactNeighborSearch.hpp"
 
 using std::string;
 using std::vector;
@@ -65,34 +67,22 @@ operator<<(std::ostream &os, const Result &r) {
 
 
 static void
-exec_query(const vector<FeatureVector> &database,
-           const FeatureVector &query,
-           const size_t n_neighbors,
-           const double max_proximity_radius,
-           vector<Result> &results) {
-
-  std::priority_queue<Result, vector<Result>, std::less<Result> > pq;
-  double current_dist_cutoff = max_proximity_radius;
-  for (vector<FeatureVector>::const_iterator i(database.begin());
-       i != database.end(); ++i) {
-    const double dist = query.compute_angle(*i);
-    ++comparisons;
-    if (dist < current_dist_cutoff) {
-      if (pq.size() == n_neighbors)
-        pq.pop();
-      pq.push(Result(i->get_id(), dist));
-
-      if(pq.size() == n_neighbors)
-        current_dist_cutoff = pq.top().val;
-    }
-  }
+exec_queries(const ExactNeighborSearch &database,
+             const vector<FeatureVector> &queries,
+             const size_t n_neighbors,
+             const double max_proximity_radius,
+             vector<vector<Result> > &results) {
+
+  vector<vector<ExactNeighbor> > neighbors;
+  database.query(queries, n_neighbors, max_proximity_radius, neighbors);
+  comparisons += queries.size()*database.size();
 
   results.clear();
-  while (!pq.empty()) {
-    results.push_back(pq.top());
-    pq.pop();
-  }
-  reverse(results.begin(), results.end());
+  results.resize(queries.size());
+  for (size_t i = 0; i < neighbors.size(); ++i)
+    for (size_t j = 0; j < neighbors[i].size(); ++j)
+      results[i].push_back(Result(database.get_id(neighbors[i][j].second),
+                                  neighbors[i][j].first));
 }
 
 
@@ -121,7 +111,7 @@ load_feature_vectors(const bool VERBOSE, const string &fvs_file,
 
   for(size_t i = 0; i < fv_files.size(); ++i) {
     FeatureVector fv;
-    std::ifstream in(fv_files[i].c_str());
+    CompressedInputStream in(fv_files[i]);
     if (!in)
       throw SMITHLABException("bad feature vector file: " + fv_files[i]);
     in >> fv;
@@ -155,6 +145,8 @@ main(int argc, const char **argv) {
     bool VERBOSE = false;
     size_t n_neighbors = 1;
     double max_proximity_radius = 0.75;
+    size_t n_threads = 1;
+    size_t block_size = 256;
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "batch query a set of "
@@ -164,6 +156,10 @@ main(int argc, const char **argv) {
                       false, n_neighbors);
     opt_parse.add_opt("mpr", 'r', "maximum proximity radius",
                       false, max_proximity_radius);
+    opt_parse.add_opt("threads", 't', "number of threads (default: 1)",
+                      false, n_threads);
+    opt_parse.add_opt("block", 'B', "vectors per block in matrix products "
+                      "(default: 256)", false, block_size);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -203,12 +199,16 @@ main(int argc, const char **argv) {
     ////////////////////////////////////////////////////////////////////////
 
     // reading database
-    vector<FeatureVector> database;
+    vector<FeatureVector> database_fvs;
     if (VERBOSE)
       cerr << "loading database" << endl;
-    load_feature_vectors(VERBOSE, database_file, database);
+    load_feature_vectors(VERBOSE, database_file, database_fvs);
     if (VERBOSE)
-      cerr << "database size: " << database.size() << endl;
+      cerr << "database size: " << database_fvs.size() << endl;
+
+    // the search keeps its own unit-length copy of the vectors
+    const ExactNeighborSearch database(database_fvs, n_threads, block_size);
+    vector<FeatureVector>().swap(database_fvs);
 
     ////////////////////////////////////////////////////////////////////////
     ///// STARTING THE QUERY PROCESS ///////////////////////////////////////
@@ -223,16 +223,13 @@ main(int argc, const char **argv) {
       cerr << "number of queries: " << queries.size() << endl;
 
     // "n" query points requires a "n*t" results
-    vector<vector<Result> > results(queries.size());
-    for (size_t i = 0; i < queries.size(); ++i) {
-      exec_query(database, queries[i],
-                 n_neighbors, max_proximity_radius, results[i]);
-      if (VERBOSE)
-        cerr << '\r' << "processing queries: "
-             << percent(i, queries.size()) << "%\r";
-    }
     if (VERBOSE)
-      cerr << '\r' << "processing queries: 100% ("
+      cerr << "processing queries" << endl;
+    vector<vector<Result> > results;
+    exec_queries(database, queries, n_neighbors,
+                 max_proximity_radius, results);
+    if (VERBOSE)
+      cerr << "processing queries: 100% ("
            << queries.size() << ")" << endl;
 
     ////////////////////////////////////////////////////////////////////////
@@ -78,8 +78,8 @@ main(int argc, const char **argv) {
     vector<string> labels;
     load_features_and_labels(input_file, fv, labels);
     
-    const double mean = gsl_stats_mean(&fv[0], 1, fv.size());
-    const double sd = gsl_stats_sd_m(&fv[0], 1, fv.size(), mean);
+    const double mean = gsl_stats_mean(fv.data(), 1, fv.size());
+    const double sd = gsl_stats_sd_m(fv.data(), 1, fv.size(), mean);
     
     transform(fv.begin(), fv.end(), fv.begin(), 
               bind2nd(std::minus<double>(), mean));
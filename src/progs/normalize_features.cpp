@@ -19,31 +19,43 @@
 
 #include <string>
 #include <vector>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 #include "OptionParser.hpp"
 #include "smithlab_os.hpp"
 
 #include "FeatureVector.hpp"
+#include "FeaturePack.hpp"
 
 using std::string;
 using std::vector;
 using std::cerr;
 using std::endl;
 using std::unordered_map;
+using std::min;
+using std::max;
 
 
 static void
 load_normalizers(const string &normalizers_file,
                  vector<string> &labels,
                  vector<double> &means, vector<double> &sds) {
-  
+
   std::ifstream in(normalizers_file.c_str());
   if (!in)
     throw SMITHLABException("cannot open file: " + normalizers_file);
-  
+
   string l;
   double m = 0.0, s = 0.0;
   while (in >> l >> m >> s) {
@@ -54,6 +66,269 @@ load_normalizers(const string &normalizers_file,
 }
 
 
+/* How each vector is normalized: by the per-feature normalizers, or
+ * (z-scoring) by the mean and sd of its own values. The reciprocals
+ * of the sds are taken once, so each value costs one subtraction and
+ * one multiplication.
+ */
+struct Normalizer {
+  bool zscore;
+  vector<double> means;
+  vector<double> inv_sds;
+
+  void apply(double *values, const size_t n) const;
+};
+
+
+void
+Normalizer::apply(double *values, const size_t n) const {
+  if (!zscore) {
+    const double *m = &means[0];
+    const double *s = &inv_sds[0];
+    for (size_t i = 0; i < n; ++i)
+      values[i] = (values[i] - m[i])*s[i];
+    return;
+  }
+  if (n == 0)
+    return;
+  double mean = 0.0;
+  for (size_t i = 0; i < n; ++i)
+    mean += values[i];
+  mean /= n;
+  double ss = 0.0;
+  for (size_t i = 0; i < n; ++i)
+    ss += (values[i] - mean)*(values[i] - mean);
+  // a constant vector is centered only, rather than made all NaN
+  const double sd = n > 1 ? std::sqrt(ss/(n - 1)) : 0.0;
+  const double scale = sd > 0.0 ? 1.0/sd : 1.0;
+  for (size_t i = 0; i < n; ++i)
+    values[i] = (values[i] - mean)*scale;
+}
+
+
+/* same text as FeatureVector::tostring_with_labels followed by endl */
+static void
+format_feature_vector(const string &id, const vector<string> &labels,
+                      const double *values, string &text) {
+  text = id;
+  char buf[32];
+  for (size_t i = 0; i < labels.size(); ++i) {
+    text += '\n';
+    text += labels[i];
+    text += '\t';
+    text.append(buf, std::snprintf(buf, sizeof(buf), "%g", values[i]));
+  }
+  text += '\n';
+}
+
+
+struct NormalizedFile {
+  string filename;
+  string text;
+};
+
+
+/* Queue between the normalizing threads and the writers. Producers
+ * block while it is full, which bounds the memory held in formatted
+ * output when writing is the bottleneck.
+ */
+class BoundedQueue {
+public:
+  explicit BoundedQueue(const size_t c) : capacity(max(c, size_t(1))),
+                                          closed(false) {}
+
+  // false if the queue was closed
+  bool push(NormalizedFile &item) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    not_full.wait(lock, [this]{return closed || items.size() < capacity;});
+    if (closed)
+      return false;
+    items.push_back(NormalizedFile());
+    items.back().filename.swap(item.filename);
+    items.back().text.swap(item.text);
+    not_empty.notify_one();
+    return true;
+  }
+  // false once the queue is closed and empty
+  bool pop(NormalizedFile &item) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    not_empty.wait(lock, [this]{return closed || !items.empty();});
+    if (items.empty())
+      return false;
+    item.filename.swap(items.front().filename);
+    item.text.swap(items.front().text);
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+  void close() {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed;
+  std::deque<NormalizedFile> items;
+  std::mutex queue_mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
+
+
+/* state shared by the normalizing and writing threads */
+struct BatchState {
+  BatchState(const size_t queue_size) :
+    queue(queue_size), next_file(0), n_written(0), bytes_written(0),
+    failed(false) {}
+
+  void fail(const string &message) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!failed)
+      error = message;
+    failed = true;
+    queue.close();
+  }
+
+  BoundedQueue queue;
+  std::atomic<size_t> next_file;
+  std::atomic<size_t> n_written;
+  std::atomic<size_t> bytes_written;
+  std::atomic<bool> failed;
+  std::mutex error_mutex;
+  string error;
+};
+
+
+static void
+normalize_files(const vector<string> &filenames, const string &suffix,
+                const vector<string> &labels, const Normalizer &normalizer,
+                BatchState &state) {
+  try {
+    const uint64_t fingerprint = label_fingerprint(labels);
+    FeatureVectorReader reader;
+    FeatureVector fv;
+    NormalizedFile item;
+    for (size_t i = state.next_file++; i < filenames.size() && !state.failed;
+         i = state.next_file++) {
+      uint64_t curr_fingerprint = 0;
+      reader.read(filenames[i], fv, curr_fingerprint);
+      if (curr_fingerprint != fingerprint)
+        throw SMITHLABException("inconsistent labels: " +
+                                filenames[0] + "\t" + filenames[i]);
+      normalizer.apply(fv.data(), fv.size());
+      format_feature_vector(fv.get_id(), labels, fv.data(), item.text);
+      item.filename = filenames[i] + suffix;
+      if (!state.queue.push(item))
+        return;
+    }
+  }
+  catch (const SMITHLABException &e) {
+    state.fail(e.what());
+  }
+  catch (std::bad_alloc &ba) {
+    state.fail("ERROR: could not allocate memory");
+  }
+}
+
+
+static void
+write_files(const size_t n_files, const bool report_progress,
+            BatchState &state) {
+  NormalizedFile item;
+  while (state.queue.pop(item)) {
+    std::ofstream out(item.filename.c_str());
+    out.write(item.text.data(), item.text.size());
+    if (!out) {
+      state.fail("cannot write to file: " + item.filename);
+      return;
+    }
+    state.bytes_written += item.text.size();
+    const size_t done = ++state.n_written;
+    if (report_progress)
+      cerr << '\r' << percent(done, n_files) << "%\r";
+  }
+}
+
+
+/* Normalizes each file in the list to a file of the same name plus the
+ * suffix. Normalizing threads take files in turn from a shared counter
+ * and queue the formatted text for the writers.
+ */
+static void
+normalize_file_list(const vector<string> &filenames, const string &suffix,
+                    const vector<string> &labels,
+                    const Normalizer &normalizer, const size_t n_threads,
+                    const size_t n_writers, const size_t queue_size,
+                    const bool VERBOSE, size_t &bytes_written) {
+  BatchState state(queue_size);
+
+  vector<std::thread> writers;
+  for (size_t i = 0; i < max(n_writers, size_t(1)); ++i)
+    writers.push_back(std::thread(write_files, filenames.size(),
+                                  VERBOSE && i == 0, std::ref(state)));
+  vector<std::thread> workers;
+  for (size_t i = 0; i < max(n_threads, size_t(1)); ++i)
+    workers.push_back(std::thread(normalize_files, std::cref(filenames),
+                                  std::cref(suffix), std::cref(labels),
+                                  std::cref(normalizer), std::ref(state)));
+  for (size_t i = 0; i < workers.size(); ++i)
+    workers[i].join();
+  state.queue.close();
+  for (size_t i = 0; i < writers.size(); ++i)
+    writers[i].join();
+
+  if (state.failed)
+    throw SMITHLABException(state.error);
+  bytes_written = state.bytes_written;
+}
+
+
+/* Normalizes every vector in a feature pack into a new pack, in blocks
+ * that are normalized in parallel and then appended in order.
+ */
+static void
+normalize_pack(const string &infile, const string &outfile,
+               const Normalizer &normalizer, const size_t n_threads,
+               const bool VERBOSE, size_t &n_vectors, size_t &bytes_written) {
+  const FeaturePack pack(infile);
+  if (!normalizer.zscore && pack.get_dimension() != normalizer.means.size())
+    throw SMITHLABException("normalizers do not match dimension of: " +
+                            infile);
+  FeaturePackWriter writer(outfile);
+
+  const size_t block_size = 1024;
+  const size_t n_features = pack.get_dimension();
+  vector<FeatureVector> block;
+  for (size_t start = 0; start < pack.size(); start += block_size) {
+    const size_t n_rows = min(block_size, pack.size() - start);
+    block.resize(n_rows);
+    const size_t n_workers = max(size_t(1), min(n_threads, n_rows));
+    vector<std::thread> workers;
+    for (size_t w = 0; w < n_workers; ++w)
+      workers.push_back(std::thread([&, w] {
+        for (size_t i = w; i < n_rows; i += n_workers) {
+          const double *row = pack.get_values(start + i);
+          vector<double> values(row, row + n_features);
+          normalizer.apply(&values[0], n_features);
+          block[i] = FeatureVector(pack.get_id(start + i), values);
+        }
+      }));
+    for (size_t w = 0; w < workers.size(); ++w)
+      workers[w].join();
+    for (size_t i = 0; i < n_rows; ++i)
+      writer.add(block[i]);
+    if (VERBOSE)
+      cerr << '\r' << percent(start + n_rows, pack.size()) << "%\r";
+  }
+  writer.close();
+  n_vectors = pack.size();
+  bytes_written = pack.size()*(n_features + 1)*sizeof(double);
+}
+
+
 int
 main(int argc, const char **argv) {
 
@@ -64,17 +339,33 @@ main(int argc, const char **argv) {
     bool VERBOSE = false;
     string outfile;
     string features_file;
-    
+
+    bool zscore = false;
+    bool pack_input = false;
+    size_t n_threads = 1;
+    size_t n_writers = 2;
+    size_t queue_size = 256;
+
     /****************** COMMAND LINE OPTIONS ********************/
-    OptionParser opt_parse(strip_path(argv[0]), 
+    OptionParser opt_parse(strip_path(argv[0]),
                            "normalizes feature vectors",
-                           "<normalizer-file> <vectors-path-file>");
+                           "[<normalizer-file>] <vectors-path-file|pack>");
     opt_parse.add_opt("out", 'o', "output file (default: stdout)",
                       false, outfile);
     opt_parse.add_opt("suff", 's', "output file suffic (default: norm)",
                       false, outfile_suffix);
+    opt_parse.add_opt("zscore", 'z', "z-score each vector by its own mean "
+                      "and sd, with no normalizer file", false, zscore);
+    opt_parse.add_opt("pack", 'p', "input is a feature pack; the normalized "
+                      "pack is written to the output file", false, pack_input);
+    opt_parse.add_opt("threads", 'x', "normalizing threads (default: 1)",
+                      false, n_threads);
+    opt_parse.add_opt("writers", 'w', "threads writing output files "
+                      "(default: 2)", false, n_writers);
+    opt_parse.add_opt("queue", 'q', "normalized files waiting to be "
+                      "written (default: 256)", false, queue_size);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
-    
+
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -90,57 +381,74 @@ main(int argc, const char **argv) {
       cerr << opt_parse.option_missing_message() << endl;
       return EXIT_SUCCESS;
     }
-    if (leftover_args.size() != 2) {
+    if (leftover_args.size() != (zscore ? 1 : 2)) {
       cerr << opt_parse.help_message() << endl;
       return EXIT_SUCCESS;
     }
-    const string normalizers_file(leftover_args.front());
+    if (pack_input && outfile.empty()) {
+      cerr << "normalizing a pack requires an output file" << endl;
+      return EXIT_SUCCESS;
+    }
+    const string normalizers_file(zscore ? "" : leftover_args.front());
     const string vectors_path_file(leftover_args.back());
     /****************** END COMMAND LINE OPTIONS *****************/
 
-    if (VERBOSE)
-      cerr << "loading normalizers" << endl;
-    vector<double> means, sds;
+    Normalizer normalizer;
+    normalizer.zscore = zscore;
     vector<string> labels;
-    load_normalizers(normalizers_file, labels, means, sds);
-    
-    if (VERBOSE)
-      cerr << "extracting feature vector paths" << endl;
-    std::ifstream paths_in(vectors_path_file.c_str());
-    if (!paths_in)
-      throw SMITHLABException("bad feature vectors locations: " +
-                              vectors_path_file);
-    vector<string> feat_vec_filenames;
-    string feat_vec_file;
-    while (paths_in >> feat_vec_file)
-      feat_vec_filenames.push_back(feat_vec_file);
-    
-    if (VERBOSE)
-      cerr << "processing feature vectors" << endl;
-    
-    for (size_t i = 0; i < feat_vec_filenames.size(); ++i) {
-      
-      FeatureVector fv;
-      vector<string> curr_labels;
-      load_features_and_labels(feat_vec_filenames[i], fv, curr_labels);
-      
-      if (labels != curr_labels)
-        throw SMITHLABException("inconsistent labels: " +
-                                feat_vec_filenames[0] + "\t" + 
-                                feat_vec_filenames[i]);
-      
-      for (size_t j = 0; j < means.size(); ++j)
-        fv[j] = (fv[j] - means[j])/sds[j];
-      
+    if (!zscore) {
       if (VERBOSE)
-        cerr << '\r' << percent(i, feat_vec_filenames.size()) << "%\r";
-      
-      // write the hash table to disk
-      std::ofstream out(string(feat_vec_filenames[i] + outfile_suffix).c_str());
-      out << fv.tostring_with_labels(labels) << endl;
+        cerr << "loading normalizers" << endl;
+      vector<double> sds;
+      load_normalizers(normalizers_file, labels, normalizer.means, sds);
+      for (size_t i = 0; i < sds.size(); ++i)
+        normalizer.inv_sds.push_back(1.0/sds[i]);
+    }
+
+    const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    size_t n_vectors = 0, bytes_written = 0;
+
+    if (pack_input) {
+      if (VERBOSE)
+        cerr << "processing feature pack" << endl;
+      normalize_pack(vectors_path_file, outfile, normalizer, n_threads,
+                     VERBOSE, n_vectors, bytes_written);
+    }
+    else {
+      if (VERBOSE)
+        cerr << "extracting feature vector paths" << endl;
+      std::ifstream paths_in(vectors_path_file.c_str());
+      if (!paths_in)
+        throw SMITHLABException("bad feature vectors locations: " +
+                                vectors_path_file);
+      vector<string> feat_vec_filenames;
+      string feat_vec_file;
+      while (paths_in >> feat_vec_file)
+        feat_vec_filenames.push_back(feat_vec_file);
+
+      if (zscore && !feat_vec_filenames.empty()) {
+        FeatureVector fv;
+        load_features_and_labels(feat_vec_filenames.front(), fv, labels);
+      }
+
+      if (VERBOSE)
+        cerr << "processing feature vectors" << endl;
+      normalize_file_list(feat_vec_filenames, outfile_suffix, labels,
+                          normalizer, n_threads, n_writers, queue_size,
+                          VERBOSE, bytes_written);
+      n_vectors = feat_vec_filenames.size();
+    }
+
+    if (VERBOSE) {
+      const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+      cerr << '\r' << "100%" << endl
+           << "normalized " << n_vectors << " vectors in " << seconds
+           << "s (" << n_vectors/max(seconds, 1e-9) << " vectors/s, "
+           << bytes_written/max(seconds, 1e-9)/1e6 << " MB/s written)"
+           << endl;
     }
-    if (VERBOSE)
-      cerr << '\r' << "100%" << endl;
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
@@ -0,0 +1,113 @@
+/*
+ *    Part of AMORDAD software
+ *
+ *    Copyright (C) 2014 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
+#include "FeaturePack.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    string outfile;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]),
+                           "write feature vectors into a single binary "
+                           "feature pack", "<feat-vecs>");
+    opt_parse.add_opt("out", 'o', "output feature pack", true, outfile);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string feat_vecs_filename(leftover_args.front());
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    std::ifstream fv_filenames_in(feat_vecs_filename.c_str());
+    if (!fv_filenames_in)
+      throw SMITHLABException("problem reading: " + feat_vecs_filename);
+    vector<string> filenames;
+    string filename;
+    while (fv_filenames_in >> filename)
+      filenames.push_back(filename);
+
+    // vectors are written as they are read, so only one is in memory
+    FeaturePackWriter pack(outfile);
+    for (size_t i = 0; i < filenames.size(); ++i) {
+      CompressedInputStream in(filenames[i]);
+      if (!in)
+        throw SMITHLABException("problem reading: " + filenames[i]);
+      FeatureVector fv;
+      in >> fv;
+      pack.add(fv);
+      if (VERBOSE)
+        cerr << '\r' << "packing: " << percent(i, filenames.size()) << "%\r";
+    }
+    pack.close();
+    if (VERBOSE)
+      cerr << '\r' << "packing: 100%" << endl
+           << "feature vectors: " << pack.size() << endl;
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
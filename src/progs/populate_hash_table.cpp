@@ -29,6 +29,7 @@
 #include "LSHAngleHashFunction.hpp"
 #include "LSHEuclideanHashFunction.hpp"
 #include "FeatureVector.hpp"
+#include "CompressedInput.hpp"
 #include "LSHAngleHashTable.hpp"
 
 using std::string;
@@ -96,7 +97,7 @@ main(int argc, const char **argv) {
     if (VERBOSE)
       cerr << "loading hash function" << endl;
     // LOAD THE HASH FUNCTION
-    std::ifstream hash_fun_in(hash_function_file.c_str());
+    CompressedInputStream hash_fun_in(hash_function_file);
     if (!hash_fun_in)
       throw SMITHLABException("cannot open: " + hash_function_file);
     LSHAngleHashFunction hash_fun;
@@ -129,22 +130,19 @@ main(int argc, const char **argv) {
     if (VERBOSE)
       cerr << "hashing feature vectors" << endl;
     // ITERATE OVER EACH FEATURE VECTOR FILE AND HASH IT
+    const uint64_t features_fingerprint = label_fingerprint(features);
+    FeatureVectorReader reader;
     for (size_t i = 0; i < feat_vec_filenames.size(); ++i) {
       
       FeatureVector fv;
       if (!features_file.empty()) {
-        vector<string> labels;
-        load_features_and_labels(feat_vec_filenames[i], fv, labels);
-        if (features != labels)
+        uint64_t fingerprint = 0;
+        reader.read(feat_vec_filenames[i], fv, fingerprint);
+        if (fingerprint != features_fingerprint)
           throw SMITHLABException("inconsistent features: " + 
                                   feat_vec_filenames[i] + "/" + features_file);
       }
-      else {
-        std::ifstream feat_vec_in(feat_vec_filenames[i].c_str());
-        if (!feat_vec_in)
-          throw SMITHLABException("bad file: " + feat_vec_filenames[i]);
-        feat_vec_in >> fv;
-      }
+      else reader.read(feat_vec_filenames[i], fv);
       hash_table.insert(fv, hash_fun(fv));
       
       if (VERBOSE)